@@ -0,0 +1,196 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+// Host side of the eapis sampling profiler (see profiler_abi.h). Samples
+// are dumped in the folded stack format used by perf / FlameGraph, i.e.
+//
+//     cr3;caller_n;...;caller_0;rip count
+//
+// where each address is printed in hex. Since the profiler does not know
+// anything about guest symbols, the output can be symbolized afterwards
+// using the guest's binaries.
+//
+// Note that by default the profiler only accepts requests from the guest
+// kernel (CPL 0). To run this tool as a normal ring 3 process, the VMM must
+// opt in for the guest's vCPUs using vcpu::allow_profiler_user_access()
+// (e.g. on a development host VM). Otherwise, every request fails.
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sched.h>
+
+#include <hve/arch/intel_x64/profiler_abi.h>
+
+namespace abi = eapis::intel_x64::profiler_abi;
+
+struct regs_t {
+    uint64_t rax;
+    uint64_t rbx;
+    uint64_t rcx;
+    uint64_t rdx;
+};
+
+// The profiler returns all 64 bits of each register, so the cpuid helpers
+// from bfintrinsics (which are 32bit) cannot be used here.
+//
+static regs_t
+profiler_call(uint64_t cmd, uint64_t arg = 0)
+{
+    regs_t regs = {abi::leaf, cmd, arg, 0};
+
+    __asm__ volatile(
+        "cpuid"
+        : "+a"(regs.rax), "+b"(regs.rbx), "+c"(regs.rcx), "+d"(regs.rdx)
+        :
+        : "memory"
+    );
+
+    return regs;
+}
+
+static bool
+pin_to_cpu(unsigned int cpu)
+{
+    cpu_set_t mask;
+
+    CPU_ZERO(&mask);
+    CPU_SET(cpu, &mask);
+
+    return sched_setaffinity(0, sizeof(mask), &mask) == 0;
+}
+
+static std::string
+hex(uint64_t val)
+{
+    std::stringstream ss;
+    ss << "0x" << std::hex << val;
+
+    return ss.str();
+}
+
+static uint64_t
+dump_cpu(std::map<std::string, uint64_t> &stacks)
+{
+    uint64_t dropped = 0;
+
+    while (true) {
+        auto sample = profiler_call(abi::cmd_pop);
+        if (sample.rax == abi::status_empty || sample.rax > abi::max_depth) {
+            break;
+        }
+
+        auto depth = sample.rax;
+        dropped = sample.rdx;
+
+        std::vector<uint64_t> frames;
+        for (uint64_t i = 0; i < depth; i += abi::frames_per_call) {
+            auto regs = profiler_call(abi::cmd_frames, i);
+            if (regs.rax != abi::status_success) {
+                break;
+            }
+
+            for (auto frame : {regs.rbx, regs.rcx, regs.rdx}) {
+                if (frames.size() < depth) {
+                    frames.push_back(frame);
+                }
+            }
+        }
+
+        auto stack = "cr3_" + hex(sample.rcx);
+        for (auto iter = frames.rbegin(); iter != frames.rend(); ++iter) {
+            stack += ";" + hex(*iter);
+        }
+
+        stacks[stack + ";" + hex(sample.rbx)]++;
+    }
+
+    return dropped;
+}
+
+static int
+usage()
+{
+    std::clog << "usage: ack_profile start <hz> | stop | dump" << '\n';
+    return EXIT_FAILURE;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        return usage();
+    }
+
+    std::string cmd = argv[1];
+
+    uint64_t freq_hz = 0;
+    if (cmd == "start") {
+        if (argc < 3) {
+            return usage();
+        }
+
+        freq_hz = std::strtoull(argv[2], nullptr, 10);
+    }
+    else if (cmd != "stop" && cmd != "dump") {
+        return usage();
+    }
+
+    std::map<std::string, uint64_t> stacks;
+    auto num_cpus = std::thread::hardware_concurrency();
+
+    for (auto cpu = 0U; cpu < num_cpus; cpu++) {
+        if (!pin_to_cpu(cpu)) {
+            std::clog << "ack_profile: failed to pin to cpu " << cpu << '\n';
+            return EXIT_FAILURE;
+        }
+
+        if (cmd == "start") {
+            if (profiler_call(abi::cmd_start, freq_hz).rax != abi::status_success) {
+                std::clog << "ack_profile: start failed on cpu " << cpu
+                          << " (has the VMM allowed user access?)" << '\n';
+                return EXIT_FAILURE;
+            }
+        }
+        else if (cmd == "stop") {
+            profiler_call(abi::cmd_stop);
+        }
+        else {
+            auto dropped = dump_cpu(stacks);
+            if (dropped != 0) {
+                std::clog << "ack_profile: cpu " << cpu << " dropped "
+                          << dropped << " samples" << '\n';
+            }
+        }
+    }
+
+    for (const auto &[stack, count] : stacks) {
+        std::cout << stack << ' ' << count << '\n';
+    }
+
+    return EXIT_SUCCESS;
+}
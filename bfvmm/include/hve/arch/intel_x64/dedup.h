@@ -0,0 +1,284 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef DEDUP_INTEL_X64_EAPIS_H
+#define DEDUP_INTEL_X64_EAPIS_H
+
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <bfvmm/hve/arch/intel_x64/exit_handler.h>
+
+#include "ept/mmap.h"
+#include "../x64/map_window.h"
+
+// -----------------------------------------------------------------------------
+// Exports
+// -----------------------------------------------------------------------------
+
+#include <bfexports.h>
+
+#ifndef STATIC_EAPIS_HVE
+#ifdef SHARED_EAPIS_HVE
+#define EXPORT_EAPIS_HVE EXPORT_SYM
+#else
+#define EXPORT_EAPIS_HVE IMPORT_SYM
+#endif
+#else
+#define EXPORT_EAPIS_HVE
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis::intel_x64
+{
+
+/// Page Deduplication
+///
+/// Merges identical guest pages, across any number of EPT maps (and
+/// therefore VMs), into a single read-only frame. The guest frames are
+/// provided by, and given back to, a frame allocator shared by the maps.
+///
+/// Scanning is incremental. Each call to scan() does the following:
+///
+/// - hands the frames freed by the previous call back to the allocator
+/// - hashes the pages write-protected by the previous call (in bulk,
+///   using a mapping window), and merges each one with an identical frame
+///   found in the index, or adds it to the index
+/// - write-protects the next num_pages pages of the registered ranges
+///
+/// As a result, every vCPU that uses one of the maps must execute INVEPT
+/// between two calls to scan() (e.g. by calling it from a timer on each
+/// vCPU). This guarantees that a page is hashed, compared and remapped
+/// only once no CPU can still write to it, and that a frame is only freed
+/// once no CPU can still read from it.
+///
+/// A write to a page that is write-protected by the scanner causes an EPT
+/// violation, which must be handed to handle_write() (see
+/// vcpu::enable_dedup). If the page is shared, the guest gets a private
+/// copy. Otherwise, write access is simply given back.
+///
+/// Only 4k pages are deduplicated. Large pages are skipped, and so are
+/// the pages of a map that is used by more than one vCPU, as breaking
+/// sharing only invalidates the translations of the vCPU that wrote to
+/// the page (see ept::mmap::write_protect_shared).
+///
+class EXPORT_EAPIS_HVE page_dedup
+{
+public:
+
+    /// Frame Allocate Delegate
+    ///
+    /// Returns the host physical address of a free 4k frame, or 0 if there
+    /// are no frames left.
+    ///
+    using alloc_delegate_t = delegate<uintptr_t()>;
+
+    /// Frame Free Delegate
+    ///
+    /// Gives a 4k frame (by host physical address) back to the allocator
+    ///
+    using free_delegate_t = delegate<void(uintptr_t)>;
+
+    /// Window Pages
+    ///
+    /// The number of pages hashed per batch
+    ///
+    constexpr static std::size_t window_pages = 64;
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param alloc the delegate used to allocate private frames
+    /// @param free the delegate used to free merged frames
+    ///
+    page_dedup(const alloc_delegate_t &alloc, const free_delegate_t &free);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~page_dedup() = default;
+
+    /// Add Range
+    ///
+    /// Adds [gpa, gpa + size) of mmap to the ranges that are scanned
+    ///
+    /// @expects gpa and size are 4k aligned, and size != 0
+    /// @ensures
+    ///
+    /// @param mmap the map to scan
+    /// @param gpa the first guest physical address of the range
+    /// @param size the size of the range in bytes
+    ///
+    void add_range(ept::mmap &mmap, uintptr_t gpa, std::size_t size);
+
+    /// Remove Map
+    ///
+    /// Stops scanning mmap, and gives each of its pages that is tracked by
+    /// the scanner a private, writable frame again. This must be called
+    /// before a map (or the VM that owns it) is destroyed.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param mmap the map to remove
+    ///
+    void remove_map(ept::mmap &mmap);
+
+    /// Scan
+    ///
+    /// Performs one step of the scanner (see above). INVEPT must be
+    /// executed by every vCPU that uses one of the maps before this
+    /// function is called again.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param num_pages the number of 4k pages of the registered ranges to
+    ///     write-protect in this step
+    /// @return the number of pages that were merged
+    ///
+    std::size_t scan(std::size_t num_pages = window_pages);
+
+    /// Handle Write
+    ///
+    /// Breaks sharing for a page that was write-protected by the scanner.
+    /// The guest's instruction pointer should not be advanced.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param mmap the map the EPT violation occurred in
+    /// @param gpa the guest physical address that was written to
+    /// @return true if the page is tracked by the scanner, false otherwise
+    ///
+    bool handle_write(ept::mmap &mmap, uintptr_t gpa);
+
+    /// Shared Frames
+    ///
+    /// @return the number of frames that are mapped by more than one page
+    ///
+    std::size_t shared_frames() const;
+
+    /// Freed Frames
+    ///
+    /// @return the number of frames that have been freed by merging
+    ///
+    std::size_t freed_frames() const;
+
+    /// Copied Frames
+    ///
+    /// @return the number of frames that have been allocated to break
+    ///     sharing
+    ///
+    std::size_t copied_frames() const;
+
+    /// Hash
+    ///
+    /// Hashes a 4k page using 4 independent 64bit lanes (in the style of
+    /// xxHash64), which allows the compiler to interleave (or vectorize)
+    /// the lanes instead of waiting on a single dependency chain.
+    ///
+    /// @expects page != nullptr
+    /// @ensures
+    ///
+    /// @param page the page to hash
+    /// @return the hash of the page
+    ///
+    static uint64_t hash(const void *page) noexcept;
+
+private:
+
+    struct range_t {
+        ept::mmap *mmap;
+        uintptr_t gpa;
+        std::size_t size;
+    };
+
+    struct page_t {
+        uintptr_t hpa;
+        bool pending;
+    };
+
+    struct frame_t {
+        uint64_t hash;
+        std::size_t refs;
+    };
+
+    using key_t = std::pair<ept::mmap *, uintptr_t>;
+
+    void protect(std::size_t num_pages);
+    std::size_t merge();
+
+    bool merge(const key_t &key, page_t &page, const void *ptr, uint64_t hash);
+    void unshare(const key_t &key, page_t &page);
+
+    void index(uintptr_t hpa, uint64_t hash);
+    void unindex(uintptr_t hpa);
+
+private:
+
+    alloc_delegate_t m_alloc;
+    free_delegate_t m_free;
+
+    std::vector<range_t> m_ranges;
+    std::size_t m_cursor_range{0};
+    std::size_t m_cursor_offset{0};
+
+    std::map<key_t, page_t> m_pages;
+    std::vector<key_t> m_pending;
+    std::vector<uintptr_t> m_released;
+
+    std::unordered_map<uintptr_t, frame_t> m_frames;
+    std::unordered_multimap<uint64_t, uintptr_t> m_index;
+
+    std::size_t m_shared_frames{0};
+    std::size_t m_freed_frames{0};
+    std::size_t m_copied_frames{0};
+
+    x64::map_window m_window;
+    mutable std::mutex m_mutex;
+
+public:
+
+    /// @cond
+
+    page_dedup(page_dedup &&) = delete;
+    page_dedup &operator=(page_dedup &&) = delete;
+
+    page_dedup(const page_dedup &) = delete;
+    page_dedup &operator=(const page_dedup &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
@@ -0,0 +1,274 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef DEMAND_PAGER_INTEL_X64_EAPIS_H
+#define DEMAND_PAGER_INTEL_X64_EAPIS_H
+
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <bfvmm/hve/arch/intel_x64/exit_handler.h>
+
+#include "ept/mmap.h"
+#include "../x64/map_window.h"
+
+// -----------------------------------------------------------------------------
+// Exports
+// -----------------------------------------------------------------------------
+
+#include <bfexports.h>
+
+#ifndef STATIC_EAPIS_HVE
+#ifdef SHARED_EAPIS_HVE
+#define EXPORT_EAPIS_HVE EXPORT_SYM
+#else
+#define EXPORT_EAPIS_HVE IMPORT_SYM
+#endif
+#else
+#define EXPORT_EAPIS_HVE
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis::intel_x64
+{
+
+/// Demand Pager
+///
+/// Populates the RAM of a guest lazily instead of mapping all of it up
+/// front (e.g. with ept::identity_map). A RAM region is registered with
+/// add_region() but left unmapped, and the first access to each part of
+/// it causes an EPT violation, which must be handed to handle_fault()
+/// (see vcpu::enable_demand_paging). The pager then asks the backing
+/// allocator for a frame, and maps it. A 2m page is used whenever the
+/// surrounding 2m block lies inside the region and is still empty (and
+/// the allocator can provide one), otherwise a 4k page is used. Every
+/// frame is zeroed before it is mapped, so a guest never sees what the
+/// frame was last used for.
+///
+/// Faults are also used to detect sequential access. Each time a fault
+/// lands right after the memory populated by the previous fault in the
+/// same region, the number of pages that are populated ahead of the
+/// fault (of the same size as the faulting page) is doubled, up to
+/// max_prefetch. Any other fault resets it. The cost of starting a guest
+/// therefore depends on its working set, and not on its configured RAM.
+///
+/// Only entries that are not present are ever populated, and EPT
+/// translations are never cached for entries that are not present, so
+/// no INVEPT is needed.
+///
+class EXPORT_EAPIS_HVE demand_pager
+{
+public:
+
+    /// Frame Allocate Delegate
+    ///
+    /// Returns the host physical address of a free, naturally aligned
+    /// frame of the requested size (4k or 2m) that will back the provided
+    /// guest physical address, or 0 if no such frame is available. As the
+    /// frame is zeroed, it must not hold anything that is still in use.
+    ///
+    using alloc_delegate_t = delegate<uintptr_t(uintptr_t, std::size_t)>;
+
+    /// Frame Free Delegate
+    ///
+    /// Gives a frame (by host physical address and size) back to the
+    /// allocator
+    ///
+    using free_delegate_t = delegate<void(uintptr_t, std::size_t)>;
+
+    /// Frame Zero Delegate
+    ///
+    /// Fills a frame (by host physical address and size) with zeros
+    ///
+    using zero_delegate_t = delegate<void(uintptr_t, std::size_t)>;
+
+    /// Max Prefetch
+    ///
+    /// The maximum number of pages that are populated ahead of a fault
+    ///
+    constexpr static std::size_t max_prefetch = 16;
+
+    /// Constructor
+    ///
+    /// Frames are zeroed through a map window owned by the pager.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param alloc the delegate used to allocate frames
+    /// @param free the delegate used to free frames
+    ///
+    demand_pager(const alloc_delegate_t &alloc, const free_delegate_t &free);
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param alloc the delegate used to allocate frames
+    /// @param free the delegate used to free frames
+    /// @param zero the delegate used to zero frames before they are mapped
+    ///
+    demand_pager(
+        const alloc_delegate_t &alloc, const free_delegate_t &free,
+        const zero_delegate_t &zero);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~demand_pager() = default;
+
+    /// Add Region
+    ///
+    /// Registers [gpa, gpa + size) of mmap as guest RAM that is populated
+    /// on demand. The region should not be mapped by anything else.
+    ///
+    /// @expects gpa and size are 4k aligned, and size != 0
+    /// @expects the region does not overlap a region of the same map
+    /// @ensures
+    ///
+    /// @param mmap the map to populate
+    /// @param gpa the first guest physical address of the region
+    /// @param size the size of the region in bytes
+    /// @param attr the permissions of the pages that are populated
+    /// @param cache the memory type of the pages that are populated
+    ///
+    void add_region(
+        ept::mmap &mmap, uintptr_t gpa, std::size_t size,
+        ept::mmap::attr_type attr = ept::mmap::attr_type::read_write_execute,
+        ept::mmap::memory_type cache = ept::mmap::memory_type::write_back);
+
+    /// Remove Map
+    ///
+    /// Unmaps every page of mmap that was populated by the pager, and
+    /// gives the frames back to the allocator. This must be called before
+    /// a map (or the VM that owns it) is destroyed, once no vCPU is using
+    /// the map anymore.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param mmap the map to remove
+    ///
+    void remove_map(ept::mmap &mmap);
+
+    /// Handle Fault
+    ///
+    /// Populates the page that contains gpa (and possibly the pages that
+    /// follow it). This should only be called for EPT violations caused
+    /// by an entry that is not present. The guest's instruction pointer
+    /// should not be advanced.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param mmap the map the EPT violation occurred in
+    /// @param gpa the guest physical address that caused the violation
+    /// @return true if gpa is inside a region (and is now mapped), false
+    ///     otherwise
+    ///
+    bool handle_fault(ept::mmap &mmap, uintptr_t gpa);
+
+    /// Faults
+    ///
+    /// @return the number of faults that populated memory
+    ///
+    std::size_t faults() const;
+
+    /// Populated
+    ///
+    /// @return the number of bytes that are currently populated
+    ///
+    std::size_t populated() const;
+
+    /// Prefetched
+    ///
+    /// @return the number of bytes that have been populated ahead of a
+    ///     fault
+    ///
+    std::size_t prefetched() const;
+
+private:
+
+    struct frame_t {
+        uintptr_t hpa;
+        std::size_t size;
+    };
+
+    struct region_t {
+        ept::mmap *mmap;
+        uintptr_t gpa;
+        std::size_t size;
+        ept::mmap::attr_type attr;
+        ept::mmap::memory_type cache;
+
+        uintptr_t next;
+        std::size_t window;
+
+        std::map<uintptr_t, frame_t> frames;
+    };
+
+    region_t *find(ept::mmap &mmap, uintptr_t gpa);
+
+    std::size_t populate(region_t &region, uintptr_t gpa);
+    bool populate(region_t &region, uintptr_t gpa, std::size_t size);
+
+    void zero(uintptr_t hpa, std::size_t size);
+
+private:
+
+    alloc_delegate_t m_alloc;
+    free_delegate_t m_free;
+    zero_delegate_t m_zero;
+
+    x64::map_window m_window{1};
+
+    std::vector<region_t> m_regions;
+
+    std::size_t m_faults{0};
+    std::size_t m_populated{0};
+    std::size_t m_prefetched{0};
+
+    mutable std::mutex m_mutex;
+
+public:
+
+    /// @cond
+
+    demand_pager(demand_pager &&) = delete;
+    demand_pager &operator=(demand_pager &&) = delete;
+
+    demand_pager(const demand_pager &) = delete;
+    demand_pager &operator=(const demand_pager &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
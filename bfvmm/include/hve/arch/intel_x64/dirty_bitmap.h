@@ -0,0 +1,171 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef DIRTY_BITMAP_INTEL_X64_EAPIS_H
+#define DIRTY_BITMAP_INTEL_X64_EAPIS_H
+
+#include <cstdint>
+#include <vector>
+
+#include <bfgsl.h>
+
+// -----------------------------------------------------------------------------
+// Exports
+// -----------------------------------------------------------------------------
+
+#include <bfexports.h>
+
+#ifndef STATIC_EAPIS_HVE
+#ifdef SHARED_EAPIS_HVE
+#define EXPORT_EAPIS_HVE EXPORT_SYM
+#else
+#define EXPORT_EAPIS_HVE IMPORT_SYM
+#endif
+#else
+#define EXPORT_EAPIS_HVE
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis::intel_x64
+{
+
+/// Dirty Bitmap
+///
+/// A bitmap with one bit per 4k page of guest physical memory, shared by
+/// every vCPU of a VM. Setting a bit and harvesting the bitmap are both
+/// lock-free, so vCPUs can log dirty pages (e.g. while draining their PML
+/// buffers) while another CPU collects them. Every bit is set and cleared
+/// atomically, so a page that is dirtied during a harvest is either part
+/// of that harvest or of the next one, but is never lost.
+///
+class EXPORT_EAPIS_HVE dirty_bitmap
+{
+public:
+
+    using size_type = std::size_t;      ///< Size type
+
+    /// Constructor
+    ///
+    /// @expects size != 0
+    /// @ensures
+    ///
+    /// @param size the amount of guest physical memory tracked (in bytes),
+    ///     starting from GPA 0
+    ///
+    explicit dirty_bitmap(size_type size);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~dirty_bitmap() = default;
+
+    /// Set
+    ///
+    /// Marks the page that contains gpa as dirty. GPAs outside of the
+    /// tracked range are ignored.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the guest physical address that was written to
+    /// @return true if the page was not already dirty, false otherwise
+    ///
+    bool set(uintptr_t gpa) noexcept;
+
+    /// Is Dirty
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the guest physical address to test
+    /// @return true if the page that contains gpa is dirty, false otherwise
+    ///
+    bool is_dirty(uintptr_t gpa) const noexcept;
+
+    /// Harvest
+    ///
+    /// Copies the bitmap into bitmap (bit n is the page at n * 4k) and
+    /// clears it, one 64bit word at a time.
+    ///
+    /// @expects bitmap.size() >= words()
+    /// @ensures
+    ///
+    /// @param bitmap where to store the dirty pages
+    /// @return the number of dirty pages
+    ///
+    size_type harvest(gsl::span<uint64_t> bitmap);
+
+    /// Clear
+    ///
+    /// Marks every page as clean
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void clear() noexcept;
+
+    /// Size
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the amount of guest physical memory tracked (in bytes)
+    ///
+    size_type size() const noexcept
+    { return m_size; }
+
+    /// Words
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the number of 64bit words needed to harvest the bitmap
+    ///
+    size_type words() const noexcept
+    { return m_bits.size(); }
+
+private:
+
+    size_type m_size;
+    std::vector<uint64_t> m_bits;
+
+public:
+
+    /// @cond
+
+    dirty_bitmap(dirty_bitmap &&) = default;
+    dirty_bitmap &operator=(dirty_bitmap &&) = default;
+
+    dirty_bitmap(const dirty_bitmap &) = delete;
+    dirty_bitmap &operator=(const dirty_bitmap &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
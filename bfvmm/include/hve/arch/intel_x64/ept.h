@@ -22,8 +22,15 @@
 #ifndef EAPIS_EPT_HANDLER_INTEL_X64_H
 #define EAPIS_EPT_HANDLER_INTEL_X64_H
 
+#include <memory>
+#include <vector>
+
+#include <bfvmm/hve/arch/intel_x64/vmcs.h>
+#include <bfvmm/hve/arch/intel_x64/exit_handler.h>
+
 #include "ept/mmap.h"
 #include "ept/helpers.h"
+#include "ept/sppt.h"
 
 // -----------------------------------------------------------------------------
 // Exports
@@ -58,6 +65,8 @@ class EXPORT_EAPIS_HVE ept_handler
 {
 public:
 
+    constexpr static std::size_t eptp_list_size = 512;  ///< Max EPT views
+
     /// Constructor
     ///
     /// @expects
@@ -71,14 +80,19 @@ public:
 
     /// Destructor
     ///
+    /// Detaches every map this vCPU could walk (see ept::mmap::attach)
+    ///
     /// @expects
     /// @ensures
     ///
-    ~ept_handler() = default;
+    ~ept_handler();
 
     /// Set EPTP
     ///
-    /// @expects
+    /// If the map has opted into accessed and dirty flags, they are enabled
+    /// in the EPTP, otherwise they are disabled.
+    ///
+    /// @expects if map->accessed_and_dirty_flags(), the CPU supports them
     /// @ensures
     ///
     /// @param map A pointer to the map to set EPTP to. If the pointer is
@@ -86,9 +100,155 @@ public:
     ///
     void set_eptp(ept::mmap *map);
 
+    /// INVEPT
+    ///
+    /// Invalidates the cached EPT translations of the current EPTP on
+    /// this CPU. Does nothing if EPT is disabled.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void invept();
+
+    /// Set EPTP List Entry
+    ///
+    /// Adds (or replaces) an EPT view in this vCPU's EPTP list. Once EPTP
+    /// switching is enabled, the guest can switch to any view in the list
+    /// using VMFUNC (leaf 0) without a VM exit.
+    ///
+    /// @expects index < eptp_list_size
+    /// @expects if map->accessed_and_dirty_flags(), the CPU supports them
+    /// @expects map is not the active view if map is a nullptr
+    /// @ensures
+    ///
+    /// @param index the index of the view in the EPTP list
+    /// @param map the map to use for the view. If the pointer is a
+    ///     nullptr, the view is removed.
+    ///
+    void set_eptp_list_entry(std::size_t index, ept::mmap *map);
+
+    /// Enable EPTP Switching
+    ///
+    /// Enables VM functions with EPTP switching, using this vCPU's EPTP
+    /// list (which is allocated on first use). A VMFUNC that fails (i.e.
+    /// an unsupported leaf or an index without a view) exits, and #UD is
+    /// injected, as it would be without a hypervisor.
+    ///
+    /// @expects EPT is enabled
+    /// @expects the CPU supports EPTP switching
+    /// @ensures
+    ///
+    void enable_eptp_switching();
+
+    /// Disable EPTP Switching
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable_eptp_switching();
+
+    /// Set EPTP Index
+    ///
+    /// Switches this vCPU to a view in the EPTP list from the VMM. Since
+    /// EPT translations are tagged with the EPTP, no INVEPT is needed.
+    ///
+    /// @expects the view at index exists
+    /// @ensures
+    ///
+    /// @param index the index of the view in the EPTP list
+    /// @return the map of the view
+    ///
+    ept::mmap *set_eptp_index(std::size_t index);
+
+    /// EPTP Index
+    ///
+    /// The guest can switch views without a VM exit, so the active view is
+    /// looked up using the current EPTP. The index that matched last is
+    /// checked first, so the EPTP list is only searched when the guest
+    /// has switched views since.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the index of the active view, or eptp_list_size if the
+    ///     current EPTP is not in the EPTP list
+    ///
+    std::size_t eptp_index() const;
+
+    /// Map
+    ///
+    /// The map the guest is currently using. The guest can switch views
+    /// using VMFUNC without a VM exit, so if the current EPTP is in the
+    /// EPTP list, the map of that view is returned, otherwise the map
+    /// provided to set_eptp() is returned.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the active map, or a nullptr if EPT is disabled
+    ///
+    ept::mmap *map() const;
+
+    /// EPTP List Entry
+    ///
+    /// @expects index < eptp_list_size
+    /// @ensures
+    ///
+    /// @param index the index of the view in the EPTP list
+    /// @return the map of the view, or a nullptr if the view does not exist
+    ///
+    ept::mmap *eptp_list_entry(std::size_t index) const;
+
+    /// Set SPPT
+    ///
+    /// Enables sub-page write permissions using the provided SPP table, or
+    /// disables them if the pointer is a nullptr. The table should describe
+    /// the pages of the map(s) used by this vCPU (see ept::sppt).
+    ///
+    /// @expects EPT is enabled, and sub-page write permissions are
+    ///     supported, if sppt is not a nullptr
+    /// @ensures
+    ///
+    /// @param sppt the SPP table to use
+    ///
+    void set_sppt(ept::sppt *sppt);
+
+    /// SPPT
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the SPP table set by set_sppt(), or a nullptr if sub-page
+    ///     write permissions are disabled
+    ///
+    ept::sppt *sppt() const noexcept
+    { return m_sppt; }
+
+public:
+
+    /// @cond
+
+    bool handle_vmfunc(gsl::not_null<vcpu_t *> vcpu);
+
+    /// @endcond
+
+private:
+
+    bool uses(const ept::mmap *map) const;
+
+    template<typename F>
+    void track(ept::mmap *old_map, ept::mmap *new_map, F f);
+
 private:
 
     vcpu *m_vcpu;
+    ept::mmap *m_map{nullptr};
+
+    std::unique_ptr<uint64_t, void(*)(void *)> m_eptp_list;
+    std::vector<ept::mmap *> m_eptp_views;
+    mutable std::size_t m_eptp_hint{0};
+
+    ept::sppt *m_sppt{nullptr};
 
 public:
 
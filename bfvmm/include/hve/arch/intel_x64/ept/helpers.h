@@ -437,6 +437,63 @@ identity_map_convert_4k_to_2m(
     map.map_2m(addr, addr, attr, cache);
 }
 
+/// Map MMIO
+///
+/// Maps [gpa, gpa + size) using write-only, uncacheable 4k pages. A
+/// write-only EPT entry is an EPT misconfiguration, so any guest access to
+/// the range results in an EPT misconfiguration exit (see mmio_handler).
+///
+/// @expects gpa and size are 4k aligned
+/// @expects the range is not already mapped
+///
+/// @param map the map to add the MMIO range to
+/// @param gpa the first guest physical address of the range
+/// @param size the size of the range in bytes
+///
+inline void
+map_mmio(
+    mmap &map,
+    mmap::phys_addr_t gpa,
+    mmap::size_type size)
+{
+    using namespace ::intel_x64::ept;
+
+    expects(bfn::lower(gpa, pt::from) == 0);
+    expects(bfn::lower(size, pt::from) == 0);
+
+    for (auto end = gpa + size; gpa < end; gpa += pt::page_size) {
+        map.map_4k(
+            gpa, gpa, mmap::attr_type::write_only, mmap::memory_type::uncacheable
+        );
+    }
+}
+
+/// Unmap MMIO
+///
+/// Removes a range that was added using map_mmio
+///
+/// @expects gpa and size are 4k aligned
+///
+/// @param map the map to remove the MMIO range from
+/// @param gpa the first guest physical address of the range
+/// @param size the size of the range in bytes
+///
+inline void
+unmap_mmio(
+    mmap &map,
+    mmap::phys_addr_t gpa,
+    mmap::size_type size)
+{
+    using namespace ::intel_x64::ept;
+
+    expects(bfn::lower(gpa, pt::from) == 0);
+    expects(bfn::lower(size, pt::from) == 0);
+
+    for (auto end = gpa + size; gpa < end; gpa += pt::page_size) {
+        map.unmap(gpa);
+    }
+}
+
 //--------------------------------------------------------------------------
 // Checked
 //--------------------------------------------------------------------------
@@ -454,6 +511,7 @@ identity_map_convert_4k_to_2m(
 /// corruption on the host OS.
 ///
 /// @param map the map to apply the identity map too
+/// @param ranges the MTRRs that define the memory type of each address
 /// @param saddr the starting address for the map
 /// @param eaddr the ending address for the map
 /// @param attr the memory attributes to apply to the map
@@ -461,35 +519,52 @@ identity_map_convert_4k_to_2m(
 inline void
 identity_map(
     mmap &map,
+    const mtrrs &ranges,
     mmap::phys_addr_t saddr,
     mmap::phys_addr_t eaddr,
     mmap::attr_type attr = mmap::attr_type::read_write_execute)
 {
     using namespace ::intel_x64::ept;
-    auto range = g_mtrrs->ranges().begin();
 
-    expects(g_mtrrs->size() != 0);
+    expects(ranges.size() != 0);
     expects(bfn::lower(saddr, pd::from) == 0);
     expects(bfn::lower(eaddr, pd::from) == 0);
 
     while (saddr < eaddr) {
-        while (!range->contains(saddr)) {
-            range++;
-        }
-
-        if (bfn::lower(saddr, pd::from) == 0 &&
-            std::min(range->distance(saddr), eaddr - saddr) >= pd::page_size
-           ) {
-            map.map_2m(saddr, saddr, attr, range->type);
-            saddr += pd::page_size;
-        }
-        else {
-            map.map_4k(saddr, saddr, attr, range->type);
-            saddr += pt::page_size;
+        const auto &span = ranges.lookup(saddr);
+        auto send = std::min(span.base + span.size, eaddr);
+
+        while (saddr < send) {
+            if (bfn::lower(saddr, pd::from) == 0 && send - saddr >= pd::page_size) {
+                map.map_2m(saddr, saddr, attr, span.type);
+                saddr += pd::page_size;
+            }
+            else {
+                map.map_4k(saddr, saddr, attr, span.type);
+                saddr += pt::page_size;
+            }
         }
     }
 }
 
+/// Identity Map
+///
+/// Adds a 1:1 map from the starting address to the ending address using
+/// the MTRRs of the current CPU. See above.
+///
+/// @param map the map to apply the identity map too
+/// @param saddr the starting address for the map
+/// @param eaddr the ending address for the map
+/// @param attr the memory attributes to apply to the map
+///
+inline void
+identity_map(
+    mmap &map,
+    mmap::phys_addr_t saddr,
+    mmap::phys_addr_t eaddr,
+    mmap::attr_type attr = mmap::attr_type::read_write_execute)
+{ identity_map(map, *g_mtrrs, saddr, eaddr, attr); }
+
 /// Identity Map
 ///
 /// Adds a 1:1 map from 0 to the ending address.
@@ -22,7 +22,10 @@
 #ifndef EPT_MMAP_INTEL_X64_H
 #define EPT_MMAP_INTEL_X64_H
 
+#include <algorithm>
+#include <atomic>
 #include <mutex>
+#include <vector>
 
 #include <bfgsl.h>
 #include <bfdebug.h>
@@ -31,6 +34,8 @@
 #include <intrinsics.h>
 #include <bfvmm/memory_manager/memory_manager.h>
 
+#include "../page_table.h"
+
 // -----------------------------------------------------------------------------
 // Exports
 // -----------------------------------------------------------------------------
@@ -125,13 +130,21 @@ public:
         for (auto pml4i = 0; pml4i < pml4::num_entries; pml4i++) {
             auto &entry = m_pml4.virt_addr.at(pml4i);
 
-            if (entry == 0) {
+            if (!is_present(entry)) {
                 continue;
             }
 
             this->clear_pdpt(pml4i);
         }
 
+        for (const auto &cow_page : m_cow_pages) {
+            free_page(cow_page.page);
+        }
+
+        for (auto page : m_cow_pool) {
+            free_page(page);
+        }
+
         free_page(m_pml4.virt_addr.data());
     }
 
@@ -311,6 +324,58 @@ public:
         return map_4k(reinterpret_cast<void *>(virt_addr), phys_addr, attr, cache);
     }
 
+    /// Map Range
+    ///
+    /// Maps [virt_addr, virt_addr + size) to [phys_addr, phys_addr + size)
+    /// using the largest pages (up to max_level) that the alignment of the
+    /// two ranges allows. This uses the same range splitting as the VT-d
+    /// second-level tables, so a range mapped into both is made up of the
+    /// same pages.
+    ///
+    /// @expects virt_addr, phys_addr and size are 4k aligned
+    /// @ensures
+    ///
+    /// @param virt_addr the first virtual address to map from
+    /// @param phys_addr the first physical address to map to
+    /// @param size the size of the range in bytes
+    /// @param attr the map permissions
+    /// @param cache the memory type for the mapping
+    /// @param max_level the largest page level to use (see paging)
+    /// @return the number of entries that were written
+    ///
+    size_type
+    map_range(
+        virt_addr_t virt_addr,
+        phys_addr_t phys_addr,
+        size_type size,
+        attr_type attr = attr_type::read_write_execute,
+        memory_type cache = memory_type::write_back,
+        uint64_t max_level = paging::level_1g)
+    {
+        size_type num = 0;
+
+        paging::split_range(virt_addr, phys_addr, size, max_level, [&](
+        auto virt, auto phys, auto level) {
+            switch (level) {
+                case paging::level_1g:
+                    this->map_1g(virt, phys, attr, cache);
+                    break;
+
+                case paging::level_2m:
+                    this->map_2m(virt, phys, attr, cache);
+                    break;
+
+                default:
+                    this->map_4k(virt, phys, attr, cache);
+                    break;
+            };
+
+            num++;
+        });
+
+        return num;
+    }
+
     /// Unmap Virtual Address
     ///
     /// @expects
@@ -328,29 +393,29 @@ public:
         this->map_pdpt(pml4::index(virt_addr));
         auto &pdpte = m_pdpt.virt_addr.at(pdpt::index(virt_addr));
 
-        if (pdpte == 0) {
+        if (!is_present(pdpte)) {
             return ::intel_x64::ept::pdpt::from;
         }
 
         if (pdpt::entry::ps::is_enabled(pdpte)) {
-            pdpte = 0;
+            pdpte = this->not_present();
             return ::intel_x64::ept::pdpt::from;
         }
 
         this->map_pd(pdpt::index(virt_addr));
         auto &pde = m_pd.virt_addr.at(pd::index(virt_addr));
 
-        if (pde == 0) {
+        if (!is_present(pde)) {
             return ::intel_x64::ept::pd::from;
         }
 
         if (pd::entry::ps::is_enabled(pde)) {
-            pde = 0;
+            pde = this->not_present();
             return ::intel_x64::ept::pd::from;
         }
 
         this->map_pt(pd::index(virt_addr));
-        m_pt.virt_addr.at(pt::index(virt_addr)) = 0;
+        m_pt.virt_addr.at(pt::index(virt_addr)) = this->not_present();
 
         return ::intel_x64::ept::pt::from;
     }
@@ -390,7 +455,7 @@ public:
         using namespace ::intel_x64::ept;
 
         if (this->release_pdpte(virt_addr)) {
-            m_pml4.virt_addr.at(pml4::index(virt_addr)) = 0;
+            m_pml4.virt_addr.at(pml4::index(virt_addr)) = this->not_present();
         }
     }
 
@@ -427,7 +492,7 @@ public:
         this->map_pdpt(pml4::index(virt_addr));
         auto &pdpte = m_pdpt.virt_addr.at(pdpt::index(virt_addr));
 
-        if (pdpte == 0) {
+        if (!is_present(pdpte)) {
             throw std::runtime_error("entry: pdpte not mapped");
         }
 
@@ -438,7 +503,7 @@ public:
         this->map_pd(pdpt::index(virt_addr));
         auto &pde = m_pd.virt_addr.at(pd::index(virt_addr));
 
-        if (pde == 0) {
+        if (!is_present(pde)) {
             throw std::runtime_error("entry: pde not mapped");
         }
 
@@ -449,7 +514,7 @@ public:
         this->map_pt(pd::index(virt_addr));
         auto &pte = m_pt.virt_addr.at(pt::index(virt_addr));
 
-        if (pte == 0) {
+        if (!is_present(pte)) {
             throw std::runtime_error("entry: pte not mapped");
         }
 
@@ -496,7 +561,7 @@ public:
         this->map_pdpt(pml4::index(virt_addr));
         auto pdpte = m_pdpt.virt_addr.at(pdpt::index(virt_addr));
 
-        if (pdpte == 0) {
+        if (!is_present(pdpte)) {
             throw std::runtime_error("virt_to_phys: pdpte not mapped");
         }
 
@@ -510,7 +575,7 @@ public:
         this->map_pd(pdpt::index(virt_addr));
         auto pde = m_pd.virt_addr.at(pd::index(virt_addr));
 
-        if (pde == 0) {
+        if (!is_present(pde)) {
             throw std::runtime_error("virt_to_phys: pde not mapped");
         }
 
@@ -524,7 +589,7 @@ public:
         this->map_pt(pd::index(virt_addr));
         auto pte = m_pt.virt_addr.at(pt::index(virt_addr));
 
-        if (pte == 0) {
+        if (!is_present(pte)) {
             throw std::runtime_error("virt_to_phys: pte not mapped");
         }
 
@@ -551,7 +616,7 @@ public:
         this->map_pdpt(pml4::index(virt_addr));
         auto pdpte = m_pdpt.virt_addr.at(pdpt::index(virt_addr));
 
-        if (pdpte == 0) {
+        if (!is_present(pdpte)) {
             throw std::runtime_error("from: pdpte not mapped");
         }
 
@@ -562,7 +627,7 @@ public:
         this->map_pd(pdpt::index(virt_addr));
         auto pde = m_pd.virt_addr.at(pd::index(virt_addr));
 
-        if (pde == 0) {
+        if (!is_present(pde)) {
             throw std::runtime_error("from: pde not mapped");
         }
 
@@ -573,7 +638,7 @@ public:
         this->map_pt(pd::index(virt_addr));
         auto pte = m_pt.virt_addr.at(pt::index(virt_addr));
 
-        if (pte == 0) {
+        if (!is_present(pte)) {
             throw std::runtime_error("from: pte not mapped");
         }
 
@@ -663,166 +728,1237 @@ public:
     inline auto is_4k(virt_addr_t virt_addr)
     { return is_4k(reinterpret_cast<void *>(virt_addr)); }
 
-private:
-
-    gsl::span<virt_addr_t>
-    allocate_span(size_type num_entries)
+    /// Is Mapped
+    ///
+    /// Unlike from() (and is_1g / is_2m / is_4k), this does not throw if
+    /// the address is not mapped, and does not allocate any page tables.
+    ///
+    /// @expects virt_addr and size are 4k aligned
+    /// @ensures
+    ///
+    /// @param virt_addr the first virtual address of the range
+    /// @param size the size of the range in bytes
+    /// @return true if any page in [virt_addr, virt_addr + size) is mapped,
+    ///     false otherwise
+    ///
+    bool
+    is_mapped(virt_addr_t virt_addr, size_type size)
     {
-        return
-            gsl::make_span(
-                static_cast<virt_addr_t *>(alloc_page()),
-                num_entries
-            );
+        auto mapped = false;
+
+        this->walk(virt_addr, size, [&](entry_type & entry, virt_addr_t addr, uint64_t level) {
+            bfignored(addr);
+            bfignored(level);
+
+            if (is_present(entry)) {
+                mapped = true;
+            }
+        });
+
+        return mapped;
     }
 
-    pair
-    allocate(size_type num_entries)
+    /// Enable Accessed and Dirty Flags
+    ///
+    /// Opts this map into EPT accessed and dirty flags. Once a vCPU's EPTP
+    /// points to this map, the hardware sets the accessed flag of every
+    /// entry it walks, and the dirty flag of every leaf entry that is
+    /// written to, which can then be collected with harvest_dirty() and
+    /// harvest_accessed() instead of write protecting each page.
+    ///
+    /// Note that this only takes effect the next time the map is given to
+    /// set_eptp().
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void enable_accessed_and_dirty_flags() noexcept
+    { m_accessed_and_dirty_flags = true; }
+
+    /// Disable Accessed and Dirty Flags
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable_accessed_and_dirty_flags() noexcept
+    { m_accessed_and_dirty_flags = false; }
+
+    /// Accessed and Dirty Flags
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return true if this map uses EPT accessed and dirty flags, false
+    ///     otherwise
+    ///
+    bool accessed_and_dirty_flags() const noexcept
+    { return m_accessed_and_dirty_flags; }
+
+    /// Attach
+    ///
+    /// Records that one more vCPU can walk this map (i.e. the map is the
+    /// vCPU's EPTP, or is in its EPTP list). This is maintained by
+    /// ept_handler.
+    ///
+    /// INVEPT only invalidates the TLBs of the CPU that executes it, so
+    /// anything that clears a flag or a permission and relies on INVEPT
+    /// afterwards (i.e. harvest_dirty) is only safe while a single vCPU
+    /// has the map attached. For the same reason, a map that has a
+    /// snapshot or shared pages (see write_protect_shared) cannot be
+    /// attached to a second vCPU, as copy_on_write() and unshare() could
+    /// not invalidate its translations.
+    ///
+    /// @expects the map is not attached, or has no snapshot and no shared
+    ///     pages
+    /// @ensures
+    ///
+    void attach()
     {
-        auto span =
-            gsl::make_span(
-                static_cast<virt_addr_t *>(alloc_page()),
-                num_entries
-            );
+        std::lock_guard lock(m_mutex);
 
-        pair ptrs = {
-            span,
-            g_mm->virtptr_to_physint(
-                span.data()
-            )
-        };
+        if (m_attached != 0 && (m_snapshot || m_shared != 0)) {
+            throw std::runtime_error("attach: a map with a snapshot or shared pages can only be used by one vcpu");
+        }
 
-        return ptrs;
+        ++m_attached;
     }
 
-    void
-    free(const gsl::span<virt_addr_t> &virt_addr)
-    { free_page(virt_addr.data()); }
+    /// Detach
+    ///
+    /// @expects attached() != 0
+    /// @ensures
+    ///
+    void detach() noexcept
+    { --m_attached; }
 
-private:
+    /// Attached
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the number of vCPUs that can walk this map
+    ///
+    std::size_t attached() const noexcept
+    { return m_attached.load(); }
 
-    pair
-    phys_to_pair(phys_addr_t phys_addr, size_type num_entries)
+    /// Harvest Dirty
+    ///
+    /// Walks the leaf entries that map [virt_addr, virt_addr + size) and
+    /// sets a bit in bitmap for every 4k page that is mapped by a dirty
+    /// entry (bit n is the page at virt_addr + (n * 4k)). The dirty flag
+    /// of each of these entries is cleared atomically so that writes from
+    /// the hardware are never lost. A large page that is only partially
+    /// covered by the range is reported, but its dirty flag is left set.
+    ///
+    /// Since the hardware only sets a flag the first time it caches a
+    /// translation, INVEPT must be executed once the harvest is complete,
+    /// and before the result is relied on (see vcpu::harvest_dirty).
+    ///
+    /// @expects accessed_and_dirty_flags() == true
+    /// @expects virt_addr and size are 4k aligned
+    /// @expects bitmap has at least one bit per 4k page in the range
+    /// @ensures
+    ///
+    /// @param virt_addr the first virtual address of the range
+    /// @param size the size of the range in bytes
+    /// @param bitmap the resulting dirty bitmap
+    /// @return the number of dirty 4k pages in the range
+    ///
+    size_type
+    harvest_dirty(virt_addr_t virt_addr, size_type size, gsl::span<uint64_t> bitmap)
     {
-        auto virt_addr =
-            static_cast<virt_addr_t *>(
-                g_mm->physint_to_virtptr(phys_addr)
-            );
-
-        return {
-            gsl::make_span<virt_addr_t>(virt_addr, num_entries),
-            phys_addr
-        };
+        return this->harvest(
+                   virt_addr, size, ::intel_x64::ept::pt::entry::dirty::mask, bitmap
+               );
     }
 
-    void
-    map_pdpt(index_type pml4i)
+    /// Harvest Accessed
+    ///
+    /// Same as harvest_dirty(), but for the accessed flag of each leaf
+    /// entry, which can be used to estimate the working set of a guest.
+    ///
+    /// @expects accessed_and_dirty_flags() == true
+    /// @expects virt_addr and size are 4k aligned
+    /// @expects bitmap has at least one bit per 4k page in the range
+    /// @ensures
+    ///
+    /// @param virt_addr the first virtual address of the range
+    /// @param size the size of the range in bytes
+    /// @param bitmap the resulting accessed bitmap
+    /// @return the number of accessed 4k pages in the range
+    ///
+    size_type
+    harvest_accessed(virt_addr_t virt_addr, size_type size, gsl::span<uint64_t> bitmap)
     {
-        using namespace ::intel_x64::ept;
-        auto &entry = m_pml4.virt_addr.at(pml4i);
+        return this->harvest(
+                   virt_addr, size, ::intel_x64::ept::pt::entry::accessed_flag::mask, bitmap
+               );
+    }
 
-        if (entry != 0) {
-            auto phys_addr = pml4::entry::phys_addr::get(entry);
+    /// Suppress #VE Mask
+    ///
+    /// Bit 63 of a leaf entry, or of an entry (at any level) that is not
+    /// present. If this bit is clear, and the vCPU has enabled EPT-violation
+    /// #VE, an EPT violation caused by the entry is delivered to the guest
+    /// as a virtualization exception instead of causing a VM exit.
+    ///
+    constexpr static entry_type suppress_ve_mask = 0x8000000000000000ULL;
 
-            if (m_pdpt.phys_addr == phys_addr) {
-                return;
-            }
+    /// Enable Suppress #VE By Default
+    ///
+    /// Sets the suppress #VE bit of every leaf entry that is mapped from
+    /// now on, and of every entry that is not present (i.e. memory that is
+    /// not mapped, now or after an unmap), so that EPT violations only
+    /// become #VEs for the entries that have been explicitly armed using
+    /// set_suppress_ve(). Leaf entries that are already mapped are left
+    /// as they are, so this should be enabled before the map is populated.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void enable_suppress_ve_by_default()
+    {
+        std::lock_guard lock(m_mutex);
 
-            m_pdpt = phys_to_pair(phys_addr, pdpt::num_entries);
-            return;
-        }
+        m_suppress_ve = true;
+        this->fill_not_present();
+    }
 
-        m_pdpt = this->allocate(pdpt::num_entries);
+    /// Disable Suppress #VE By Default
+    ///
+    /// Clears the suppress #VE bit of every entry that is not present, and
+    /// of every leaf entry that is mapped from now on.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable_suppress_ve_by_default()
+    {
+        std::lock_guard lock(m_mutex);
 
-        pml4::entry::phys_addr::set(entry, m_pdpt.phys_addr);
-        pml4::entry::read_access::enable(entry);
-        pml4::entry::write_access::enable(entry);
-        pml4::entry::execute_access::enable(entry);
+        m_suppress_ve = false;
+        this->fill_not_present();
     }
 
-    void
-    map_pd(index_type pdpti)
-    {
-        using namespace ::intel_x64::ept;
-        auto &entry = m_pdpt.virt_addr.at(pdpti);
+    /// Suppress #VE By Default
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return true if new leaf entries suppress #VEs, false otherwise
+    ///
+    bool suppress_ve_by_default() const noexcept
+    { return m_suppress_ve; }
 
-        if (entry != 0) {
-            auto phys_addr = pdpt::entry::phys_addr::get(entry);
+    /// Set Suppress #VE
+    ///
+    /// Sets (or clears) the suppress #VE bit of every leaf entry that maps
+    /// [virt_addr, virt_addr + size), and of every entry that is not
+    /// present in the range. A large page (or an entry that is not present
+    /// in a higher level table) that is only partially covered by the range
+    /// is updated as a whole, and no tables are allocated. The bit is
+    /// updated atomically, so the hardware's accessed and dirty flags are
+    /// never lost.
+    ///
+    /// INVEPT must be executed before the change is guaranteed to be seen
+    /// by the hardware.
+    ///
+    /// @expects virt_addr and size are 4k aligned
+    /// @ensures
+    ///
+    /// @param virt_addr the first virtual address of the range
+    /// @param size the size of the range in bytes
+    /// @param suppress true to set the suppress #VE bit, false to clear it
+    ///     (i.e. arm the entries)
+    /// @return the number of entries that were updated
+    ///
+    size_type
+    set_suppress_ve(virt_addr_t virt_addr, size_type size, bool suppress)
+    {
+        size_type num = 0;
 
-            if (m_pd.phys_addr == phys_addr) {
-                return;
+        this->walk(virt_addr, size, [&](entry_type & entry, virt_addr_t, uint64_t) {
+            if (suppress) {
+                __atomic_fetch_or(&entry, suppress_ve_mask, __ATOMIC_SEQ_CST);
+            }
+            else {
+                __atomic_fetch_and(&entry, ~suppress_ve_mask, __ATOMIC_SEQ_CST);
             }
 
-            m_pd = phys_to_pair(phys_addr, pd::num_entries);
-            return;
-        }
-
-        m_pd = this->allocate(pd::num_entries);
+            num++;
+        });
 
-        pdpt::entry::phys_addr::set(entry, m_pd.phys_addr);
-        pdpt::entry::read_access::enable(entry);
-        pdpt::entry::write_access::enable(entry);
-        pdpt::entry::execute_access::enable(entry);
+        return num;
     }
 
+    /// Suppress #VE
+    ///
+    /// @expects virt_addr is mapped
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address to test
+    /// @return true if the leaf entry that maps virt_addr suppresses #VEs,
+    ///     false otherwise
+    ///
+    bool
+    suppress_ve(virt_addr_t virt_addr)
+    { return (this->entry(virt_addr).first.get() & suppress_ve_mask) != 0; }
+
+    /// Sub-Page Write Permissions Mask
+    ///
+    /// Bit 61 of a 4k entry. If this bit is set, and the entry does not
+    /// allow writes, a write to the page is checked against the page's
+    /// sub-page write permissions (see ept::sppt) instead of always causing
+    /// an EPT violation.
+    ///
+    constexpr static entry_type spp_mask = 0x2000000000000000ULL;
+
+    /// Set Sub-Page Write Permissions
+    ///
+    /// Enables (or disables) sub-page write permissions for the 4k page
+    /// that maps virt_addr. Enabling removes write access from the entry
+    /// (so that the SPP table decides which writes are allowed), and
+    /// disabling gives it back. Enabling an entry that is already enabled,
+    /// or disabling one that is not, does nothing.
+    ///
+    /// The SPP table must already describe the page before it is enabled,
+    /// and INVEPT must be executed before the change is guaranteed to be
+    /// seen by the hardware.
+    ///
+    /// @expects virt_addr is mapped by a 4k page
+    /// @expects the page is writable when enabling
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address of the page
+    /// @param enable true to enable sub-page write permissions, false to
+    ///     disable them
+    ///
     void
-    map_pt(index_type pdi)
+    set_spp(virt_addr_t virt_addr, bool enable)
     {
         using namespace ::intel_x64::ept;
-        auto &entry = m_pd.virt_addr.at(pdi);
 
-        if (entry != 0) {
-            auto phys_addr = pd::entry::phys_addr::get(entry);
+        auto [ref, from] = this->entry(virt_addr);
+        auto &entry = ref.get();
 
-            if (m_pt.phys_addr == phys_addr) {
+        if (from != pt::from) {
+            throw std::runtime_error("set_spp: virt_addr is not mapped by a 4k page");
+        }
+
+        auto val = __atomic_load_n(&entry, __ATOMIC_SEQ_CST);
+
+        // The two bits are updated in an order that never allows a write
+        // that both the old and the new entry would have denied.
+        //
+
+        if (enable) {
+            if ((val & spp_mask) != 0) {
                 return;
             }
 
-            m_pt = phys_to_pair(phys_addr, pt::num_entries);
-            return;
-        }
+            if (pt::entry::write_access::is_disabled(val)) {
+                throw std::runtime_error("set_spp: page is not writable");
+            }
 
-        m_pt = this->allocate(pt::num_entries);
+            __atomic_fetch_or(&entry, spp_mask, __ATOMIC_SEQ_CST);
+            __atomic_fetch_and(&entry, ~pt::entry::write_access::mask, __ATOMIC_SEQ_CST);
+        }
+        else {
+            if ((val & spp_mask) == 0) {
+                return;
+            }
 
-        pd::entry::phys_addr::set(entry, m_pt.phys_addr);
-        pd::entry::read_access::enable(entry);
-        pd::entry::write_access::enable(entry);
-        pd::entry::execute_access::enable(entry);
+            __atomic_fetch_or(&entry, pt::entry::write_access::mask, __ATOMIC_SEQ_CST);
+            __atomic_fetch_and(&entry, ~spp_mask, __ATOMIC_SEQ_CST);
+        }
     }
 
-    void
-    clear_pdpt(index_type pml4i)
+    /// Sub-Page Write Permissions
+    ///
+    /// @expects virt_addr is mapped
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address to test
+    /// @return true if sub-page write permissions are enabled for the page
+    ///     that maps virt_addr, false otherwise
+    ///
+    bool
+    spp(virt_addr_t virt_addr)
+    { return (this->entry(virt_addr).first.get() & spp_mask) != 0; }
+
+    /// Copy-On-Write Mask
+    ///
+    /// Bit 52 of a leaf entry, which is ignored by the hardware. Set on
+    /// every entry that was write-protected by snapshot().
+    ///
+    constexpr static entry_type cow_mask = 0x0010000000000000ULL;
+
+    /// Max Virtual Address
+    ///
+    /// The end of the address space described by the map (48 bits)
+    ///
+    constexpr static virt_addr_t max_virt_addr = 0x0001000000000000ULL;
+
+    /// Snapshot
+    ///
+    /// Takes a copy-on-write snapshot of the memory described by this map
+    /// by removing write access from every readable and writable leaf
+    /// entry that maps write-back memory. Entries with any other memory
+    /// type (e.g. uncacheable MMIO) are left writable, as a device's
+    /// registers cannot be copied. Large pages are left as is: a 1g or 2m
+    /// page is only split (down to 4k) once the guest writes to it.
+    ///
+    /// Each write to a page of the snapshot causes an EPT violation, which
+    /// must be handed to copy_on_write() (see vcpu::snapshot). Once the
+    /// guest is done, revert() throws away everything the guest wrote in
+    /// O(dirty pages), leaving the snapshot in place so that it can be
+    /// used again.
+    ///
+    /// INVEPT must be executed before the snapshot is guaranteed to be seen
+    /// by the hardware.
+    ///
+    /// @expects a snapshot has not already been taken, and the map is not
+    ///     attached to more than one vCPU (see attach())
+    /// @ensures
+    ///
+    /// @return the number of leaf entries that were write-protected
+    ///
+    size_type
+    snapshot()
     {
         using namespace ::intel_x64::ept;
-        this->map_pdpt(pml4i);
 
-        for (auto pdpti = 0; pdpti < pdpt::num_entries; pdpti++) {
-            auto &entry = m_pdpt.virt_addr.at(pdpti);
+        {
+            std::lock_guard lock(m_mutex);
 
-            if (entry == 0) {
-                continue;
+            if (m_snapshot) {
+                throw std::runtime_error("snapshot: a snapshot has already been taken");
             }
 
-            if (pdpt::entry::ps::is_disabled(entry)) {
-                this->clear_pd(pdpti);
+            if (m_attached > 1) {
+                throw std::runtime_error("snapshot: map is used by more than one vcpu");
             }
 
-            entry = 0;
+            m_snapshot = true;
         }
 
-        this->free(m_pdpt.virt_addr);
-        m_pdpt = {};
-    }
-
-    void
-    clear_pd(index_type pdpti)
-    {
-        using namespace ::intel_x64::ept;
-        this->map_pd(pdpti);
+        size_type num = 0;
 
-        for (auto pdi = 0; pdi < pd::num_entries; pdi++) {
-            auto &entry = m_pd.virt_addr.at(pdi);
+        this->walk(0, max_virt_addr, [&](entry_type & entry, virt_addr_t, uint64_t) {
+            auto val = __atomic_load_n(&entry, __ATOMIC_SEQ_CST);
 
-            if (entry == 0) {
+            if (pt::entry::read_access::is_disabled(val) ||
+                pt::entry::write_access::is_disabled(val) ||
+                pt::entry::memory_type::get(val) != pt::entry::memory_type::write_back) {
+                return;
+            }
+
+            __atomic_fetch_or(&entry, cow_mask, __ATOMIC_SEQ_CST);
+            __atomic_fetch_and(&entry, ~pt::entry::write_access::mask, __ATOMIC_SEQ_CST);
+
+            num++;
+        });
+
+        return num;
+    }
+
+    /// Has Snapshot
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return true if snapshot() has been called (and the snapshot has not
+    ///     been released), false otherwise
+    ///
+    bool
+    has_snapshot() const
+    {
+        std::lock_guard lock(m_mutex);
+        return m_snapshot;
+    }
+
+    /// Copy On Write
+    ///
+    /// Handles a write to a page of the snapshot. A large page is split
+    /// (in place) down to 4k, a private copy of the 4k page that contains
+    /// virt_addr is made using copy, and the entry is pointed at the copy
+    /// with write access restored. If another CPU already made the copy,
+    /// nothing is done.
+    ///
+    /// The copy is provided with a VMM page (which becomes the private
+    /// copy) and the physical address of the page to copy, and must copy
+    /// the 4k page into the VMM page. Copies are recycled by revert(), so
+    /// no allocation is needed once the working set of the guest is known.
+    ///
+    /// No INVEPT is needed, as the EPT violation already invalidated the
+    /// translations of virt_addr on the faulting CPU, and the rest of a
+    /// page that was split is mapped exactly as it was before. This only
+    /// holds because a map with a snapshot is used by a single vCPU (see
+    /// attach()); another vCPU could keep reading the original page.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address that was written to
+    /// @param copy the function used to copy the page, of the form
+    ///     void(void *dst, phys_addr_t src)
+    /// @return true if virt_addr belongs to the snapshot, false otherwise
+    ///
+    template<typename F>
+    bool
+    copy_on_write(virt_addr_t virt_addr, F copy)
+    {
+        using namespace ::intel_x64::ept;
+        std::lock_guard lock(m_mutex);
+
+        if (!m_snapshot || !is_present(m_pml4.virt_addr.at(pml4::index(virt_addr)))) {
+            return false;
+        }
+
+        this->map_pdpt(pml4::index(virt_addr));
+        auto &pdpte = m_pdpt.virt_addr.at(pdpt::index(virt_addr));
+
+        if (!is_present(pdpte)) {
+            return false;
+        }
+
+        if (pdpt::entry::ps::is_enabled(pdpte)) {
+            if ((pdpte & cow_mask) == 0) {
+                return false;
+            }
+
+            this->split_pdpte(pdpt::index(virt_addr));
+        }
+
+        this->map_pd(pdpt::index(virt_addr));
+        auto &pde = m_pd.virt_addr.at(pd::index(virt_addr));
+
+        if (!is_present(pde)) {
+            return false;
+        }
+
+        if (pd::entry::ps::is_enabled(pde)) {
+            if ((pde & cow_mask) == 0) {
+                return false;
+            }
+
+            this->split_pde(pd::index(virt_addr));
+        }
+
+        this->map_pt(pd::index(virt_addr));
+        auto &pte = m_pt.virt_addr.at(pt::index(virt_addr));
+
+        if ((pte & cow_mask) == 0) {
+            return false;
+        }
+
+        if (pt::entry::write_access::is_enabled(pte)) {
+            return true;
+        }
+
+        if (m_cow_pool.empty()) {
+            m_cow_pool.push_back(alloc_page());
+        }
+
+        auto page = m_cow_pool.back();
+        auto phys_addr = pt::entry::phys_addr::get(pte);
+
+        copy(page, phys_addr);
+
+        m_cow_pages.push_back({bfn::upper(virt_addr, pt::from), phys_addr, page});
+        m_cow_pool.pop_back();
+
+        auto val = pte;
+        pt::entry::phys_addr::set(val, g_mm->virtptr_to_physint(page));
+        pt::entry::write_access::enable(val);
+
+        __atomic_store_n(&pte, val, __ATOMIC_SEQ_CST);
+        return true;
+    }
+
+    /// Revert
+    ///
+    /// Throws away every write made to the snapshot since it was taken (or
+    /// last reverted) by pointing each copied page back at the original
+    /// page and removing its write access again. The private copies are
+    /// kept for the next run. Pages that were split stay split.
+    ///
+    /// The guest must not run on any CPU until INVEPT has been executed
+    /// on every CPU that uses this map, as stale translations would still
+    /// point at the private copies.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the number of pages that were reverted
+    ///
+    size_type
+    revert()
+    {
+        using namespace ::intel_x64::ept;
+        std::lock_guard lock(m_mutex);
+
+        for (const auto &cow_page : m_cow_pages) {
+            auto &pte = this->pte(cow_page.virt_addr);
+
+            auto val = pte;
+            pt::entry::phys_addr::set(val, cow_page.phys_addr);
+            pt::entry::write_access::disable(val);
+
+            __atomic_store_n(&pte, val, __ATOMIC_SEQ_CST);
+            m_cow_pool.push_back(cow_page.page);
+        }
+
+        auto num = m_cow_pages.size();
+        m_cow_pages.clear();
+
+        return num;
+    }
+
+    /// Release Snapshot
+    ///
+    /// Reverts the snapshot (see revert()), gives write access back to
+    /// every entry of the snapshot and frees the private copies.
+    ///
+    /// The same INVEPT requirements as revert() apply.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void
+    release_snapshot()
+    {
+        using namespace ::intel_x64::ept;
+
+        this->revert();
+
+        this->walk(0, max_virt_addr, [&](entry_type & entry, virt_addr_t, uint64_t) {
+            if ((__atomic_load_n(&entry, __ATOMIC_SEQ_CST) & cow_mask) == 0) {
+                return;
+            }
+
+            __atomic_fetch_or(&entry, pt::entry::write_access::mask, __ATOMIC_SEQ_CST);
+            __atomic_fetch_and(&entry, ~cow_mask, __ATOMIC_SEQ_CST);
+        });
+
+        std::lock_guard lock(m_mutex);
+
+        for (auto page : m_cow_pool) {
+            free_page(page);
+        }
+
+        m_cow_pool.clear();
+        m_snapshot = false;
+    }
+
+    /// Copied Pages
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the number of pages the guest has written to since the
+    ///     snapshot was taken (or last reverted)
+    ///
+    size_type
+    cow_pages() const
+    {
+        std::lock_guard lock(m_mutex);
+        return m_cow_pages.size();
+    }
+
+    /// Shared Mask
+    ///
+    /// Bit 53 of a 4k entry, which is ignored by the hardware. Set on every
+    /// entry that was write-protected by write_protect_shared() so that its
+    /// page can be shared with other maps (see page_dedup).
+    ///
+    constexpr static entry_type shared_mask = 0x0020000000000000ULL;
+
+    /// Write Protect Shared
+    ///
+    /// Removes write access from every readable and writable 4k entry in
+    /// [virt_addr, virt_addr + size) that is not already being tracked by
+    /// a snapshot, SPP or a previous call, and marks it as shared. Large
+    /// pages are skipped. func is called (with the lock held) for each
+    /// entry that was updated, of the form:
+    ///     void(virt_addr_t virt_addr, phys_addr_t phys_addr)
+    ///
+    /// Nothing is write-protected while the map is attached to more than
+    /// one vCPU, as unshare() gives write access back to an entry (and
+    /// changes its physical address) without an INVEPT, which is only
+    /// correct for the vCPU that took the EPT violation.
+    ///
+    /// INVEPT must be executed before the change is guaranteed to be seen
+    /// by the hardware.
+    ///
+    /// @expects virt_addr and size are 4k aligned
+    /// @ensures
+    ///
+    /// @param virt_addr the first virtual address of the range
+    /// @param size the size of the range in bytes
+    /// @param func the function to call for each entry
+    /// @return the number of entries that were write-protected
+    ///
+    template<typename F>
+    size_type
+    write_protect_shared(virt_addr_t virt_addr, size_type size, F func)
+    {
+        using namespace ::intel_x64::ept;
+        size_type num = 0;
+
+        this->walk(virt_addr, size, [&](entry_type & entry, virt_addr_t addr, uint64_t level) {
+            auto val = __atomic_load_n(&entry, __ATOMIC_SEQ_CST);
+
+            if (level != paging::level_4k || m_attached > 1 ||
+                pt::entry::read_access::is_disabled(val) ||
+                pt::entry::write_access::is_disabled(val) ||
+                (val & (cow_mask | spp_mask | shared_mask)) != 0) {
+                return;
+            }
+
+            __atomic_fetch_or(&entry, shared_mask, __ATOMIC_SEQ_CST);
+            __atomic_fetch_and(&entry, ~pt::entry::write_access::mask, __ATOMIC_SEQ_CST);
+
+            func(addr, pt::entry::phys_addr::get(val));
+
+            m_shared++;
+            num++;
+        });
+
+        return num;
+    }
+
+    /// Remap Shared
+    ///
+    /// Points a shared entry at a different (read-only) physical page, as
+    /// long as the entry has not been unshared and still maps from.
+    ///
+    /// INVEPT must be executed before the change is guaranteed to be seen
+    /// by the hardware, so from must not be reused until then.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address of the 4k page
+    /// @param from the physical address the entry is expected to map
+    /// @param to the new physical address of the entry
+    /// @return true if the entry was remapped, false otherwise
+    ///
+    bool
+    remap_shared(virt_addr_t virt_addr, phys_addr_t from, phys_addr_t to)
+    {
+        using namespace ::intel_x64::ept;
+        std::lock_guard lock(m_mutex);
+
+        auto pte = this->find_pte(virt_addr);
+        if (pte == nullptr) {
+            return false;
+        }
+
+        auto val = __atomic_load_n(pte, __ATOMIC_SEQ_CST);
+
+        if ((val & shared_mask) == 0 ||
+            pt::entry::write_access::is_enabled(val) ||
+            pt::entry::phys_addr::get(val) != from) {
+            return false;
+        }
+
+        pt::entry::phys_addr::set(val, to);
+        __atomic_store_n(pte, val, __ATOMIC_SEQ_CST);
+
+        return true;
+    }
+
+    /// Unshare
+    ///
+    /// Points a shared entry at a private physical page, and gives write
+    /// access back to the entry.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address of the 4k page
+    /// @param phys_addr the private physical page (which may be the page
+    ///     the entry already maps)
+    /// @return true if the entry was shared, false otherwise
+    ///
+    bool
+    unshare(virt_addr_t virt_addr, phys_addr_t phys_addr)
+    {
+        using namespace ::intel_x64::ept;
+        std::lock_guard lock(m_mutex);
+
+        auto pte = this->find_pte(virt_addr);
+        if (pte == nullptr) {
+            return false;
+        }
+
+        auto val = __atomic_load_n(pte, __ATOMIC_SEQ_CST);
+
+        if ((val & shared_mask) == 0) {
+            return false;
+        }
+
+        pt::entry::phys_addr::set(val, phys_addr);
+        pt::entry::write_access::enable(val);
+
+        __atomic_store_n(pte, val & ~shared_mask, __ATOMIC_SEQ_CST);
+        m_shared--;
+
+        return true;
+    }
+
+private:
+
+    gsl::span<virt_addr_t>
+    allocate_span(size_type num_entries)
+    {
+        return
+            gsl::make_span(
+                static_cast<virt_addr_t *>(alloc_page()),
+                num_entries
+            );
+    }
+
+    pair
+    allocate(size_type num_entries)
+    {
+        auto span =
+            gsl::make_span(
+                static_cast<virt_addr_t *>(alloc_page()),
+                num_entries
+            );
+
+        if (m_suppress_ve) {
+            std::fill(span.begin(), span.end(), this->not_present());
+        }
+
+        pair ptrs = {
+            span,
+            g_mm->virtptr_to_physint(
+                span.data()
+            )
+        };
+
+        return ptrs;
+    }
+
+    void
+    free(const gsl::span<virt_addr_t> &virt_addr)
+    { free_page(virt_addr.data()); }
+
+    // An entry is present if any of its read, write or execute bits are
+    // set. The rest of an entry that is not present is not ignored by the
+    // hardware, as the suppress #VE bit still applies.
+    //
+    constexpr static entry_type present_mask = 0x7ULL;
+
+    static bool
+    is_present(entry_type entry) noexcept
+    { return (entry & present_mask) != 0; }
+
+    entry_type
+    not_present() const noexcept
+    { return m_suppress_ve ? suppress_ve_mask : 0; }
+
+    // Gives every entry that is not present, in every table, the value of
+    // not_present(), so that addresses that are not mapped follow the
+    // suppress #VE default as well.
+    //
+    void
+    fill_not_present()
+    {
+        using namespace ::intel_x64::ept;
+        auto val = this->not_present();
+
+        for (auto pml4i = 0; pml4i < pml4::num_entries; pml4i++) {
+            auto &pml4e = m_pml4.virt_addr.at(pml4i);
+
+            if (!is_present(pml4e)) {
+                __atomic_store_n(&pml4e, val, __ATOMIC_SEQ_CST);
+                continue;
+            }
+
+            this->map_pdpt(pml4i);
+
+            for (auto pdpti = 0; pdpti < pdpt::num_entries; pdpti++) {
+                auto &pdpte = m_pdpt.virt_addr.at(pdpti);
+
+                if (!is_present(pdpte)) {
+                    __atomic_store_n(&pdpte, val, __ATOMIC_SEQ_CST);
+                    continue;
+                }
+
+                if (pdpt::entry::ps::is_enabled(pdpte)) {
+                    continue;
+                }
+
+                this->map_pd(pdpti);
+
+                for (auto pdi = 0; pdi < pd::num_entries; pdi++) {
+                    auto &pde = m_pd.virt_addr.at(pdi);
+
+                    if (!is_present(pde)) {
+                        __atomic_store_n(&pde, val, __ATOMIC_SEQ_CST);
+                        continue;
+                    }
+
+                    if (pd::entry::ps::is_enabled(pde)) {
+                        continue;
+                    }
+
+                    this->map_pt(pdi);
+
+                    for (auto &pte : m_pt.virt_addr) {
+                        if (!is_present(pte)) {
+                            __atomic_store_n(&pte, val, __ATOMIC_SEQ_CST);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+private:
+
+    size_type
+    harvest(
+        virt_addr_t virt_addr, size_type size, entry_type mask, gsl::span<uint64_t> bitmap)
+    {
+        if (!m_accessed_and_dirty_flags) {
+            throw std::runtime_error("harvest: accessed and dirty flags are not enabled");
+        }
+
+        expects(static_cast<size_type>(bitmap.size()) * 64U >= (size >> ::intel_x64::ept::pt::from));
+        std::fill(bitmap.begin(), bitmap.end(), 0);
+
+        size_type num = 0;
+        auto end = virt_addr + size;
+
+        this->walk(virt_addr, size, [&](entry_type & entry, virt_addr_t addr, uint64_t level) {
+            num += harvest_entry(entry, mask, addr, level, virt_addr, end, bitmap);
+        });
+
+        return num;
+    }
+
+    // Calls func with the leaf entry (or the entry that is not present, at
+    // any level) for each page in the range. Tables are never allocated
+    // here, so an entry that is not present skips everything it would have
+    // mapped.
+    //
+    template<typename F>
+    void
+    walk(virt_addr_t virt_addr, size_type size, F func)
+    {
+        using namespace ::intel_x64::ept;
+
+        expects(bfn::lower(virt_addr | size, paging::from(paging::level_4k)) == 0);
+
+        std::lock_guard lock(m_mutex);
+        auto end = virt_addr + size;
+
+        for (auto addr = virt_addr; addr < end;) {
+            auto &pml4e = m_pml4.virt_addr.at(pml4::index(addr));
+
+            if (!is_present(pml4e)) {
+                func(pml4e, addr, paging::level_1g + 1U);
+                addr = next_page(addr, paging::page_size(paging::level_1g + 1U));
+                continue;
+            }
+
+            this->map_pdpt(pml4::index(addr));
+            auto &pdpte = m_pdpt.virt_addr.at(pdpt::index(addr));
+
+            if (!is_present(pdpte) || pdpt::entry::ps::is_enabled(pdpte)) {
+                func(pdpte, addr, paging::level_1g);
+                addr = next_page(addr, paging::page_size(paging::level_1g));
+                continue;
+            }
+
+            this->map_pd(pdpt::index(addr));
+            auto &pde = m_pd.virt_addr.at(pd::index(addr));
+
+            if (!is_present(pde) || pd::entry::ps::is_enabled(pde)) {
+                func(pde, addr, paging::level_2m);
+                addr = next_page(addr, paging::page_size(paging::level_2m));
+                continue;
+            }
+
+            this->map_pt(pd::index(addr));
+            auto &pte = m_pt.virt_addr.at(pt::index(addr));
+
+            func(pte, addr, paging::level_4k);
+            addr = next_page(addr, paging::page_size(paging::level_4k));
+        }
+    }
+
+    static virt_addr_t
+    next_page(virt_addr_t addr, size_type page_size) noexcept
+    { return (addr & ~(page_size - 1U)) + page_size; }
+
+    // Returns the 4k entry that maps virt_addr, or a nullptr if virt_addr
+    // is not mapped by a 4k page. Tables are never allocated here.
+    //
+    entry_type *
+    find_pte(virt_addr_t virt_addr)
+    {
+        using namespace ::intel_x64::ept;
+
+        if (!is_present(m_pml4.virt_addr.at(pml4::index(virt_addr)))) {
+            return nullptr;
+        }
+
+        this->map_pdpt(pml4::index(virt_addr));
+        auto pdpte = m_pdpt.virt_addr.at(pdpt::index(virt_addr));
+
+        if (!is_present(pdpte) || pdpt::entry::ps::is_enabled(pdpte)) {
+            return nullptr;
+        }
+
+        this->map_pd(pdpt::index(virt_addr));
+        auto pde = m_pd.virt_addr.at(pd::index(virt_addr));
+
+        if (!is_present(pde) || pd::entry::ps::is_enabled(pde)) {
+            return nullptr;
+        }
+
+        this->map_pt(pd::index(virt_addr));
+        return &m_pt.virt_addr.at(pt::index(virt_addr));
+    }
+
+    // Returns the 4k entry that maps virt_addr, which must exist
+    //
+    entry_type &
+    pte(virt_addr_t virt_addr)
+    {
+        using namespace ::intel_x64::ept;
+
+        this->map_pdpt(pml4::index(virt_addr));
+        this->map_pd(pdpt::index(virt_addr));
+        this->map_pt(pd::index(virt_addr));
+
+        return m_pt.virt_addr.at(pt::index(virt_addr));
+    }
+
+    // Replaces a large page with a table of pages of the next size down
+    // that map the same memory with the same attributes. The table is
+    // filled in before it is linked, so the hardware (or another CPU)
+    // never sees a partial table.
+    //
+    void
+    split_pdpte(index_type pdpti)
+    {
+        using namespace ::intel_x64::ept;
+
+        auto &entry = m_pdpt.virt_addr.at(pdpti);
+        auto table = this->allocate(pd::num_entries);
+
+        auto phys_addr = pdpt::entry::phys_addr::get(entry);
+        auto attr = entry & ~pdpt::entry::phys_addr::mask;
+
+        for (auto pdi = 0; pdi < pd::num_entries; pdi++) {
+            table.virt_addr.at(pdi) =
+                attr | (phys_addr + (static_cast<phys_addr_t>(pdi) << pd::from));
+        }
+
+        entry_type val = 0;
+        pdpt::entry::phys_addr::set(val, table.phys_addr);
+        pdpt::entry::read_access::enable(val);
+        pdpt::entry::write_access::enable(val);
+        pdpt::entry::execute_access::enable(val);
+
+        __atomic_store_n(&entry, val, __ATOMIC_SEQ_CST);
+        m_pd = table;
+    }
+
+    void
+    split_pde(index_type pdi)
+    {
+        using namespace ::intel_x64::ept;
+
+        auto &entry = m_pd.virt_addr.at(pdi);
+        auto table = this->allocate(pt::num_entries);
+
+        auto phys_addr = pd::entry::phys_addr::get(entry);
+        auto attr = entry & ~(pd::entry::phys_addr::mask | pd::entry::ps::mask);
+
+        for (auto pti = 0; pti < pt::num_entries; pti++) {
+            table.virt_addr.at(pti) =
+                attr | (phys_addr + (static_cast<phys_addr_t>(pti) << pt::from));
+        }
+
+        entry_type val = 0;
+        pd::entry::phys_addr::set(val, table.phys_addr);
+        pd::entry::read_access::enable(val);
+        pd::entry::write_access::enable(val);
+        pd::entry::execute_access::enable(val);
+
+        __atomic_store_n(&entry, val, __ATOMIC_SEQ_CST);
+        m_pt = table;
+    }
+
+    static size_type
+    harvest_entry(
+        entry_type &entry, entry_type mask, virt_addr_t addr, uint64_t level,
+        virt_addr_t start, virt_addr_t end, gsl::span<uint64_t> bitmap)
+    {
+        if ((__atomic_load_n(&entry, __ATOMIC_RELAXED) & mask) == 0) {
+            return 0;
+        }
+
+        auto page_size = paging::page_size(level);
+        auto base = addr & ~(page_size - 1U);
+
+        auto first = std::max(base, start);
+        auto last = std::min(base + page_size, end);
+
+        // The flag of a large page that extends past the range is left set,
+        // as clearing it would lose writes to the part that is not reported.
+        //
+
+        if (last - first == page_size) {
+            if ((__atomic_fetch_and(&entry, ~mask, __ATOMIC_SEQ_CST) & mask) == 0) {
+                return 0;
+            }
+        }
+
+        for (auto page = first; page < last; page += paging::page_size(paging::level_4k)) {
+            auto bit = (page - start) >> ::intel_x64::ept::pt::from;
+            bitmap.at(static_cast<std::ptrdiff_t>(bit >> 6U)) |= 1ULL << (bit & 63U);
+        }
+
+        return (last - first) >> ::intel_x64::ept::pt::from;
+    }
+
+private:
+
+    pair
+    phys_to_pair(phys_addr_t phys_addr, size_type num_entries)
+    {
+        auto virt_addr =
+            static_cast<virt_addr_t *>(
+                g_mm->physint_to_virtptr(phys_addr)
+            );
+
+        return {
+            gsl::make_span<virt_addr_t>(virt_addr, num_entries),
+            phys_addr
+        };
+    }
+
+    void
+    map_pdpt(index_type pml4i)
+    {
+        using namespace ::intel_x64::ept;
+        auto &entry = m_pml4.virt_addr.at(pml4i);
+
+        if (is_present(entry)) {
+            auto phys_addr = pml4::entry::phys_addr::get(entry);
+
+            if (m_pdpt.phys_addr == phys_addr) {
+                return;
+            }
+
+            m_pdpt = phys_to_pair(phys_addr, pdpt::num_entries);
+            return;
+        }
+
+        m_pdpt = this->allocate(pdpt::num_entries);
+
+        entry = 0;
+        pml4::entry::phys_addr::set(entry, m_pdpt.phys_addr);
+        pml4::entry::read_access::enable(entry);
+        pml4::entry::write_access::enable(entry);
+        pml4::entry::execute_access::enable(entry);
+    }
+
+    void
+    map_pd(index_type pdpti)
+    {
+        using namespace ::intel_x64::ept;
+        auto &entry = m_pdpt.virt_addr.at(pdpti);
+
+        if (is_present(entry)) {
+            auto phys_addr = pdpt::entry::phys_addr::get(entry);
+
+            if (m_pd.phys_addr == phys_addr) {
+                return;
+            }
+
+            m_pd = phys_to_pair(phys_addr, pd::num_entries);
+            return;
+        }
+
+        m_pd = this->allocate(pd::num_entries);
+
+        entry = 0;
+        pdpt::entry::phys_addr::set(entry, m_pd.phys_addr);
+        pdpt::entry::read_access::enable(entry);
+        pdpt::entry::write_access::enable(entry);
+        pdpt::entry::execute_access::enable(entry);
+    }
+
+    void
+    map_pt(index_type pdi)
+    {
+        using namespace ::intel_x64::ept;
+        auto &entry = m_pd.virt_addr.at(pdi);
+
+        if (is_present(entry)) {
+            auto phys_addr = pd::entry::phys_addr::get(entry);
+
+            if (m_pt.phys_addr == phys_addr) {
+                return;
+            }
+
+            m_pt = phys_to_pair(phys_addr, pt::num_entries);
+            return;
+        }
+
+        m_pt = this->allocate(pt::num_entries);
+
+        entry = 0;
+        pd::entry::phys_addr::set(entry, m_pt.phys_addr);
+        pd::entry::read_access::enable(entry);
+        pd::entry::write_access::enable(entry);
+        pd::entry::execute_access::enable(entry);
+    }
+
+    void
+    clear_pdpt(index_type pml4i)
+    {
+        using namespace ::intel_x64::ept;
+        this->map_pdpt(pml4i);
+
+        for (auto pdpti = 0; pdpti < pdpt::num_entries; pdpti++) {
+            auto &entry = m_pdpt.virt_addr.at(pdpti);
+
+            if (!is_present(entry)) {
+                continue;
+            }
+
+            if (pdpt::entry::ps::is_disabled(entry)) {
+                this->clear_pd(pdpti);
+            }
+
+            entry = 0;
+        }
+
+        this->free(m_pdpt.virt_addr);
+        m_pdpt = {};
+    }
+
+    void
+    clear_pd(index_type pdpti)
+    {
+        using namespace ::intel_x64::ept;
+        this->map_pd(pdpti);
+
+        for (auto pdi = 0; pdi < pd::num_entries; pdi++) {
+            auto &entry = m_pd.virt_addr.at(pdi);
+
+            if (!is_present(entry)) {
                 continue;
             }
 
@@ -854,13 +1990,14 @@ private:
         using namespace ::intel_x64::ept;
         auto &entry = m_pdpt.virt_addr.at(pdpt::index(virt_addr));
 
-        if (entry != 0) {
+        if (is_present(entry)) {
             throw std::runtime_error(
                 "map_pdpte: map failed, virt / phys map already exists: " +
                 bfn::to_string(phys_addr, 16)
             );
         }
 
+        entry = 0;
         pdpt::entry::phys_addr::set(entry, phys_addr);
 
         switch (attr) {
@@ -934,6 +2071,11 @@ private:
         };
 
         pdpt::entry::ps::enable(entry);
+
+        if (m_suppress_ve) {
+            entry |= suppress_ve_mask;
+        }
+
         return entry;
     }
 
@@ -945,13 +2087,14 @@ private:
         using namespace ::intel_x64::ept;
         auto &entry = m_pd.virt_addr.at(pd::index(virt_addr));
 
-        if (entry != 0) {
+        if (is_present(entry)) {
             throw std::runtime_error(
                 "map_pde: map failed, virt / phys map already exists: " +
                 bfn::to_string(phys_addr, 16)
             );
         }
 
+        entry = 0;
         pd::entry::phys_addr::set(entry, phys_addr);
 
         switch (attr) {
@@ -1025,6 +2168,11 @@ private:
         };
 
         pd::entry::ps::enable(entry);
+
+        if (m_suppress_ve) {
+            entry |= suppress_ve_mask;
+        }
+
         return entry;
     }
 
@@ -1036,13 +2184,14 @@ private:
         using namespace ::intel_x64::ept;
         auto &entry = m_pt.virt_addr.at(pt::index(virt_addr));
 
-        if (entry != 0) {
+        if (is_present(entry)) {
             throw std::runtime_error(
                 "map_pte: map failed, virt / phys map already exists: " +
                 bfn::to_string(phys_addr, 16)
             );
         }
 
+        entry = 0;
         pt::entry::phys_addr::set(entry, phys_addr);
 
         switch (attr) {
@@ -1115,6 +2264,10 @@ private:
                 break;
         };
 
+        if (m_suppress_ve) {
+            entry |= suppress_ve_mask;
+        }
+
         return entry;
     }
 
@@ -1132,11 +2285,11 @@ private:
             }
         }
 
-        entry = 0;
+        entry = this->not_present();
 
         auto empty = true;
         for (auto pdpti = 0; pdpti < pdpt::num_entries; pdpti++) {
-            if (m_pdpt.virt_addr.at(pdpti) != 0) {
+            if (is_present(m_pdpt.virt_addr.at(pdpti))) {
                 empty = false;
             }
         }
@@ -1163,11 +2316,11 @@ private:
             }
         }
 
-        entry = 0;
+        entry = this->not_present();
 
         auto empty = true;
         for (auto pdi = 0; pdi < pd::num_entries; pdi++) {
-            if (m_pd.virt_addr.at(pdi) != 0) {
+            if (is_present(m_pd.virt_addr.at(pdi))) {
                 empty = false;
             }
         }
@@ -1186,11 +2339,11 @@ private:
         using namespace ::intel_x64::ept;
 
         this->map_pt(pd::index(virt_addr));
-        m_pt.virt_addr.at(pt::index(virt_addr)) = 0;
+        m_pt.virt_addr.at(pt::index(virt_addr)) = this->not_present();
 
         auto empty = true;
         for (auto pti = 0; pti < pt::num_entries; pti++) {
-            if (m_pt.virt_addr.at(pti) != 0) {
+            if (is_present(m_pt.virt_addr.at(pti))) {
                 empty = false;
             }
         }
@@ -1210,6 +2363,23 @@ private:
     pair m_pd;
     pair m_pt;
 
+    bool m_accessed_and_dirty_flags{false};
+    bool m_suppress_ve{false};
+
+    std::atomic<std::size_t> m_attached{0};
+
+    struct cow_page_t {
+        virt_addr_t virt_addr;
+        phys_addr_t phys_addr;
+        void *page;
+    };
+
+    bool m_snapshot{false};
+    std::vector<cow_page_t> m_cow_pages;
+    std::vector<void *> m_cow_pool;
+
+    size_type m_shared{0};
+
     mutable std::mutex m_mutex;
 
 public:
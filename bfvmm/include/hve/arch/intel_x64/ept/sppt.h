@@ -0,0 +1,390 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef EPT_SPPT_INTEL_X64_H
+#define EPT_SPPT_INTEL_X64_H
+
+#include <unordered_map>
+
+#include "mmap.h"
+
+// -----------------------------------------------------------------------------
+// Definition
+// -----------------------------------------------------------------------------
+
+namespace eapis::intel_x64::ept
+{
+
+/// Sub-Page Permission Table
+///
+/// Builds the sub-page permission table (SPPT) used by the hardware to
+/// control write access to a 4k page with a granularity of 128 bytes. This
+/// allows a small structure to be write-protected without every write to
+/// the rest of its page causing an EPT violation.
+///
+/// Pages are tied to the EPT entries of an ept::mmap: when a page is
+/// given sub-page write permissions, its EPT entry loses write access and
+/// gains the SPP bit (see ept::mmap::set_spp). Once every sub-page of a
+/// page is writable again, the EPT entry is restored. A write to a
+/// protected sub-page causes an EPT violation with bit 11 of the exit
+/// qualification set, and is delivered to the EPT violation write handlers
+/// (see ept_violation_handler::spp_violation_mask).
+///
+/// The SPPT has the same 4 level layout as EPT. Each leaf entry holds the
+/// write permission of sub-page i of its page in bit 2 * i, and each
+/// non-leaf entry holds the physical address of the next table along with
+/// a valid bit. Tables are only ever added, so the hardware never sees a
+/// table go away while the SPPT is in use.
+///
+class sppt
+{
+
+public:
+
+    using gpa_type = uintptr_t;                         ///< GPA Type
+    using size_type = size_t;                           ///< Size Type
+    using entry_type = uint64_t;                        ///< Entry Type
+    using mask_type = uint32_t;                         ///< Sub-Page Mask Type
+
+    /// Sub-Page Size
+    ///
+    constexpr static size_type sub_page_size = 128;
+
+    /// Number of Sub-Pages (per 4k page)
+    ///
+    constexpr static size_type num_sub_pages = 32;
+
+    /// All Sub-Pages Writable
+    ///
+    constexpr static mask_type all_writable = 0xFFFFFFFFU;
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    sppt() :
+        m_root{allocate_table()}
+    { }
+
+    /// Destructor
+    ///
+    /// Note that the EPT entries of the pages that still have sub-page
+    /// write permissions are not restored, as the ept::mmap they belong to
+    /// might already be gone.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~sppt()
+    { free_table(m_root, num_levels - 1U); }
+
+    /// SPPTP
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the value that should be written into the SPPTP
+    ///
+    uintptr_t spptp()
+    {
+        std::lock_guard lock(m_mutex);
+        return g_mm->virtptr_to_physint(m_root.data());
+    }
+
+    /// Set Write Permissions
+    ///
+    /// Sets the sub-page write permissions of the page that contains gpa.
+    /// Bit i of mask is the write permission of bytes [i * 128, i * 128 +
+    /// 128) of the page. Setting all_writable removes the page from the
+    /// SPPT and restores its EPT entry.
+    ///
+    /// INVEPT must be executed before the change is guaranteed to be seen
+    /// by the hardware.
+    ///
+    /// @expects gpa is mapped by a writable 4k page in mmap
+    /// @ensures
+    ///
+    /// @param mmap the EPT map that maps gpa
+    /// @param gpa a guest physical address in the page
+    /// @param mask the sub-page write permissions of the page
+    ///
+    void
+    set_write_permissions(mmap &mmap, gpa_type gpa, mask_type mask)
+    {
+        std::lock_guard lock(m_mutex);
+        this->set(mmap, page_of(gpa), mask);
+    }
+
+    /// Write Permissions
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa a guest physical address in the page
+    /// @return the sub-page write permissions of the page that contains gpa,
+    ///     or all_writable if the page is not in the SPPT
+    ///
+    mask_type
+    write_permissions(gpa_type gpa) const
+    {
+        std::lock_guard lock(m_mutex);
+        return this->get(page_of(gpa));
+    }
+
+    /// Write Protect
+    ///
+    /// Removes write access from every sub-page that overlaps
+    /// [gpa, gpa + size). The range does not have to be aligned, but as
+    /// the hardware only tracks 128 byte sub-pages, writes to the bytes
+    /// that share a sub-page with the range are trapped as well.
+    ///
+    /// INVEPT must be executed before the change is guaranteed to be seen
+    /// by the hardware.
+    ///
+    /// @expects every page in the range is mapped by a writable 4k page
+    /// @ensures
+    ///
+    /// @param mmap the EPT map that maps the range
+    /// @param gpa the first guest physical address of the range
+    /// @param size the size of the range in bytes
+    ///
+    void
+    write_protect(mmap &mmap, gpa_type gpa, size_type size)
+    {
+        std::lock_guard lock(m_mutex);
+
+        this->update(gpa, size, [&](gpa_type page, mask_type bits) {
+            this->set(mmap, page, this->get(page) & ~bits);
+        });
+    }
+
+    /// Write Unprotect
+    ///
+    /// Gives write access back to every sub-page that overlaps
+    /// [gpa, gpa + size). Pages that end up with every sub-page writable
+    /// are removed from the SPPT.
+    ///
+    /// INVEPT must be executed before the change is guaranteed to be seen
+    /// by the hardware.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param mmap the EPT map that maps the range
+    /// @param gpa the first guest physical address of the range
+    /// @param size the size of the range in bytes
+    ///
+    void
+    write_unprotect(mmap &mmap, gpa_type gpa, size_type size)
+    {
+        std::lock_guard lock(m_mutex);
+
+        this->update(gpa, size, [&](gpa_type page, mask_type bits) {
+            this->set(mmap, page, this->get(page) | bits);
+        });
+    }
+
+    /// Size
+    ///
+    /// @return the number of pages that have sub-page write permissions
+    ///
+    size_type
+    size() const
+    {
+        std::lock_guard lock(m_mutex);
+        return m_pages.size();
+    }
+
+private:
+
+    constexpr static size_type num_levels = 4;
+    constexpr static size_type num_entries = 512;
+    constexpr static entry_type valid_mask = 0x1ULL;
+    constexpr static entry_type phys_addr_mask = 0x000FFFFFFFFFF000ULL;
+
+    static gpa_type
+    page_of(gpa_type gpa) noexcept
+    { return gpa & ~(::intel_x64::ept::pt::page_size - 1U); }
+
+    static size_type
+    index(gpa_type gpa, size_type level) noexcept
+    { return (gpa >> (::intel_x64::ept::pt::from + (level * 9U))) & (num_entries - 1U); }
+
+    // Spreads the sub-page mask so that sub-page i lands in bit 2 * i. The
+    // odd bits are reserved and must be 0.
+    //
+    static entry_type
+    to_entry(mask_type mask) noexcept
+    {
+        entry_type entry = 0;
+
+        for (size_type i = 0; i < num_sub_pages; i++) {
+            if ((mask & (1U << i)) != 0) {
+                entry |= 1ULL << (i * 2U);
+            }
+        }
+
+        return entry;
+    }
+
+    // Calls func once per page in [gpa, gpa + size) with the bits of the
+    // sub-pages of that page that overlap the range.
+    //
+    template<typename F>
+    void
+    update(gpa_type gpa, size_type size, F func)
+    {
+        expects(size != 0);
+        expects(gpa + size > gpa);
+
+        auto end = gpa + size;
+
+        for (auto page = page_of(gpa); page < end; page += ::intel_x64::ept::pt::page_size) {
+            auto first = (std::max(gpa, page) - page) / sub_page_size;
+            auto last = (std::min(end, page + ::intel_x64::ept::pt::page_size) - page - 1U) / sub_page_size;
+
+            auto bits = static_cast<mask_type>(
+                            (all_writable >> (num_sub_pages - 1U - (last - first))) << first
+                        );
+
+            func(page, bits);
+        }
+    }
+
+    mask_type
+    get(gpa_type page) const
+    {
+        if (auto iter = m_pages.find(page); iter != m_pages.end()) {
+            return iter->second;
+        }
+
+        return all_writable;
+    }
+
+    // The leaf entry must be valid before the EPT entry points the hardware
+    // at it, and the EPT entry must be restored before the leaf entry stops
+    // allowing the writes it allowed.
+    //
+    void
+    set(mmap &mmap, gpa_type page, mask_type mask)
+    {
+        if (mask == all_writable) {
+            if (m_pages.count(page) == 0) {
+                return;
+            }
+
+            mmap.set_spp(page, false);
+            __atomic_store_n(&this->leaf(page), to_entry(mask), __ATOMIC_SEQ_CST);
+
+            m_pages.erase(page);
+            return;
+        }
+
+        __atomic_store_n(&this->leaf(page), to_entry(mask), __ATOMIC_SEQ_CST);
+        mmap.set_spp(page, true);
+
+        m_pages[page] = mask;
+    }
+
+    entry_type &
+    leaf(gpa_type gpa)
+    {
+        auto table = m_root;
+
+        for (auto level = num_levels - 1U; level > 0; level--) {
+            auto &entry = table.at(static_cast<std::ptrdiff_t>(index(gpa, level)));
+
+            if ((entry & valid_mask) == 0) {
+                auto next = allocate_table();
+                __atomic_store_n(
+                    &entry, g_mm->virtptr_to_physint(next.data()) | valid_mask, __ATOMIC_SEQ_CST
+                );
+
+                table = next;
+                continue;
+            }
+
+            table = gsl::make_span(
+                        static_cast<entry_type *>(g_mm->physint_to_virtptr(entry & phys_addr_mask)),
+                        static_cast<std::ptrdiff_t>(num_entries)
+                    );
+        }
+
+        return table.at(static_cast<std::ptrdiff_t>(index(gpa, 0)));
+    }
+
+    static gsl::span<entry_type>
+    allocate_table()
+    {
+        return
+            gsl::make_span(
+                static_cast<entry_type *>(alloc_page()),
+                static_cast<std::ptrdiff_t>(num_entries)
+            );
+    }
+
+    static void
+    free_table(gsl::span<entry_type> table, size_type level)
+    {
+        if (level > 0) {
+            for (auto entry : table) {
+                if ((entry & valid_mask) == 0) {
+                    continue;
+                }
+
+                free_table(
+                    gsl::make_span(
+                        static_cast<entry_type *>(g_mm->physint_to_virtptr(entry & phys_addr_mask)),
+                        static_cast<std::ptrdiff_t>(num_entries)
+                    ),
+                    level - 1U
+                );
+            }
+        }
+
+        free_page(table.data());
+    }
+
+private:
+
+    gsl::span<entry_type> m_root;
+    std::unordered_map<gpa_type, mask_type> m_pages;
+
+    mutable std::mutex m_mutex;
+
+public:
+
+    /// @cond
+
+    sppt(sppt &&) = delete;
+    sppt &operator=(sppt &&) = delete;
+
+    sppt(const sppt &) = delete;
+    sppt &operator=(const sppt &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
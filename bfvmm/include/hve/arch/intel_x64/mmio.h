@@ -0,0 +1,299 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef MMIO_INTEL_X64_EAPIS_H
+#define MMIO_INTEL_X64_EAPIS_H
+
+#include <array>
+#include <map>
+
+#include "vmexit/ept_misconfiguration.h"
+
+// -----------------------------------------------------------------------------
+// Exports
+// -----------------------------------------------------------------------------
+
+#include <bfexports.h>
+
+#ifndef STATIC_EAPIS_HVE
+#ifdef SHARED_EAPIS_HVE
+#define EXPORT_EAPIS_HVE EXPORT_SYM
+#else
+#define EXPORT_EAPIS_HVE IMPORT_SYM
+#endif
+#else
+#define EXPORT_EAPIS_HVE
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis::intel_x64
+{
+
+class vcpu;
+
+/// MMIO Decoder
+///
+/// Decodes the subset of x86 instructions that guests use to access MMIO
+/// registers:
+///
+/// - MOV r/m, r (88, 89) and MOV r, r/m (8A, 8B)
+/// - MOV r/m, imm (C6 /0, C7 /0)
+/// - MOVZX (0F B6, 0F B7), MOVSX (0F BE, 0F BF) and MOVSXD (REX.W 63)
+/// - STOS (AA, AB), with or without a REP prefix
+///
+/// Only 64bit code and 32bit protected mode code (with 32bit addressing)
+/// are supported. Anything else is reported as unsupported so that the
+/// caller can fall back to a full emulator.
+///
+class EXPORT_EAPIS_HVE mmio_decoder
+{
+public:
+
+    constexpr static std::size_t max_insn_size = 15;    ///< Max x86 insn size
+
+    /// Operation
+    ///
+    enum class op_t : uint8_t {
+        none = 0,       ///< Not decoded
+        load = 1,       ///< Memory to register
+        store = 2,      ///< Register (or immediate) to memory
+        stos = 3        ///< AL/AX/EAX/RAX to memory at [RDI]
+    };
+
+    /// Decode Status
+    ///
+    enum class status_t : uint8_t {
+        ok = 0,             ///< The instruction was decoded
+        unsupported = 1,    ///< The instruction is not supported
+        truncated = 2       ///< More bytes are needed to decode
+    };
+
+    /// Instruction
+    ///
+    struct insn_t {
+        op_t op;                ///< Operation
+        uint8_t len;            ///< Length of the instruction in bytes
+        uint8_t size;           ///< Size of the memory access in bytes
+        uint8_t reg;            ///< Register operand (SDM encoding, 0-15)
+        uint8_t reg_size;       ///< Size of the register operand in bytes
+        uint8_t addr_size;      ///< Address size in bytes
+        bool high_byte;         ///< reg is AH, CH, DH or BH
+        bool sign_extend;       ///< Loads are sign extended to reg_size
+        bool has_imm;           ///< Stores use imm instead of reg
+        bool rep;               ///< STOS has a REP prefix
+        uint64_t imm;           ///< Immediate (sign extended to size)
+    };
+
+    /// Decode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param bytes the bytes at the guest's instruction pointer. Only the
+    ///     first max_insn_size bytes are looked at.
+    /// @param long_mode true if the guest is executing 64bit code, false
+    ///     if the guest is executing 32bit code
+    /// @param insn where to store the decoded instruction
+    /// @return ok if the instruction was decoded, truncated if bytes ended
+    ///     before the instruction did, unsupported otherwise
+    ///
+    static status_t decode(
+        gsl::span<const uint8_t> bytes, bool long_mode, insn_t &insn) noexcept;
+};
+
+/// MMIO
+///
+/// Emulates guest accesses to MMIO ranges so that device models only have
+/// to deal with a (gpa, size, write, val) callback.
+///
+/// The pages of an emulated range should be mapped using ept::map_mmio,
+/// which maps them as write-only. A write-only EPT entry is an EPT
+/// misconfiguration, so every guest access to the range traps as an EPT
+/// misconfiguration exit, which this handler hooks.
+///
+/// The faulting instruction is decoded with the mmio_decoder. Decoding
+/// requires mapping the guest's instruction pointer into the VMM, which is
+/// the expensive part of an MMIO exit, so decoded instructions are cached in
+/// a small, direct mapped cache indexed by (CR3, RIP). Since the cache does
+/// not check the guest's code for changes, flush_decode_cache() must be
+/// called if code that accesses an emulated range is modified or remapped
+/// in place.
+///
+/// Ranges are per vCPU, while ept::map_mmio only needs to be called once
+/// per EPT map.
+///
+class EXPORT_EAPIS_HVE mmio_handler
+{
+public:
+
+    constexpr static std::size_t decode_cache_size = 128;   ///< Cache size
+
+    ///
+    /// Info
+    ///
+    /// This struct is created by mmio_handler::handle before being
+    /// passed to the handler that owns the accessed range.
+    ///
+    struct info_t {
+
+        /// GPA (in)
+        ///
+        /// The guest physical address that was accessed
+        ///
+        uint64_t gpa;
+
+        /// Size (in)
+        ///
+        /// The size of the access in bytes (1, 2, 4 or 8)
+        ///
+        uint64_t size;
+
+        /// Write (in)
+        ///
+        /// True if the guest is writing to gpa, false if the guest is
+        /// reading from gpa
+        ///
+        bool write;
+
+        /// Value (in/out)
+        ///
+        /// For writes, the value the guest wrote. For reads, the value that
+        /// the guest will read (only the lower size bytes are used).
+        ///
+        /// default: 0
+        ///
+        uint64_t val;
+    };
+
+    /// Handler delegate type
+    ///
+    /// The type of delegate clients must use when registering
+    /// handlers
+    ///
+    using handler_delegate_t =
+        delegate<bool(gsl::not_null<vcpu_t *>, info_t &)>;
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vcpu object for this MMIO handler
+    ///
+    mmio_handler(
+        gsl::not_null<vcpu *> vcpu);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~mmio_handler() = default;
+
+public:
+
+    /// Add MMIO Handler
+    ///
+    /// @expects size != 0
+    /// @expects the range does not overlap a registered range
+    /// @ensures
+    ///
+    /// @param gpa the first guest physical address of the range
+    /// @param size the size of the range in bytes
+    /// @param d the handler to call when the guest accesses the range
+    ///
+    void add_handler(
+        uint64_t gpa, uint64_t size, const handler_delegate_t &d);
+
+    /// Remove MMIO Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the first guest physical address of a registered range
+    /// @return true if the range was removed, false if no range starts
+    ///     at gpa
+    ///
+    bool remove_handler(uint64_t gpa);
+
+    /// Flush Decode Cache
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void flush_decode_cache() noexcept;
+
+public:
+
+    /// @cond
+
+    bool handle(
+        gsl::not_null<vcpu_t *> vcpu, ept_misconfiguration_handler::info_t &info);
+
+    /// @endcond
+
+private:
+
+    struct range_t {
+        uint64_t end;
+        handler_delegate_t d;
+    };
+
+    struct cache_entry_t {
+        uint64_t cr3;
+        uint64_t rip;
+        mmio_decoder::insn_t insn;
+    };
+
+    const range_t *find_range(uint64_t gpa) const noexcept;
+    const mmio_decoder::insn_t *decode(uint64_t rip, bool long_mode);
+
+    bool emulate(
+        gsl::not_null<vcpu_t *> vcpu, const range_t &range,
+        const mmio_decoder::insn_t &insn, uint64_t gpa);
+
+private:
+
+    vcpu *m_vcpu;
+
+    std::map<uint64_t, range_t> m_ranges;
+    std::array<cache_entry_t, decode_cache_size> m_decode_cache{};
+
+public:
+
+    /// @cond
+
+    mmio_handler(mmio_handler &&) = default;
+    mmio_handler &operator=(mmio_handler &&) = default;
+
+    mmio_handler(const mmio_handler &) = delete;
+    mmio_handler &operator=(const mmio_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
@@ -66,6 +66,19 @@ namespace eapis::intel_x64
 /// match what is in the MSRs, but instead provides a corrected version that
 /// is continuous and non-overlapping.
 ///
+/// The list is produced by a single sweep over the boundaries of every
+/// range. Where variable ranges overlap, the memory type is resolved using
+/// the precedence rules defined by the SDM (11.11.4.1):
+///
+/// - if any of the ranges is UC, the memory type is UC
+/// - if the ranges are WT and WB, the memory type is WT
+/// - any other combination is undefined, in which case UC is used
+///
+/// The fixed ranges always take precedence over the variable ranges, and
+/// memory that is not covered by any range uses the default memory type.
+/// Adjacent ranges with the same memory type are also merged into spans
+/// which can be looked up in O(log n) using lookup().
+///
 class EXPORT_EAPIS_HVE mtrrs
 {
 public:
@@ -156,8 +169,7 @@ public:
     /// @ensures
     ///
     /// @return returns the corrected MTRR ranges. If this function returns
-    ///     no ranges, an error has occurred. If All 256 ranges are used, and
-    ///     error has also occurred.
+    ///     no ranges, an error has occurred.
     ///
     const std::array<range_t, 256> &ranges() const
     { return m_ranges; }
@@ -169,6 +181,21 @@ public:
     auto size() const
     { return m_num; }
 
+    /// Lookup
+    ///
+    /// Returns the largest range of memory that contains addr and has a
+    /// single memory type (i.e. neighbouring ranges in ranges() that share
+    /// the same memory type are merged). The lookup is a binary search.
+    ///
+    /// @expects size() != 0
+    /// @ensures
+    ///
+    /// @param addr the physical address to look up
+    /// @return the effective memory type of addr, and the uniform span
+    ///     that contains it
+    ///
+    const range_t &lookup(uint64_t addr) const;
+
     /// Dump
     ///
     /// Prints the MTRR ranges.
@@ -187,7 +214,7 @@ private:
     void get_fixed_ranges();
     void get_variable_ranges();
 
-    bool make_continuous();
+    void flatten(ept::mmap::memory_type default_type);
 
     void add_range(const range_t &range);
     void add_range(uint64_t ia32_mtrr_physbase, uint64_t ia32_mtrr_physmask);
@@ -197,6 +224,11 @@ private:
     uint8_t m_num{0};
     std::array<range_t, 256> m_ranges;
 
+    range_t m_fixed{};
+
+    uint8_t m_num_spans{0};
+    std::array<range_t, 256> m_spans;
+
 public:
 
     // @cond
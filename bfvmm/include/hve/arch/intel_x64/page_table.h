@@ -0,0 +1,655 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef PAGE_TABLE_INTEL_X64_EAPIS_H
+#define PAGE_TABLE_INTEL_X64_EAPIS_H
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include <bfgsl.h>
+#include <bfdebug.h>
+#include <bfdelegate.h>
+#include <bfupperlower.h>
+
+#include <intrinsics.h>
+
+#include <bfvmm/memory_manager/memory_manager.h>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis::intel_x64
+{
+
+/// Paging
+///
+/// Helpers shared by every 4k / 9bit-per-level page table format (i.e.
+/// EPT and VT-d second-level tables). A level of 0 is a page table, 1 a
+/// page directory, 2 a PDPT, and so on.
+///
+namespace paging
+{
+
+constexpr const uint64_t table_bits = 9;                ///< Index bits per level
+constexpr const uint64_t num_entries = 512;             ///< Entries per table
+
+constexpr const uint64_t level_4k = 0;                  ///< 4k page level
+constexpr const uint64_t level_2m = 1;                  ///< 2m page level
+constexpr const uint64_t level_1g = 2;                  ///< 1g page level
+
+/// From
+///
+/// @param level the level of the table
+/// @return the bit position of the first address bit translated by the
+///     level
+///
+constexpr uint64_t from(uint64_t level) noexcept
+{ return 12U + (level * table_bits); }
+
+/// Page Size
+///
+/// @param level the level of the table
+/// @return the size of a page mapped by an entry in the level
+///
+constexpr uint64_t page_size(uint64_t level) noexcept
+{ return 1ULL << from(level); }
+
+/// Index
+///
+/// @param addr the address to translate
+/// @param level the level of the table
+/// @return the index of the entry in the level that translates addr
+///
+constexpr uint64_t index(uintptr_t addr, uint64_t level) noexcept
+{ return (addr >> from(level)) & (num_entries - 1U); }
+
+/// Split Range
+///
+/// Breaks [virt_addr, virt_addr + size) up into the fewest pages that are
+/// no larger than max_level, calling f(virt_addr, phys_addr, level) for
+/// each page. A large page is only used when both the virtual and the
+/// physical addresses are aligned to it.
+///
+/// @expects virt_addr, phys_addr and size are 4k aligned
+/// @ensures
+///
+/// @param virt_addr the first virtual address of the range
+/// @param phys_addr the first physical address of the range
+/// @param size the size of the range in bytes
+/// @param max_level the largest page level to use
+/// @param f the function to call for each page
+///
+template<typename F>
+void split_range(
+    uintptr_t virt_addr, uintptr_t phys_addr, std::size_t size,
+    uint64_t max_level, F f)
+{
+    expects(bfn::lower(virt_addr | phys_addr | size, from(level_4k)) == 0);
+
+    while (size != 0) {
+        auto level = max_level;
+
+        for (; level > level_4k; level--) {
+            if (bfn::lower(virt_addr | phys_addr, from(level)) == 0 && size >= page_size(level)) {
+                break;
+            }
+        }
+
+        f(virt_addr, phys_addr, level);
+
+        virt_addr += page_size(level);
+        phys_addr += page_size(level);
+        size -= page_size(level);
+    }
+}
+
+}
+
+/// Page Table
+///
+/// A generic page table builder for 4 and 5 level (and 3 level for VT-d)
+/// page tables with 512 64bit entries per table. The layout of each entry
+/// is provided by the format, which must provide the following:
+///
+/// - entry_type: the type of an entry
+/// - attr_type: the attributes of a leaf entry
+/// - table(phys_addr): returns an entry that points to a table
+/// - leaf(phys_addr, level, attr): returns an entry that maps a page
+/// - is_leaf(entry, level): returns true if the entry maps a page
+/// - phys_addr(entry): returns the physical address stored in an entry
+///
+/// An entry of 0 is not present. Unlike ept::mmap, tables that become
+/// empty when a mapping is removed are freed as part of the removal, but
+/// only after the flush delegate has been called, so that hardware which
+/// caches the tables never walks a page that has been given back. All
+/// functions are thread safe.
+///
+template<typename F>
+class page_table
+{
+public:
+
+    using format_type = F;                                      ///< Format Type
+    using entry_type = typename F::entry_type;                  ///< Entry Type
+    using attr_type = typename F::attr_type;                    ///< Attribute Type
+    using phys_addr_t = uintptr_t;                              ///< Phys Address Type
+    using virt_addr_t = uintptr_t;                              ///< Virt Address Type
+    using size_type = std::size_t;                              ///< Size Type
+
+    /// Flush Delegate
+    ///
+    /// Called with [virt_addr, virt_addr + size) each time mappings are
+    /// removed, after the entries have been cleared and before any table
+    /// that was emptied by the removal is freed. The delegate must
+    /// invalidate any translation (i.e. IOTLB or paging-structure cache)
+    /// the hardware might hold for the range.
+    ///
+    using flush_delegate_t = delegate<void(virt_addr_t, size_type)>;
+
+    /// Constructor
+    ///
+    /// @expects levels >= 3 && levels <= 5
+    /// @ensures
+    ///
+    /// @param levels the number of levels in a walk
+    /// @param coherent false if the hardware that walks the tables does
+    ///     not snoop the processor's caches, in which case every entry
+    ///     (and every new table) is flushed from the cache once written
+    ///
+    explicit page_table(uint64_t levels = 4, bool coherent = true) :
+        m_levels{levels},
+        m_coherent{coherent}
+    {
+        expects(levels >= 3 && levels <= 5);
+
+        m_root = this->allocate();
+        m_root_phys = g_mm->virtptr_to_physint(m_root);
+    }
+
+    /// Destructor
+    ///
+    /// @expects the hardware no longer walks the tables
+    /// @ensures
+    ///
+    ~page_table()
+    {
+        for (auto table : m_pending_free) {
+            this->free(table);
+        }
+
+        this->release(m_root, m_levels - 1U);
+    }
+
+    /// Root
+    ///
+    /// @return the physical address of the top level table
+    ///
+    phys_addr_t root_phys() const noexcept
+    { return m_root_phys; }
+
+    /// Levels
+    ///
+    /// @return the number of levels in a walk
+    ///
+    uint64_t levels() const noexcept
+    { return m_levels; }
+
+    /// Number of Tables
+    ///
+    /// @return the number of tables (including the top level table) that
+    ///     are currently allocated
+    ///
+    size_type num_tables() const
+    {
+        std::lock_guard lock(m_mutex);
+        return m_num_tables;
+    }
+
+    /// Coherent
+    ///
+    /// @return false if written entries are flushed from the cache
+    ///
+    bool coherent() const noexcept
+    { return m_coherent; }
+
+    /// Set Flush
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param flush the delegate that is called each time mappings are
+    ///     removed (see flush_delegate_t)
+    ///
+    void set_flush(flush_delegate_t flush)
+    {
+        std::lock_guard lock(m_mutex);
+        m_flush = std::move(flush);
+    }
+
+    /// Map
+    ///
+    /// @expects level <= paging::level_1g
+    /// @expects virt_addr and phys_addr are aligned to the page size
+    /// @expects virt_addr can be translated by the table
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address to map from
+    /// @param phys_addr the physical address to map to
+    /// @param level the level of the page (i.e. paging::level_4k)
+    /// @param attr the attributes of the page
+    /// @return Returns the entry that performs the map
+    ///
+    entry_type &
+    map(virt_addr_t virt_addr, phys_addr_t phys_addr, uint64_t level, const attr_type &attr)
+    {
+        std::lock_guard lock(m_mutex);
+        return this->map_page(virt_addr, phys_addr, level, attr);
+    }
+
+    /// Map Range
+    ///
+    /// Maps [virt_addr, virt_addr + size) to [phys_addr, phys_addr + size)
+    /// using the largest pages (up to max_level) that the alignment of the
+    /// two ranges allows. If a page in the range is already mapped, an
+    /// exception is thrown and the pages that were mapped before it are
+    /// left in place.
+    ///
+    /// @expects virt_addr, phys_addr and size are 4k aligned
+    /// @ensures
+    ///
+    /// @param virt_addr the first virtual address to map from
+    /// @param phys_addr the first physical address to map to
+    /// @param size the size of the range in bytes
+    /// @param attr the attributes of each page
+    /// @param max_level the largest page level to use
+    /// @return the number of entries that were written
+    ///
+    size_type
+    map_range(
+        virt_addr_t virt_addr, phys_addr_t phys_addr, size_type size,
+        const attr_type &attr, uint64_t max_level = paging::level_1g)
+    {
+        std::lock_guard lock(m_mutex);
+        size_type num = 0;
+
+        paging::split_range(virt_addr, phys_addr, size, max_level, [&](
+        auto virt, auto phys, auto level) {
+            this->map_page(virt, phys, level, attr);
+            num++;
+        });
+
+        return num;
+    }
+
+    /// Unmap
+    ///
+    /// Removes the page that maps virt_addr (whatever its size), and frees
+    /// any tables that are empty as a result.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address to unmap
+    /// @return the size of the page that was unmapped, or 0 if virt_addr
+    ///     was not mapped
+    ///
+    size_type
+    unmap(virt_addr_t virt_addr)
+    {
+        std::lock_guard lock(m_mutex);
+
+        auto size = this->unmap_page(m_root, m_levels - 1U, virt_addr);
+        if (size != 0) {
+            this->flush_and_free(virt_addr & ~(size - 1U), size);
+        }
+
+        return size;
+    }
+
+    /// Unmap Range
+    ///
+    /// Removes every page that maps an address in
+    /// [virt_addr, virt_addr + size). Large pages that only partially
+    /// overlap with the range are removed as a whole.
+    ///
+    /// @expects virt_addr and size are 4k aligned
+    /// @ensures
+    ///
+    /// @param virt_addr the first virtual address to unmap
+    /// @param size the size of the range in bytes
+    /// @return the number of entries that were removed
+    ///
+    size_type
+    unmap_range(virt_addr_t virt_addr, size_type size)
+    {
+        expects(bfn::lower(virt_addr | size, paging::from(paging::level_4k)) == 0);
+
+        std::lock_guard lock(m_mutex);
+        size_type num = 0;
+
+        auto first = virt_addr;
+        auto last = virt_addr;
+
+        for (auto end = virt_addr + size; virt_addr < end;) {
+            auto [entry, level] = this->walk(virt_addr);
+            auto base = virt_addr & ~(paging::page_size(level) - 1U);
+
+            if (entry != nullptr) {
+                this->unmap_page(m_root, m_levels - 1U, virt_addr);
+
+                first = num == 0 ? base : std::min(first, base);
+                last = base + paging::page_size(level);
+                num++;
+            }
+
+            virt_addr = base + paging::page_size(level);
+        }
+
+        if (num != 0) {
+            this->flush_and_free(first, last - first);
+        }
+
+        return num;
+    }
+
+    /// Virtual Address to Entry
+    ///
+    /// @expects virt_addr is mapped
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address to look up
+    /// @return the entry that maps virt_addr, and the from of the page
+    ///
+    std::pair<std::reference_wrapper<entry_type>, uintptr_t>
+    entry(virt_addr_t virt_addr)
+    {
+        std::lock_guard lock(m_mutex);
+
+        auto [entry, level] = this->walk(virt_addr);
+        if (entry == nullptr) {
+            throw std::runtime_error("page_table::entry: not mapped");
+        }
+
+        return {*entry, paging::from(level)};
+    }
+
+    /// Virtual Address to Physical Address
+    ///
+    /// @expects virt_addr is mapped
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address to be converted
+    /// @return Returns the phys_addr for the map, and the from of the page
+    ///
+    std::pair<phys_addr_t, uintptr_t>
+    virt_to_phys(virt_addr_t virt_addr)
+    {
+        std::lock_guard lock(m_mutex);
+
+        auto [entry, level] = this->walk(virt_addr);
+        if (entry == nullptr) {
+            throw std::runtime_error("page_table::virt_to_phys: not mapped");
+        }
+
+        return {
+            bfn::upper(F::phys_addr(*entry), paging::from(level)) |
+            bfn::lower(virt_addr, paging::from(level)),
+            paging::from(level)
+        };
+    }
+
+    /// Is Mapped
+    ///
+    /// @param virt_addr the virtual address to test
+    /// @return true if virt_addr is mapped, false otherwise
+    ///
+    bool is_mapped(virt_addr_t virt_addr)
+    {
+        std::lock_guard lock(m_mutex);
+        return this->walk(virt_addr).first != nullptr;
+    }
+
+private:
+
+    entry_type *
+    allocate()
+    {
+        auto table = static_cast<entry_type *>(alloc_page());
+        std::memset(table, 0, paging::num_entries * sizeof(entry_type));
+
+        this->flush_cache(table, paging::num_entries);
+
+        m_num_tables++;
+        return table;
+    }
+
+    static void
+    no_flush(virt_addr_t virt_addr, size_type size) noexcept
+    { bfignored(virt_addr); bfignored(size); }
+
+    // Writes num entries starting at entry back to memory, if the
+    // hardware does not snoop the cache
+    //
+    void
+    flush_cache(entry_type *entry, size_type num) const
+    {
+        if (m_coherent) {
+            return;
+        }
+
+        auto addr = reinterpret_cast<uintptr_t>(entry);
+        auto end = reinterpret_cast<uintptr_t>(entry + num);
+
+        for (addr &= ~(cache_line_size - 1U); addr < end; addr += cache_line_size) {
+            ::x64::cache::clflush(reinterpret_cast<void *>(addr));
+        }
+    }
+
+    // Invalidates the translations for the removed range, and only then
+    // frees the tables that the removal emptied
+    //
+    void
+    flush_and_free(virt_addr_t virt_addr, size_type size)
+    {
+        m_flush(virt_addr, size);
+
+        for (auto table : m_pending_free) {
+            this->free(table);
+        }
+
+        m_pending_free.clear();
+    }
+
+    void
+    free(entry_type *table)
+    {
+        free_page(table);
+        m_num_tables--;
+    }
+
+    static entry_type *
+    table_of(entry_type entry)
+    { return static_cast<entry_type *>(g_mm->physint_to_virtptr(F::phys_addr(entry))); }
+
+    static bool
+    is_empty(const entry_type *table) noexcept
+    {
+        for (uint64_t i = 0; i < paging::num_entries; i++) {
+            if (table[i] != 0) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    void
+    release(entry_type *table, uint64_t level)
+    {
+        if (level > paging::level_4k) {
+            for (uint64_t i = 0; i < paging::num_entries; i++) {
+                if (table[i] != 0 && !F::is_leaf(table[i], level)) {
+                    this->release(table_of(table[i]), level - 1U);
+                }
+            }
+        }
+
+        this->free(table);
+    }
+
+    // Returns the entry that maps virt_addr and its level, or nullptr and
+    // the level of the first entry in the walk that is not present.
+    //
+    std::pair<entry_type *, uint64_t>
+    walk(virt_addr_t virt_addr) const
+    {
+        auto table = m_root;
+
+        for (auto level = m_levels - 1U;; level--) {
+            auto &entry = table[paging::index(virt_addr, level)];
+
+            if (entry == 0) {
+                return {nullptr, level};
+            }
+
+            if (F::is_leaf(entry, level)) {
+                return {&entry, level};
+            }
+
+            table = table_of(entry);
+        }
+    }
+
+    entry_type &
+    map_page(virt_addr_t virt_addr, phys_addr_t phys_addr, uint64_t level, const attr_type &attr)
+    {
+        expects(level <= paging::level_1g);
+        expects(bfn::lower(virt_addr | phys_addr, paging::from(level)) == 0);
+        expects(bfn::upper(virt_addr, paging::from(m_levels)) == 0);
+
+        auto table = m_root;
+
+        for (auto l = m_levels - 1U; l > level; l--) {
+            auto &entry = table[paging::index(virt_addr, l)];
+
+            if (entry == 0) {
+                auto next = this->allocate();
+                entry = F::table(g_mm->virtptr_to_physint(next));
+                this->flush_cache(&entry, 1);
+
+                table = next;
+                continue;
+            }
+
+            if (F::is_leaf(entry, l)) {
+                throw std::runtime_error(
+                    "page_table::map: a larger page already maps: " +
+                    bfn::to_string(virt_addr, 16)
+                );
+            }
+
+            table = table_of(entry);
+        }
+
+        auto &entry = table[paging::index(virt_addr, level)];
+
+        if (entry != 0) {
+            throw std::runtime_error(
+                "page_table::map: virt / phys map already exists: " +
+                bfn::to_string(virt_addr, 16)
+            );
+        }
+
+        entry = F::leaf(phys_addr, level, attr);
+        this->flush_cache(&entry, 1);
+
+        return entry;
+    }
+
+    size_type
+    unmap_page(entry_type *table, uint64_t level, virt_addr_t virt_addr)
+    {
+        auto &entry = table[paging::index(virt_addr, level)];
+
+        if (entry == 0) {
+            return 0;
+        }
+
+        if (F::is_leaf(entry, level)) {
+            entry = 0;
+            this->flush_cache(&entry, 1);
+
+            return paging::page_size(level);
+        }
+
+        auto next = table_of(entry);
+        auto size = this->unmap_page(next, level - 1U, virt_addr);
+
+        if (size != 0 && is_empty(next)) {
+            entry = 0;
+            this->flush_cache(&entry, 1);
+
+            m_pending_free.push_back(next);
+        }
+
+        return size;
+    }
+
+private:
+
+    constexpr static uintptr_t cache_line_size = 64;
+
+    uint64_t m_levels;
+    bool m_coherent;
+
+    entry_type *m_root{nullptr};
+    phys_addr_t m_root_phys{0};
+    size_type m_num_tables{0};
+
+    flush_delegate_t m_flush{flush_delegate_t::template create<&page_table::no_flush>()};
+    std::vector<entry_type *> m_pending_free;
+
+    mutable std::mutex m_mutex;
+
+public:
+
+    /// @cond
+
+    page_table(page_table &&) = delete;
+    page_table &operator=(page_table &&) = delete;
+
+    page_table(const page_table &) = delete;
+    page_table &operator=(const page_table &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
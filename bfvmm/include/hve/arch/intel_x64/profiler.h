@@ -0,0 +1,275 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef PROFILER_INTEL_X64_EAPIS_H
+#define PROFILER_INTEL_X64_EAPIS_H
+
+#include <array>
+#include <vector>
+
+#include "vmexit/cpuid.h"
+
+#include "profiler_abi.h"
+#include "timer_wheel.h"
+
+// -----------------------------------------------------------------------------
+// Exports
+// -----------------------------------------------------------------------------
+
+#include <bfexports.h>
+
+#ifndef STATIC_EAPIS_HVE
+#ifdef SHARED_EAPIS_HVE
+#define EXPORT_EAPIS_HVE EXPORT_SYM
+#else
+#define EXPORT_EAPIS_HVE IMPORT_SYM
+#endif
+#else
+#define EXPORT_EAPIS_HVE
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis::intel_x64
+{
+
+class vcpu;
+
+/// Profiler
+///
+/// A sampling profiler driven by the vCPU's timer wheel (and therefore the
+/// VMX-preemption timer). Each time the sampling timer fires, the guest's
+/// RIP and CR3 are recorded, along with a bounded walk of the guest's
+/// frame pointer (RBP) chain, into a per-vCPU ring. Since the sample is
+/// taken on a VM exit, the guest does not need to be modified, and time is
+/// attributed to the exact guest instruction that was interrupted.
+///
+/// The ring is drained by the host using the CPUID interface defined in
+/// profiler_abi.h (see bfack). If the ring is full, new samples are
+/// dropped (and counted) so that the samples that are read are always
+/// contiguous.
+///
+/// Note that the stack walk only follows frame pointers. Guest code that
+/// is compiled without frame pointers will produce truncated stacks, but
+/// the RIP of every sample is always exact.
+///
+class EXPORT_EAPIS_HVE profiler
+{
+public:
+
+    using sample_frames_t =
+        std::array<uint64_t, profiler_abi::max_depth>;  ///< Frames type
+
+    /// Sample
+    ///
+    struct sample_t {
+
+        /// RIP
+        ///
+        /// The guest instruction pointer at the time of the sample
+        ///
+        uint64_t rip;
+
+        /// CR3
+        ///
+        /// The guest CR3 at the time of the sample, which identifies the
+        /// guest address space (i.e. process) RIP belongs to
+        ///
+        uint64_t cr3;
+
+        /// Depth
+        ///
+        /// The number of valid return addresses in frames
+        ///
+        uint64_t depth;
+
+        /// Frames
+        ///
+        /// The return addresses of the frame pointer walk, starting with
+        /// the caller of RIP
+        ///
+        sample_frames_t frames;
+    };
+
+    /// Default Capacity
+    ///
+    /// The default number of samples each vCPU's ring can hold
+    ///
+    constexpr static std::size_t default_capacity = 1024;
+
+    /// Max Frequency
+    ///
+    /// The maximum number of samples per second. Each sample is a VM exit,
+    /// so this bounds the overhead the profiler can add to a vCPU.
+    ///
+    constexpr static uint64_t max_freq_hz = 100000;
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vcpu object for this profiler
+    ///
+    profiler(
+        gsl::not_null<vcpu *> vcpu);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~profiler() = default;
+
+public:
+
+    /// Enable
+    ///
+    /// Allocates the ring (if needed) and starts sampling. If the profiler
+    /// is already enabled, it is restarted with the new frequency and the
+    /// existing samples are kept.
+    ///
+    /// @expects freq_hz != 0
+    /// @expects freq_hz <= max_freq_hz
+    /// @expects capacity is a non-zero power of 2
+    /// @ensures
+    ///
+    /// @param freq_hz the number of samples to take per second
+    /// @param capacity the number of samples the ring can hold
+    ///
+    void enable(uint64_t freq_hz, std::size_t capacity = default_capacity);
+
+    /// Disable
+    ///
+    /// Stops sampling. Samples that have already been recorded can still
+    /// be read.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable();
+
+    /// Enabled
+    ///
+    /// @return true if the profiler is sampling, false otherwise
+    ///
+    bool enabled() const noexcept
+    { return m_timer != timer_wheel::invalid_id; }
+
+    /// Pop
+    ///
+    /// Removes the oldest sample from the ring
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param sample where to store the sample
+    /// @return true if a sample was removed, false if the ring is empty
+    ///
+    bool pop(sample_t &sample);
+
+    /// Size
+    ///
+    /// @return the number of samples in the ring
+    ///
+    std::size_t size() const noexcept
+    { return m_tail - m_head; }
+
+    /// Dropped
+    ///
+    /// @return the number of samples that were dropped because the ring
+    ///     was full
+    ///
+    uint64_t dropped() const noexcept
+    { return m_dropped; }
+
+    /// Allow User Access
+    ///
+    /// By default, the CPUID interface only accepts requests from the
+    /// guest kernel (CPL 0), as samples contain kernel addresses and CR3
+    /// values. A VMM that trusts every process of the guest (e.g. a
+    /// development host VM, where bfack's ack_profile runs as a normal
+    /// ring 3 process) can accept requests from any CPL instead.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param allow true to accept requests from any CPL, false to only
+    ///     accept requests from CPL 0
+    ///
+    void allow_user_access(bool allow) noexcept
+    { m_user_access = allow; }
+
+    /// User Access
+    ///
+    /// @return true if requests are accepted from any CPL, false otherwise
+    ///
+    bool user_access() const noexcept
+    { return m_user_access; }
+
+public:
+
+    /// @cond
+
+    void handle_sample(
+        gsl::not_null<vcpu_t *> vcpu, timer_wheel::info_t &info);
+
+    bool handle_cpuid(
+        gsl::not_null<vcpu_t *> vcpu, cpuid_handler::info_t &info);
+
+    /// @endcond
+
+private:
+
+    void walk(uint64_t rbp, sample_t &sample);
+
+private:
+
+    vcpu *m_vcpu;
+
+    timer_wheel::id_t m_timer{timer_wheel::invalid_id};
+
+    std::vector<sample_t> m_ring;
+    std::size_t m_head{0};
+    std::size_t m_tail{0};
+    uint64_t m_dropped{0};
+
+    sample_t m_current{};
+    bool m_user_access{false};
+
+public:
+
+    /// @cond
+
+    profiler(profiler &&) = default;
+    profiler &operator=(profiler &&) = default;
+
+    profiler(const profiler &) = delete;
+    profiler &operator=(const profiler &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
@@ -0,0 +1,73 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef PROFILER_ABI_INTEL_X64_EAPIS_H
+#define PROFILER_ABI_INTEL_X64_EAPIS_H
+
+#include <cstdint>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+/// Profiler ABI
+///
+/// Defines the CPUID based interface that is used to control the sampling
+/// profiler from the host (see bfack). This header has no dependencies so
+/// that it can be included by both the VMM and userspace.
+///
+/// Each request is made by executing CPUID with RAX set to the profiler
+/// leaf and RBX set to one of the commands below. The results are returned
+/// in the full 64 bits of RAX, RBX, RCX and RDX. Since every vCPU has its
+/// own ring, the caller must be pinned to the CPU it wishes to talk to.
+/// Requests are only accepted from CPL 0. Any other CPL gets
+/// status_failure, so the host must issue them from a kernel driver.
+///
+/// - start: RCX = sampling frequency (Hz), clamped to 100 kHz
+///     RAX = status
+/// - stop:
+///     RAX = status
+/// - pop: removes the oldest sample from the ring
+///     RAX = number of frames (or status_empty), RBX = RIP, RCX = CR3,
+///     RDX = number of samples dropped so far
+/// - frames: RCX = index of the first frame of the last popped sample
+///     RAX = status, RBX/RCX/RDX = frames[index], [index + 1], [index + 2]
+///
+namespace eapis::intel_x64::profiler_abi
+{
+
+constexpr const uint64_t leaf = 0x4BF00100;             ///< CPUID leaf
+
+constexpr const uint64_t cmd_start = 1;                 ///< Start sampling
+constexpr const uint64_t cmd_stop = 2;                  ///< Stop sampling
+constexpr const uint64_t cmd_pop = 3;                   ///< Pop a sample
+constexpr const uint64_t cmd_frames = 4;                ///< Read frames
+
+constexpr const uint64_t status_success = 0;            ///< Success
+constexpr const uint64_t status_failure = ~0ULL;        ///< Failure
+constexpr const uint64_t status_empty = ~0ULL - 1;      ///< Ring is empty
+
+constexpr const uint64_t max_depth = 16;                ///< Max frames per sample
+constexpr const uint64_t frames_per_call = 3;           ///< Frames per cmd_frames
+
+}
+
+#endif
@@ -62,7 +62,11 @@ namespace eapis::intel_x64::time
 // same formula above and mentions using cpuid.15H with the max turbo ratio,
 // but that doesn't make sense either.
 //
-// For now we just use the MSR_PLATFORM_INFO formula
+// The tsc class (see tsc.h) calibrates the TSC using cpuid.15H, cpuid.16H,
+// the ACPI PM timer and the PIT, and only falls back to the
+// MSR_PLATFORM_INFO formula (and therefore the model table below) when all
+// of these fail. New code should use the calibrated conversions provided by
+// vcpu::clock() instead of the functions in this file.
 //
 inline uint64_t bus_freq_MHz()
 {
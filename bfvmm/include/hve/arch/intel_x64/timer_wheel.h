@@ -0,0 +1,264 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef TIMER_WHEEL_INTEL_X64_EAPIS_H
+#define TIMER_WHEEL_INTEL_X64_EAPIS_H
+
+#include <array>
+#include <list>
+#include <unordered_map>
+
+#include <bfvmm/hve/arch/intel_x64/exit_handler.h>
+
+// -----------------------------------------------------------------------------
+// Exports
+// -----------------------------------------------------------------------------
+
+#include <bfexports.h>
+
+#ifndef STATIC_EAPIS_HVE
+#ifdef SHARED_EAPIS_HVE
+#define EXPORT_EAPIS_HVE EXPORT_SYM
+#else
+#define EXPORT_EAPIS_HVE IMPORT_SYM
+#endif
+#else
+#define EXPORT_EAPIS_HVE
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis::intel_x64
+{
+
+/// Timer Wheel
+///
+/// A hierarchical timing wheel used to multiplex a single hardware timer
+/// (the VMX-preemption timer) between many clients. All times are absolute
+/// and in nanoseconds. The wheel itself never reads the time, which is
+/// provided by the caller, so it can be driven by any clock source.
+///
+/// The wheel has 4 levels of 64 slots each. A slot in level 0 is 1024ns
+/// wide, and each level is 64 times coarser than the previous one, so
+/// the wheel covers ~17 seconds. Timers further out than that are kept in
+/// an overflow list and moved into the wheel as time advances.
+/// Each timer keeps its exact deadline, so the granularity of the slots
+/// only affects bookkeeping, not when a timer fires.
+///
+/// Adding and cancelling a timer is O(1), and finding the next deadline
+/// only has to look at one slot per level thanks to a per-level occupancy
+/// bitmap (plus the overflow list, which is normally empty).
+///
+class EXPORT_EAPIS_HVE timer_wheel
+{
+public:
+
+    using id_t = uint64_t;                  ///< Timer id type
+
+    constexpr static id_t invalid_id = 0;   ///< Invalid timer id
+    constexpr static uint64_t never = ~0ULL;    ///< No pending deadline
+
+    ///
+    /// Info
+    ///
+    /// This struct is created by timer_wheel::expire before being
+    /// passed to each expired timer's delegate.
+    ///
+    struct info_t {
+
+        /// ID (in)
+        ///
+        /// The id of the timer that expired
+        ///
+        id_t id;
+
+        /// Deadline (in)
+        ///
+        /// The deadline (in ns) the timer was armed for
+        ///
+        uint64_t deadline;
+
+        /// Now (in)
+        ///
+        /// The time (in ns) the timer was processed
+        ///
+        uint64_t now;
+
+        /// Cancel (out)
+        ///
+        /// If set to true, a periodic timer will not be re-armed.
+        ///
+        /// default: false
+        ///
+        bool cancel;
+    };
+
+    /// Handler delegate type
+    ///
+    /// The type of delegate clients must use when adding timers
+    ///
+    using handler_delegate_t =
+        delegate<void(gsl::not_null<vcpu_t *>, info_t &)>;
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    timer_wheel() = default;
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~timer_wheel() = default;
+
+public:
+
+    /// Add Timer
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param now the current time in ns
+    /// @param deadline the absolute time (in ns) the timer should fire
+    /// @param period if non-zero, the timer is re-armed every period ns
+    ///     after it fires
+    /// @param d the delegate to call when the timer fires
+    /// @return the id of the new timer
+    ///
+    id_t add(
+        uint64_t now, uint64_t deadline, uint64_t period,
+        const handler_delegate_t &d);
+
+    /// Cancel Timer
+    ///
+    /// Cancelling a timer that has already fired (or does not exist) is
+    /// not an error.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param id the id of the timer to cancel
+    /// @return true if the timer was pending, false otherwise
+    ///
+    bool cancel(id_t id);
+
+    /// Expire
+    ///
+    /// Advances the wheel to now and calls the delegate of every timer
+    /// whose deadline is <= now. Periodic timers are re-armed relative to
+    /// their previous deadline so that they do not drift. If a periodic
+    /// timer has fallen more than one period behind, its missed periods
+    /// are dropped.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vcpu passed to each delegate
+    /// @param now the current time in ns
+    /// @return the number of timers that fired
+    ///
+    std::size_t expire(gsl::not_null<vcpu_t *> vcpu, uint64_t now);
+
+    /// Next Deadline
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the earliest pending deadline (in ns), or never if no timers
+    ///     are pending
+    ///
+    uint64_t next_deadline() const;
+
+    /// Size
+    ///
+    /// @return the number of pending timers
+    ///
+    std::size_t size() const noexcept
+    { return m_index.size(); }
+
+    /// Empty
+    ///
+    /// @return true if no timers are pending, false otherwise
+    ///
+    bool empty() const noexcept
+    { return m_index.empty(); }
+
+private:
+
+    constexpr static uint64_t num_levels = 4;
+    constexpr static uint64_t num_slots = 64;
+    constexpr static uint64_t slot_bits = 6;
+    constexpr static uint64_t base_shift = 10;
+
+    struct timer_t {
+        id_t id;
+        uint64_t deadline;
+        uint64_t period;
+        handler_delegate_t d;
+    };
+
+    struct location_t {
+        uint64_t level;
+        uint64_t slot;
+        std::list<timer_t>::iterator iter;
+    };
+
+    static uint64_t shift(uint64_t level) noexcept
+    { return base_shift + (level * slot_bits); }
+
+    void insert(timer_t &&timer);
+    void insert(std::list<timer_t> &list, std::list<timer_t>::iterator iter);
+
+    void remove(uint64_t level, uint64_t slot, std::list<timer_t>::iterator iter);
+
+private:
+
+    id_t m_next_id{1};
+    uint64_t m_now{0};
+
+    std::array<uint64_t, num_levels> m_occupied{};
+    std::array<std::array<std::list<timer_t>, num_slots>, num_levels> m_slots;
+    std::list<timer_t> m_expiring;
+    std::list<timer_t> m_overflow;
+
+    std::unordered_map<id_t, location_t> m_index;
+
+public:
+
+    /// @cond
+
+    timer_wheel(timer_wheel &&) = default;
+    timer_wheel &operator=(timer_wheel &&) = default;
+
+    timer_wheel(const timer_wheel &) = delete;
+    timer_wheel &operator=(const timer_wheel &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
@@ -0,0 +1,292 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef TSC_INTEL_X64_EAPIS_H
+#define TSC_INTEL_X64_EAPIS_H
+
+#include <cstdint>
+
+// -----------------------------------------------------------------------------
+// Exports
+// -----------------------------------------------------------------------------
+
+#include <bfexports.h>
+
+#ifndef STATIC_EAPIS_HVE
+#ifdef SHARED_EAPIS_HVE
+#define EXPORT_EAPIS_HVE EXPORT_SYM
+#else
+#define EXPORT_EAPIS_HVE IMPORT_SYM
+#endif
+#else
+#define EXPORT_EAPIS_HVE
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis::intel_x64
+{
+
+/// TSC
+///
+/// Calibrates the frequency of the TSC and provides precomputed, division
+/// free conversions between nanoseconds, TSC ticks and VMX-preemption timer
+/// (PET) ticks. Calibration is attempted in the following order:
+///
+/// - CPUID.15H (crystal clock frequency * TSC / crystal clock ratio)
+/// - CPUID.16H (processor base frequency)
+/// - ACPI PM timer (if the PM timer port was provided)
+/// - PIT channel 2
+/// - MSR_PLATFORM_INFO (using the legacy bus frequency table in time.h)
+///
+/// Measuring the TSC against the PIT or the PM timer uses shared platform
+/// hardware, so the first successful calibration is cached and reused by
+/// every other CPU when the TSC is invariant. Each vCPU still stores its
+/// own copy of the result so that conversions never touch shared state.
+///
+/// Each conversion is of the form:
+///
+///     out = (in * mult) >> shift
+///
+/// where the multiply is performed with 128 bits of precision.
+///
+class EXPORT_EAPIS_HVE tsc
+{
+public:
+
+    /// Calibration Source
+    ///
+    enum class source_t : uint64_t {
+        none = 0,
+        cpuid_15h = 1,
+        cpuid_16h = 2,
+        acpi_pm_timer = 3,
+        pit = 4,
+        platform_info = 5,
+        manual = 6
+    };
+
+    /// Conversion
+    ///
+    /// Defines a multiply / shift pair used to convert between two
+    /// frequencies without having to perform a division.
+    ///
+    struct conversion_t {
+
+        uint64_t mult{0};       ///< Multiplier
+        uint64_t shift{0};      ///< Shift
+
+        /// Convert
+        ///
+        /// @param val the value to convert
+        /// @return (val * mult) >> shift
+        ///
+        uint64_t operator()(uint64_t val) const noexcept
+        {
+            using uint128_t = unsigned __int128;
+            return static_cast<uint64_t>((static_cast<uint128_t>(val) * mult) >> shift);
+        }
+    };
+
+    /// Make Conversion
+    ///
+    /// Computes the multiply / shift pair that converts ticks of a clock
+    /// running at from_hz into ticks of a clock running at to_hz with the
+    /// largest shift (and therefore the most precision) that still fits
+    /// in 64 bits.
+    ///
+    /// @expects from_hz != 0
+    /// @expects from_hz < 2^63
+    /// @ensures
+    ///
+    /// @param from_hz the frequency of the source clock
+    /// @param to_hz the frequency of the destination clock
+    /// @return the resulting conversion
+    ///
+    static conversion_t make_conversion(uint64_t from_hz, uint64_t to_hz);
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    tsc() noexcept = default;
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~tsc() = default;
+
+    /// Calibrate
+    ///
+    /// Determines the frequency of the TSC and computes the conversion
+    /// constants. If a previous calibration has already been performed on
+    /// another CPU, and the TSC is invariant, the cached result is used.
+    /// If every calibration source fails, calibrated() will return false.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param pm_timer_port the IO port of the ACPI PM timer
+    ///     (FADT.X_PM_TMR_BLK). If 0, the PM timer is not used.
+    ///
+    void calibrate(uint16_t pm_timer_port = 0);
+
+    /// Set Frequency
+    ///
+    /// Manually sets the frequency of the TSC and computes the conversion
+    /// constants.
+    ///
+    /// @expects freq_hz != 0
+    /// @ensures
+    ///
+    /// @param freq_hz the frequency of the TSC in Hz
+    /// @param pet_shift the rate of the VMX-preemption timer relative to
+    ///     the TSC (i.e. IA32_VMX_MISC[4:0])
+    /// @param source the source of the provided frequency
+    ///
+    void set_freq_hz(
+        uint64_t freq_hz, uint64_t pet_shift, source_t source = source_t::manual);
+
+    /// Frequency (Hz)
+    ///
+    /// @return the frequency of the TSC in Hz, or 0 if not calibrated
+    ///
+    uint64_t freq_hz() const noexcept
+    { return m_freq_hz; }
+
+    /// Frequency (MHz)
+    ///
+    /// @return the frequency of the TSC in MHz, or 0 if not calibrated
+    ///
+    uint64_t freq_MHz() const noexcept
+    { return m_to_MHz(m_freq_hz); }
+
+    /// Source
+    ///
+    /// @return the method used to calibrate the TSC
+    ///
+    source_t source() const noexcept
+    { return m_source; }
+
+    /// Calibrated
+    ///
+    /// @return true if the TSC has been calibrated, false otherwise
+    ///
+    bool calibrated() const noexcept
+    { return m_freq_hz != 0; }
+
+    /// PET Shift
+    ///
+    /// @return the number of TSC bits per VMX-preemption timer tick
+    ///
+    uint64_t pet_shift() const noexcept
+    { return m_pet_shift; }
+
+    /// TSC to Nanoseconds
+    ///
+    /// @param ticks the number of TSC ticks to convert
+    /// @return ticks converted to nanoseconds
+    ///
+    uint64_t tsc_to_ns(uint64_t ticks) const noexcept
+    { return m_tsc_to_ns(ticks); }
+
+    /// Nanoseconds to TSC
+    ///
+    /// @param ns the number of nanoseconds to convert
+    /// @return ns converted to TSC ticks
+    ///
+    uint64_t ns_to_tsc(uint64_t ns) const noexcept
+    { return m_ns_to_tsc(ns); }
+
+    /// PET to Nanoseconds
+    ///
+    /// @param ticks the number of VMX-preemption timer ticks to convert
+    /// @return ticks converted to nanoseconds
+    ///
+    uint64_t pet_to_ns(uint64_t ticks) const noexcept
+    { return m_pet_to_ns(ticks); }
+
+    /// Nanoseconds to PET
+    ///
+    /// @param ns the number of nanoseconds to convert
+    /// @return ns converted to VMX-preemption timer ticks
+    ///
+    uint64_t ns_to_pet(uint64_t ns) const noexcept
+    { return m_ns_to_pet(ns); }
+
+    /// TSC to PET
+    ///
+    /// @param ticks the number of TSC ticks to convert
+    /// @return ticks converted to VMX-preemption timer ticks
+    ///
+    uint64_t tsc_to_pet(uint64_t ticks) const noexcept
+    { return ticks >> m_pet_shift; }
+
+    /// PET to TSC
+    ///
+    /// @param ticks the number of VMX-preemption timer ticks to convert
+    /// @return ticks converted to TSC ticks
+    ///
+    uint64_t pet_to_tsc(uint64_t ticks) const noexcept
+    { return ticks << m_pet_shift; }
+
+    /// Dump
+    ///
+    /// Prints the calibration results
+    ///
+    /// @param level the debug level to use
+    ///
+    void dump(int level = 0) const;
+
+private:
+
+    source_t m_source{source_t::none};
+
+    uint64_t m_freq_hz{0};
+    uint64_t m_pet_shift{0};
+
+    conversion_t m_to_MHz{};
+    conversion_t m_tsc_to_ns{};
+    conversion_t m_ns_to_tsc{};
+    conversion_t m_pet_to_ns{};
+    conversion_t m_ns_to_pet{};
+
+public:
+
+    /// @cond
+
+    tsc(tsc &&) noexcept = default;
+    tsc &operator=(tsc &&) noexcept = default;
+
+    tsc(const tsc &) = default;
+    tsc &operator=(const tsc &) = default;
+
+    /// @endcond
+};
+
+}
+
+#endif
@@ -33,17 +33,24 @@
 #include "vmexit/interrupt_window.h"
 #include "vmexit/io_instruction.h"
 #include "vmexit/monitor_trap.h"
+#include "vmexit/page_modification_log.h"
 #include "vmexit/rdmsr.h"
 #include "vmexit/sipi_signal.h"
 #include "vmexit/preemption_timer.h"
 #include "vmexit/wrmsr.h"
 #include "vmexit/xsetbv.h"
 
+#include "dedup.h"
+#include "demand_pager.h"
 #include "ept.h"
 #include "interrupt_queue.h"
 #include "lapic.h"
 #include "microcode.h"
+#include "mmio.h"
+#include "profiler.h"
+#include "tsc.h"
 #include "vcpu_global_state.h"
+#include "virtualization_exception.h"
 #include "vpid.h"
 
 #include "../x64/unmapper.h"
@@ -110,6 +117,364 @@ public:
     ///
     VIRTUAL void disable_ept();
 
+    /// INVEPT
+    ///
+    /// Invalidates the cached EPT translations of the current EPTP on
+    /// this CPU.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void invept();
+
+    /// Harvest Dirty
+    ///
+    /// Collects and clears the dirty flags of the current EPT map for
+    /// [gpa, gpa + size) (see ept::mmap::harvest_dirty), followed by a
+    /// single INVEPT if any page was dirty. The INVEPT only affects this
+    /// CPU, so the map must not be used by any other vCPU (see
+    /// ept::mmap::attach), otherwise their cached translations would keep
+    /// writing without setting the dirty flags again.
+    ///
+    /// @expects EPT is enabled, and the map uses accessed and dirty flags
+    /// @expects the map is only used by this vCPU
+    /// @ensures
+    ///
+    /// @param gpa the first guest physical address of the range
+    /// @param size the size of the range in bytes
+    /// @param bitmap the resulting dirty bitmap (one bit per 4k page)
+    /// @return the number of dirty 4k pages in the range
+    ///
+    VIRTUAL std::size_t harvest_dirty(
+        uintptr_t gpa, std::size_t size, gsl::span<uint64_t> bitmap);
+
+    /// Harvest Accessed
+    ///
+    /// Same as harvest_dirty(), but for the accessed flags.
+    ///
+    /// @expects EPT is enabled, and the map uses accessed and dirty flags
+    /// @expects the map is only used by this vCPU
+    /// @ensures
+    ///
+    /// @param gpa the first guest physical address of the range
+    /// @param size the size of the range in bytes
+    /// @param bitmap the resulting accessed bitmap (one bit per 4k page)
+    /// @return the number of accessed 4k pages in the range
+    ///
+    VIRTUAL std::size_t harvest_accessed(
+        uintptr_t gpa, std::size_t size, gsl::span<uint64_t> bitmap);
+
+    /// Add EPT View
+    ///
+    /// Adds a map to this vCPU's EPTP list (see ept_handler). Views can be
+    /// switched by the guest using VMFUNC once EPTP switching is enabled,
+    /// or by the VMM using switch_ept_view(). Everything that acts on the
+    /// current EPT map (i.e. harvest_dirty or snapshot) uses the view that
+    /// is active when it is called (see ept_handler::map).
+    ///
+    /// @expects index < ept_handler::eptp_list_size
+    /// @ensures
+    ///
+    /// @param index the index of the view
+    /// @param map the map to use for the view
+    ///
+    VIRTUAL void add_ept_view(std::size_t index, ept::mmap &map);
+
+    /// Remove EPT View
+    ///
+    /// @expects index < ept_handler::eptp_list_size
+    /// @expects the view is not active
+    /// @ensures
+    ///
+    /// @param index the index of the view
+    ///
+    VIRTUAL void remove_ept_view(std::size_t index);
+
+    /// Switch EPT View
+    ///
+    /// Makes the view at index the current EPT map of this vCPU without an
+    /// INVEPT.
+    ///
+    /// @expects the view at index exists
+    /// @ensures
+    ///
+    /// @param index the index of the view
+    ///
+    VIRTUAL void switch_ept_view(std::size_t index);
+
+    /// EPT View
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the index of the active view (which the guest might have
+    ///     switched to using VMFUNC), or ept_handler::eptp_list_size if the
+    ///     current EPT map is not a view
+    ///
+    VIRTUAL std::size_t ept_view() const;
+
+    /// Enable EPTP Switching
+    ///
+    /// Allows the guest to switch between the views added with
+    /// add_ept_view() using VMFUNC, without a VM exit.
+    ///
+    /// @expects EPT is enabled, and the CPU supports EPTP switching
+    /// @ensures
+    ///
+    VIRTUAL void enable_eptp_switching();
+
+    /// Disable EPTP Switching
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void disable_eptp_switching();
+
+    //--------------------------------------------------------------------------
+    // Sub-Page Write Permissions
+    //--------------------------------------------------------------------------
+
+    /// Set SPPT
+    ///
+    /// Enables sub-page write permissions using the provided SPP table.
+    /// Writes to a write-protected sub-page are delivered to the EPT
+    /// violation write handlers (see ept_violation_handler::spp_violation_mask).
+    ///
+    /// @expects EPT is enabled
+    /// @ensures
+    ///
+    /// @param sppt the SPP table to use
+    ///
+    VIRTUAL void set_sppt(ept::sppt &sppt);
+
+    /// Disable Sub-Page Write Permissions
+    ///
+    /// Note that the EPT entries of the pages in the SPP table remain
+    /// write-protected.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void disable_sppt();
+
+    /// Write Protect Sub-Pages
+    ///
+    /// Write-protects every 128 byte sub-page that overlaps
+    /// [gpa, gpa + size) in the current EPT map, leaving the rest of each
+    /// page writable, followed by an INVEPT on this CPU.
+    ///
+    /// @expects set_sppt() has been called
+    /// @expects every page in the range is mapped by a writable 4k page
+    /// @ensures
+    ///
+    /// @param gpa the first guest physical address of the range
+    /// @param size the size of the range in bytes
+    ///
+    VIRTUAL void write_protect_sub_pages(uintptr_t gpa, std::size_t size);
+
+    /// Write Unprotect Sub-Pages
+    ///
+    /// Undoes write_protect_sub_pages(), followed by an INVEPT on this CPU.
+    ///
+    /// @expects set_sppt() has been called
+    /// @ensures
+    ///
+    /// @param gpa the first guest physical address of the range
+    /// @param size the size of the range in bytes
+    ///
+    VIRTUAL void write_unprotect_sub_pages(uintptr_t gpa, std::size_t size);
+
+    //--------------------------------------------------------------------------
+    // Snapshots
+    //--------------------------------------------------------------------------
+
+    /// Snapshot
+    ///
+    /// Takes a copy-on-write snapshot of the current EPT map (see
+    /// ept::mmap::snapshot), followed by an INVEPT on this CPU. Writes to
+    /// the snapshot are handled by a built-in EPT violation write handler,
+    /// which gives the guest a private copy of the page and resumes the
+    /// guest without advancing its instruction pointer. Write handlers
+    /// added after the snapshot is taken see these violations first, and
+    /// must return false for addresses they do not own.
+    ///
+    /// The INVEPT only affects this CPU, so the map must not be used by any
+    /// other vCPU (see ept::mmap::attach), otherwise their cached
+    /// translations would keep writing to the snapshot.
+    ///
+    /// @expects EPT is enabled
+    /// @expects the map is only used by this vCPU
+    /// @ensures
+    ///
+    /// @return the number of leaf entries that were write-protected
+    ///
+    VIRTUAL std::size_t snapshot();
+
+    /// Revert Snapshot
+    ///
+    /// Throws away every write made since the snapshot was taken (or last
+    /// reverted) in O(dirty pages), followed by an INVEPT on this CPU.
+    ///
+    /// @expects EPT is enabled
+    /// @expects the map is only used by this vCPU
+    /// @ensures
+    ///
+    /// @return the number of pages that were reverted
+    ///
+    VIRTUAL std::size_t revert_snapshot();
+
+    /// Release Snapshot
+    ///
+    /// Reverts the snapshot and removes it from the current EPT map,
+    /// followed by an INVEPT on this CPU.
+    ///
+    /// @expects EPT is enabled
+    /// @expects the map is only used by this vCPU
+    /// @ensures
+    ///
+    VIRTUAL void release_snapshot();
+
+    //--------------------------------------------------------------------------
+    // Page Deduplication
+    //--------------------------------------------------------------------------
+
+    /// Enable Dedup
+    ///
+    /// Registers this vCPU with a page deduplication scanner. Writes to
+    /// pages that the scanner has write-protected in the current EPT map
+    /// are handled by a built-in EPT violation write handler (see
+    /// page_dedup::handle_write), which resumes the guest without
+    /// advancing its instruction pointer. This includes read-modify-write
+    /// accesses, which report both a read and a write and are dispatched
+    /// as writes. The ranges to scan must be added to the scanner
+    /// separately (see page_dedup::add_range).
+    ///
+    /// Breaking sharing does not INVEPT the other vCPUs, so the map must
+    /// only be used by this vCPU (see ept::mmap::attach).
+    ///
+    /// @expects EPT is enabled, and the map is only used by this vCPU
+    /// @ensures
+    ///
+    /// @param dedup the scanner that owns the shared pages of this vCPU
+    ///
+    VIRTUAL void enable_dedup(page_dedup &dedup);
+
+    //--------------------------------------------------------------------------
+    // Demand Paging
+    //--------------------------------------------------------------------------
+
+    /// Enable Demand Paging
+    ///
+    /// Registers this vCPU with a demand pager. EPT violations caused by
+    /// an entry of the current EPT map that is not present are handed to
+    /// the pager by built-in read, write and execute handlers (see
+    /// demand_pager::handle_fault), which resume the guest without
+    /// advancing its instruction pointer. The RAM regions to populate must
+    /// be added to the pager separately (see demand_pager::add_region).
+    ///
+    /// @expects EPT is enabled
+    /// @ensures
+    ///
+    /// @param pager the pager that populates the RAM of this vCPU
+    ///
+    VIRTUAL void enable_demand_paging(demand_pager &pager);
+
+    //--------------------------------------------------------------------------
+    // Virtualization Exceptions
+    //--------------------------------------------------------------------------
+
+    /// Enable #VE
+    ///
+    /// Delivers EPT violations caused by entries whose suppress #VE bit is
+    /// clear to the guest as virtualization exceptions (see
+    /// virtualization_exception_handler). Entries can be armed with
+    /// set_suppress_ve().
+    ///
+    /// @expects EPT is enabled, and the CPU supports EPT-violation #VE
+    /// @ensures
+    ///
+    VIRTUAL void enable_ve();
+
+    /// Disable #VE
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void disable_ve();
+
+    /// Rearm #VE
+    ///
+    /// Clears the busy field of this vCPU's #VE information page, allowing
+    /// the next #VE to be delivered.
+    ///
+    /// @expects enable_ve() has been called
+    /// @ensures
+    ///
+    VIRTUAL void rearm_ve();
+
+    /// #VE Info
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return this vCPU's #VE information page, or a nullptr if #VE has
+    ///     never been enabled
+    ///
+    VIRTUAL const virtualization_exception_handler::info_t *ve_info() const;
+
+    /// Set Suppress #VE
+    ///
+    /// Sets (or clears) the suppress #VE bit of the current EPT map for
+    /// [gpa, gpa + size) (see ept::mmap::set_suppress_ve), followed by an
+    /// INVEPT on this CPU if any entry changed. Clearing the bit arms the
+    /// entries, so that violations they cause become #VEs.
+    ///
+    /// @expects EPT is enabled
+    /// @ensures
+    ///
+    /// @param gpa the first guest physical address of the range
+    /// @param size the size of the range in bytes
+    /// @param suppress true to suppress #VEs, false to arm the entries
+    ///
+    VIRTUAL void set_suppress_ve(uintptr_t gpa, std::size_t size, bool suppress);
+
+    //--------------------------------------------------------------------------
+    // Page-Modification Logging
+    //--------------------------------------------------------------------------
+
+    /// Enable PML
+    ///
+    /// Logs every page whose EPT dirty flag is set by this vCPU into the
+    /// provided dirty bitmap (see page_modification_log_handler). The
+    /// same bitmap is normally shared by every vCPU of a VM.
+    ///
+    /// @expects the current EPT map uses accessed and dirty flags
+    /// @ensures
+    ///
+    /// @param bitmap the dirty bitmap to log into
+    ///
+    VIRTUAL void enable_pml(dirty_bitmap &bitmap);
+
+    /// Disable PML
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void disable_pml();
+
+    /// Flush PML
+    ///
+    /// Drains this vCPU's page-modification log into the dirty bitmap.
+    /// This must be called on every vCPU before the dirty bitmap is
+    /// harvested.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the number of entries that were drained
+    ///
+    VIRTUAL uint64_t flush_pml();
+
     //--------------------------------------------------------------------------
     // VPID
     //--------------------------------------------------------------------------
@@ -128,6 +493,70 @@ public:
     ///
     VIRTUAL void disable_vpid();
 
+    /// INVVPID (Single Address)
+    ///
+    /// Invalidates the TLB entries of a single guest virtual address that
+    /// are tagged with this vCPU's VPID. This should be used in place of a
+    /// global flush when the guest changes a single mapping.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gva the guest virtual address to invalidate
+    ///
+    VIRTUAL void invvpid_single_address(uint64_t gva);
+
+    /// INVVPID (Single Context)
+    ///
+    /// Invalidates the TLB entries that are tagged with this vCPU's VPID.
+    /// This should be used in place of a global flush when the guest
+    /// changes its paging structures (e.g. a write to CR3).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param retain_globals if true, global translations are kept
+    ///
+    VIRTUAL void invvpid_single_context(bool retain_globals = false);
+
+    //--------------------------------------------------------------------------
+    // Profiler
+    //--------------------------------------------------------------------------
+
+    /// Enable Profiler
+    ///
+    /// Starts sampling the guest on this vCPU. The samples are read from
+    /// the host using bfack (see profiler_abi.h).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param freq_hz the number of samples to take per second
+    ///
+    VIRTUAL void enable_profiler(uint64_t freq_hz);
+
+    /// Disable Profiler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void disable_profiler();
+
+    /// Allow Profiler User Access
+    ///
+    /// Lets any guest process (and not just the guest kernel) use the
+    /// profiler's CPUID interface on this vCPU, which is needed to run
+    /// bfack's ack_profile directly from ring 3 (see
+    /// profiler::allow_user_access).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param allow true to accept requests from any CPL, false to only
+    ///     accept requests from CPL 0
+    ///
+    VIRTUAL void allow_profiler_user_access(bool allow);
+
     //==========================================================================
     // Helpers
     //==========================================================================
@@ -297,6 +726,78 @@ public:
     VIRTUAL void add_ept_execute_violation_handler(
         const ept_violation_handler::handler_delegate_t &d);
 
+    /// Add EPT read violation handler (GPA range)
+    ///
+    /// @expects size != 0
+    /// @expects the range does not overlap a registered read range
+    /// @ensures
+    ///
+    /// @param gpa the first guest physical address of the range
+    /// @param size the size of the range in bytes
+    /// @param d the delegate to call when an exit occurs in the range
+    ///
+    VIRTUAL void add_ept_read_violation_handler(
+        uint64_t gpa, uint64_t size,
+        const ept_violation_handler::handler_delegate_t &d);
+
+    /// Add EPT write violation handler (GPA range)
+    ///
+    /// @expects size != 0
+    /// @expects the range does not overlap a registered write range
+    /// @ensures
+    ///
+    /// @param gpa the first guest physical address of the range
+    /// @param size the size of the range in bytes
+    /// @param d the delegate to call when an exit occurs in the range
+    ///
+    VIRTUAL void add_ept_write_violation_handler(
+        uint64_t gpa, uint64_t size,
+        const ept_violation_handler::handler_delegate_t &d);
+
+    /// Add EPT execute violation handler (GPA range)
+    ///
+    /// @expects size != 0
+    /// @expects the range does not overlap a registered execute range
+    /// @ensures
+    ///
+    /// @param gpa the first guest physical address of the range
+    /// @param size the size of the range in bytes
+    /// @param d the delegate to call when an exit occurs in the range
+    ///
+    VIRTUAL void add_ept_execute_violation_handler(
+        uint64_t gpa, uint64_t size,
+        const ept_violation_handler::handler_delegate_t &d);
+
+    /// Remove EPT read violation handler (GPA range)
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the first guest physical address of a registered range
+    /// @return true if the range was removed, false otherwise
+    ///
+    VIRTUAL bool remove_ept_read_violation_handler(uint64_t gpa);
+
+    /// Remove EPT write violation handler (GPA range)
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the first guest physical address of a registered range
+    /// @return true if the range was removed, false otherwise
+    ///
+    VIRTUAL bool remove_ept_write_violation_handler(uint64_t gpa);
+
+    /// Remove EPT execute violation handler (GPA range)
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the first guest physical address of a registered range
+    /// @return true if the range was removed, false otherwise
+    ///
+    VIRTUAL bool remove_ept_execute_violation_handler(uint64_t gpa);
+
     /// Add EPT Read Violation Default Handler
     ///
     /// @expects
@@ -327,6 +828,47 @@ public:
     VIRTUAL void add_default_ept_execute_violation_handler(
         const ::handler_delegate_t &d);
 
+    //--------------------------------------------------------------------------
+    // MMIO
+    //--------------------------------------------------------------------------
+
+    /// Add MMIO Handler
+    ///
+    /// Emulates guest accesses to [gpa, gpa + size). The range must also be
+    /// mapped using ept::map_mmio for accesses to trap.
+    ///
+    /// @expects size != 0
+    /// @expects the range does not overlap a registered MMIO range
+    /// @ensures
+    ///
+    /// @param gpa the first guest physical address of the range
+    /// @param size the size of the range in bytes
+    /// @param d the delegate to call when the guest accesses the range
+    ///
+    VIRTUAL void add_mmio_handler(
+        uint64_t gpa, uint64_t size,
+        const mmio_handler::handler_delegate_t &d);
+
+    /// Remove MMIO Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the first guest physical address of a registered range
+    /// @return true if the range was removed, false otherwise
+    ///
+    VIRTUAL bool remove_mmio_handler(uint64_t gpa);
+
+    /// Flush MMIO Decode Cache
+    ///
+    /// Must be called if guest code that accesses an MMIO range is modified
+    /// or remapped in place.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void flush_mmio_decode_cache();
+
     //--------------------------------------------------------------------------
     // External Interrupt
     //--------------------------------------------------------------------------
@@ -706,6 +1248,48 @@ public:
     ///
     VIRTUAL void disable_preemption_timer();
 
+    /// Add Timer
+    ///
+    /// Arms a one-shot timer on this vCPU's timer wheel. Note that timers
+    /// should not be mixed with set_preemption_timer() as both use the
+    /// same hardware timer.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param ns the number of nanoseconds from now the timer should fire
+    /// @param d the delegate to call when the timer fires
+    /// @return the id of the timer
+    ///
+    VIRTUAL timer_wheel::id_t add_timer(
+        uint64_t ns, const timer_wheel::handler_delegate_t &d);
+
+    /// Add Periodic Timer
+    ///
+    /// Arms a periodic timer on this vCPU's timer wheel. Note that timers
+    /// should not be mixed with set_preemption_timer() as both use the
+    /// same hardware timer.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param period_ns the period of the timer in nanoseconds
+    /// @param d the delegate to call when the timer fires
+    /// @return the id of the timer
+    ///
+    VIRTUAL timer_wheel::id_t add_periodic_timer(
+        uint64_t period_ns, const timer_wheel::handler_delegate_t &d);
+
+    /// Cancel Timer
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param id the id of the timer to cancel
+    /// @return true if the timer was pending, false otherwise
+    ///
+    VIRTUAL bool cancel_timer(timer_wheel::id_t id);
+
     //==========================================================================
     // Resources
     //==========================================================================
@@ -720,6 +1304,17 @@ public:
     VIRTUAL gsl::not_null<vcpu_global_state_t *> global_state() const
     { return m_vcpu_global_state; }
 
+    /// Clock
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the calibrated TSC for this vCPU, which provides division
+    ///     free conversions between nanoseconds, TSC and PET ticks.
+    ///
+    VIRTUAL const tsc &clock() const
+    { return m_tsc; }
+
     //==========================================================================
     // Memory Mapping
     //==========================================================================
@@ -1416,15 +2011,29 @@ private:
 
     uintptr_t get_entry(uintptr_t tble_gpa, std::ptrdiff_t index);
 
+    bool handle_snapshot_write(
+        gsl::not_null<vcpu_t *> vcpu, ept_violation_handler::info_t &info);
+
+    bool handle_dedup_write(
+        gsl::not_null<vcpu_t *> vcpu, ept_violation_handler::info_t &info);
+
+    bool handle_demand_fault(
+        gsl::not_null<vcpu_t *> vcpu, ept_violation_handler::info_t &info);
+
 private:
 
-    ept::mmap *m_mmap{};
     vcpu_global_state_t *m_vcpu_global_state;
 
+    tsc m_tsc;
+
     std::unique_ptr<uint8_t, void(*)(void *)> m_msr_bitmap;
     std::unique_ptr<uint8_t, void(*)(void *)> m_io_bitmap_a;
     std::unique_ptr<uint8_t, void(*)(void *)> m_io_bitmap_b;
 
+    bool m_snapshot_handler{false};
+    page_dedup *m_dedup{};
+    demand_pager *m_demand_pager{};
+
 private:
 
     control_register_handler m_control_register_handler;
@@ -1440,13 +2049,18 @@ private:
     external_interrupt_handler m_external_interrupt_handler;
     init_signal_handler m_init_signal_handler;
     interrupt_window_handler m_interrupt_window_handler;
+    page_modification_log_handler m_page_modification_log_handler;
     sipi_signal_handler m_sipi_signal_handler;
 
     ept_handler m_ept_handler;
     microcode_handler m_microcode_handler;
+    mmio_handler m_mmio_handler;
     vpid_handler m_vpid_handler;
+    virtualization_exception_handler m_virtualization_exception_handler;
     preemption_timer_handler m_preemption_timer_handler;
 
+    profiler m_profiler;
+
 private:
 
     friend class io_instruction_handler;
@@ -0,0 +1,201 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef VIRTUALIZATION_EXCEPTION_INTEL_X64_EAPIS_H
+#define VIRTUALIZATION_EXCEPTION_INTEL_X64_EAPIS_H
+
+#include <memory>
+
+#include <bfvmm/hve/arch/intel_x64/vmcs.h>
+#include <bfvmm/hve/arch/intel_x64/exit_handler.h>
+
+// -----------------------------------------------------------------------------
+// Exports
+// -----------------------------------------------------------------------------
+
+#include <bfexports.h>
+
+#ifndef STATIC_EAPIS_HVE
+#ifdef SHARED_EAPIS_HVE
+#define EXPORT_EAPIS_HVE EXPORT_SYM
+#else
+#define EXPORT_EAPIS_HVE IMPORT_SYM
+#endif
+#else
+#define EXPORT_EAPIS_HVE
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis::intel_x64
+{
+
+class vcpu;
+
+/// Virtualization Exception
+///
+/// Provides an interface for EPT-violation #VE. Once enabled, an EPT
+/// violation caused by an EPT entry whose suppress #VE bit is clear (see
+/// ept::mmap::set_suppress_ve) is delivered to the guest as a
+/// virtualization exception (vector 20) instead of causing a VM exit, so
+/// that an in-guest agent can handle it without leaving the guest.
+///
+/// The details of each #VE are written to a per-vCPU information page.
+/// Once a #VE is delivered, the page is marked as busy and every following
+/// EPT violation causes a VM exit as usual, until the page is re-armed,
+/// either by the guest (by clearing the busy field) or with rearm().
+///
+/// The information page is allocated by the VMM. Its physical address is
+/// returned by info_phys() so that it can be mapped into the guest.
+///
+class EXPORT_EAPIS_HVE virtualization_exception_handler
+{
+public:
+
+    constexpr static uint32_t busy = 0xFFFFFFFF;    ///< Busy field value
+
+    ///
+    /// Info
+    ///
+    /// The layout of the virtualization-exception information area (see
+    /// the Intel SDM, Vol. 3, 25.5.7.2)
+    ///
+    struct info_t {
+        uint32_t exit_reason;           ///< Always an EPT violation (48)
+        uint32_t busy;                  ///< busy once a #VE is delivered
+        uint64_t exit_qualification;    ///< The EPT violation qualification
+        uint64_t gva;                   ///< Guest linear address
+        uint64_t gpa;                   ///< Guest physical address
+        uint16_t eptp_index;            ///< The active EPT view
+    };
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vcpu object for this #VE handler
+    ///
+    virtualization_exception_handler(
+        gsl::not_null<vcpu *> vcpu);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~virtualization_exception_handler() = default;
+
+public:
+
+    /// Enable
+    ///
+    /// Enables EPT-violation #VE and arms the information page, which is
+    /// allocated the first time this is called.
+    ///
+    /// @expects EPT is enabled, and the CPU supports EPT-violation #VE
+    /// @ensures
+    ///
+    void enable();
+
+    /// Disable
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable();
+
+    /// Rearm
+    ///
+    /// Clears the busy field of the information page so that the next EPT
+    /// violation that is not suppressed is delivered as a #VE.
+    ///
+    /// @expects enable() has been called
+    /// @ensures
+    ///
+    void rearm();
+
+    /// Armed
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return true if the information page exists and is not busy, false
+    ///     otherwise
+    ///
+    bool armed() const noexcept;
+
+    /// Enabled
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return true if EPT-violation #VE is enabled, false otherwise
+    ///
+    bool enabled() const noexcept
+    { return m_enabled; }
+
+    /// Info
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the information page, or a nullptr if enable() has not been
+    ///     called
+    ///
+    const info_t *info() const noexcept
+    { return m_info.get(); }
+
+    /// Info Phys
+    ///
+    /// @expects enable() has been called
+    /// @ensures
+    ///
+    /// @return the physical address of the information page
+    ///
+    uintptr_t info_phys() const;
+
+private:
+
+    vcpu *m_vcpu;
+    bool m_enabled{false};
+
+    std::unique_ptr<info_t, void(*)(void *)> m_info;
+
+public:
+
+    /// @cond
+
+    virtualization_exception_handler(virtualization_exception_handler &&) = default;
+    virtualization_exception_handler &operator=(virtualization_exception_handler &&) = default;
+
+    virtualization_exception_handler(const virtualization_exception_handler &) = delete;
+    virtualization_exception_handler &operator=(const virtualization_exception_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
@@ -23,6 +23,7 @@
 #define EPT_VIOLATION_INTEL_X64_H
 
 #include <list>
+#include <map>
 
 #include <bfvmm/hve/arch/intel_x64/vmcs.h>
 #include <bfvmm/hve/arch/intel_x64/exit_handler.h>
@@ -61,6 +62,24 @@ class EXPORT_EAPIS_HVE ept_violation_handler
 {
 public:
 
+    /// SPP Violation Mask
+    ///
+    /// Bit 11 of the exit qualification. Set if the violation was caused
+    /// by a write to a sub-page that is write-protected by the SPP table
+    /// (see ept::sppt). Such violations are always delivered to the write
+    /// handlers, even if the instruction also read from the address.
+    ///
+    constexpr static uint64_t spp_violation_mask = 0x800ULL;
+
+    /// Entry Present Mask
+    ///
+    /// Bits 5:3 of the exit qualification. Each bit is set if the guest
+    /// physical address was readable, writable or executable respectively.
+    /// If none of them are set, the violation was caused by an entry that
+    /// is not present.
+    ///
+    constexpr static uint64_t entry_present_mask = 0x38ULL;
+
     ///
     /// Info
     ///
@@ -152,6 +171,88 @@ public:
     ///
     void add_execute_handler(const handler_delegate_t &d);
 
+    /// Add Read EPT Violation Handler (GPA Range)
+    ///
+    /// Registers a handler that owns [gpa, gpa + size). Violations in
+    /// this range are dispatched straight to this handler (O(log n) in
+    /// the number of ranges) before any of the handlers that were
+    /// registered without a range are called. If the handler returns
+    /// false, those handlers are called as usual.
+    ///
+    /// @expects size != 0
+    /// @expects the range does not overlap a registered read range
+    /// @ensures
+    ///
+    /// @param gpa the first guest physical address of the range
+    /// @param size the size of the range in bytes
+    /// @param d the handler to call when an exit occurs
+    ///
+    void add_read_handler(
+        uint64_t gpa, uint64_t size, const handler_delegate_t &d);
+
+    /// Add Write EPT Violation Handler (GPA Range)
+    ///
+    /// See add_read_handler(gpa, size, d)
+    ///
+    /// @expects size != 0
+    /// @expects the range does not overlap a registered write range
+    /// @ensures
+    ///
+    /// @param gpa the first guest physical address of the range
+    /// @param size the size of the range in bytes
+    /// @param d the handler to call when an exit occurs
+    ///
+    void add_write_handler(
+        uint64_t gpa, uint64_t size, const handler_delegate_t &d);
+
+    /// Add Execute EPT Violation Handler (GPA Range)
+    ///
+    /// See add_read_handler(gpa, size, d)
+    ///
+    /// @expects size != 0
+    /// @expects the range does not overlap a registered execute range
+    /// @ensures
+    ///
+    /// @param gpa the first guest physical address of the range
+    /// @param size the size of the range in bytes
+    /// @param d the handler to call when an exit occurs
+    ///
+    void add_execute_handler(
+        uint64_t gpa, uint64_t size, const handler_delegate_t &d);
+
+    /// Remove Read EPT Violation Handler (GPA Range)
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the first guest physical address of a registered range
+    /// @return true if the range was removed, false if no range starts
+    ///     at gpa
+    ///
+    bool remove_read_handler(uint64_t gpa);
+
+    /// Remove Write EPT Violation Handler (GPA Range)
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the first guest physical address of a registered range
+    /// @return true if the range was removed, false if no range starts
+    ///     at gpa
+    ///
+    bool remove_write_handler(uint64_t gpa);
+
+    /// Remove Execute EPT Violation Handler (GPA Range)
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gpa the first guest physical address of a registered range
+    /// @return true if the range was removed, false if no range starts
+    ///     at gpa
+    ///
+    bool remove_execute_handler(uint64_t gpa);
+
     /// Add Default Read Handler
     ///
     /// This is called when no registered handlers have been called and
@@ -216,6 +317,30 @@ public:
 
 private:
 
+    // Registered ranges are disjoint, and are indexed by their first GPA,
+    // so the only range that can contain a GPA is the last one that
+    // starts at or below it.
+    //
+    struct range_t {
+        uint64_t end;
+        handler_delegate_t d;
+    };
+
+    using range_map_t = std::map<uint64_t, range_t>;
+
+    static void add_range(
+        range_map_t &ranges, uint64_t gpa, uint64_t size, const handler_delegate_t &d);
+
+    static const range_t *find_range(
+        const range_map_t &ranges, uint64_t gpa) noexcept;
+
+    bool dispatch(
+        gsl::not_null<vcpu_t *> vcpu, info_t &info,
+        const range_map_t &ranges,
+        const std::list<handler_delegate_t> &handlers,
+        const ::handler_delegate_t &default_handler,
+        const char *unhandled);
+
     bool handle_read(gsl::not_null<vcpu_t *> vcpu, info_t &info);
     bool handle_write(gsl::not_null<vcpu_t *> vcpu, info_t &info);
     bool handle_execute(gsl::not_null<vcpu_t *> vcpu, info_t &info);
@@ -232,6 +357,10 @@ private:
     std::list<handler_delegate_t> m_write_handlers;
     std::list<handler_delegate_t> m_execute_handlers;
 
+    range_map_t m_read_ranges;
+    range_map_t m_write_ranges;
+    range_map_t m_execute_ranges;
+
 public:
 
     /// @cond
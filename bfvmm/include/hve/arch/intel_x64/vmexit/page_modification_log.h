@@ -0,0 +1,183 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef PAGE_MODIFICATION_LOG_INTEL_X64_EAPIS_H
+#define PAGE_MODIFICATION_LOG_INTEL_X64_EAPIS_H
+
+#include <memory>
+
+#include <bfvmm/hve/arch/intel_x64/vmcs.h>
+#include <bfvmm/hve/arch/intel_x64/exit_handler.h>
+
+#include "../dirty_bitmap.h"
+
+// -----------------------------------------------------------------------------
+// Exports
+// -----------------------------------------------------------------------------
+
+#include <bfexports.h>
+
+#ifndef STATIC_EAPIS_HVE
+#ifdef SHARED_EAPIS_HVE
+#define EXPORT_EAPIS_HVE EXPORT_SYM
+#else
+#define EXPORT_EAPIS_HVE IMPORT_SYM
+#endif
+#else
+#define EXPORT_EAPIS_HVE
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis::intel_x64
+{
+
+class vcpu;
+
+/// Page-Modification Log
+///
+/// Provides an interface for Page-Modification Logging (PML). When PML is
+/// enabled, each time the hardware sets the dirty flag of an EPT entry, it
+/// also writes the GPA of the page into a 512 entry log, and only exits
+/// once the log is full. The log is then drained into a dirty bitmap that
+/// is shared by every vCPU of the VM, which means that dirty tracking
+/// costs one VM exit per 512 newly dirtied pages instead of one per page.
+///
+/// Since a page is only logged when its dirty flag is set, PML requires
+/// EPT accessed and dirty flags (see ept::mmap), and the dirty flags of
+/// the pages that should be logged again must be cleared (see
+/// vcpu::harvest_dirty).
+///
+class EXPORT_EAPIS_HVE page_modification_log_handler
+{
+public:
+
+    constexpr static uint64_t num_entries = 512;    ///< Entries in the log
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vcpu object for this page-modification log handler
+    ///
+    page_modification_log_handler(
+        gsl::not_null<vcpu *> vcpu);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~page_modification_log_handler() = default;
+
+public:
+
+    /// Enable
+    ///
+    /// Allocates the log (the first time PML is enabled), and starts
+    /// logging dirty pages into bitmap.
+    ///
+    /// @expects EPT accessed and dirty flags are enabled
+    /// @ensures
+    ///
+    /// @param bitmap the dirty bitmap to drain the log into. This bitmap
+    ///     must outlive this handler, or PML must be disabled first.
+    ///
+    void enable(dirty_bitmap &bitmap);
+
+    /// Disable
+    ///
+    /// Flushes the log and stops logging dirty pages
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable();
+
+    /// Flush
+    ///
+    /// Drains the entries that are currently in the log into the dirty
+    /// bitmap, and resets the log. This should be called on each vCPU
+    /// before the dirty bitmap is harvested, as the log is only drained
+    /// automatically once it is full.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the number of entries that were drained
+    ///
+    uint64_t flush();
+
+    /// Log
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the page-modification log, or an empty span if PML has
+    ///     never been enabled
+    ///
+    gsl::span<uint64_t> log() const noexcept;
+
+    /// Enabled
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return true if PML is enabled, false otherwise
+    ///
+    bool enabled() const noexcept
+    { return m_bitmap != nullptr; }
+
+public:
+
+    /// @cond
+
+    bool handle(gsl::not_null<vcpu_t *> vcpu);
+
+    /// @endcond
+
+private:
+
+    vcpu *m_vcpu;
+    dirty_bitmap *m_bitmap{};
+
+    std::unique_ptr<uint64_t, void(*)(void *)> m_log;
+
+public:
+
+    /// @cond
+
+    page_modification_log_handler(page_modification_log_handler &&) = default;
+    page_modification_log_handler &operator=(page_modification_log_handler &&) = default;
+
+    page_modification_log_handler(const page_modification_log_handler &) = delete;
+    page_modification_log_handler &operator=(const page_modification_log_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
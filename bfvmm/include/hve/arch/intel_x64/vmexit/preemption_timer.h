@@ -27,6 +27,8 @@
 #include <bfvmm/hve/arch/intel_x64/vmcs.h>
 #include <bfvmm/hve/arch/intel_x64/exit_handler.h>
 
+#include "../timer_wheel.h"
+
 // -----------------------------------------------------------------------------
 // Exports
 // -----------------------------------------------------------------------------
@@ -57,6 +59,15 @@ class vcpu;
 /// Provides an interface for registering handlers for VMX-preemption timer
 /// exits.
 ///
+/// In addition to the raw interface (set_timer / add_handler), this class
+/// owns a per-vCPU timer wheel that allows any number of clients to arm
+/// one-shot or periodic timers in nanoseconds. Whenever a timer is added,
+/// cancelled or fires, the earliest deadline is programmed into the
+/// VMX-preemption timer relative to the current TSC, so any time spent in
+/// the VMM processing the expiry is accounted for. Clients should not mix
+/// the raw interface with the timer wheel as both share the same hardware
+/// timer.
+///
 class EXPORT_EAPIS_HVE preemption_timer_handler
 {
 public:
@@ -139,6 +150,67 @@ public:
     ///
     value_t get_timer() const;
 
+    /// Add Timer
+    ///
+    /// Arms a one-shot timer that fires ns nanoseconds from now
+    ///
+    /// @expects the TSC has been calibrated
+    /// @ensures
+    ///
+    /// @param ns the number of nanoseconds from now the timer should fire
+    /// @param d the delegate to call when the timer fires
+    /// @return the id of the timer
+    ///
+    timer_wheel::id_t add_timer(
+        uint64_t ns, const timer_wheel::handler_delegate_t &d);
+
+    /// Add Periodic Timer
+    ///
+    /// Arms a timer that fires every period_ns nanoseconds
+    ///
+    /// @expects the TSC has been calibrated
+    /// @expects period_ns != 0
+    /// @ensures
+    ///
+    /// @param period_ns the period of the timer in nanoseconds
+    /// @param d the delegate to call when the timer fires
+    /// @return the id of the timer
+    ///
+    timer_wheel::id_t add_periodic_timer(
+        uint64_t period_ns, const timer_wheel::handler_delegate_t &d);
+
+    /// Cancel Timer
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param id the id of the timer to cancel
+    /// @return true if the timer was pending, false otherwise
+    ///
+    bool cancel_timer(timer_wheel::id_t id);
+
+    /// Program Timer
+    ///
+    /// Programs the VMX-preemption timer with the earliest pending deadline
+    /// of the timer wheel, taking into account the time that has already
+    /// elapsed. This is called automatically when timers are added,
+    /// cancelled or expire, but can also be called by an extension right
+    /// before VM entry to account for time spent handling other exits.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void program_timer();
+
+    /// Now
+    ///
+    /// @expects the TSC has been calibrated
+    /// @ensures
+    ///
+    /// @return the current time in nanoseconds, as used by the timer wheel
+    ///
+    uint64_t now() const;
+
 public:
 
     /// @cond
@@ -152,6 +224,9 @@ private:
     vcpu *m_vcpu;
     std::list<handler_delegate_t> m_handlers;
 
+    timer_wheel m_timer_wheel;
+    bool m_timer_wheel_armed{false};
+
 public:
 
     /// @cond
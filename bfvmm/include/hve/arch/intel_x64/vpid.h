@@ -22,6 +22,11 @@
 #ifndef VPID_INTEL_X64_EAPIS_H
 #define VPID_INTEL_X64_EAPIS_H
 
+#include <bitset>
+#include <mutex>
+#include <utility>
+#include <vector>
+
 // -----------------------------------------------------------------------------
 // Exports
 // -----------------------------------------------------------------------------
@@ -47,9 +52,102 @@ namespace eapis::intel_x64
 
 class vcpu;
 
+/// VPID Allocator
+///
+/// Hands out VPIDs in the range [1, 0xFFFF]. VPID 0 is reserved for the
+/// host (VMX root), and is never returned. Released VPIDs are placed on a
+/// free list and handed out again before any new VPID is used, so vCPUs
+/// can be created and destroyed for the life of the host without running
+/// out of VPIDs. All functions are thread safe.
+///
+class EXPORT_EAPIS_HVE vpid_allocator
+{
+public:
+
+    using id_t = uint16_t;                          ///< VPID type
+
+    constexpr static id_t invalid_id = 0;           ///< Reserved (host)
+    constexpr static id_t max_id = 0xFFFF;          ///< Largest VPID
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    vpid_allocator() = default;
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~vpid_allocator() = default;
+
+    /// Allocate
+    ///
+    /// @expects
+    /// @ensures ret != invalid_id
+    ///
+    /// @param recycled set to true if the returned VPID was previously
+    ///     released, in which case the TLB may still hold translations
+    ///     tagged with it.
+    /// @return a VPID that is not currently in use. Throws if every VPID
+    ///     is in use.
+    ///
+    id_t allocate(bool &recycled);
+
+    /// Release
+    ///
+    /// @expects id != invalid_id
+    /// @expects id is currently allocated (i.e. it has not already been
+    ///     released)
+    /// @ensures
+    ///
+    /// @param id the VPID to release
+    ///
+    void release(id_t id);
+
+    /// In Use
+    ///
+    /// @return the number of VPIDs currently allocated
+    ///
+    std::size_t in_use() const;
+
+private:
+
+    mutable std::mutex m_mutex;
+
+    uint32_t m_next{1};
+    std::vector<id_t> m_free;
+    std::bitset<max_id + 1U> m_released;
+
+public:
+
+    /// @cond
+
+    vpid_allocator(vpid_allocator &&) = delete;
+    vpid_allocator &operator=(vpid_allocator &&) = delete;
+
+    vpid_allocator(const vpid_allocator &) = delete;
+    vpid_allocator &operator=(const vpid_allocator &) = delete;
+
+    /// @endcond
+};
+
+/// Global VPID Allocator
+///
+/// The allocator shared by every vpid_handler
+///
+EXPORT_EAPIS_HVE vpid_allocator &g_vpid_allocator() noexcept;
+
 /// VPID
 ///
-/// Provides an interface for enabling VPID
+/// Provides an interface for enabling VPID, and for invalidating the
+/// translations that are tagged with this vCPU's VPID. The VPID is taken
+/// from g_vpid_allocator() on construction and returned on destruction.
+/// Since INVVPID only affects the CPU that executes it, the handler must be
+/// destroyed on the CPU the vCPU ran on, so that the VPID is flushed there
+/// before it can be handed out again.
 ///
 class EXPORT_EAPIS_HVE vpid_handler
 {
@@ -70,7 +168,7 @@ public:
     /// @expects
     /// @ensures
     ///
-    ~vpid_handler() = default;
+    ~vpid_handler();
 
     /// Get ID
     ///
@@ -95,6 +193,35 @@ public:
     ///
     void disable();
 
+    /// Invalidate Address
+    ///
+    /// Invalidates the linear and combined mappings of a single guest
+    /// virtual address that are tagged with this VPID (INVVPID type 0).
+    /// If VPID is disabled, this is a no-op as every VM entry and VM exit
+    /// already flushes the TLB.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param gva the guest virtual address to invalidate
+    ///
+    void invalidate_address(uint64_t gva);
+
+    /// Invalidate Context
+    ///
+    /// Invalidates the linear and combined mappings that are tagged with
+    /// this VPID (INVVPID type 1, or type 3 if retain_globals is true).
+    /// If VPID is disabled, this is a no-op as every VM entry and VM exit
+    /// already flushes the TLB.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param retain_globals if true, global translations are kept, which
+    ///     matches the behavior of a guest write to CR3
+    ///
+    void invalidate_context(bool retain_globals = false);
+
 private:
 
     vcpu *m_vcpu;
@@ -104,8 +231,18 @@ public:
 
     /// @cond
 
-    vpid_handler(vpid_handler &&) = default;
-    vpid_handler &operator=(vpid_handler &&) = default;
+    vpid_handler(vpid_handler &&other) noexcept :
+        m_vcpu{other.m_vcpu},
+        m_id{std::exchange(other.m_id, vpid_allocator::invalid_id)}
+    { }
+
+    vpid_handler &operator=(vpid_handler &&other) noexcept
+    {
+        std::swap(m_vcpu, other.m_vcpu);
+        std::swap(m_id, other.m_id);
+
+        return *this;
+    }
 
     vpid_handler(const vpid_handler &) = delete;
     vpid_handler &operator=(const vpid_handler &) = delete;
@@ -0,0 +1,324 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef VTD_DMA_REMAPPING_INTEL_X64_EAPIS_H
+#define VTD_DMA_REMAPPING_INTEL_X64_EAPIS_H
+
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "iommu_unit.h"
+#include "root_entry.h"
+#include "context_entry.h"
+#include "queued_invalidation.h"
+#include "second_level_table.h"
+
+#include "../ept/mmap.h"
+
+// -----------------------------------------------------------------------------
+// Exports
+// -----------------------------------------------------------------------------
+
+#include <bfexports.h>
+
+#ifndef STATIC_EAPIS_HVE
+#ifdef SHARED_EAPIS_HVE
+#define EXPORT_EAPIS_HVE EXPORT_SYM
+#else
+#define EXPORT_EAPIS_HVE IMPORT_SYM
+#endif
+#else
+#define EXPORT_EAPIS_HVE
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis::intel_x64::vtd
+{
+
+/// DMA Remapping
+///
+/// Builds the root and context tables of a DMA remapping hardware unit, and
+/// programs the unit to use them. A root table has one entry per bus, each of which points to a
+/// context table with one entry per device/function (devfn). Context tables
+/// are only allocated for buses that have a device assigned to them.
+///
+/// When the remapping hardware supports it, a device's context entry points
+/// directly at the PML4 of an existing ept::mmap, so the guest's DMA and the
+/// guest's CPU accesses share a single set of page tables. The EPT and VT-d
+/// second-level formats agree on the read, write and large page bits, and
+/// the bits that differ (memory type, accessed / dirty) are ignored by the
+/// remapping hardware. For this to be safe, the remapping hardware must:
+///
+/// - support a 4-level (48bit) adjusted guest address width (CAP.SAGAW[2])
+/// - support 2m second-level pages (CAP.SLLPS[0]), as ept::mmap uses them
+/// - snoop its page walks (ECAP.C), as ept::mmap does not flush the cache
+///   when it updates an entry
+///
+/// Invalidations are performed using the register based interface unless
+/// an enabled invalidation queue has been provided, in which case the
+/// context cache and IOTLB invalidations needed by a single update are
+/// submitted together and only waited on once.
+///
+class EXPORT_EAPIS_HVE dma_remapping
+{
+public:
+
+    using bus_type = uint64_t;                  ///< Bus type
+    using devfn_type = uint64_t;                ///< Device / function type
+    using did_type = uint64_t;                  ///< Domain ID type
+
+    /// Constructor
+    ///
+    /// Allocates an empty root table
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param unit the remapping hardware unit to program. The unit must
+    ///     outlive this object.
+    ///
+    explicit dma_remapping(iommu_unit &unit);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~dma_remapping() = default;
+
+public:
+
+    /// EPT Compatible
+    ///
+    /// The remapping hardware must support 4-level tables, 2m and 1g
+    /// pages (as an ept::mmap may contain both) and page-walk coherency.
+    ///
+    /// @return true if the remapping hardware can walk the page tables of
+    ///     an ept::mmap, false otherwise
+    ///
+    bool ept_compatible() const;
+
+    /// Assign Device
+    ///
+    /// Points the context entry of bus:devfn at the page tables of the
+    /// provided EPT memory map, which means that DMA from the device is
+    /// translated exactly like the guest's own memory accesses. The mmap
+    /// must outlive the assignment.
+    ///
+    /// @expects ept_compatible()
+    /// @expects bus < 256
+    /// @expects devfn < 256
+    /// @ensures
+    ///
+    /// @param bus the bus of the device
+    /// @param devfn the device / function of the device
+    /// @param did the domain id to tag the device's translations with.
+    ///     Every device that shares an mmap should use the same did.
+    /// @param map the EPT memory map to share with the device
+    ///
+    void assign_device(
+        bus_type bus, devfn_type devfn, did_type did, ept::mmap &map);
+
+    /// Assign Device (Second-Level Table)
+    ///
+    /// Points the context entry of bus:devfn at a set of second-level
+    /// page tables that were built for this unit. The table must outlive
+    /// the assignment.
+    ///
+    /// @expects bus < 256
+    /// @expects devfn < 256
+    /// @ensures
+    ///
+    /// @param bus the bus of the device
+    /// @param devfn the device / function of the device
+    /// @param did the domain id to tag the device's translations with.
+    ///     Every device that shares a table should use the same did.
+    /// @param table the second-level page tables to use
+    ///
+    void assign_device(
+        bus_type bus, devfn_type devfn, did_type did, second_level_table &table);
+
+    /// Assign Device (Pass Through)
+    ///
+    /// DMA from bus:devfn is not translated (ECAP.PT is required)
+    ///
+    /// @expects bus < 256
+    /// @expects devfn < 256
+    /// @ensures
+    ///
+    /// @param bus the bus of the device
+    /// @param devfn the device / function of the device
+    /// @param did the domain id of the device
+    ///
+    void assign_device_passthrough(
+        bus_type bus, devfn_type devfn, did_type did);
+
+    /// Remove Device
+    ///
+    /// Clears the context entry of bus:devfn (blocking all DMA from the
+    /// device) and invalidates any cached translations
+    ///
+    /// @expects bus < 256
+    /// @expects devfn < 256
+    /// @ensures
+    ///
+    /// @param bus the bus of the device
+    /// @param devfn the device / function of the device
+    ///
+    void remove_device(bus_type bus, devfn_type devfn);
+
+    /// Enable
+    ///
+    /// Programs the root table, invalidates the context cache and IOTLB,
+    /// and enables DMA remapping
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void enable();
+
+    /// Disable
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable();
+
+    /// Set Invalidation Queue
+    ///
+    /// Once the provided queue is enabled, every invalidation is performed
+    /// using it. The queue must outlive this object (or be unset).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param qi the invalidation queue of this remapping hardware unit,
+    ///     or nullptr to use the register based interface
+    ///
+    void set_invalidation_queue(queued_invalidation *qi);
+
+    /// Root Table Physical Address
+    ///
+    /// @return the physical address of the root table
+    ///
+    uintptr_t root_table_phys() const noexcept
+    { return m_root_phys; }
+
+    /// Get Context Entry
+    ///
+    /// @expects bus < 256
+    /// @expects devfn < 256
+    /// @ensures
+    ///
+    /// @param bus the bus of the device
+    /// @param devfn the device / function of the device
+    /// @return the context entry of bus:devfn (all zeros if the device
+    ///     has not been assigned)
+    ///
+    ::intel_x64::vtd::context_entry::value_type
+    get_context_entry(bus_type bus, devfn_type devfn) const;
+
+    /// Flush Context Cache
+    ///
+    /// Performs a global context cache invalidation
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void flush_context_cache();
+
+    /// Flush IOTLB
+    ///
+    /// Performs a global IOTLB invalidation
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void flush_iotlb();
+
+    /// Invalidate Domain
+    ///
+    /// Performs a domain selective IOTLB invalidation (using the
+    /// invalidation queue if it is enabled). The flush delegate of a
+    /// second_level_table should call this for each unit the table is
+    /// used with, so that the IOTLB is invalidated before the table frees
+    /// any of its pages.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param did the domain to invalidate
+    ///
+    void invalidate_domain(did_type did);
+
+private:
+
+    using page_ptr = std::unique_ptr<void, void(*)(void *)>;
+
+    ::intel_x64::vtd::context_entry::value_type &
+    context_entry_ref(bus_type bus, devfn_type devfn);
+
+    void set_context_entry(
+        bus_type bus, devfn_type devfn,
+        const ::intel_x64::vtd::context_entry::value_type &entry);
+
+    void flush_tables();
+    void invalidate_all();
+    void invalidate_device(did_type did, uint64_t sid);
+
+    bool use_qi() const noexcept
+    { return m_qi != nullptr && m_qi->enabled(); }
+
+    void flush_context_cache(uint64_t cirg, did_type did, uint64_t sid);
+    void flush_iotlb(uint64_t iirg, did_type did);
+
+private:
+
+    iommu_unit &m_unit;
+
+    page_ptr m_root;
+    uintptr_t m_root_phys;
+
+    std::unordered_map<bus_type, page_ptr> m_context_tables;
+    queued_invalidation *m_qi{nullptr};
+
+    mutable std::mutex m_mutex;
+
+public:
+
+    /// @cond
+
+    dma_remapping(dma_remapping &&) = delete;
+    dma_remapping &operator=(dma_remapping &&) = delete;
+
+    dma_remapping(const dma_remapping &) = delete;
+    dma_remapping &operator=(const dma_remapping &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
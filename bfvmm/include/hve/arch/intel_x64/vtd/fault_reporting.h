@@ -0,0 +1,236 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef VTD_FAULT_REPORTING_INTEL_X64_EAPIS_H
+#define VTD_FAULT_REPORTING_INTEL_X64_EAPIS_H
+
+#include <mutex>
+#include <unordered_map>
+
+#include "iommu_unit.h"
+
+// -----------------------------------------------------------------------------
+// Exports
+// -----------------------------------------------------------------------------
+
+#include <bfexports.h>
+
+#ifndef STATIC_EAPIS_HVE
+#ifdef SHARED_EAPIS_HVE
+#define EXPORT_EAPIS_HVE EXPORT_SYM
+#else
+#define EXPORT_EAPIS_HVE IMPORT_SYM
+#endif
+#else
+#define EXPORT_EAPIS_HVE
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis::intel_x64::vtd
+{
+
+/// Fault Reporting
+///
+/// Drains the primary fault recording registers of a remapping hardware
+/// unit, and keeps a counter for each (source id, fault reason) pair that
+/// has been seen.
+///
+/// A misbehaving device can fault millions of times per second, so faults
+/// are never logged one by one. Instead, log output is limited by a token
+/// bucket: at most "burst" faults are logged per "interval" ns, and the
+/// number of faults that were not logged is reported with the next line
+/// that is. The counters are always updated, and can be printed using
+/// dump().
+///
+/// Like the timer wheel, this class never reads the time itself. The
+/// caller provides the current time (in ns) to drain().
+///
+class EXPORT_EAPIS_HVE fault_reporting
+{
+public:
+
+    using sid_type = uint64_t;                  ///< Source ID type
+    using reason_type = uint64_t;               ///< Fault reason type
+
+    /// Stats
+    ///
+    /// The aggregated faults of a single (source id, fault reason) pair
+    ///
+    struct stats_t {
+        uint64_t count;         ///< Number of faults
+        uint64_t last_fi;       ///< Fault info (page) of the last fault
+        bool last_write;        ///< True if the last fault was a write
+        uint64_t first_ns;      ///< Time of the first fault
+        uint64_t last_ns;       ///< Time of the last fault
+    };
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param unit the remapping hardware unit to drain. The unit must
+    ///     outlive this object.
+    /// @param burst the maximum number of faults that are logged per
+    ///     interval
+    /// @param interval_ns the length of an interval in ns
+    ///
+    explicit fault_reporting(
+        iommu_unit &unit, uint64_t burst = 10, uint64_t interval_ns = 1000000000ULL);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~fault_reporting() = default;
+
+    /// Drain
+    ///
+    /// Reads and clears every pending primary fault record in one pass,
+    /// starting at FSTS.FRI, and clears FSTS.PFO if the hardware had to
+    /// drop faults because every record was full.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param now_ns the current time in ns
+    /// @return the number of fault records that were drained
+    ///
+    std::size_t drain(uint64_t now_ns);
+
+    /// Count
+    ///
+    /// @param sid the source id (bus:devfn) of the faulting device
+    /// @param reason the fault reason
+    /// @return the number of faults seen for this (sid, reason) pair
+    ///
+    uint64_t count(sid_type sid, reason_type reason) const;
+
+    /// Stats
+    ///
+    /// @param sid the source id (bus:devfn) of the faulting device
+    /// @param reason the fault reason
+    /// @return the aggregated faults of this (sid, reason) pair (all
+    ///     zeros if none have been seen)
+    ///
+    stats_t stats(sid_type sid, reason_type reason) const;
+
+    /// Total
+    ///
+    /// @return the number of faults that have been drained
+    ///
+    uint64_t total() const noexcept
+    { return m_total; }
+
+    /// Overflows
+    ///
+    /// @return the number of times the hardware reported that faults were
+    ///     dropped (FSTS.PFO)
+    ///
+    uint64_t overflows() const noexcept
+    { return m_overflows; }
+
+    /// Logged
+    ///
+    /// @return the number of faults that have been logged
+    ///
+    uint64_t logged() const noexcept
+    { return m_logged; }
+
+    /// Suppressed
+    ///
+    /// @return the number of faults that were not logged due to rate
+    ///     limiting
+    ///
+    uint64_t suppressed() const noexcept
+    { return m_suppressed_total; }
+
+    /// Clear
+    ///
+    /// Resets every counter
+    ///
+    void clear();
+
+    /// Dump
+    ///
+    /// Prints the counters of every (source id, fault reason) pair
+    ///
+    /// @param level the debug level to use
+    ///
+    void dump(int level = 0) const;
+
+    /// Reason To String
+    ///
+    /// @param reason the fault reason
+    /// @return a description of the fault reason
+    ///
+    static const char *reason_to_str(reason_type reason) noexcept;
+
+private:
+
+    bool take_token(uint64_t now_ns) noexcept;
+    void record(const ::intel_x64::vtd::iommu::frr::value_type &frr, uint64_t now_ns);
+
+    static uint64_t key(sid_type sid, reason_type reason) noexcept
+    { return (sid << 8U) | (reason & 0xFFU); }
+
+private:
+
+    iommu_unit &m_unit;
+
+    uint64_t m_fro;
+    uint64_t m_nfr;
+
+    uint64_t m_burst;
+    uint64_t m_interval_ns;
+    uint64_t m_tokens;
+    uint64_t m_interval_start{0};
+
+    uint64_t m_total{0};
+    uint64_t m_overflows{0};
+    uint64_t m_logged{0};
+    uint64_t m_suppressed{0};
+    uint64_t m_suppressed_total{0};
+
+    std::unordered_map<uint64_t, stats_t> m_stats;
+    mutable std::mutex m_mutex;
+
+public:
+
+    /// @cond
+
+    fault_reporting(fault_reporting &&) = delete;
+    fault_reporting &operator=(fault_reporting &&) = delete;
+
+    fault_reporting(const fault_reporting &) = delete;
+    fault_reporting &operator=(const fault_reporting &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
@@ -0,0 +1,272 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef VTD_INTERRUPT_REMAPPING_INTEL_X64_EAPIS_H
+#define VTD_INTERRUPT_REMAPPING_INTEL_X64_EAPIS_H
+
+#include <array>
+#include <memory>
+#include <mutex>
+
+#include "iommu_unit.h"
+#include "irte.h"
+#include "pid.h"
+#include "queued_invalidation.h"
+
+// -----------------------------------------------------------------------------
+// Exports
+// -----------------------------------------------------------------------------
+
+#include <bfexports.h>
+
+#ifndef STATIC_EAPIS_HVE
+#ifdef SHARED_EAPIS_HVE
+#define EXPORT_EAPIS_HVE EXPORT_SYM
+#else
+#define EXPORT_EAPIS_HVE IMPORT_SYM
+#endif
+#else
+#define EXPORT_EAPIS_HVE
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis::intel_x64::vtd
+{
+
+/// Interrupt Remapping
+///
+/// Manages the interrupt remapping table (IRT) of a remapping hardware
+/// unit. The table is a single page of 256 interrupt remapping table
+/// entries (IRTEs), which are
+/// handed out by a bitmap allocator, either one at a time or as a
+/// naturally aligned block for multi-message MSI.
+///
+/// An IRTE can either be remapped, in which case the interrupt is
+/// delivered to a physical APIC, or posted, in which case the interrupt is
+/// recorded in a posted interrupt descriptor (PID) and a notification is
+/// sent to the physical CPU the PID names. With one PID per vCPU, a device
+/// assigned to a guest can interrupt the guest without a VM exit.
+///
+/// Once an entry is present, the hardware can read it at any time, so
+/// every update to a present entry (including retargeting a posted entry
+/// to another PID when a vCPU migrates) is done with a single 128bit
+/// compare exchange, followed by an interrupt entry cache invalidation
+/// through the provided invalidation queue.
+///
+class EXPORT_EAPIS_HVE interrupt_remapping
+{
+public:
+
+    using index_type = uint64_t;                ///< IRTE index type
+    using sid_type = uint64_t;                  ///< Source ID type
+
+    /// Number of Entries
+    ///
+    constexpr static index_type num_entries = 256;
+
+    /// Constructor
+    ///
+    /// Allocates an empty interrupt remapping table
+    ///
+    /// @expects ECAP.IR == 1
+    /// @ensures
+    ///
+    /// @param unit the remapping hardware unit to program. The unit must
+    ///     outlive this object.
+    /// @param qi the invalidation queue of the same remapping hardware
+    ///     unit. The queue must outlive this object.
+    ///
+    interrupt_remapping(iommu_unit &unit, queued_invalidation &qi);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~interrupt_remapping() = default;
+
+public:
+
+    /// Enable
+    ///
+    /// Programs the table address, invalidates the interrupt entry cache
+    /// and enables interrupt remapping
+    ///
+    /// @expects the invalidation queue is enabled
+    /// @ensures
+    ///
+    /// @param x2apic if true, destination IDs are 32bit x2APIC IDs,
+    ///     otherwise they are 8bit xAPIC IDs
+    ///
+    void enable(bool x2apic = true);
+
+    /// Disable
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable();
+
+    /// Allocate
+    ///
+    /// Allocates a naturally aligned block of count entries. The entries
+    /// are not present until they are mapped.
+    ///
+    /// @expects count is a power of 2 <= 32
+    /// @ensures
+    ///
+    /// @param count the number of entries to allocate
+    /// @return the index of the first entry
+    ///
+    index_type allocate(index_type count = 1);
+
+    /// Free
+    ///
+    /// Clears and frees a block of entries that was returned by
+    /// allocate()
+    ///
+    /// @expects index / count were returned / passed to allocate()
+    /// @ensures
+    ///
+    /// @param index the index of the first entry
+    /// @param count the number of entries in the block
+    ///
+    void free(index_type index, index_type count = 1);
+
+    /// Map Remapped
+    ///
+    /// Sets an entry to deliver a fixed, edge triggered interrupt to a
+    /// physical APIC
+    ///
+    /// @expects index is allocated
+    /// @ensures
+    ///
+    /// @param index the entry to set
+    /// @param sid the source id (bus:devfn) the interrupt must come from
+    /// @param vector the vector to deliver
+    /// @param dst the (x2)APIC ID of the destination CPU
+    ///
+    void map_remapped(
+        index_type index, sid_type sid, uint64_t vector, uint64_t dst);
+
+    /// Map Posted
+    ///
+    /// Sets an entry to post the interrupt to a posted interrupt
+    /// descriptor
+    ///
+    /// @expects index is allocated
+    /// @expects ECAP.PI == 1
+    /// @expects pid is 64 byte aligned
+    /// @ensures
+    ///
+    /// @param index the entry to set
+    /// @param sid the source id (bus:devfn) the interrupt must come from
+    /// @param vector the (virtual) vector to post
+    /// @param pid the PID of the vCPU to post the interrupt to. The PID
+    ///     must remain mapped for as long as the entry uses it.
+    /// @param urgent if true, notifications are sent even when the PID
+    ///     suppresses them
+    ///
+    void map_posted(
+        index_type index, sid_type sid, uint64_t vector,
+        const ::intel_x64::vtd::pid::value_type &pid, bool urgent = false);
+
+    /// Retarget
+    ///
+    /// Atomically points a posted entry at a different PID. The vector,
+    /// source id and urgency of the entry are preserved.
+    ///
+    /// @expects index is a posted entry
+    /// @expects pid is 64 byte aligned
+    /// @ensures
+    ///
+    /// @param index the entry to retarget
+    /// @param pid the PID of the vCPU to post the interrupt to
+    ///
+    void retarget(
+        index_type index, const ::intel_x64::vtd::pid::value_type &pid);
+
+    /// Get Entry
+    ///
+    /// @expects index < num_entries
+    /// @ensures
+    ///
+    /// @param index the entry to get
+    /// @return a copy of the entry
+    ///
+    ::intel_x64::vtd::irte::value_type get_entry(index_type index) const;
+
+    /// Allocated
+    ///
+    /// @param index the entry to check
+    /// @return true if the entry is allocated, false otherwise
+    ///
+    bool allocated(index_type index) const;
+
+    /// Table Physical Address
+    ///
+    /// @return the physical address of the interrupt remapping table
+    ///
+    uintptr_t table_phys() const noexcept
+    { return m_table_phys; }
+
+private:
+
+    using page_ptr = std::unique_ptr<void, void(*)(void *)>;
+
+    volatile ::intel_x64::vtd::irte::value_type *entry(index_type index) const;
+
+    void set_entry(index_type index, const ::intel_x64::vtd::irte::value_type &irte);
+    void invalidate(index_type index, uint64_t im);
+
+private:
+
+    iommu_unit &m_unit;
+    queued_invalidation &m_qi;
+
+    bool m_x2apic{true};
+
+    page_ptr m_table;
+    uintptr_t m_table_phys;
+
+    std::array<uint64_t, num_entries / 64> m_bitmap{};
+    mutable std::mutex m_mutex;
+
+public:
+
+    /// @cond
+
+    interrupt_remapping(interrupt_remapping &&) = delete;
+    interrupt_remapping &operator=(interrupt_remapping &&) = delete;
+
+    interrupt_remapping(const interrupt_remapping &) = delete;
+    interrupt_remapping &operator=(const interrupt_remapping &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
@@ -2385,7 +2385,7 @@ namespace frr
 
     namespace sid
     {
-		constexpr const auto mask = 0xF000ULL;
+		constexpr const auto mask = 0xFFFFULL;
 		constexpr const auto index = 1ULL;
 		constexpr const auto from = 0;
 		constexpr const auto name = "source_identifier";
@@ -2453,7 +2453,7 @@ namespace frr
 
     namespace fr
     {
-		constexpr const auto mask = 0xFF0000000ULL;
+		constexpr const auto mask = 0xFF00000000ULL;
 		constexpr const auto index = 1ULL;
 		constexpr const auto from = 32;
 		constexpr const auto name = "fault_reason";
@@ -2969,6 +2969,9 @@ namespace iqt_reg
 	inline auto get() noexcept
 	{ return read_64(offset); }
 
+	inline auto set(value_type val) noexcept
+	{ return write_64(offset, val); }
+
 	namespace qt
 	{
 		constexpr const auto mask = 0x7FFF0ULL;
@@ -2981,6 +2984,12 @@ namespace iqt_reg
 		inline auto get(const value_type &iqt_reg) noexcept
 		{ return get_bits(iqt_reg, mask) >> from; }
 
+		inline void set(uint64_t val) noexcept
+		{ set(set_bits(read_64(offset), mask, val << from)); }
+
+		inline void set(value_type &iqt_reg, uint64_t val) noexcept
+		{ iqt_reg = set_bits(iqt_reg, mask, val << from); }
+
 		inline void dump(int level, const value_type &iqt_reg, std::string *msg = nullptr)
 		{ bfdebug_subnhex(level, name, get(iqt_reg), msg); }
 	}
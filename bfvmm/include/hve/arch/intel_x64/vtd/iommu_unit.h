@@ -0,0 +1,304 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef VTD_IOMMU_UNIT_INTEL_X64_EAPIS_H
+#define VTD_IOMMU_UNIT_INTEL_X64_EAPIS_H
+
+#include <stdexcept>
+
+#include "iommu.h"
+#include "../../x64/unmapper.h"
+
+// -----------------------------------------------------------------------------
+// Exports
+// -----------------------------------------------------------------------------
+
+#include <bfexports.h>
+
+#ifndef STATIC_EAPIS_HVE
+#ifdef SHARED_EAPIS_HVE
+#define EXPORT_EAPIS_HVE EXPORT_SYM
+#else
+#define EXPORT_EAPIS_HVE IMPORT_SYM
+#endif
+#else
+#define EXPORT_EAPIS_HVE
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis::intel_x64::vtd
+{
+
+/// IOMMU Unit
+///
+/// A single DMA remapping hardware unit (a DRHD in the ACPI DMAR table).
+/// Each unit owns the uncached mapping of its own register set, so any
+/// number of units can be driven at the same time, and the register
+/// offsets and field helpers in iommu.h are used to decode the values that
+/// are read.
+///
+/// The capability and extended capability registers never change, so they
+/// are read once when the unit is created and cached, which means that
+/// checking a capability never touches MMIO.
+///
+/// A unit can also be created on top of memory that is already mapped,
+/// such as an in-memory fake register file in a unit test, in which case
+/// nothing is mapped or unmapped.
+///
+class EXPORT_EAPIS_HVE iommu_unit
+{
+public:
+
+    using offset_type = uint32_t;               ///< Register offset type
+
+    /// Snapshot
+    ///
+    /// The state of the unit's architectural registers at one point in
+    /// time
+    ///
+    struct snapshot_t {
+        uint32_t ver;           ///< Version register
+        uint64_t cap;           ///< Capability register
+        uint64_t ecap;          ///< Extended capability register
+        uint32_t gsts;          ///< Global status register
+        uint64_t rtaddr;        ///< Root table address register
+        uint32_t fsts;          ///< Fault status register
+        uint32_t fectl;         ///< Fault event control register
+        uint64_t iqh;           ///< Invalidation queue head register
+        uint64_t iqt;           ///< Invalidation queue tail register
+        uint64_t iqa;           ///< Invalidation queue address register
+        uint32_t ics;           ///< Invalidation completion status register
+        uint64_t irta;          ///< Interrupt remapping table address register
+    };
+
+    /// Constructor (Map)
+    ///
+    /// Maps the register set of the unit located at hpa (the register base
+    /// address of a DRHD structure). The size of the mapping is based on
+    /// the location of the IOTLB and fault recording registers.
+    ///
+    /// @expects hpa != 0
+    /// @expects hpa is 4k page aligned
+    /// @ensures
+    ///
+    /// @param hpa the host physical address of the register set
+    ///
+    explicit iommu_unit(uintptr_t hpa);
+
+    /// Constructor (Existing Memory)
+    ///
+    /// Uses already mapped memory as the register set. The memory must
+    /// outlive the unit.
+    ///
+    /// @expects regs != nullptr
+    /// @expects size >= 0x1000
+    /// @ensures
+    ///
+    /// @param regs the register set
+    /// @param size the size of the register set in bytes
+    ///
+    iommu_unit(void *regs, std::size_t size);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~iommu_unit() = default;
+
+public:
+
+    /// Read (32bit)
+    ///
+    /// @expects offset + 4 <= size()
+    /// @ensures
+    ///
+    /// @param offset the register's offset from the base of the unit
+    /// @return the value of the register
+    ///
+    uint32_t read_32(offset_type offset) const;
+
+    /// Read (64bit)
+    ///
+    /// @expects offset + 8 <= size()
+    /// @ensures
+    ///
+    /// @param offset the register's offset from the base of the unit
+    /// @return the value of the register
+    ///
+    uint64_t read_64(offset_type offset) const;
+
+    /// Write (32bit)
+    ///
+    /// @expects offset + 4 <= size()
+    /// @ensures
+    ///
+    /// @param offset the register's offset from the base of the unit
+    /// @param val the value to write
+    ///
+    void write_32(offset_type offset, uint32_t val);
+
+    /// Write (64bit)
+    ///
+    /// @expects offset + 8 <= size()
+    /// @ensures
+    ///
+    /// @param offset the register's offset from the base of the unit
+    /// @param val the value to write
+    ///
+    void write_64(offset_type offset, uint64_t val);
+
+    /// Capability Register
+    ///
+    /// @return the (cached) value of the capability register
+    ///
+    uint64_t cap() const noexcept
+    { return m_cap; }
+
+    /// Extended Capability Register
+    ///
+    /// @return the (cached) value of the extended capability register
+    ///
+    uint64_t ecap() const noexcept
+    { return m_ecap; }
+
+    /// Global Status Register
+    ///
+    /// @return the value of the global status register
+    ///
+    uint32_t gsts() const
+    { return this->read_32(::intel_x64::vtd::iommu::gsts_reg::offset); }
+
+    /// Global Command (Set)
+    ///
+    /// Sets a bit in the global command register. As the global command
+    /// register cannot be read, the current state of every persistent
+    /// command bit is taken from the global status register.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param bit the command bit (as a mask) to set
+    ///
+    void gcmd_set(uint32_t bit);
+
+    /// Global Command (Clear)
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param bit the command bit (as a mask) to clear
+    ///
+    void gcmd_clear(uint32_t bit);
+
+    /// Wait For
+    ///
+    /// Spins until f() returns true
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param f the condition to wait for
+    /// @param what the error reported if the condition is never met
+    ///
+    template<typename F>
+    static void wait_for(F f, const char *what)
+    {
+        for (auto loops = 0ULL; !f(); loops++) {
+            if (loops > max_spin_loops) {
+                throw std::runtime_error(what);
+            }
+        }
+    }
+
+    /// Snapshot
+    ///
+    /// @return the current state of the unit's architectural registers
+    ///
+    snapshot_t snapshot() const;
+
+    /// Dump
+    ///
+    /// Prints a snapshot of the unit's registers
+    ///
+    /// @param level the debug level to use
+    ///
+    void dump(int level = 0) const;
+
+    /// Host Physical Address
+    ///
+    /// @return the host physical address of the unit (0 if the unit was
+    ///     created on top of existing memory)
+    ///
+    uintptr_t hpa() const noexcept
+    { return m_hpa; }
+
+    /// Host Virtual Address
+    ///
+    /// @return the address the unit's registers are accessed through
+    ///
+    uintptr_t hva() const noexcept
+    { return reinterpret_cast<uintptr_t>(m_regs); }
+
+    /// Size
+    ///
+    /// @return the size of the unit's register set in bytes
+    ///
+    std::size_t size() const noexcept
+    { return m_size; }
+
+private:
+
+    constexpr static uint64_t max_spin_loops = 0x10000000ULL;
+
+    std::size_t register_set_size() const noexcept;
+
+private:
+
+    uintptr_t m_hpa{0};
+    volatile uint8_t *m_regs{nullptr};
+    std::size_t m_size{0};
+
+    uint64_t m_cap{0};
+    uint64_t m_ecap{0};
+
+    x64::unique_map<uint8_t> m_map{nullptr, x64::unmapper{}};
+
+public:
+
+    /// @cond
+
+    iommu_unit(iommu_unit &&) = delete;
+    iommu_unit &operator=(iommu_unit &&) = delete;
+
+    iommu_unit(const iommu_unit &) = delete;
+    iommu_unit &operator=(const iommu_unit &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
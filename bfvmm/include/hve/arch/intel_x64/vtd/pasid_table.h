@@ -0,0 +1,359 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef VTD_PASID_TABLE_INTEL_X64_EAPIS_H
+#define VTD_PASID_TABLE_INTEL_X64_EAPIS_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "extended_context_entry.h"
+#include "iommu_unit.h"
+#include "pasid_entry.h"
+#include "pasid_state_entry.h"
+#include "queued_invalidation.h"
+
+#include "../ept/mmap.h"
+
+// -----------------------------------------------------------------------------
+// Exports
+// -----------------------------------------------------------------------------
+
+#include <bfexports.h>
+
+#ifndef STATIC_EAPIS_HVE
+#ifdef SHARED_EAPIS_HVE
+#define EXPORT_EAPIS_HVE EXPORT_SYM
+#else
+#define EXPORT_EAPIS_HVE IMPORT_SYM
+#endif
+#else
+#define EXPORT_EAPIS_HVE
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis::intel_x64::vtd
+{
+
+/// PASID Table
+///
+/// Manages the PASID table and the PASID state table of a device (or a
+/// group of devices sharing a domain) in extended context mode. Binding a
+/// PASID to a process's CR3 lets the device walk the process's own
+/// (first-level) page tables, so the device can DMA directly into user
+/// buffers without pinning or copying them.
+///
+/// A guest's CR3, and its page tables, hold guest physical addresses. To
+/// bind a guest process, the extended context entry must therefore be set
+/// up with nested translation (see setup_nested_context_entry), so that
+/// the hardware translates them using the guest's EPT. Without it, CR3 is
+/// treated as a host physical address, which only works for host
+/// processes and identity mapped guests.
+///
+/// Both tables are a single page, so up to 512 PASIDs are supported (or
+/// fewer if ECAP.PSS reports a smaller PASID width).
+///
+/// Whenever a present PASID entry is changed, the PASID cache and the
+/// extended IOTLB of the PASID must be invalidated. If the hardware
+/// supports deferred invalidation (ECAP.DIS), and no device is currently
+/// using the PASID (i.e. the active reference count of its state entry is
+/// 0), the DINV bit of the state entry is set instead, and the hardware
+/// invalidates the PASID itself the next time a device starts using it.
+/// This avoids a round trip through the invalidation queue for PASIDs of
+/// processes that are not currently running on the device.
+///
+/// Devices with ATS enabled cache translations in their own device-TLB,
+/// which the remapping hardware does not invalidate on its own. Once such
+/// a device is registered (see enable_ats), every invalidation also sends
+/// an extended device-TLB invalidation to it, and is never deferred.
+///
+class EXPORT_EAPIS_HVE pasid_table
+{
+public:
+
+    using pasid_type = uint64_t;                ///< PASID type
+    using did_type = uint64_t;                  ///< Domain ID type
+    using sid_type = uint64_t;                  ///< Source ID type
+
+    /// Number of Entries
+    ///
+    constexpr static pasid_type num_entries = 512;
+
+    /// Constructor
+    ///
+    /// Allocates an empty PASID table and PASID state table
+    ///
+    /// @expects ECAP.ECS == 1
+    /// @expects ECAP.PASID == 1
+    /// @ensures
+    ///
+    /// @param unit the remapping hardware unit the tables are used by.
+    ///     The unit must outlive this object.
+    /// @param qi the invalidation queue of the same remapping hardware
+    ///     unit. The queue must outlive this object.
+    /// @param did the domain of the extended context entries that will
+    ///     point to these tables
+    ///
+    pasid_table(iommu_unit &unit, queued_invalidation &qi, did_type did);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~pasid_table() = default;
+
+public:
+
+    /// Bind
+    ///
+    /// Points a PASID at the first-level (4-level IA-32e) page tables
+    /// rooted at cr3. The PWT and PCD bits of the PASID entry are taken
+    /// from cr3. If the PASID was already bound, it is rebound and
+    /// invalidated.
+    ///
+    /// @expects pasid < size()
+    /// @expects ECAP.SRS == 1 if supervisor is true
+    /// @ensures
+    ///
+    /// @param pasid the PASID to bind
+    /// @param cr3 the process's CR3 (the physical address of its PML4).
+    ///     This is a guest physical address if the context entry uses
+    ///     nested translation, and a host physical address otherwise.
+    /// @param supervisor if true, supervisor requests are allowed
+    ///
+    void bind(pasid_type pasid, uint64_t cr3, bool supervisor = false);
+
+    /// Unbind
+    ///
+    /// Clears a PASID entry and invalidates it. Unbinding a PASID that is
+    /// not bound is not an error.
+    ///
+    /// @expects pasid < size()
+    /// @ensures
+    ///
+    /// @param pasid the PASID to unbind
+    ///
+    void unbind(pasid_type pasid);
+
+    /// Bound
+    ///
+    /// @expects pasid < size()
+    /// @ensures
+    ///
+    /// @param pasid the PASID to check
+    /// @return true if the PASID is bound, false otherwise
+    ///
+    bool bound(pasid_type pasid) const;
+
+    /// Invalidate
+    ///
+    /// Invalidates the cached translations of a PASID. The invalidation
+    /// is deferred if the hardware supports it and the PASID is not in
+    /// use, otherwise the PASID cache and extended IOTLB are invalidated
+    /// through the invalidation queue.
+    ///
+    /// @expects pasid < size()
+    /// @expects the invalidation queue is enabled (if not deferred)
+    /// @ensures
+    ///
+    /// @param pasid the PASID to invalidate
+    /// @return true if the invalidation was deferred, false otherwise
+    ///
+    bool invalidate(pasid_type pasid);
+
+    /// Enable ATS
+    ///
+    /// Registers a device that uses these tables and has ATS enabled, so
+    /// that its device-TLB is invalidated along with the remapping
+    /// hardware's caches. The device's (extended) context entry must also
+    /// have DTE set.
+    ///
+    /// @expects ECAP.DT == 1
+    /// @expects fewer than max_ats_devices devices are registered
+    /// @ensures
+    ///
+    /// @param sid the source ID of the device
+    /// @param qdep the invalidate queue depth of the device (from its ATS
+    ///     capability), or 0 if it is 32
+    ///
+    void enable_ats(sid_type sid, uint64_t qdep = 0);
+
+    /// Max ATS Devices
+    ///
+    /// The number of ATS devices an invalidation can reach in one batch
+    /// (along with the PASID cache and extended IOTLB invalidations)
+    ///
+    constexpr static std::size_t max_ats_devices =
+        queued_invalidation::max_batch_size - 2;
+
+    /// Setup Context Entry
+    ///
+    /// Points an extended context entry at these tables. Only the PASID
+    /// related fields are modified.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param ece the extended context entry to set up
+    ///
+    void setup_context_entry(::intel_x64::vtd::extended_context_entry::value_type &ece) const;
+
+    /// Setup Nested Context Entry
+    ///
+    /// Same as setup_context_entry(), but also enables nested translation
+    /// with the guest's EPT as the second level, so that the guest
+    /// physical addresses of bound CR3s (and of the guest's first-level
+    /// tables) are translated exactly like the guest's own accesses. The
+    /// map must outlive the context entry.
+    ///
+    /// @expects ECAP.NEST == 1
+    /// @expects the unit can walk the map (see
+    ///     dma_remapping::ept_compatible)
+    /// @ensures
+    ///
+    /// @param ece the extended context entry to set up
+    /// @param guest the EPT memory map of the guest that owns the PASIDs
+    ///
+    void setup_nested_context_entry(
+        ::intel_x64::vtd::extended_context_entry::value_type &ece, ept::mmap &guest) const;
+
+    /// Size
+    ///
+    /// @return the number of usable PASIDs
+    ///
+    pasid_type size() const noexcept
+    { return m_size; }
+
+    /// Domain ID
+    ///
+    /// @return the domain ID of the tables
+    ///
+    did_type did() const noexcept
+    { return m_did; }
+
+    /// Deferred
+    ///
+    /// @return the number of invalidations that were deferred to the
+    ///     hardware instead of being sent through the invalidation queue
+    ///
+    uint64_t deferred() const noexcept
+    { return m_deferred.load(); }
+
+    /// Table Physical Address
+    ///
+    /// @return the physical address of the PASID table
+    ///
+    uintptr_t table_phys() const noexcept
+    { return m_table_phys; }
+
+    /// State Table Physical Address
+    ///
+    /// @return the physical address of the PASID state table
+    ///
+    uintptr_t state_table_phys() const noexcept
+    { return m_state_phys; }
+
+    /// Entry
+    ///
+    /// @expects pasid < size()
+    /// @ensures
+    ///
+    /// @param pasid the PASID of the entry
+    /// @return the PASID entry
+    ///
+    ::intel_x64::vtd::pasid_entry::value_type entry(pasid_type pasid) const;
+
+    /// State Entry
+    ///
+    /// @expects pasid < size()
+    /// @ensures
+    ///
+    /// @param pasid the PASID of the entry
+    /// @return the PASID state entry
+    ///
+    ::intel_x64::vtd::pasid_state_entry::value_type state_entry(pasid_type pasid) const;
+
+private:
+
+    using page_ptr = std::unique_ptr<void, void(*)(void *)>;
+
+    uint64_t *table() const noexcept
+    { return static_cast<uint64_t *>(m_table.get()); }
+
+    uint64_t *state_table() const noexcept
+    { return static_cast<uint64_t *>(m_state.get()); }
+
+    void write(pasid_type pasid, ::intel_x64::vtd::pasid_entry::value_type val);
+
+    // Writes [ptr, ptr + size) back to memory, if the hardware does not
+    // snoop the cache (ECAP.C == 0)
+    //
+    void flush_cache(const void *ptr, std::size_t size) const;
+
+    struct ats_device_t {
+        sid_type sid;
+        uint64_t qdep;
+    };
+
+private:
+
+    iommu_unit &m_unit;
+    queued_invalidation &m_qi;
+    did_type m_did;
+
+    pasid_type m_size;
+    bool m_dis;
+
+    page_ptr m_table;
+    uintptr_t m_table_phys;
+
+    page_ptr m_state;
+    uintptr_t m_state_phys;
+
+    std::atomic<uint64_t> m_deferred{0};
+    mutable std::mutex m_mutex;
+
+    std::vector<ats_device_t> m_ats_devices;
+    mutable std::mutex m_ats_mutex;
+
+public:
+
+    /// @cond
+
+    pasid_table(pasid_table &&) = delete;
+    pasid_table &operator=(pasid_table &&) = delete;
+
+    pasid_table(const pasid_table &) = delete;
+    pasid_table &operator=(const pasid_table &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
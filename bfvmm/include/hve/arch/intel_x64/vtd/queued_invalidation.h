@@ -0,0 +1,448 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef VTD_QUEUED_INVALIDATION_INTEL_X64_EAPIS_H
+#define VTD_QUEUED_INVALIDATION_INTEL_X64_EAPIS_H
+
+#include <array>
+#include <atomic>
+#include <memory>
+
+#include "iommu_unit.h"
+
+// -----------------------------------------------------------------------------
+// Exports
+// -----------------------------------------------------------------------------
+
+#include <bfexports.h>
+
+#ifndef STATIC_EAPIS_HVE
+#ifdef SHARED_EAPIS_HVE
+#define EXPORT_EAPIS_HVE EXPORT_SYM
+#else
+#define EXPORT_EAPIS_HVE IMPORT_SYM
+#endif
+#else
+#define EXPORT_EAPIS_HVE
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis::intel_x64::vtd
+{
+
+/// Queued Invalidation
+///
+/// Manages the invalidation queue of a remapping hardware unit. The queue is
+/// a single page ring of 256 128bit descriptors.
+///
+/// Invalidations are collected into a batch, and each batch is appended to
+/// the queue followed by a single invalidation wait descriptor that writes
+/// a status word once the hardware has processed every descriptor before
+/// it. Callers therefore only wait once per batch, instead of once per
+/// invalidation as is the case with the register based interface.
+///
+/// Appending does not take a lock. Space in the ring is reserved with an
+/// atomic add, the descriptors are written in parallel, and the tail
+/// register is then advanced in reservation order, so any number of CPUs
+/// can post batches at the same time.
+///
+/// Note that once queued invalidation is enabled, the register based
+/// invalidation interface must not be used.
+///
+class EXPORT_EAPIS_HVE queued_invalidation
+{
+public:
+
+    using did_type = uint64_t;                  ///< Domain ID type
+    using sid_type = uint64_t;                  ///< Source ID type
+    using pasid_type = uint64_t;                ///< PASID type
+    using ticket_type = uint64_t;               ///< Completion ticket type
+
+    /// Descriptor
+    ///
+    /// A 128bit invalidation descriptor
+    ///
+    struct descriptor_t {
+        uint64_t lo;        ///< Bits 63:0
+        uint64_t hi;        ///< Bits 127:64
+    };
+
+    /// Max Batch Size
+    ///
+    /// The maximum number of descriptors in a single batch (not including
+    /// the wait descriptor that is added when the batch is posted)
+    ///
+    constexpr static std::size_t max_batch_size = 32;
+
+    /// Batch
+    ///
+    /// A list of invalidation descriptors that complete together. Page
+    /// selective IOTLB invalidations are encoded using the capabilities
+    /// of the queue the batch was created from.
+    ///
+    class EXPORT_EAPIS_HVE batch
+    {
+    public:
+
+        /// Constructor
+        ///
+        /// @expects
+        /// @ensures
+        ///
+        /// @param qi the queue this batch will be posted to
+        ///
+        explicit batch(const queued_invalidation &qi) noexcept;
+
+        /// Context Cache Invalidate (Global)
+        ///
+        /// @expects size() < max_batch_size
+        /// @ensures
+        ///
+        void context_global();
+
+        /// Context Cache Invalidate (Domain)
+        ///
+        /// @expects size() < max_batch_size
+        /// @ensures
+        ///
+        /// @param did the domain to invalidate
+        ///
+        void context_domain(did_type did);
+
+        /// Context Cache Invalidate (Device)
+        ///
+        /// @expects size() < max_batch_size
+        /// @ensures
+        ///
+        /// @param did the domain the device was assigned to
+        /// @param sid the source id (bus:devfn) of the device
+        /// @param fm the function mask
+        ///
+        void context_device(did_type did, sid_type sid, uint64_t fm = 0);
+
+        /// IOTLB Invalidate (Global)
+        ///
+        /// @expects size() < max_batch_size
+        /// @ensures
+        ///
+        void iotlb_global();
+
+        /// IOTLB Invalidate (Domain)
+        ///
+        /// @expects size() < max_batch_size
+        /// @ensures
+        ///
+        /// @param did the domain to invalidate
+        ///
+        void iotlb_domain(did_type did);
+
+        /// IOTLB Invalidate (Pages)
+        ///
+        /// Invalidates [addr, addr + size) using a single page selective
+        /// invalidation of the smallest naturally aligned block that
+        /// contains the range. If the hardware does not support page
+        /// selective invalidations, or the block is larger than
+        /// CAP.MAMV allows, the whole domain is invalidated instead.
+        ///
+        /// @expects size() < max_batch_size
+        /// @expects size != 0
+        /// @ensures
+        ///
+        /// @param did the domain to invalidate
+        /// @param addr the first guest physical address to invalidate
+        /// @param size the number of bytes to invalidate
+        /// @param ih if true, only leaf entries were modified, so cached
+        ///     non-leaf (paging structure) entries may be preserved
+        ///
+        void iotlb_pages(
+            did_type did, uintptr_t addr, uint64_t size, bool ih = false);
+
+        /// Interrupt Entry Cache Invalidate (Global)
+        ///
+        /// @expects size() < max_batch_size
+        /// @ensures
+        ///
+        void iec_global();
+
+        /// Interrupt Entry Cache Invalidate (Index)
+        ///
+        /// Invalidates the 2^im interrupt remapping table entries starting
+        /// at index
+        ///
+        /// @expects size() < max_batch_size
+        /// @expects index is aligned to 2^im
+        /// @ensures
+        ///
+        /// @param index the first IRTE to invalidate
+        /// @param im the index mask
+        ///
+        void iec_index(uint64_t index, uint64_t im = 0);
+
+        /// PASID Cache Invalidate (Domain)
+        ///
+        /// Invalidates the PASID cache entries of every PASID in a domain
+        ///
+        /// @expects size() < max_batch_size
+        /// @ensures
+        ///
+        /// @param did the domain to invalidate
+        ///
+        void pasid_cache_domain(did_type did);
+
+        /// PASID Cache Invalidate (PASID)
+        ///
+        /// @expects size() < max_batch_size
+        /// @ensures
+        ///
+        /// @param did the domain the PASID table belongs to
+        /// @param pasid the PASID to invalidate
+        ///
+        void pasid_cache_pasid(did_type did, pasid_type pasid);
+
+        /// Extended IOTLB Invalidate (PASID)
+        ///
+        /// Invalidates the non-global first-level mappings (and any
+        /// cached paging structures) of a PASID
+        ///
+        /// @expects size() < max_batch_size
+        /// @ensures
+        ///
+        /// @param did the domain the PASID table belongs to
+        /// @param pasid the PASID to invalidate
+        ///
+        void ext_iotlb_pasid(did_type did, pasid_type pasid);
+
+        /// Extended Device-TLB Invalidate (PASID)
+        ///
+        /// Invalidates every translation of a PASID that is cached by the
+        /// address translation cache of a device (i.e. a device with ATS
+        /// enabled). The remapping hardware only invalidates its own
+        /// caches, so this must follow ext_iotlb_pasid for such devices.
+        ///
+        /// @expects size() < max_batch_size
+        /// @ensures
+        ///
+        /// @param sid the source ID of the device
+        /// @param pasid the PASID to invalidate
+        /// @param qdep the invalidate queue depth of the device (from its
+        ///     ATS capability), or 0 if it is 32
+        ///
+        void ext_dev_tlb_pasid(sid_type sid, pasid_type pasid, uint64_t qdep = 0);
+
+        /// Size
+        ///
+        /// @return the number of descriptors in the batch
+        ///
+        std::size_t size() const noexcept
+        { return m_size; }
+
+        /// Empty
+        ///
+        /// @return true if the batch has no descriptors, false otherwise
+        ///
+        bool empty() const noexcept
+        { return m_size == 0; }
+
+        /// Clear
+        ///
+        /// Removes every descriptor from the batch
+        ///
+        void clear() noexcept
+        { m_size = 0; }
+
+        /// Descriptors
+        ///
+        /// @return the descriptors in the batch
+        ///
+        const descriptor_t *data() const noexcept
+        { return m_descs.data(); }
+
+    private:
+
+        void push(uint64_t lo, uint64_t hi);
+
+    private:
+
+        bool m_psi;
+        uint64_t m_mamv;
+
+        std::size_t m_size{0};
+        std::array<descriptor_t, max_batch_size> m_descs;
+    };
+
+public:
+
+    /// Constructor
+    ///
+    /// Allocates the queue and the status words used by wait descriptors
+    ///
+    /// @expects ECAP.QI == 1
+    /// @ensures
+    ///
+    /// @param unit the remapping hardware unit that owns the queue. The
+    ///     unit must outlive this object.
+    ///
+    explicit queued_invalidation(iommu_unit &unit);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~queued_invalidation() = default;
+
+    /// Enable
+    ///
+    /// Programs the queue address and enables queued invalidation
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void enable();
+
+    /// Disable
+    ///
+    /// Waits for the hardware to drain the queue and disables queued
+    /// invalidation
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable();
+
+    /// Enabled
+    ///
+    /// @return true if enable() has been called, false otherwise
+    ///
+    bool enabled() const noexcept
+    { return m_enabled; }
+
+    /// Post
+    ///
+    /// Appends the batch, followed by a wait descriptor, to the queue and
+    /// returns without waiting for the hardware. If the queue is full,
+    /// this spins until the hardware has made room.
+    ///
+    /// @expects enabled()
+    /// @ensures
+    ///
+    /// @param b the batch to post
+    /// @return a ticket that can be passed to wait() / complete()
+    ///
+    ticket_type post(const batch &b);
+
+    /// Wait
+    ///
+    /// Spins until every descriptor posted with (and before) the ticket
+    /// has been processed by the hardware
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param ticket the ticket returned by post()
+    ///
+    void wait(ticket_type ticket);
+
+    /// Complete
+    ///
+    /// @param ticket the ticket returned by post()
+    /// @return true if the ticket's batch has been processed, false
+    ///     otherwise
+    ///
+    bool complete(ticket_type ticket) const;
+
+    /// Submit
+    ///
+    /// Posts the batch and waits for it to complete
+    ///
+    /// @expects enabled()
+    /// @ensures
+    ///
+    /// @param b the batch to submit
+    ///
+    void submit(const batch &b)
+    { this->wait(this->post(b)); }
+
+    /// Queue Physical Address
+    ///
+    /// @return the physical address of the queue
+    ///
+    uintptr_t queue_phys() const noexcept
+    { return m_queue_phys; }
+
+    /// Status Physical Address
+    ///
+    /// @return the physical address of the status words
+    ///
+    uintptr_t status_phys() const noexcept
+    { return m_status_phys; }
+
+    /// Queue
+    ///
+    /// @return the descriptors of the queue
+    ///
+    const descriptor_t *queue() const noexcept
+    { return static_cast<const descriptor_t *>(m_queue.get()); }
+
+private:
+
+    using page_ptr = std::unique_ptr<void, void(*)(void *)>;
+
+    uint64_t head() const;
+    volatile uint32_t &status(ticket_type ticket) const;
+
+private:
+
+    iommu_unit &m_unit;
+    bool m_enabled{false};
+
+    page_ptr m_queue;
+    uintptr_t m_queue_phys;
+
+    page_ptr m_status;
+    uintptr_t m_status_phys;
+
+    std::atomic<uint64_t> m_reserved{0};
+    std::atomic<uint64_t> m_published{0};
+    mutable std::atomic<uint64_t> m_completed{0};
+
+    friend class batch;
+
+public:
+
+    /// @cond
+
+    queued_invalidation(queued_invalidation &&) = delete;
+    queued_invalidation &operator=(queued_invalidation &&) = delete;
+
+    queued_invalidation(const queued_invalidation &) = delete;
+    queued_invalidation &operator=(const queued_invalidation &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
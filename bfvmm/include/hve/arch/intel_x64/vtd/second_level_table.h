@@ -0,0 +1,317 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef VTD_SECOND_LEVEL_TABLE_INTEL_X64_EAPIS_H
+#define VTD_SECOND_LEVEL_TABLE_INTEL_X64_EAPIS_H
+
+#include "iommu_unit.h"
+#include "second_level_paging_entries.h"
+
+#include "../page_table.h"
+
+// -----------------------------------------------------------------------------
+// Exports
+// -----------------------------------------------------------------------------
+
+#include <bfexports.h>
+
+#ifndef STATIC_EAPIS_HVE
+#ifdef SHARED_EAPIS_HVE
+#define EXPORT_EAPIS_HVE EXPORT_SYM
+#else
+#define EXPORT_EAPIS_HVE IMPORT_SYM
+#endif
+#else
+#define EXPORT_EAPIS_HVE
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis::intel_x64::vtd
+{
+
+/// Second-Level Entry Format
+///
+/// Describes the layout of a VT-d second-level paging entry for
+/// page_table. Every level shares the same R/W/PS/address bits, so the
+/// PTE helpers are used for anything that is not level specific.
+///
+struct second_level_format {
+
+    using entry_type = ::intel_x64::vtd::second_level_paging_entries::pte::value_type;
+
+    /// Attributes
+    ///
+    struct attr_type {
+        bool read{true};            ///< DMA reads are allowed
+        bool write{true};           ///< DMA writes are allowed
+        bool snoop{false};          ///< Force snooping (requires ECAP.SC)
+    };
+
+    /// @cond
+
+    static entry_type table(uintptr_t phys_addr) noexcept
+    {
+        using namespace ::intel_x64::vtd::second_level_paging_entries;
+        entry_type entry{};
+
+        pml4e::phys_addr_bits::set(entry, phys_addr >> pml4e::phys_addr_bits::from);
+        pml4e::read_access::enable(entry);
+        pml4e::write_access::enable(entry);
+
+        return entry;
+    }
+
+    static entry_type leaf(uintptr_t phys_addr, uint64_t level, const attr_type &attr) noexcept
+    {
+        using namespace ::intel_x64::vtd::second_level_paging_entries;
+        entry_type entry{};
+
+        pte::phys_addr_bits::set(entry, phys_addr >> pte::phys_addr_bits::from);
+
+        if (attr.read) {
+            pte::read_access::enable(entry);
+        }
+
+        if (attr.write) {
+            pte::write_access::enable(entry);
+        }
+
+        if (attr.snoop) {
+            pte::snoop::enable(entry);
+        }
+
+        if (level != paging::level_4k) {
+            pde::entry_type::enable(entry);
+        }
+
+        return entry;
+    }
+
+    static bool is_leaf(entry_type entry, uint64_t level) noexcept
+    {
+        using namespace ::intel_x64::vtd::second_level_paging_entries;
+        return level == paging::level_4k || pde::entry_type::is_enabled(entry);
+    }
+
+    static uintptr_t phys_addr(entry_type entry) noexcept
+    {
+        using namespace ::intel_x64::vtd::second_level_paging_entries;
+        return pte::phys_addr_bits::get(entry) << pte::phys_addr_bits::from;
+    }
+
+    /// @endcond
+};
+
+/// Second-Level Table
+///
+/// Builds the second-level (DMA) page tables for a domain that cannot, or
+/// should not, share its page tables with EPT. The number of levels is
+/// based on the adjusted guest address widths the unit supports
+/// (CAP.SAGAW), large pages are only used if the unit supports them
+/// (CAP.SLLPS), and the snoop bit is only set if the unit supports snoop
+/// control (ECAP.SC).
+///
+/// Ranges are mapped with the largest pages that are supported, which
+/// keeps the number of IOTLB misses down when identity mapping all of
+/// memory for a pass through domain on a large host.
+///
+/// If the unit does not snoop the cache (ECAP.C), every entry that is
+/// written is flushed from the cache. Once the table is in use, a flush
+/// delegate that invalidates the IOTLB of each unit (and domain) that
+/// uses the table must be set (see dma_remapping::invalidate_domain), as
+/// tables that are emptied by an unmap are freed once it returns.
+///
+/// The page_table is inherited privately, so that pages can only be
+/// mapped with the sizes and attributes the unit supports.
+///
+class EXPORT_EAPIS_HVE second_level_table :
+    private page_table<second_level_format>
+{
+    using base_type = page_table<second_level_format>;
+
+public:
+
+    using base_type::entry_type;
+    using base_type::attr_type;
+    using base_type::phys_addr_t;
+    using base_type::virt_addr_t;
+    using base_type::size_type;
+    using base_type::flush_delegate_t;
+
+    using base_type::root_phys;
+    using base_type::levels;
+    using base_type::num_tables;
+    using base_type::coherent;
+    using base_type::set_flush;
+    using base_type::unmap;
+    using base_type::unmap_range;
+    using base_type::entry;
+    using base_type::virt_to_phys;
+    using base_type::is_mapped;
+
+    /// Constructor
+    ///
+    /// @expects the unit supports a walk of at least addr_width bits
+    /// @ensures
+    ///
+    /// @param unit the remapping hardware unit the tables will be used
+    ///     with
+    /// @param addr_width the number of address bits that must be
+    ///     translated. The smallest number of levels that can translate
+    ///     this many bits is used.
+    ///
+    explicit second_level_table(const iommu_unit &unit, uint64_t addr_width = 48);
+
+    /// Constructor
+    ///
+    /// @expects levels >= 3 && levels <= 5
+    /// @expects max_level <= paging::level_1g
+    /// @ensures
+    ///
+    /// @param levels the number of levels in a walk
+    /// @param max_level the largest page level to use
+    /// @param snoop_control true if the snoop bit may be used
+    /// @param coherent true if the unit snoops the cache (ECAP.C)
+    ///
+    second_level_table(
+        uint64_t levels, uint64_t max_level, bool snoop_control, bool coherent = true);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~second_level_table() = default;
+
+    /// Map
+    ///
+    /// Maps a single page. If the unit does not support snoop control,
+    /// the snoop attribute is ignored.
+    ///
+    /// @expects level <= max_level()
+    /// @expects gpa and hpa are aligned to the page size
+    /// @ensures
+    ///
+    /// @param gpa the guest physical address to map from
+    /// @param hpa the host physical address to map to
+    /// @param level the level of the page (i.e. paging::level_4k)
+    /// @param attr the attributes of the page
+    /// @return Returns the entry that performs the map
+    ///
+    entry_type &map(uintptr_t gpa, uintptr_t hpa, uint64_t level, attr_type attr = {});
+
+    /// Map Range
+    ///
+    /// Maps [gpa, gpa + size) to [hpa, hpa + size) using the largest pages
+    /// the unit supports. If the unit does not support snoop control, the
+    /// snoop attribute is ignored.
+    ///
+    /// @expects gpa, hpa and size are 4k aligned
+    /// @ensures
+    ///
+    /// @param gpa the first guest physical address to map from
+    /// @param hpa the first host physical address to map to
+    /// @param size the size of the range in bytes
+    /// @param attr the attributes of each page
+    /// @return the number of entries that were written
+    ///
+    size_type map_range(
+        uintptr_t gpa, uintptr_t hpa, size_type size, attr_type attr = {});
+
+    /// Map Identity
+    ///
+    /// Identity maps [0, size), which is what a pass through domain needs
+    /// on hardware that does not support pass through (ECAP.PT).
+    ///
+    /// @expects size is 4k aligned
+    /// @ensures
+    ///
+    /// @param size the size of the range in bytes
+    /// @param attr the attributes of each page
+    /// @return the number of entries that were written
+    ///
+    size_type map_identity(size_type size, attr_type attr = {})
+    { return this->map_range(0, 0, size, attr); }
+
+    /// Adjusted Guest Address Width
+    ///
+    /// @return the value of the AW field of a context entry that uses
+    ///     this table
+    ///
+    uint64_t aw() const noexcept
+    { return this->levels() - 2U; }
+
+    /// Max Level
+    ///
+    /// @return the largest page level used by map_range
+    ///
+    uint64_t max_level() const noexcept
+    { return m_max_level; }
+
+    /// Snoop Control
+    ///
+    /// @return true if the snoop bit is used, false otherwise
+    ///
+    bool snoop_control() const noexcept
+    { return m_snoop_control; }
+
+    /// Levels (From CAP)
+    ///
+    /// @param cap the value of the capability register
+    /// @param addr_width the number of address bits that must be
+    ///     translated
+    /// @return the smallest number of levels that the unit supports which
+    ///     can translate addr_width bits, or 0 if there are none
+    ///
+    static uint64_t levels_from_cap(uint64_t cap, uint64_t addr_width) noexcept;
+
+    /// Max Level (From CAP)
+    ///
+    /// @param cap the value of the capability register
+    /// @return the largest page level the unit supports
+    ///
+    static uint64_t max_level_from_cap(uint64_t cap) noexcept;
+
+private:
+
+    uint64_t m_max_level;
+    bool m_snoop_control;
+
+public:
+
+    /// @cond
+
+    second_level_table(second_level_table &&) = delete;
+    second_level_table &operator=(second_level_table &&) = delete;
+
+    second_level_table(const second_level_table &) = delete;
+    second_level_table &operator=(const second_level_table &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
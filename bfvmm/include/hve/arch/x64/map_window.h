@@ -0,0 +1,139 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef MAP_WINDOW_X64_EAPIS_H
+#define MAP_WINDOW_X64_EAPIS_H
+
+#include <vector>
+#include <intrinsics.h>
+
+// -----------------------------------------------------------------------------
+// Exports
+// -----------------------------------------------------------------------------
+
+#include <bfexports.h>
+
+#ifndef STATIC_EAPIS_HVE
+#ifdef SHARED_EAPIS_HVE
+#define EXPORT_EAPIS_HVE EXPORT_SYM
+#else
+#define EXPORT_EAPIS_HVE IMPORT_SYM
+#endif
+#else
+#define EXPORT_EAPIS_HVE
+#endif
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis::x64
+{
+
+/// Map Window
+///
+/// A fixed range of VMM virtual addresses that host physical pages can be
+/// mapped into, one slot (4k) at a time. Unlike a unique_map, the virtual
+/// addresses are only allocated once, and a slot that already maps the
+/// requested page does not need to be remapped, which makes it suitable
+/// for touching a large number of pages in bulk (e.g. when scanning guest
+/// memory).
+///
+/// The virtual addresses are allocated on first use.
+///
+class EXPORT_EAPIS_HVE map_window
+{
+public:
+
+    /// Constructor
+    ///
+    /// @expects num_pages != 0
+    /// @ensures
+    ///
+    /// @param num_pages the number of 4k slots in the window
+    ///
+    explicit map_window(std::size_t num_pages);
+
+    /// Destructor
+    ///
+    /// Unmaps every slot and frees the virtual addresses
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~map_window();
+
+    /// Map
+    ///
+    /// The slot's address is always flushed from this CPU's TLB (even if
+    /// the slot already maps hpa), as the window may be used from more
+    /// than one CPU.
+    ///
+    /// @expects slot < size()
+    /// @expects hpa is 4k aligned and hpa != 0
+    /// @ensures
+    ///
+    /// @param slot the slot to map the page into
+    /// @param hpa the host physical address of the page
+    /// @return the host virtual address of the page
+    ///
+    void *map(std::size_t slot, uintptr_t hpa);
+
+    /// Unmap
+    ///
+    /// Unmapping a slot that is not mapped is not an error.
+    ///
+    /// @expects slot < size()
+    /// @ensures
+    ///
+    /// @param slot the slot to unmap
+    ///
+    void unmap(std::size_t slot);
+
+    /// Size
+    ///
+    /// @return the number of 4k slots in the window
+    ///
+    std::size_t size() const noexcept
+    { return m_hpas.size(); }
+
+private:
+
+    uintptr_t m_hva{};
+    std::vector<uintptr_t> m_hpas;
+
+public:
+
+    /// @cond
+
+    map_window(map_window &&) = delete;
+    map_window &operator=(map_window &&) = delete;
+
+    map_window(const map_window &) = delete;
+    map_window &operator=(const map_window &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
@@ -19,8 +19,19 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
-#include <list>
+
+// TIDY_EXCLUSION=-cert-err58-cpp
+//
+// Reason:
+//     This test triggers on the use of a std::mutex being globally defined
+//     from the EPT map.
+//
+
+#include <array>
 #include <algorithm>
+#include <string>
+
+#include <bfcallonce.h>
 
 #include <bfvmm/vcpu/vcpu_factory.h>
 #include <eapis/hve/arch/intel_x64/time.h>
@@ -29,33 +40,241 @@
 using namespace eapis::intel_x64;
 
 // -----------------------------------------------------------------------------
-// vCPU
+// Samples
 // -----------------------------------------------------------------------------
 
 namespace test
 {
 
 #ifndef SAMPLE_SIZE
-#define SAMPLE_SIZE 256
+#define SAMPLE_SIZE 4096
+#endif
+
+#ifndef WARMUP_SIZE
+#define WARMUP_SIZE 64
 #endif
 
+constexpr const uint32_t cpuid_leaf = 42;
+constexpr const uint32_t rearm_ept_leaf = 43;
+constexpr const uint32_t arm_window_leaf = 44;
+
+constexpr const uint32_t msr = 0x000000000000003B;
+constexpr const uint16_t port = 0x80;
+
+enum kind_t : uint64_t {
+    preemption_timer,
+    cpuid,
+    rdmsr,
+    wrmsr,
+    io_instruction,
+    wrcr3,
+    ept_violation,
+    interrupt_window,
+    num_kinds
+};
+
+constexpr const std::array<const char *, num_kinds> kind_names = {{
+    "preemption timer",
+    "cpuid",
+    "rdmsr",
+    "wrmsr",
+    "io instruction",
+    "wrcr3",
+    "ept violation",
+    "interrupt window"
+}};
+
+// Each sample is split into the time spent by the hardware (the VM exit,
+// the VM entry and the base hypervisor's entry / exit stubs) and the time
+// spent handling the exit, measured from the first exit handler delegate
+// to the end of the eapis handler. All of the samples are preallocated so
+// that collecting a sample never allocates.
+//
+struct samples_t {
+    uint64_t count{0};
+
+    std::array<uint64_t, SAMPLE_SIZE> total{};
+    std::array<uint64_t, SAMPLE_SIZE> handler{};
+    std::array<uint64_t, SAMPLE_SIZE> transition{};
+};
+
+std::array<samples_t, num_kinds> g_samples{};
+
+void
+record(kind_t kind, uint64_t total, uint64_t handler)
+{
+    auto &samples = g_samples.at(kind);
+
+    if (samples.count == SAMPLE_SIZE) {
+        return;
+    }
+
+    samples.total.at(samples.count) = total;
+    samples.handler.at(samples.count) = handler;
+    samples.transition.at(samples.count) = total > handler ? total - handler : 0;
+
+    samples.count++;
+}
+
+std::string
+percentiles(std::array<uint64_t, SAMPLE_SIZE> &sample, uint64_t count, const tsc &clock)
+{
+    std::sort(sample.begin(), sample.begin() + gsl::narrow_cast<std::ptrdiff_t>(count));
+
+    auto at = [&](uint64_t per_10k) {
+        auto ticks = sample.at(std::min(count - 1, (count * per_10k) / 10000));
+        return std::to_string(clock.calibrated() ? clock.tsc_to_ns(ticks) : ticks);
+    };
+
+    return
+        "min " + at(0) +
+        ", p50 " + at(5000) +
+        ", p99 " + at(9900) +
+        ", p99.9 " + at(9990) +
+        ", max " + at(10000);
+}
+
+void
+report(const tsc &clock)
+{
+    const char *unit = clock.calibrated() ? " (ns)" : " (ticks)";
+
+    for (uint64_t kind = 0; kind < num_kinds; kind++) {
+        auto &samples = g_samples.at(kind);
+
+        if (samples.count == 0) {
+            continue;
+        }
+
+        bfdebug_transaction(0, [&](std::string * msg) {
+            bfdebug_lnbr(0, msg);
+            bfdebug_info(0, kind_names.at(kind), msg);
+            bfdebug_brk2(0, msg);
+
+            bfdebug_subndec(0, "samples", samples.count, msg);
+            bfdebug_subtext(0, std::string("total") + unit,
+                            percentiles(samples.total, samples.count, clock), msg);
+            bfdebug_subtext(0, std::string("transition") + unit,
+                            percentiles(samples.transition, samples.count, clock), msg);
+            bfdebug_subtext(0, std::string("handler") + unit,
+                            percentiles(samples.handler, samples.count, clock), msg);
+        });
+    }
+}
+
+// -----------------------------------------------------------------------------
+// vCPU
+// -----------------------------------------------------------------------------
+
+bfn::once_flag flag;
+ept::mmap g_guest_map;
+
+alignas(0x200000) std::array<uint8_t, 0x200000> buffer;
+
 class vcpu : public eapis::intel_x64::vcpu
 {
-    uint64_t m_start{};
-    uint64_t m_end{};
-    uint64_t m_count{};
+    uint64_t m_exit{};
+    uint64_t m_resume{};
+    uint64_t m_handler{};
 
-    std::list<uint64_t> m_sample;
+    bool m_window_armed{};
 
 public:
     explicit vcpu(vcpuid::type id) :
         eapis::intel_x64::vcpu{id}
     {
+        using namespace vmcs_n::exit_reason;
+
+        if (id != 0) {
+            return;
+        }
+
+        bfn::call_once(flag, [&] {
+            ept::identity_map(
+                g_guest_map,
+                MAX_PHYS_ADDR
+            );
+        });
+
+        this->add_hlt_delegate(
+            hlt_delegate_t::create<vcpu, &vcpu::bench>(this)
+        );
+
         this->add_preemption_timer_handler(
             preemption_timer_handler::handler_delegate_t::create <
-            vcpu, &vcpu::handler > (this)
+            vcpu, &vcpu::handle_preemption_timer > (this)
+        );
+
+        this->add_cpuid_handler(
+            cpuid_leaf,
+            cpuid_handler::handler_delegate_t::create<vcpu, &vcpu::handle_cpuid>(this)
+        );
+
+        this->add_cpuid_handler(
+            rearm_ept_leaf,
+            cpuid_handler::handler_delegate_t::create<vcpu, &vcpu::handle_rearm_ept>(this)
+        );
+
+        this->add_cpuid_handler(
+            arm_window_leaf,
+            cpuid_handler::handler_delegate_t::create<vcpu, &vcpu::handle_arm_window>(this)
         );
 
+        this->add_rdmsr_handler(
+            msr, rdmsr_handler::handler_delegate_t::create<vcpu, &vcpu::handle_rdmsr>(this)
+        );
+
+        this->add_wrmsr_handler(
+            msr, wrmsr_handler::handler_delegate_t::create<vcpu, &vcpu::handle_wrmsr>(this)
+        );
+
+        this->add_io_instruction_handler(
+            port,
+            io_instruction_handler::handler_delegate_t::create<vcpu, &vcpu::handle_io>(this),
+            io_instruction_handler::handler_delegate_t::create<vcpu, &vcpu::handle_io>(this)
+        );
+
+        this->add_wrcr3_handler(
+            control_register_handler::handler_delegate_t::create<vcpu, &vcpu::handle_wrcr3>(this)
+        );
+
+        this->add_ept_read_violation_handler(
+            ept_violation_handler::handler_delegate_t::create<vcpu, &vcpu::handle_ept_violation>(this)
+        );
+
+        this->add_ept_write_violation_handler(
+            ept_violation_handler::handler_delegate_t::create<vcpu, &vcpu::handle_ept_violation>(this)
+        );
+
+        this->add_handler(
+            basic_exit_reason::interrupt_window,
+            ::handler_delegate_t::create<vcpu, &vcpu::handle_interrupt_window>(this)
+        );
+
+        // The base hypervisor calls the delegates for an exit reason in the
+        // reverse order they were added, and the eapis handlers were added
+        // by the base class, so the following delegates run first and mark
+        // the start of each exit.
+        //
+
+        for (auto reason : {
+                 basic_exit_reason::preemption_timer_expired,
+                 basic_exit_reason::cpuid,
+                 basic_exit_reason::rdmsr,
+                 basic_exit_reason::wrmsr,
+                 basic_exit_reason::io_instruction,
+                 basic_exit_reason::control_register_accesses,
+                 basic_exit_reason::ept_violation,
+                 basic_exit_reason::interrupt_window
+             }) {
+            this->add_handler(
+                reason, ::handler_delegate_t::create<vcpu, &vcpu::exit_start>(this)
+            );
+        }
+
+        this->rearm_ept();
+        this->set_eptp(g_guest_map);
+
         if (!eapis::intel_x64::time::invariant_tsc_supported()) {
             return;
         }
@@ -63,50 +282,234 @@ public:
         this->enable_preemption_timer();
         this->set_preemption_timer(0);
 
-        m_start = ::x64::read_tsc::get();
+        m_resume = ::x64::read_tsc::get();
+    }
+
+    ~vcpu() override = default;
+
+    // -------------------------------------------------------------------------
+    // Guest
+    // -------------------------------------------------------------------------
+
+    // Each exit is generated by the guest while it is being torn down. The
+    // round trip is measured from the guest, and the handler time is read
+    // back from m_handler, which the exit handlers write.
+    //
+    template<typename B, typename F>
+    void measure(kind_t kind, B before, F f)
+    {
+        for (uint64_t i = 0; i < WARMUP_SIZE + SAMPLE_SIZE; i++) {
+            before();
+            m_handler = 0;
+
+            auto start = ::x64::read_tsc::get();
+            f();
+            auto end = ::x64::read_tsc::get();
+
+            if (i >= WARMUP_SIZE) {
+                record(kind, end - start, m_handler);
+            }
+        }
     }
 
-    bool handler(gsl::not_null<vcpu_t *> vcpu)
+    void bench(bfobject *obj)
+    {
+        bfignored(obj);
+
+        auto none = [] { };
+
+        this->measure(cpuid, none, [] {
+            ::x64::cpuid::get(cpuid_leaf, 0, 0, 0);
+        });
+
+        this->measure(rdmsr, none, [] {
+            ::x64::msrs::get(msr);
+        });
+
+        auto val = ::x64::msrs::get(msr);
+        this->measure(wrmsr, none, [&] {
+            ::x64::msrs::set(msr, val);
+        });
+
+        this->measure(io_instruction, none, [] {
+            ::x64::portio::outb(port, 0);
+        });
+
+        auto cr3 = ::intel_x64::cr3::get();
+        this->measure(wrcr3, none, [&] {
+            ::intel_x64::cr3::set(cr3);
+        });
+
+        this->measure(ept_violation, [] {
+            ::x64::cpuid::get(rearm_ept_leaf, 0, 0, 0);
+        },
+        [] {
+            buffer.at(0)++;
+        });
+
+        // The interrupt window is open as soon as interrupts are enabled,
+        // so the exit happens right after the VM entry that follows the
+        // arming CPUID. It is measured from the VMM, like the timer.
+        //
+
+        if (::x64::rflags::interrupt_enable_flag::is_enabled()) {
+            for (uint64_t i = 0; i < WARMUP_SIZE + SAMPLE_SIZE; i++) {
+                ::x64::cpuid::get(arm_window_leaf, 0, 0, 0);
+            }
+        }
+
+        report(this->clock());
+    }
+
+    // -------------------------------------------------------------------------
+    // Handlers
+    // -------------------------------------------------------------------------
+
+    bool exit_start(gsl::not_null<vcpu_t *> vcpu)
     {
         bfignored(vcpu);
 
-        m_end = ::x64::read_tsc::get();
-        m_count++;
+        m_exit = ::x64::read_tsc::get();
+        return false;
+    }
+
+    void exit_end()
+    { m_handler = ::x64::read_tsc::get() - m_exit; }
+
+    // The preemption timer and interrupt window exits happen immediately
+    // after a VM entry, so the transition is measured directly from the end
+    // of the previous exit to the start of this one.
+    //
+    void record_immediate(kind_t kind, uint64_t &count)
+    {
+        auto end = ::x64::read_tsc::get();
+
+        if (count++ >= WARMUP_SIZE) {
+            record(kind, end - m_resume, end - m_exit);
+        }
+
+        m_resume = ::x64::read_tsc::get();
+    }
 
-        if (m_count > SAMPLE_SIZE) {
+    bool handle_preemption_timer(gsl::not_null<vcpu_t *> vcpu)
+    {
+        bfignored(vcpu);
+
+        static uint64_t count = 0;
+        this->record_immediate(preemption_timer, count);
+
+        if (g_samples.at(preemption_timer).count == SAMPLE_SIZE) {
             this->disable_preemption_timer();
-            return true;
         }
 
-        m_sample.push_front(m_end - m_start);
-        m_start = ::x64::read_tsc::get();
+        return true;
+    }
+
+    bool handle_arm_window(gsl::not_null<vcpu_t *> vcpu, cpuid_handler::info_t &info)
+    {
+        using namespace vmcs_n::primary_processor_based_vm_execution_controls;
 
+        bfignored(vcpu);
+        bfignored(info);
+
+        // If the window is already being used to inject an interrupt, it
+        // is left alone and the sample is skipped.
+        //
+
+        if (interrupt_window_exiting::is_disabled()) {
+            interrupt_window_exiting::enable();
+            m_window_armed = true;
+        }
+
+        m_resume = ::x64::read_tsc::get();
         return true;
     }
 
-    ~vcpu() override
+    bool handle_interrupt_window(gsl::not_null<vcpu_t *> vcpu)
     {
-        uint64_t sum = 0;
-        for (const auto &sample : m_sample) {
-            sum += sample;
+        using namespace vmcs_n::primary_processor_based_vm_execution_controls;
+
+        bfignored(vcpu);
+
+        if (!m_window_armed) {
+            return false;
         }
 
-        uint64_t tsc = sum >> 8; // Divide by SAMPLE_SIZE
-        uint64_t ticks_per_usec = eapis::intel_x64::time::pet_freq_MHz();
-        uint64_t div = ::intel_x64::msrs::ia32_vmx_misc::preemption_timer_decrement::get();
-        uint64_t bus = eapis::intel_x64::time::bus_freq_MHz();
-
-        // NOTE: we should try to avoid / here. We could use multiplies and shifts
-        // or we could start a static table of 'ticks_per_usec', and then at initialization
-        // assign a conversion function that has compile-time constants so the compiler
-        // will do the mult/shift for us.
-
-        if (ticks_per_usec != 0) {
-            bfdebug_ndec(0, "BUS (MHz)", bus);
-            bfdebug_ndec(0, "TSC (MHz)", eapis::intel_x64::time::tsc_freq_MHz(bus));
-            bfdebug_ndec(0, "Avg vmentry->vmexit latency (us)", tsc / ticks_per_usec);
-            bfdebug_ndec(0, "Avg vmentry->vmexit latency TSC ticks", tsc);
-            bfdebug_ndec(0, "Avg vmentry->vmexit latency PET ticks", tsc >> div);
+        static uint64_t count = 0;
+
+        m_window_armed = false;
+        interrupt_window_exiting::disable();
+
+        this->record_immediate(interrupt_window, count);
+        return true;
+    }
+
+    bool handle_cpuid(gsl::not_null<vcpu_t *> vcpu, cpuid_handler::info_t &info)
+    { bfignored(vcpu); bfignored(info); this->exit_end(); return true; }
+
+    bool handle_rdmsr(gsl::not_null<vcpu_t *> vcpu, rdmsr_handler::info_t &info)
+    { bfignored(vcpu); bfignored(info); this->exit_end(); return true; }
+
+    bool handle_wrmsr(gsl::not_null<vcpu_t *> vcpu, wrmsr_handler::info_t &info)
+    { bfignored(vcpu); bfignored(info); this->exit_end(); return true; }
+
+    bool handle_io(gsl::not_null<vcpu_t *> vcpu, io_instruction_handler::info_t &info)
+    { bfignored(vcpu); bfignored(info); this->exit_end(); return true; }
+
+    bool handle_wrcr3(gsl::not_null<vcpu_t *> vcpu, control_register_handler::info_t &info)
+    { bfignored(vcpu); bfignored(info); this->exit_end(); return true; }
+
+    // The EPT violation invalidates the cached translation of the buffer,
+    // so restoring access does not require an INVEPT. Removing it again
+    // does, which is why it is done by a separate exit (rearm_ept_leaf)
+    // outside of the measurement.
+    //
+    bool handle_ept_violation(gsl::not_null<vcpu_t *> vcpu, ept_violation_handler::info_t &info)
+    {
+        bfignored(vcpu);
+        bfignored(info);
+
+        this->set_buffer_access(true);
+        this->exit_end();
+
+        return true;
+    }
+
+    bool handle_rearm_ept(gsl::not_null<vcpu_t *> vcpu, cpuid_handler::info_t &info)
+    {
+        bfignored(vcpu);
+        bfignored(info);
+
+        this->rearm_ept();
+        return true;
+    }
+
+    void rearm_ept()
+    {
+        this->set_buffer_access(false);
+        ::intel_x64::vmx::invept_global();
+    }
+
+    void set_buffer_access(bool enable)
+    {
+        using namespace ::intel_x64::ept::pd::entry;
+
+        auto [pte, unused] =
+            g_guest_map.entry(
+                g_mm->virtptr_to_physint(buffer.data())
+            );
+
+        bfignored(unused);
+
+        if (enable) {
+            read_access::enable(pte);
+            write_access::enable(pte);
+            execute_access::enable(pte);
+        }
+        else {
+            read_access::disable(pte);
+            write_access::disable(pte);
+            execute_access::disable(pte);
         }
     }
 
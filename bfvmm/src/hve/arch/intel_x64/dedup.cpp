@@ -0,0 +1,372 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#include <hve/arch/intel_x64/dedup.h>
+
+namespace eapis::intel_x64
+{
+
+// The pages of the current batch are mapped into the first window_pages
+// slots of the window. The last two slots are used to compare and copy
+// individual frames.
+//
+constexpr static std::size_t other_slot = page_dedup::window_pages;
+constexpr static std::size_t copy_slot = page_dedup::window_pages + 1;
+
+constexpr static uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+constexpr static uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr static uint64_t prime3 = 0x165667B19E3779F9ULL;
+constexpr static uint64_t prime4 = 0x85EBCA77C2B2AE63ULL;
+
+static inline uint64_t
+rotl(uint64_t val, uint64_t n) noexcept
+{ return (val << n) | (val >> (64U - n)); }
+
+static inline uint64_t
+hash_round(uint64_t acc, uint64_t val) noexcept
+{ return rotl(acc + (val * prime2), 31U) * prime1; }
+
+static inline uint64_t
+hash_merge(uint64_t acc, uint64_t lane) noexcept
+{ return ((acc ^ hash_round(0, lane)) * prime1) + prime4; }
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+page_dedup::page_dedup(
+    const alloc_delegate_t &alloc, const free_delegate_t &free
+) :
+    m_alloc{alloc},
+    m_free{free},
+    m_window{window_pages + 2}
+{ }
+
+void
+page_dedup::add_range(ept::mmap &mmap, uintptr_t gpa, std::size_t size)
+{
+    expects(size != 0);
+    expects(bfn::lower(gpa | size, ::x64::pt::from) == 0);
+
+    std::lock_guard lock(m_mutex);
+    m_ranges.push_back({&mmap, gpa, size});
+}
+
+void
+page_dedup::remove_map(ept::mmap &mmap)
+{
+    std::lock_guard lock(m_mutex);
+
+    m_ranges.erase(
+        std::remove_if(m_ranges.begin(), m_ranges.end(), [&](const auto & range) {
+            return range.mmap == &mmap;
+        }),
+        m_ranges.end()
+    );
+
+    m_cursor_range = 0;
+    m_cursor_offset = 0;
+
+    auto iter = m_pages.lower_bound({&mmap, 0});
+    while (iter != m_pages.end() && iter->first.first == &mmap) {
+        this->unshare(iter->first, iter->second);
+        iter = m_pages.erase(iter);
+    }
+}
+
+std::size_t
+page_dedup::scan(std::size_t num_pages)
+{
+    std::lock_guard lock(m_mutex);
+
+    for (auto hpa : m_released) {
+        m_free(hpa);
+    }
+
+    m_released.clear();
+
+    auto merged = this->merge();
+    this->protect(num_pages);
+
+    return merged;
+}
+
+bool
+page_dedup::handle_write(ept::mmap &mmap, uintptr_t gpa)
+{
+    std::lock_guard lock(m_mutex);
+
+    auto iter = m_pages.find({&mmap, bfn::upper(gpa, ::x64::pt::from)});
+    if (iter == m_pages.end()) {
+        return false;
+    }
+
+    this->unshare(iter->first, iter->second);
+    m_pages.erase(iter);
+
+    return true;
+}
+
+std::size_t
+page_dedup::shared_frames() const
+{
+    std::lock_guard lock(m_mutex);
+    return m_shared_frames;
+}
+
+std::size_t
+page_dedup::freed_frames() const
+{
+    std::lock_guard lock(m_mutex);
+    return m_freed_frames;
+}
+
+std::size_t
+page_dedup::copied_frames() const
+{
+    std::lock_guard lock(m_mutex);
+    return m_copied_frames;
+}
+
+uint64_t
+page_dedup::hash(const void *page) noexcept
+{
+    auto words = static_cast<const uint64_t *>(page);
+
+    std::array<uint64_t, 4> lanes = {
+        prime1 + prime2, prime2, 0, 0 - prime1
+    };
+
+    for (std::size_t i = 0; i < ::x64::pt::page_size / sizeof(uint64_t); i += lanes.size()) {
+        lanes[0] = hash_round(lanes[0], words[i + 0]);
+        lanes[1] = hash_round(lanes[1], words[i + 1]);
+        lanes[2] = hash_round(lanes[2], words[i + 2]);
+        lanes[3] = hash_round(lanes[3], words[i + 3]);
+    }
+
+    auto h = rotl(lanes[0], 1U) + rotl(lanes[1], 7U) + rotl(lanes[2], 12U) + rotl(lanes[3], 18U);
+
+    for (auto lane : lanes) {
+        h = hash_merge(h, lane);
+    }
+
+    h += ::x64::pt::page_size;
+
+    h ^= h >> 33U;
+    h *= prime2;
+    h ^= h >> 29U;
+    h *= prime3;
+    h ^= h >> 32U;
+
+    return h;
+}
+
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
+
+// Write-protects the next num_pages pages of the registered ranges,
+// wrapping around to the first range once the last one has been scanned.
+//
+void
+page_dedup::protect(std::size_t num_pages)
+{
+    if (m_ranges.empty()) {
+        return;
+    }
+
+    auto budget = num_pages * ::x64::pt::page_size;
+
+    for (std::size_t i = 0; i <= m_ranges.size() && budget != 0; i++) {
+        auto &range = m_ranges.at(m_cursor_range);
+        auto size = std::min(budget, range.size - m_cursor_offset);
+        auto mmap = range.mmap;
+
+        mmap->write_protect_shared(
+            range.gpa + m_cursor_offset, size, [&](uintptr_t gpa, uintptr_t hpa) {
+            key_t key{mmap, gpa};
+
+            m_pages[key] = {hpa, true};
+            m_pending.push_back(key);
+        });
+
+        budget -= size;
+        m_cursor_offset += size;
+
+        if (m_cursor_offset == range.size) {
+            m_cursor_range = (m_cursor_range + 1) % m_ranges.size();
+            m_cursor_offset = 0;
+        }
+    }
+}
+
+// Maps the pending pages into the window one batch at a time, and then
+// hashes and merges each page of the batch. Pages that were written to
+// since they were write-protected are no longer tracked, and are skipped.
+//
+std::size_t
+page_dedup::merge()
+{
+    std::size_t merged = 0;
+    std::array<const void *, window_pages> ptrs{};
+
+    for (std::size_t first = 0; first < m_pending.size(); first += window_pages) {
+        auto num = std::min(window_pages, m_pending.size() - first);
+
+        for (std::size_t i = 0; i < num; i++) {
+            auto iter = m_pages.find(m_pending.at(first + i));
+
+            if (iter == m_pages.end() || !iter->second.pending) {
+                ptrs.at(i) = nullptr;
+                continue;
+            }
+
+            ptrs.at(i) = m_window.map(i, iter->second.hpa);
+        }
+
+        for (std::size_t i = 0; i < num; i++) {
+            if (ptrs.at(i) == nullptr) {
+                continue;
+            }
+
+            const auto &key = m_pending.at(first + i);
+            auto iter = m_pages.find(key);
+
+            iter->second.pending = false;
+
+            if (this->merge(key, iter->second, ptrs.at(i), hash(ptrs.at(i)))) {
+                merged++;
+            }
+        }
+    }
+
+    m_pending.clear();
+    return merged;
+}
+
+bool
+page_dedup::merge(const key_t &key, page_t &page, const void *ptr, uint64_t hash)
+{
+    // The frame is already indexed, which means that more than one page
+    // maps it (e.g. memory the maps share on purpose). It is now shared,
+    // but no frame was freed.
+    //
+
+    if (auto iter = m_frames.find(page.hpa); iter != m_frames.end()) {
+        if (iter->second.refs++ == 1) {
+            m_shared_frames++;
+        }
+
+        return false;
+    }
+
+    auto range = m_index.equal_range(hash);
+    for (auto iter = range.first; iter != range.second; ++iter) {
+        auto hpa = iter->second;
+        auto other = m_window.map(other_slot, hpa);
+
+        if (std::memcmp(ptr, other, ::x64::pt::page_size) != 0) {
+            continue;
+        }
+
+        if (!key.first->remap_shared(key.second, page.hpa, hpa)) {
+            return false;
+        }
+
+        if (m_frames.at(hpa).refs++ == 1) {
+            m_shared_frames++;
+        }
+
+        m_freed_frames++;
+        m_released.push_back(page.hpa);
+
+        page.hpa = hpa;
+        return true;
+    }
+
+    this->index(page.hpa, hash);
+    return false;
+}
+
+void
+page_dedup::unshare(const key_t &key, page_t &page)
+{
+    auto iter = m_frames.find(page.hpa);
+
+    if (iter == m_frames.end() || iter->second.refs == 1) {
+        if (iter != m_frames.end()) {
+            this->unindex(page.hpa);
+        }
+
+        key.first->unshare(key.second, page.hpa);
+        return;
+    }
+
+    auto hpa = m_alloc();
+    if (hpa == 0) {
+        throw std::runtime_error("page_dedup::unshare: out of frames");
+    }
+
+    std::memcpy(
+        m_window.map(copy_slot, hpa),
+        m_window.map(other_slot, page.hpa),
+        ::x64::pt::page_size
+    );
+
+    key.first->unshare(key.second, hpa);
+
+    if (--iter->second.refs == 1) {
+        m_shared_frames--;
+    }
+
+    m_copied_frames++;
+    page.hpa = hpa;
+}
+
+void
+page_dedup::index(uintptr_t hpa, uint64_t hash)
+{
+    m_frames[hpa] = {hash, 1};
+    m_index.emplace(hash, hpa);
+}
+
+void
+page_dedup::unindex(uintptr_t hpa)
+{
+    auto iter = m_frames.find(hpa);
+    auto range = m_index.equal_range(iter->second.hash);
+
+    for (auto entry = range.first; entry != range.second; ++entry) {
+        if (entry->second == hpa) {
+            m_index.erase(entry);
+            break;
+        }
+    }
+
+    m_frames.erase(iter);
+}
+
+}
@@ -0,0 +1,244 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <algorithm>
+#include <cstring>
+
+#include <hve/arch/intel_x64/demand_pager.h>
+
+namespace eapis::intel_x64
+{
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+demand_pager::demand_pager(
+    const alloc_delegate_t &alloc, const free_delegate_t &free
+) :
+    m_alloc{alloc},
+    m_free{free},
+    m_zero{zero_delegate_t::create<demand_pager, &demand_pager::zero>(this)}
+{ }
+
+demand_pager::demand_pager(
+    const alloc_delegate_t &alloc, const free_delegate_t &free,
+    const zero_delegate_t &zero
+) :
+    m_alloc{alloc},
+    m_free{free},
+    m_zero{zero}
+{ }
+
+void
+demand_pager::add_region(
+    ept::mmap &mmap, uintptr_t gpa, std::size_t size,
+    ept::mmap::attr_type attr, ept::mmap::memory_type cache)
+{
+    expects(size != 0);
+    expects(bfn::lower(gpa | size, ::x64::pt::from) == 0);
+
+    std::lock_guard lock(m_mutex);
+
+    for (const auto &region : m_regions) {
+        if (region.mmap == &mmap) {
+            expects(gpa + size <= region.gpa || region.gpa + region.size <= gpa);
+        }
+    }
+
+    m_regions.push_back({&mmap, gpa, size, attr, cache, gpa, 0, {}});
+}
+
+void
+demand_pager::remove_map(ept::mmap &mmap)
+{
+    std::lock_guard lock(m_mutex);
+
+    for (const auto &region : m_regions) {
+        if (region.mmap != &mmap) {
+            continue;
+        }
+
+        for (const auto &[gpa, frame] : region.frames) {
+            mmap.unmap(gpa);
+            mmap.release(gpa);
+
+            m_free(frame.hpa, frame.size);
+            m_populated -= frame.size;
+        }
+    }
+
+    m_regions.erase(
+        std::remove_if(m_regions.begin(), m_regions.end(), [&](const auto & region) {
+            return region.mmap == &mmap;
+        }),
+        m_regions.end()
+    );
+}
+
+bool
+demand_pager::handle_fault(ept::mmap &mmap, uintptr_t gpa)
+{
+    std::lock_guard lock(m_mutex);
+
+    auto region = this->find(mmap, gpa);
+    if (region == nullptr) {
+        return false;
+    }
+
+    // Another vCPU that shares this map might have populated the page
+    // while this one was exiting, in which case the guest only needs to
+    // try again.
+    //
+
+    if (mmap.is_mapped(bfn::upper(gpa, ::x64::pt::from), ::x64::pt::page_size)) {
+        return true;
+    }
+
+    auto size = this->populate(*region, gpa);
+    if (size == 0) {
+        throw std::runtime_error("demand_pager::handle_fault: out of memory");
+    }
+
+    m_faults++;
+
+    auto addr = gpa & ~(size - 1U);
+    auto end = region->gpa + region->size;
+
+    if (addr == region->next) {
+        region->window = std::clamp<std::size_t>(region->window * 2U, 1U, max_prefetch);
+    }
+    else {
+        region->window = 0;
+    }
+
+    auto next = addr + size;
+    for (std::size_t i = 0; i < region->window && next + size <= end; i++) {
+        if (!this->populate(*region, next, size)) {
+            break;
+        }
+
+        m_prefetched += size;
+        next += size;
+    }
+
+    region->next = next;
+    return true;
+}
+
+std::size_t
+demand_pager::faults() const
+{
+    std::lock_guard lock(m_mutex);
+    return m_faults;
+}
+
+std::size_t
+demand_pager::populated() const
+{
+    std::lock_guard lock(m_mutex);
+    return m_populated;
+}
+
+std::size_t
+demand_pager::prefetched() const
+{
+    std::lock_guard lock(m_mutex);
+    return m_prefetched;
+}
+
+demand_pager::region_t *
+demand_pager::find(ept::mmap &mmap, uintptr_t gpa)
+{
+    for (auto &region : m_regions) {
+        if (region.mmap == &mmap && gpa >= region.gpa && gpa - region.gpa < region.size) {
+            return &region;
+        }
+    }
+
+    return nullptr;
+}
+
+std::size_t
+demand_pager::populate(region_t &region, uintptr_t gpa)
+{
+    using namespace ::intel_x64::ept;
+
+    auto addr_2m = bfn::upper(gpa, pd::from);
+
+    if (addr_2m >= region.gpa && addr_2m + pd::page_size <= region.gpa + region.size) {
+        if (this->populate(region, addr_2m, pd::page_size)) {
+            return pd::page_size;
+        }
+    }
+
+    if (this->populate(region, bfn::upper(gpa, pt::from), pt::page_size)) {
+        return pt::page_size;
+    }
+
+    return 0;
+}
+
+bool
+demand_pager::populate(region_t &region, uintptr_t gpa, std::size_t size)
+{
+    using namespace ::intel_x64::ept;
+
+    if (region.mmap->is_mapped(gpa, size)) {
+        return false;
+    }
+
+    auto hpa = m_alloc(gpa, size);
+    if (hpa == 0) {
+        return false;
+    }
+
+    // The frame must be zeroed before it is mapped, otherwise the guest
+    // could read whatever it was last used for (e.g. by another guest).
+    //
+
+    m_zero(hpa, size);
+
+    if (size == pd::page_size) {
+        region.mmap->map_2m(gpa, hpa, region.attr, region.cache);
+    }
+    else {
+        region.mmap->map_4k(gpa, hpa, region.attr, region.cache);
+    }
+
+    region.frames[gpa] = {hpa, size};
+    m_populated += size;
+
+    return true;
+}
+
+void
+demand_pager::zero(uintptr_t hpa, std::size_t size)
+{
+    for (std::size_t offset = 0; offset < size; offset += ::x64::pt::page_size) {
+        std::memset(m_window.map(0, hpa + offset), 0, ::x64::pt::page_size);
+    }
+
+    m_window.unmap(0);
+}
+
+}
@@ -0,0 +1,104 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <hve/arch/intel_x64/dirty_bitmap.h>
+
+namespace eapis::intel_x64
+{
+
+constexpr const uint64_t page_shift = 12;
+constexpr const uint64_t page_size = 1ULL << page_shift;
+
+dirty_bitmap::dirty_bitmap(size_type size) :
+    m_size{size}
+{
+    expects(size != 0);
+
+    auto pages = (size + page_size - 1U) >> page_shift;
+    m_bits.resize((pages + 63U) >> 6U);
+}
+
+bool
+dirty_bitmap::set(uintptr_t gpa) noexcept
+{
+    if (gpa >= m_size) {
+        return false;
+    }
+
+    auto bit = gpa >> page_shift;
+    auto mask = 1ULL << (bit & 63U);
+
+    // Reading the word first avoids a locked operation (and bouncing the
+    // cache line between vCPUs) when the page is already dirty, which is
+    // the common case for a hot page.
+    //
+
+    auto &word = m_bits[bit >> 6U];
+
+    if ((__atomic_load_n(&word, __ATOMIC_RELAXED) & mask) != 0) {
+        return false;
+    }
+
+    return (__atomic_fetch_or(&word, mask, __ATOMIC_RELAXED) & mask) == 0;
+}
+
+bool
+dirty_bitmap::is_dirty(uintptr_t gpa) const noexcept
+{
+    if (gpa >= m_size) {
+        return false;
+    }
+
+    auto bit = gpa >> page_shift;
+    return (__atomic_load_n(&m_bits[bit >> 6U], __ATOMIC_RELAXED) & (1ULL << (bit & 63U))) != 0;
+}
+
+dirty_bitmap::size_type
+dirty_bitmap::harvest(gsl::span<uint64_t> bitmap)
+{
+    expects(static_cast<size_type>(bitmap.size()) >= m_bits.size());
+
+    size_type num = 0;
+
+    for (size_type i = 0; i < m_bits.size(); i++) {
+        auto word = __atomic_load_n(&m_bits[i], __ATOMIC_RELAXED);
+
+        if (word != 0) {
+            word = __atomic_exchange_n(&m_bits[i], 0, __ATOMIC_ACQ_REL);
+        }
+
+        bitmap[static_cast<std::ptrdiff_t>(i)] = word;
+        num += static_cast<size_type>(__builtin_popcountll(word));
+    }
+
+    return num;
+}
+
+void
+dirty_bitmap::clear() noexcept
+{
+    for (auto &word : m_bits) {
+        __atomic_store_n(&word, 0, __ATOMIC_RELAXED);
+    }
+}
+
+}
@@ -19,35 +19,87 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <algorithm>
+
 #include <hve/arch/intel_x64/vcpu.h>
 
 namespace eapis::intel_x64
 {
 
+// Every view in the EPTP list uses the same EPTP format as set_eptp (see
+// the Intel SDM, Vol. 3, 24.6.11)
+//
+constexpr const uint64_t eptp_memory_type_wb = 6U;
+constexpr const uint64_t eptp_page_walk_length = 3U << 3U;
+constexpr const uint64_t eptp_accessed_and_dirty_flags = 1U << 6U;
+
+constexpr const uint64_t ud_vector = 6U;
+
 ept_handler::ept_handler(
     gsl::not_null<vcpu *> vcpu
 ) :
-    m_vcpu{vcpu}
-{ }
+    m_vcpu{vcpu},
+    m_eptp_list{nullptr, free_page}
+{
+    using namespace vmcs_n;
+
+    vcpu->add_handler(
+        exit_reason::basic_exit_reason::vmfunc,
+        ::handler_delegate_t::create<ept_handler, &ept_handler::handle_vmfunc>(this)
+    );
+}
+
+ept_handler::~ept_handler()
+{
+    std::vector<ept::mmap *> maps{m_map};
+    maps.insert(maps.end(), m_eptp_views.begin(), m_eptp_views.end());
+
+    std::sort(maps.begin(), maps.end());
+    maps.erase(std::unique(maps.begin(), maps.end()), maps.end());
+
+    for (auto map : maps) {
+        if (map != nullptr) {
+            map->detach();
+        }
+    }
+}
 
 void ept_handler::set_eptp(ept::mmap *map)
 {
     using namespace vmcs_n;
     using namespace vmcs_n::secondary_processor_based_vm_execution_controls;
 
+    // Nothing is written to the VMCS until the map is known to be
+    // supported, so a failure leaves EPT as it was
+    //
+
+    if (map != nullptr && map->accessed_and_dirty_flags()) {
+        if (::intel_x64::msrs::ia32_vmx_ept_vpid_cap::accessed_dirty_support::is_disabled()) {
+            throw std::runtime_error("ept_handler::set_eptp: accessed and dirty flags not supported");
+        }
+    }
+
+    this->track(m_map, map, [&] { m_map = map; });
+
     if (map != nullptr) {
         if (ept_pointer::phys_addr::get() == 0) {
             m_vcpu->global_state()->ia32_vmx_cr0_fixed0 &= ~::intel_x64::cr0::paging::mask;
             m_vcpu->global_state()->ia32_vmx_cr0_fixed0 &= ~::intel_x64::cr0::protection_enable::mask;
 
             ept_pointer::memory_type::set(ept_pointer::memory_type::write_back);
-            ept_pointer::accessed_and_dirty_flags::disable();
             ept_pointer::page_walk_length_minus_one::set(3U);
 
             enable_ept::enable();
             unrestricted_guest::enable();
         }
 
+        if (map->accessed_and_dirty_flags()) {
+            ept_pointer::accessed_and_dirty_flags::enable();
+        }
+        else {
+            ept_pointer::accessed_and_dirty_flags::disable();
+        }
+
         ept_pointer::phys_addr::set(map->eptp());
     }
     else {
@@ -59,6 +111,9 @@ void ept_handler::set_eptp(ept::mmap *map)
             ept_pointer::accessed_and_dirty_flags::disable();
             ept_pointer::page_walk_length_minus_one::set(0);
 
+            this->disable_eptp_switching();
+            this->set_sppt(nullptr);
+
             enable_ept::disable();
             unrestricted_guest::disable();
         }
@@ -67,4 +122,242 @@ void ept_handler::set_eptp(ept::mmap *map)
     }
 }
 
+void ept_handler::invept()
+{
+    using namespace vmcs_n;
+
+    if (ept_pointer::phys_addr::get() == 0) {
+        return;
+    }
+
+    ::intel_x64::vmx::invept_single_context(ept_pointer::get());
+}
+
+void ept_handler::set_eptp_list_entry(std::size_t index, ept::mmap *map)
+{
+    expects(index < eptp_list_size);
+
+    if (!m_eptp_list) {
+        m_eptp_list.reset(static_cast<uint64_t *>(alloc_page()));
+        std::fill_n(m_eptp_list.get(), eptp_list_size, 0);
+
+        m_eptp_views.resize(eptp_list_size);
+    }
+
+    auto eptp = gsl::make_span(m_eptp_list.get(), eptp_list_size);
+
+    if (map == nullptr) {
+        if (eptp.at(index) != 0 && eptp.at(index) == vmcs_n::ept_pointer::get()) {
+            throw std::runtime_error("ept_handler::set_eptp_list_entry: view is active");
+        }
+
+        eptp.at(index) = 0;
+        this->track(m_eptp_views.at(index), nullptr, [&] { m_eptp_views.at(index) = nullptr; });
+
+        return;
+    }
+
+    auto val = map->eptp() | eptp_memory_type_wb | eptp_page_walk_length;
+
+    if (map->accessed_and_dirty_flags()) {
+        if (::intel_x64::msrs::ia32_vmx_ept_vpid_cap::accessed_dirty_support::is_disabled()) {
+            throw std::runtime_error("ept_handler::set_eptp_list_entry: accessed and dirty flags not supported");
+        }
+
+        val |= eptp_accessed_and_dirty_flags;
+    }
+
+    this->track(m_eptp_views.at(index), map, [&] {
+        eptp.at(index) = val;
+        m_eptp_views.at(index) = map;
+    });
+}
+
+void ept_handler::enable_eptp_switching()
+{
+    using namespace vmcs_n;
+    using namespace vmcs_n::secondary_processor_based_vm_execution_controls;
+
+    if (ept_pointer::phys_addr::get() == 0) {
+        throw std::runtime_error("ept_handler::enable_eptp_switching: EPT is not enabled");
+    }
+
+    if (::intel_x64::msrs::ia32_vmx_vmfunc::eptp_switching::is_disabled()) {
+        throw std::runtime_error("ept_handler::enable_eptp_switching: EPTP switching not supported");
+    }
+
+    if (!m_eptp_list) {
+        this->set_eptp_list_entry(0, nullptr);
+    }
+
+    eptp_list_address::set(g_mm->virtptr_to_physint(m_eptp_list.get()));
+
+    vm_function_controls::eptp_switching::enable();
+    enable_vm_functions::enable();
+}
+
+void ept_handler::disable_eptp_switching()
+{
+    using namespace vmcs_n;
+    using namespace vmcs_n::secondary_processor_based_vm_execution_controls;
+
+    if (!m_eptp_list) {
+        return;
+    }
+
+    enable_vm_functions::disable();
+    vm_function_controls::eptp_switching::disable();
+}
+
+ept::mmap *ept_handler::set_eptp_index(std::size_t index)
+{
+    auto map = this->eptp_list_entry(index);
+
+    if (map == nullptr) {
+        throw std::runtime_error("ept_handler::set_eptp_index: view does not exist");
+    }
+
+    vmcs_n::ept_pointer::set(m_eptp_list.get()[index]);
+    m_eptp_hint = index;
+
+    return map;
+}
+
+std::size_t ept_handler::eptp_index() const
+{
+    auto current = vmcs_n::ept_pointer::get();
+
+    if (!m_eptp_list || current == 0) {
+        return eptp_list_size;
+    }
+
+    auto eptp = gsl::make_span(m_eptp_list.get(), eptp_list_size);
+
+    if (eptp.at(static_cast<std::ptrdiff_t>(m_eptp_hint)) == current) {
+        return m_eptp_hint;
+    }
+
+    auto iter = std::find(eptp.begin(), eptp.end(), current);
+    auto index = static_cast<std::size_t>(iter - eptp.begin());
+
+    if (index != eptp_list_size) {
+        m_eptp_hint = index;
+    }
+
+    return index;
+}
+
+ept::mmap *ept_handler::map() const
+{
+    auto index = this->eptp_index();
+
+    if (index != eptp_list_size) {
+        return m_eptp_views.at(index);
+    }
+
+    return m_map;
+}
+
+ept::mmap *ept_handler::eptp_list_entry(std::size_t index) const
+{
+    expects(index < eptp_list_size);
+
+    if (!m_eptp_list) {
+        return nullptr;
+    }
+
+    return m_eptp_views.at(index);
+}
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+bool ept_handler::handle_vmfunc(gsl::not_null<vcpu_t *> vcpu)
+{
+    bfignored(vcpu);
+
+    // A VMFUNC only exits if it fails, in which case the instruction
+    // faults, so RIP is not advanced
+    //
+
+    m_vcpu->inject_exception(ud_vector);
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
+
+bool ept_handler::uses(const ept::mmap *map) const
+{
+    if (map == nullptr) {
+        return false;
+    }
+
+    if (m_map == map) {
+        return true;
+    }
+
+    return std::find(m_eptp_views.begin(), m_eptp_views.end(), map) != m_eptp_views.end();
+}
+
+// Calls f (which replaces old_map with new_map in one of the slots this
+// vCPU can walk), attaching new_map if this is the first slot that uses
+// it, and detaching old_map if this was the last slot that used it. The
+// map is attached first, so if it refuses, the slot is left unchanged.
+//
+template<typename F>
+void ept_handler::track(ept::mmap *old_map, ept::mmap *new_map, F f)
+{
+    if (old_map == new_map) {
+        return f();
+    }
+
+    if (new_map != nullptr && !this->uses(new_map)) {
+        new_map->attach();
+    }
+
+    f();
+
+    if (old_map != nullptr && !this->uses(old_map)) {
+        old_map->detach();
+    }
+}
+
+void ept_handler::set_sppt(ept::sppt *sppt)
+{
+    using namespace vmcs_n;
+    using namespace vmcs_n::secondary_processor_based_vm_execution_controls;
+
+    if (sppt == nullptr) {
+        if (m_sppt != nullptr) {
+            sub_page_write_permissions::disable();
+            sub_page_permission_table_pointer::set(0);
+        }
+
+        m_sppt = nullptr;
+        return;
+    }
+
+    if (ept_pointer::phys_addr::get() == 0) {
+        throw std::runtime_error("ept_handler::set_sppt: EPT is not enabled");
+    }
+
+    // The allowed-1 settings of the secondary controls are the high 32
+    // bits of IA32_VMX_PROCBASED_CTLS2
+    //
+
+    auto allowed1 = ::intel_x64::msrs::ia32_vmx_procbased_ctls2::get() >> 32U;
+
+    if ((allowed1 & sub_page_write_permissions::mask) == 0) {
+        throw std::runtime_error("ept_handler::set_sppt: sub-page write permissions not supported");
+    }
+
+    sub_page_permission_table_pointer::set(sppt->spptp());
+    sub_page_write_permissions::enable();
+
+    m_sppt = sppt;
+}
+
 }
@@ -0,0 +1,605 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <algorithm>
+
+#include <hve/arch/intel_x64/vcpu.h>
+
+namespace eapis::intel_x64
+{
+
+// -----------------------------------------------------------------------------
+// Decoder
+// -----------------------------------------------------------------------------
+
+constexpr const uint8_t rex_w = 0x08;
+constexpr const uint8_t rex_r = 0x04;
+
+namespace
+{
+
+// Walks the bytes of an instruction. Running out of bytes before the
+// instruction is complete means that the caller has to provide more bytes,
+// unless it already provided the largest possible instruction.
+//
+class cursor
+{
+public:
+
+    cursor(gsl::span<const uint8_t> bytes) noexcept :
+        m_bytes{bytes},
+        m_size{std::min(static_cast<std::size_t>(bytes.size()), mmio_decoder::max_insn_size)}
+    { }
+
+    bool next(uint8_t &byte) noexcept
+    {
+        if (m_index == m_size) {
+            return false;
+        }
+
+        byte = m_bytes[static_cast<std::ptrdiff_t>(m_index++)];
+        return true;
+    }
+
+    bool skip(std::size_t num) noexcept
+    {
+        if (m_size - m_index < num) {
+            return false;
+        }
+
+        m_index += num;
+        return true;
+    }
+
+    bool imm(std::size_t num, uint64_t &val) noexcept
+    {
+        val = 0;
+
+        for (std::size_t i = 0; i < num; i++) {
+            uint8_t byte = 0;
+
+            if (!this->next(byte)) {
+                return false;
+            }
+
+            val |= static_cast<uint64_t>(byte) << (i * 8U);
+        }
+
+        return true;
+    }
+
+    mmio_decoder::status_t eof() const noexcept
+    {
+        return m_size < mmio_decoder::max_insn_size ?
+               mmio_decoder::status_t::truncated :
+               mmio_decoder::status_t::unsupported;
+    }
+
+    std::size_t index() const noexcept
+    { return m_index; }
+
+private:
+
+    gsl::span<const uint8_t> m_bytes;
+    std::size_t m_size;
+    std::size_t m_index{0};
+};
+
+}
+
+static uint64_t
+sign_extend(uint64_t val, uint64_t size) noexcept
+{
+    auto shift = 64U - (size * 8U);
+    return static_cast<uint64_t>(static_cast<int64_t>(val << shift) >> shift);
+}
+
+// Only the length of the ModR/M operand matters, as the address that was
+// accessed is provided by the VM exit. Register operands (mod == 3) cannot
+// access memory and are rejected.
+//
+static mmio_decoder::status_t
+decode_modrm(cursor &cur, uint8_t rex, mmio_decoder::insn_t &insn)
+{
+    uint8_t modrm = 0;
+    std::size_t disp = 0;
+
+    if (!cur.next(modrm)) {
+        return cur.eof();
+    }
+
+    auto mod = modrm >> 6U;
+    auto rm = modrm & 7U;
+
+    if (mod == 3) {
+        return mmio_decoder::status_t::unsupported;
+    }
+
+    insn.reg = gsl::narrow_cast<uint8_t>(((modrm >> 3U) & 7U) | ((rex & rex_r) != 0 ? 8U : 0U));
+
+    if (mod == 1) {
+        disp = 1;
+    }
+
+    if (mod == 2 || (mod == 0 && rm == 5)) {
+        disp = 4;
+    }
+
+    if (rm == 4) {
+        uint8_t sib = 0;
+
+        if (!cur.next(sib)) {
+            return cur.eof();
+        }
+
+        if (mod == 0 && (sib & 7U) == 5) {
+            disp = 4;
+        }
+    }
+
+    if (!cur.skip(disp)) {
+        return cur.eof();
+    }
+
+    return mmio_decoder::status_t::ok;
+}
+
+mmio_decoder::status_t
+mmio_decoder::decode(
+    gsl::span<const uint8_t> bytes, bool long_mode, insn_t &insn) noexcept
+{
+    cursor cur{bytes};
+
+    uint8_t rex = 0;
+    uint8_t opcode = 0;
+    bool opsize = false;
+    bool addrsize = false;
+
+    insn = {};
+
+    // Legacy prefixes can come in any order, but a REX prefix is only used
+    // if it immediately precedes the opcode.
+    //
+
+    while (true) {
+        if (!cur.next(opcode)) {
+            return cur.eof();
+        }
+
+        switch (opcode) {
+            case 0x66:
+                opsize = true;
+                rex = 0;
+                continue;
+
+            case 0x67:
+                addrsize = true;
+                rex = 0;
+                continue;
+
+            case 0xF2:
+            case 0xF3:
+                insn.rep = true;
+                rex = 0;
+                continue;
+
+            case 0x26:
+            case 0x2E:
+            case 0x36:
+            case 0x3E:
+            case 0x64:
+            case 0x65:
+                rex = 0;
+                continue;
+
+            default:
+                break;
+        }
+
+        if (long_mode && (opcode & 0xF0U) == 0x40) {
+            rex = opcode;
+            continue;
+        }
+
+        break;
+    }
+
+    if (!long_mode && addrsize) {
+        return status_t::unsupported;
+    }
+
+    auto osize = gsl::narrow_cast<uint8_t>((rex & rex_w) != 0 ? 8 : opsize ? 2 : 4);
+    auto status = status_t::ok;
+
+    insn.addr_size = gsl::narrow_cast<uint8_t>(long_mode && !addrsize ? 8 : 4);
+
+    switch (opcode) {
+        case 0x88:
+        case 0x89:
+        case 0x8A:
+        case 0x8B:
+            insn.op = (opcode & 2U) == 0 ? op_t::store : op_t::load;
+            insn.size = (opcode & 1U) == 0 ? 1 : osize;
+            insn.reg_size = insn.size;
+            status = decode_modrm(cur, rex, insn);
+            break;
+
+        case 0xC6:
+        case 0xC7: {
+            insn.op = op_t::store;
+            insn.size = opcode == 0xC6 ? 1 : osize;
+            insn.reg_size = insn.size;
+            insn.has_imm = true;
+
+            if (status = decode_modrm(cur, rex, insn); status != status_t::ok) {
+                break;
+            }
+
+            if ((insn.reg & 7U) != 0) {
+                return status_t::unsupported;
+            }
+
+            auto num = std::min<std::size_t>(insn.size, 4);
+            if (!cur.imm(num, insn.imm)) {
+                return cur.eof();
+            }
+
+            insn.imm = sign_extend(insn.imm, num);
+            insn.reg = 0;
+            break;
+        }
+
+        case 0x63:
+            if (!long_mode || (rex & rex_w) == 0) {
+                return status_t::unsupported;
+            }
+
+            insn.op = op_t::load;
+            insn.size = 4;
+            insn.reg_size = 8;
+            insn.sign_extend = true;
+            status = decode_modrm(cur, rex, insn);
+            break;
+
+        case 0x0F:
+            if (!cur.next(opcode)) {
+                return cur.eof();
+            }
+
+            if (opcode != 0xB6 && opcode != 0xB7 && opcode != 0xBE && opcode != 0xBF) {
+                return status_t::unsupported;
+            }
+
+            insn.op = op_t::load;
+            insn.size = (opcode & 1U) == 0 ? 1 : 2;
+            insn.reg_size = osize;
+            insn.sign_extend = opcode >= 0xBE;
+            status = decode_modrm(cur, rex, insn);
+            break;
+
+        case 0xAA:
+        case 0xAB:
+            insn.op = op_t::stos;
+            insn.size = opcode == 0xAA ? 1 : osize;
+            insn.reg_size = insn.size;
+            break;
+
+        default:
+            return status_t::unsupported;
+    }
+
+    if (status != status_t::ok) {
+        return status;
+    }
+
+    if (insn.rep && insn.op != op_t::stos) {
+        return status_t::unsupported;
+    }
+
+    if (insn.reg_size == 1 && rex == 0 && insn.reg >= 4 && !insn.has_imm) {
+        insn.high_byte = true;
+        insn.reg -= 4;
+    }
+
+    insn.len = gsl::narrow_cast<uint8_t>(cur.index());
+    return status_t::ok;
+}
+
+// -----------------------------------------------------------------------------
+// Registers
+// -----------------------------------------------------------------------------
+
+static uint64_t
+get_gpr(gsl::not_null<vcpu_t *> vcpu, uint64_t reg)
+{
+    switch (reg) {
+        case 0: return vcpu->rax();
+        case 1: return vcpu->rcx();
+        case 2: return vcpu->rdx();
+        case 3: return vcpu->rbx();
+        case 4: return vcpu->rsp();
+        case 5: return vcpu->rbp();
+        case 6: return vcpu->rsi();
+        case 7: return vcpu->rdi();
+        case 8: return vcpu->r08();
+        case 9: return vcpu->r09();
+        case 10: return vcpu->r10();
+        case 11: return vcpu->r11();
+        case 12: return vcpu->r12();
+        case 13: return vcpu->r13();
+        case 14: return vcpu->r14();
+        default: return vcpu->r15();
+    }
+}
+
+static void
+set_gpr(gsl::not_null<vcpu_t *> vcpu, uint64_t reg, uint64_t val)
+{
+    switch (reg) {
+        case 0: vcpu->set_rax(val); break;
+        case 1: vcpu->set_rcx(val); break;
+        case 2: vcpu->set_rdx(val); break;
+        case 3: vcpu->set_rbx(val); break;
+        case 4: vcpu->set_rsp(val); break;
+        case 5: vcpu->set_rbp(val); break;
+        case 6: vcpu->set_rsi(val); break;
+        case 7: vcpu->set_rdi(val); break;
+        case 8: vcpu->set_r08(val); break;
+        case 9: vcpu->set_r09(val); break;
+        case 10: vcpu->set_r10(val); break;
+        case 11: vcpu->set_r11(val); break;
+        case 12: vcpu->set_r12(val); break;
+        case 13: vcpu->set_r13(val); break;
+        case 14: vcpu->set_r14(val); break;
+        default: vcpu->set_r15(val); break;
+    }
+}
+
+static uint64_t
+mask(uint64_t size) noexcept
+{ return size >= 8 ? ~0ULL : (1ULL << (size * 8U)) - 1U; }
+
+// Writing a 32bit register zero extends into the upper half of the 64bit
+// register, while writing an 8 or 16bit register leaves the rest of the
+// register alone.
+//
+static uint64_t
+merge(uint64_t old, uint64_t val, const mmio_decoder::insn_t &insn) noexcept
+{
+    if (insn.high_byte) {
+        return (old & ~0xFF00ULL) | ((val & 0xFFU) << 8U);
+    }
+
+    if (insn.reg_size >= 4) {
+        return val & mask(insn.reg_size);
+    }
+
+    return (old & ~mask(insn.reg_size)) | (val & mask(insn.reg_size));
+}
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+constexpr const uint64_t cs_access_rights_l = 1ULL << 13U;
+constexpr const uint64_t cs_access_rights_db = 1ULL << 14U;
+constexpr const uint64_t rflags_df = 1ULL << 10U;
+
+mmio_handler::mmio_handler(
+    gsl::not_null<vcpu *> vcpu
+) :
+    m_vcpu{vcpu}
+{
+    vcpu->add_ept_misconfiguration_handler(
+        ept_misconfiguration_handler::handler_delegate_t::create<mmio_handler, &mmio_handler::handle>(this)
+    );
+}
+
+// -----------------------------------------------------------------------------
+// Add Handler / Enablers
+// -----------------------------------------------------------------------------
+
+void
+mmio_handler::add_handler(
+    uint64_t gpa, uint64_t size, const handler_delegate_t &d)
+{
+    expects(size != 0);
+    expects(gpa + size > gpa);
+
+    auto end = gpa + size;
+    auto next = m_ranges.lower_bound(gpa);
+
+    if (next != m_ranges.end() && next->first < end) {
+        throw std::runtime_error(
+            "mmio_handler::add_handler: range overlaps a registered range"
+        );
+    }
+
+    if (next != m_ranges.begin() && std::prev(next)->second.end > gpa) {
+        throw std::runtime_error(
+            "mmio_handler::add_handler: range overlaps a registered range"
+        );
+    }
+
+    m_ranges.emplace_hint(next, gpa, range_t{end, d});
+}
+
+bool
+mmio_handler::remove_handler(uint64_t gpa)
+{ return m_ranges.erase(gpa) != 0; }
+
+void
+mmio_handler::flush_decode_cache() noexcept
+{ m_decode_cache.fill({}); }
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+bool
+mmio_handler::handle(
+    gsl::not_null<vcpu_t *> vcpu, ept_misconfiguration_handler::info_t &info)
+{
+    auto range = this->find_range(info.gpa);
+    if (range == nullptr) {
+        return false;
+    }
+
+    // 16bit code, and code that uses a non-zero CS base, is left to the
+    // other EPT misconfiguration handlers.
+    //
+
+    auto cs = vmcs_n::guest_cs_access_rights::get();
+    auto long_mode = (cs & cs_access_rights_l) != 0;
+
+    if (!long_mode && ((cs & cs_access_rights_db) == 0 || vmcs_n::guest_cs_base::get() != 0)) {
+        return false;
+    }
+
+    auto insn = this->decode(vcpu->rip(), long_mode);
+    if (insn == nullptr) {
+        return false;
+    }
+
+    if (!this->emulate(vcpu, *range, *insn, info.gpa)) {
+        return false;
+    }
+
+    // The VM-exit instruction length is not valid for EPT misconfigurations,
+    // so the instruction pointer is advanced here using the decoded length.
+    //
+
+    info.ignore_advance = true;
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
+
+const mmio_handler::range_t *
+mmio_handler::find_range(uint64_t gpa) const noexcept
+{
+    auto iter = m_ranges.upper_bound(gpa);
+
+    if (iter == m_ranges.begin()) {
+        return nullptr;
+    }
+
+    --iter;
+    return gpa < iter->second.end ? &iter->second : nullptr;
+}
+
+const mmio_decoder::insn_t *
+mmio_handler::decode(uint64_t rip, bool long_mode)
+{
+    using namespace ::x64::pt;
+
+    auto cr3 = vmcs_n::guest_cr3::get();
+    auto &entry = m_decode_cache.at(((rip ^ (rip >> 7U)) ^ (cr3 >> 12U)) & (decode_cache_size - 1U));
+
+    if (entry.insn.len != 0 && entry.rip == rip && entry.cr3 == cr3) {
+        return &entry.insn;
+    }
+
+    // Only map the page that RIP is on unless the instruction crosses into
+    // the next page, as that page might not be mapped by the guest.
+    //
+
+    mmio_decoder::insn_t insn{};
+    auto status = mmio_decoder::status_t::truncated;
+
+    auto len = std::min(mmio_decoder::max_insn_size, page_size - bfn::lower(rip, from));
+
+    for (auto i = 0; i < 2 && status == mmio_decoder::status_t::truncated; i++) {
+        auto map = m_vcpu->map_gva_4k<uint8_t>(rip, len);
+        status = mmio_decoder::decode({map.get(), static_cast<std::ptrdiff_t>(len)}, long_mode, insn);
+
+        len = mmio_decoder::max_insn_size;
+    }
+
+    if (status != mmio_decoder::status_t::ok) {
+        return nullptr;
+    }
+
+    entry = {cr3, rip, insn};
+    return &entry.insn;
+}
+
+bool
+mmio_handler::emulate(
+    gsl::not_null<vcpu_t *> vcpu, const range_t &range,
+    const mmio_decoder::insn_t &insn, uint64_t gpa)
+{
+    struct info_t info = {
+        gpa, insn.size, insn.op != mmio_decoder::op_t::load, 0
+    };
+
+    if (insn.op == mmio_decoder::op_t::store && insn.has_imm) {
+        info.val = insn.imm & mask(insn.size);
+    }
+    else if (info.write) {
+        auto val = get_gpr(vcpu, insn.reg);
+        info.val = (insn.high_byte ? val >> 8U : val) & mask(insn.size);
+    }
+
+    if (!range.d(vcpu, info)) {
+        return false;
+    }
+
+    if (insn.op == mmio_decoder::op_t::load) {
+        auto val = info.val & mask(insn.size);
+
+        if (insn.sign_extend) {
+            val = sign_extend(val, insn.size);
+        }
+
+        set_gpr(vcpu, insn.reg, merge(get_gpr(vcpu, insn.reg), val, insn));
+    }
+
+    // A REP STOS is emulated one iteration at a time. The instruction
+    // pointer is only advanced once RCX reaches 0, so the guest re-executes
+    // the instruction (and exits again) for each remaining iteration.
+    //
+
+    if (insn.op == mmio_decoder::op_t::stos) {
+        auto amask = mask(insn.addr_size);
+        auto size = static_cast<uint64_t>(insn.size);
+        auto step = (vmcs_n::guest_rflags::get() & rflags_df) != 0 ? 0ULL - size : size;
+
+        vcpu->set_rdi((vcpu->rdi() + step) & amask);
+
+        if (insn.rep) {
+            auto rcx = (vcpu->rcx() - 1U) & amask;
+            vcpu->set_rcx(rcx);
+
+            if (rcx != 0) {
+                return true;
+            }
+        }
+    }
+
+    vcpu->set_rip(vcpu->rip() + insn.len);
+    return true;
+}
+
+}
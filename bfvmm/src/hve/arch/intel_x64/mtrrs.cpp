@@ -19,6 +19,9 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <algorithm>
+#include <vector>
+
 #include <bfdebug.h>
 
 #include <intrinsics.h>
@@ -91,12 +94,10 @@ mtrrs::dump(int level, const char *str) const
 // Constructor
 //
 // The constructor first gets both the fixed and variable MTRRs and adds all of
-// the ranges to the ranges list. From there, the ranges are corrected to
-// remove any issues with the ranges being non-continuous or overlapping. Once
-// the ranges are corrected, the last step is to add an overlapping range for
-// all of memory that defines the default memory type and then correct the
-// ranges again to ensure the overlapping range is removed. The result is ever
-// single phyiscal address is accounted for my the range list, which makes
+// the variable ranges to the ranges list. From there, the ranges are flattened
+// into a list of continuous, non-overlapping ranges, with any memory that is
+// not covered by an MTRR given the default memory type. The result is every
+// single phyiscal address is accounted for by the range list, which makes
 // processing code like EPT much easier.
 //
 // Note that if an error occurs, we clear out the ranges list, which has the
@@ -109,10 +110,7 @@ mtrrs::mtrrs() noexcept
 
     guard_exceptions([&]() {
         if (ia32_mtrr_def_type::mtrr_enable::is_disabled()) {
-            this->add_range({
-                ept::mmap::memory_type::write_back, 0, 0xFFFFFFFFFFFFFFFF
-            });
-
+            this->flatten(ept::mmap::memory_type::write_back);
             return;
         }
 
@@ -121,9 +119,6 @@ mtrrs::mtrrs() noexcept
 
         dump(1, "original mtrrs");
 
-        while (!this->make_continuous())
-        { }
-
         ept::mmap::memory_type type;
         switch (ia32_mtrr_def_type::type::get()) {
             case ::intel_x64::msrs::ia32_mtrr_def_type::type::write_back:
@@ -147,12 +142,7 @@ mtrrs::mtrrs() noexcept
                 break;
         }
 
-        this->add_range({
-            type, 0, 0xFFFFFFFFFFFFFFFF
-        });
-
-        while (!this->make_continuous())
-        { }
+        this->flatten(type);
 
         dump(1, "corrected mtrrs");
     },
@@ -162,18 +152,40 @@ mtrrs::mtrrs() noexcept
             range = {};
         }
 
+        for (auto &span : m_spans)
+        {
+            span = {};
+        }
+
         m_num = 0;
+        m_num_spans = 0;
     });
 }
 
+const mtrrs::range_t &
+mtrrs::lookup(uint64_t addr) const
+{
+    expects(m_num_spans != 0);
+
+    auto end = m_spans.begin() + m_num_spans;
+    auto span = std::upper_bound(
+        m_spans.begin(), end, addr, [](uint64_t addr, const range_t & range) {
+            return addr < range.base;
+        }
+    );
+
+    expects(span != m_spans.begin());
+    return *(--span);
+}
+
 void
 mtrrs::get_fixed_ranges()
 {
-    this->add_range({
+    m_fixed = {
         ept::mmap::memory_type::uncacheable,
         0,
         0x100000
-    });
+    };
 }
 
 void
@@ -198,135 +210,145 @@ mtrrs::get_variable_ranges()
     }
 }
 
-// Is Subset
+// Resolve
 //
-// A set is a subset of a superset if the subset is completely contained
-// within the superset. We support subsets, we do not support intersecting
-// sets that are not subsets, which is why this is important.
+// Given the number of variable ranges of each memory type that cover a
+// range of memory, returns the effective memory type of that range as
+// defined by the SDM (11.11.4.1). Overlaps that the SDM leaves undefined
+// are treated as UC, which is always safe.
 //
-// { range1 [range2] }
+// @param count the number of covering ranges, indexed by memory type
+// @param default_type the memory type of memory not covered by any range
+// @return the effective memory type
 //
-// @param range1 superset
-// @param range2 test set
-// @return returns true if range2 is a subset of range1, false otherwise.
-//
-static auto is_subset(
-    const mtrrs::range_t &range1,
-    const mtrrs::range_t &range2)
+static ept::mmap::memory_type
+resolve(
+    const std::array<uint64_t, 8> &count,
+    ept::mmap::memory_type default_type)
 {
-    return
-        range2.base >= range1.base &&
-        range2.base + range2.size <= range1.base + range1.size;
-}
+    using memory_type = ept::mmap::memory_type;
 
-// Is Intersecting
-//
-// A set is intersecting another set if the set touches the other set in some
-// way. In our case, we only care about non-inclusive intersections (i.e. the
-// edge of a set does count as intersection). If a set is intersection, but
-// is not a subset, we have an MTRR configuration we do not support.
-//
-// { range1 [range2 } ]
-//
-// @param range1 superset
-// @param range2 test set
-// @return returns true if range2 is a subset of range1, false otherwise.
-//
-static auto is_intersecting(
-    const mtrrs::range_t &range1,
-    const mtrrs::range_t &range2)
-{
-    return
-        range2.base > range1.base &&
-        range2.base < range1.base + range1.size;
-}
+    auto num = [&](memory_type type) {
+        return count.at(static_cast<std::size_t>(type));
+    };
 
-// Compare
-//
-// The following function compares two ranges. The goal of the compare function
-// is to support sorting in ascending order. If both ranges have the same base,
-// the range with the larger size (i.e. the possible superset), gets moved to
-// the left, which supports the make_continuous function WRT to how it attempts
-// to detect subsets.
-//
-// @param range1 range to test
-// @param range2 range to test
-// @return returns the comparison of the two ranges
-//
-static auto compare(
-    const mtrrs::range_t &range1,
-    const mtrrs::range_t &range2)
-{
-    if (range1.base == range2.base) {
-        return range1.size > range2.size;
+    if (num(memory_type::uncacheable) != 0) {
+        return memory_type::uncacheable;
     }
 
-    return range1.base < range2.base;
+    auto wc = num(memory_type::write_combining) != 0;
+    auto wt = num(memory_type::write_through) != 0;
+    auto wp = num(memory_type::write_protected) != 0;
+    auto wb = num(memory_type::write_back) != 0;
+
+    switch (wc + wt + wp + wb) {
+        case 0:
+            return default_type;
+
+        case 1:
+            if (wc) {
+                return memory_type::write_combining;
+            }
+
+            if (wt) {
+                return memory_type::write_through;
+            }
+
+            return wp ? memory_type::write_protected : memory_type::write_back;
+
+        default:
+            if (wt && wb && !wc && !wp) {
+                return memory_type::write_through;
+            }
+
+            return memory_type::uncacheable;
+    }
 }
 
-// Make Continuous
+// Flatten
 //
 // The goal of this function is to flatten the MTRRs into non-overlapping,
-// continuous ranges. To do this, the function first sorts the ranges into
-// ascending order and then looks for overlapping ranges. There are two
-// types of overlapping ranges:
-// - subsets (one range completely encapsulates the other)
-// - intersecting (two ranges touch)
+// continuous ranges. To do this, the start and end of each variable range is
+// turned into an event, and the events are sorted once. The events are then
+// swept in order, keeping a count of how many ranges of each memory type
+// cover the current position. Every time the position moves, the range of
+// memory between the previous event and the current one is emitted with the
+// memory type resolved from those counts. The fixed ranges always win.
 //
-// If a range is a subset of another, we break the superset apart and then
-// return from this function with "false", telling the caller to run the
-// function again to continue attempting to make the ranges continuous. This
-// process will repeat until all of the ranges are continuous and
-// non-overlapping. If two ranges are not subsets, but are intersecting, we
-// error out as this type of MTRR setup is not supported currently.
+// Once the ranges are flattened, neighbouring ranges that share the same
+// memory type are merged into the spans used by lookup().
 //
-bool
-mtrrs::make_continuous()
+void
+mtrrs::flatten(ept::mmap::memory_type default_type)
 {
-    std::sort(
-        m_ranges.begin(), m_ranges.end(), compare
-    );
+    struct event_t {
+        uint64_t addr;
+        std::size_t type;
+        int64_t delta;
+    };
 
-    for (uint8_t i = 0U; i < m_num - 1U; i++) {
-        auto &r1 = m_ranges.at(i);
-        auto &r2 = m_ranges.at(i + 1U);
+    constexpr const auto end_addr = 0xFFFFFFFFFFFFFFFF;
 
-        if (is_subset(r1, r2)) {
-            auto size1 = r2.base - r1.base;
-            auto size2 = r1.base + r1.size - r2.base - r2.size;
+    std::vector<event_t> events;
+    events.reserve((m_num * 2U) + 2U);
 
-            if (size1 != 0) {
-                this->add_range({
-                    r1.type,
-                    r1.base,
-                    size1
-                });
-            }
+    for (uint8_t i = 0U; i < m_num; i++) {
+        const auto &range = m_ranges.at(i);
+        auto type = static_cast<std::size_t>(range.type);
 
-            if (size2 != 0) {
-                this->add_range({
-                    r1.type,
-                    r2.base + r2.size,
-                    size2
-                });
-            }
+        events.push_back({range.base, type, 1});
+        events.push_back({std::min(range.base + range.size, end_addr), type, -1});
+    }
 
-            r1 = {
-                ept::mmap::memory_type::uncacheable,
-                invalid,
-                invalid
-            };
+    auto fixed_end = 0ULL;
+    if (m_fixed.size != invalid) {
+        fixed_end = m_fixed.base + m_fixed.size;
+        events.push_back({fixed_end, 0, 0});
+    }
 
-            m_num--;
-            return false;
-        }
+    std::sort(events.begin(), events.end(), [](const auto & e1, const auto & e2) {
+        return e1.addr < e2.addr;
+    });
+
+    for (auto &range : m_ranges) {
+        range = {};
+    }
+
+    m_num = 0;
 
-        if (is_intersecting(r1, r2)) {
-            throw std::runtime_error("Unable to create mutually exclusive MTRRs");
+    std::array<uint64_t, 8> count{};
+    uint64_t addr = 0;
+
+    for (auto iter = events.begin(); addr < end_addr;) {
+        for (; iter != events.end() && iter->addr <= addr; ++iter) {
+            count.at(iter->type) += static_cast<uint64_t>(iter->delta);
         }
+
+        auto next = iter != events.end() ? iter->addr : end_addr;
+
+        auto type = addr < fixed_end ?
+                    m_fixed.type : resolve(count, default_type);
+
+        this->add_range({type, addr, next - addr});
+        addr = next;
     }
 
-    return true;
+    m_num_spans = 0;
+
+    for (uint8_t i = 0U; i < m_num; i++) {
+        const auto &range = m_ranges.at(i);
+
+        if (m_num_spans != 0) {
+            auto &span = m_spans.at(m_num_spans - 1U);
+
+            if (span.type == range.type) {
+                span.size += range.size;
+                continue;
+            }
+        }
+
+        m_spans.at(m_num_spans++) = range;
+    }
 }
 
 void
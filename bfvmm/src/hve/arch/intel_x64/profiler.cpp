@@ -0,0 +1,254 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <algorithm>
+
+#include <hve/arch/intel_x64/vcpu.h>
+#include <hve/arch/intel_x64/profiler.h>
+
+namespace eapis::intel_x64
+{
+
+constexpr const uint64_t ns_per_s = 1000000000ULL;
+
+profiler::profiler(
+    gsl::not_null<vcpu *> vcpu
+) :
+    m_vcpu{vcpu}
+{
+    vcpu->emulate_cpuid(
+        profiler_abi::leaf,
+        cpuid_handler::handler_delegate_t::create<profiler, &profiler::handle_cpuid>(this)
+    );
+}
+
+// -----------------------------------------------------------------------------
+// Enable / Disable
+// -----------------------------------------------------------------------------
+
+void
+profiler::enable(uint64_t freq_hz, std::size_t capacity)
+{
+    expects(freq_hz != 0);
+    expects(freq_hz <= max_freq_hz);
+    expects(capacity != 0);
+    expects((capacity & (capacity - 1)) == 0);
+
+    if (m_ring.size() != capacity) {
+        m_ring.resize(capacity);
+        m_head = 0;
+        m_tail = 0;
+    }
+
+    this->disable();
+
+    m_timer = m_vcpu->add_periodic_timer(
+        ns_per_s / freq_hz,
+        timer_wheel::handler_delegate_t::create<profiler, &profiler::handle_sample>(this)
+    );
+}
+
+void
+profiler::disable()
+{
+    if (m_timer == timer_wheel::invalid_id) {
+        return;
+    }
+
+    m_vcpu->cancel_timer(m_timer);
+    m_timer = timer_wheel::invalid_id;
+}
+
+bool
+profiler::pop(sample_t &sample)
+{
+    if (m_head == m_tail) {
+        return false;
+    }
+
+    sample = m_ring[m_head & (m_ring.size() - 1)];
+    m_head++;
+
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+void
+profiler::handle_sample(
+    gsl::not_null<vcpu_t *> vcpu, timer_wheel::info_t &info)
+{
+    bfignored(info);
+
+    if (m_tail - m_head == m_ring.size()) {
+        m_dropped++;
+        return;
+    }
+
+    auto &sample = m_ring[m_tail & (m_ring.size() - 1)];
+
+    sample.rip = vcpu->rip();
+    sample.cr3 = vmcs_n::guest_cr3::get();
+    sample.depth = 0;
+
+    // The frame pointer walk only makes sense for a 64bit guest. For
+    // everything else, the RIP on its own is still a useful sample.
+    //
+
+    if (vmcs_n::vm_entry_controls::ia_32e_mode_guest::is_enabled()) {
+        this->walk(vcpu->rbp(), sample);
+    }
+
+    m_tail++;
+}
+
+bool
+profiler::handle_cpuid(
+    gsl::not_null<vcpu_t *> vcpu, cpuid_handler::info_t &info)
+{
+    // The cpuid_handler only returns the lower 32 bits of each register,
+    // which is not enough for an address, so the registers are written
+    // here instead.
+    //
+
+    info.ignore_write = true;
+
+    auto rax = profiler_abi::status_success;
+    auto rbx = 0ULL;
+    auto rcx = 0ULL;
+    auto rdx = 0ULL;
+
+    // Samples contain kernel addresses and CR3 values, and starting the
+    // profiler adds VM exits, so unless the VMM has allowed user access,
+    // only the guest kernel may use the interface. The CPL is the DPL of
+    // SS.
+    //
+
+    auto cmd = vcpu->rbx();
+
+    if (!m_user_access && vmcs_n::guest_ss_access_rights::dpl::get() != 0) {
+        cmd = 0;
+    }
+
+    switch (cmd) {
+        case profiler_abi::cmd_start:
+            if (vcpu->rcx() == 0) {
+                rax = profiler_abi::status_failure;
+                break;
+            }
+
+            this->enable(std::min(vcpu->rcx(), max_freq_hz));
+            break;
+
+        case profiler_abi::cmd_stop:
+            this->disable();
+            break;
+
+        case profiler_abi::cmd_pop:
+            if (!this->pop(m_current)) {
+                rax = profiler_abi::status_empty;
+                break;
+            }
+
+            rax = m_current.depth;
+            rbx = m_current.rip;
+            rcx = m_current.cr3;
+            rdx = m_dropped;
+            break;
+
+        case profiler_abi::cmd_frames: {
+            auto index = vcpu->rcx();
+            if (index >= m_current.depth) {
+                rax = profiler_abi::status_failure;
+                break;
+            }
+
+            auto frame = [&](uint64_t i) {
+                return i < m_current.depth ? m_current.frames.at(i) : 0ULL;
+            };
+
+            rbx = frame(index + 0);
+            rcx = frame(index + 1);
+            rdx = frame(index + 2);
+            break;
+        }
+
+        default:
+            rax = profiler_abi::status_failure;
+            break;
+    }
+
+    vcpu->set_rax(rax);
+    vcpu->set_rbx(rbx);
+    vcpu->set_rcx(rcx);
+    vcpu->set_rdx(rdx);
+
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Stack Walk
+// -----------------------------------------------------------------------------
+
+// Each frame is laid out as [rbp] = the caller's rbp, [rbp + 8] = the return
+// address. Since the stack grows down, a valid chain always moves to higher
+// addresses, which also guarantees that the walk terminates on a corrupt
+// chain. Any frame that cannot be translated or mapped ends the walk.
+//
+void
+profiler::walk(uint64_t rbp, sample_t &sample)
+{
+    while (sample.depth < profiler_abi::max_depth) {
+        if (rbp == 0 || bfn::lower(rbp, 3) != 0) {
+            return;
+        }
+
+        uint64_t next = 0;
+        uint64_t ret = 0;
+
+        try {
+            auto frame = m_vcpu->map_gva_4k<uint64_t>(rbp, 2);
+
+            next = frame.get()[0];
+            ret = frame.get()[1];
+        }
+        catch (...) {
+            return;
+        }
+
+        if (ret == 0) {
+            return;
+        }
+
+        sample.frames.at(sample.depth++) = ret;
+
+        if (next <= rbp) {
+            return;
+        }
+
+        rbp = next;
+    }
+}
+
+}
@@ -0,0 +1,249 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <algorithm>
+
+#include <hve/arch/intel_x64/timer_wheel.h>
+
+namespace eapis::intel_x64
+{
+
+// Timers that are in the middle of being expired, and timers that are too
+// far out to fit in the wheel are tracked in separate lists. The index uses
+// the following levels to identify them.
+//
+constexpr static uint64_t expiring_level = 4;
+constexpr static uint64_t overflow_level = 5;
+
+static inline uint64_t
+rotr(uint64_t val, uint64_t n) noexcept
+{
+    n &= 63U;
+    return n == 0 ? val : (val >> n) | (val << (64U - n));
+}
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+timer_wheel::id_t
+timer_wheel::add(
+    uint64_t now, uint64_t deadline, uint64_t period,
+    const handler_delegate_t &d)
+{
+    if (m_index.empty() && now > m_now) {
+        m_now = now;
+    }
+
+    auto id = m_next_id++;
+    this->insert({id, deadline, period, d});
+
+    return id;
+}
+
+bool
+timer_wheel::cancel(id_t id)
+{
+    const auto &loc = m_index.find(id);
+    if (loc == m_index.end()) {
+        return false;
+    }
+
+    this->remove(loc->second.level, loc->second.slot, loc->second.iter);
+    m_index.erase(loc);
+
+    return true;
+}
+
+std::size_t
+timer_wheel::expire(gsl::not_null<vcpu_t *> vcpu, uint64_t now)
+{
+    std::size_t fired = 0;
+    now = std::max(now, m_now);
+
+    // Collect every slot that the wheel has moved across, on every level.
+    // Timers that have not expired yet are cascaded back into the wheel
+    // relative to the new time.
+    //
+
+    for (uint64_t level = 0; level < num_levels; level++) {
+        auto old_pos = m_now >> shift(level);
+        auto new_pos = now >> shift(level);
+        auto count = std::min(new_pos - old_pos, num_slots - 1);
+
+        for (uint64_t i = 0; i <= count; i++) {
+            auto slot = (old_pos + i) & (num_slots - 1);
+            auto &list = m_slots.at(level).at(slot);
+
+            for (auto iter = list.begin(); iter != list.end(); ++iter) {
+                m_index[iter->id] = {expiring_level, 0, iter};
+            }
+
+            m_expiring.splice(m_expiring.end(), list);
+            m_occupied.at(level) &= ~(1ULL << slot);
+        }
+    }
+
+    // Timers that did not fit in the wheel are re-evaluated every time the
+    // wheel turns. There should only ever be a handful of these.
+    //
+
+    for (auto iter = m_overflow.begin(); iter != m_overflow.end(); ++iter) {
+        m_index[iter->id] = {expiring_level, 0, iter};
+    }
+
+    m_expiring.splice(m_expiring.end(), m_overflow);
+    m_now = now;
+
+    // Note that a delegate is free to add or cancel timers (including any
+    // timer in the expiring list), so the list is always consumed from the
+    // front.
+    //
+
+    while (!m_expiring.empty()) {
+        auto iter = m_expiring.begin();
+
+        if (iter->deadline > now) {
+            this->insert(m_expiring, iter);
+            continue;
+        }
+
+        auto timer = std::move(*iter);
+        m_expiring.erase(iter);
+        m_index.erase(timer.id);
+
+        struct info_t info = {
+            timer.id, timer.deadline, now, false
+        };
+
+        timer.d(vcpu, info);
+        fired++;
+
+        if (timer.period == 0 || info.cancel) {
+            continue;
+        }
+
+        timer.deadline += timer.period;
+        if (timer.deadline <= now) {
+            timer.deadline = now + timer.period;
+        }
+
+        this->insert(std::move(timer));
+    }
+
+    return fired;
+}
+
+uint64_t
+timer_wheel::next_deadline() const
+{
+    uint64_t deadline = never;
+
+    for (const auto &timer : m_overflow) {
+        deadline = std::min(deadline, timer.deadline);
+    }
+
+    // Within a level, every pending timer is less than num_slots slots
+    // ahead of the current position, so the first occupied slot after the
+    // current position holds the earliest timer of that level.
+    //
+
+    for (uint64_t level = 0; level < num_levels; level++) {
+        auto occupied = m_occupied.at(level);
+        if (occupied == 0) {
+            continue;
+        }
+
+        auto pos = (m_now >> shift(level)) & (num_slots - 1);
+        auto next = static_cast<uint64_t>(__builtin_ctzll(rotr(occupied, pos)));
+        auto slot = (pos + next) & (num_slots - 1);
+
+        for (const auto &timer : m_slots.at(level).at(slot)) {
+            deadline = std::min(deadline, timer.deadline);
+        }
+    }
+
+    return deadline;
+}
+
+void
+timer_wheel::insert(timer_t &&timer)
+{
+    std::list<timer_t> list;
+    list.push_back(std::move(timer));
+
+    this->insert(list, list.begin());
+}
+
+void
+timer_wheel::insert(std::list<timer_t> &list, std::list<timer_t>::iterator iter)
+{
+    auto deadline = std::max(iter->deadline, m_now);
+
+    uint64_t level = 0;
+    uint64_t pos = 0;
+
+    for (; level < num_levels; level++) {
+        pos = deadline >> shift(level);
+
+        if (pos - (m_now >> shift(level)) < num_slots) {
+            break;
+        }
+    }
+
+    if (level == num_levels) {
+        m_overflow.splice(m_overflow.end(), list, iter);
+        m_index[iter->id] = {overflow_level, 0, iter};
+
+        return;
+    }
+
+    auto slot = pos & (num_slots - 1);
+    auto &dst = m_slots.at(level).at(slot);
+
+    dst.splice(dst.end(), list, iter);
+    m_occupied.at(level) |= 1ULL << slot;
+
+    m_index[iter->id] = {level, slot, iter};
+}
+
+void
+timer_wheel::remove(uint64_t level, uint64_t slot, std::list<timer_t>::iterator iter)
+{
+    if (level == expiring_level) {
+        m_expiring.erase(iter);
+        return;
+    }
+
+    if (level == overflow_level) {
+        m_overflow.erase(iter);
+        return;
+    }
+
+    auto &list = m_slots.at(level).at(slot);
+    list.erase(iter);
+
+    if (list.empty()) {
+        m_occupied.at(level) &= ~(1ULL << slot);
+    }
+}
+
+}
@@ -0,0 +1,321 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <mutex>
+#include <tuple>
+
+#include <bfdebug.h>
+#include <bfgsl.h>
+
+#include <intrinsics.h>
+#include <hve/arch/intel_x64/time.h>
+#include <hve/arch/intel_x64/tsc.h>
+
+namespace eapis::intel_x64
+{
+
+// -----------------------------------------------------------------------------
+// Calibration Sources
+// -----------------------------------------------------------------------------
+
+constexpr const uint64_t ns_per_s = 1000000000ULL;
+constexpr const uint64_t MHz = 1000000ULL;
+
+constexpr const uint16_t pit_port_ch2 = 0x42;
+constexpr const uint16_t pit_port_cmd = 0x43;
+constexpr const uint16_t pit_port_gate = 0x61;
+
+constexpr const uint64_t pit_freq_hz = 1193182ULL;
+constexpr const uint64_t pit_latch = pit_freq_hz / 100U;        // 10ms
+
+constexpr const uint64_t pm_timer_freq_hz = 3579545ULL;
+constexpr const uint64_t pm_timer_mask = 0xFFFFFFULL;
+constexpr const uint64_t pm_timer_ticks = pm_timer_freq_hz / 100U;     // 10ms
+
+constexpr const uint64_t max_spin_loops = 0x10000000ULL;
+
+static uint64_t
+cpuid_max_leaf()
+{
+    return std::get<0>(::x64::cpuid::get(0, 0, 0, 0));
+}
+
+// Per the SDM, if CPUID.15H:EBX[31:0] != 0 and CPUID.15H:ECX[31:0] != 0,
+// the TSC frequency is crystal_hz * EBX / EAX. On a lot of client parts
+// ECX is 0, in which case we fall through to CPUID.16H.
+//
+static uint64_t
+cpuid_15h_freq_hz()
+{
+    if (cpuid_max_leaf() < 0x15) {
+        return 0;
+    }
+
+    auto [eax, ebx, ecx, edx] = ::x64::cpuid::get(0x15, 0, 0, 0);
+    bfignored(edx);
+
+    if (eax == 0 || ebx == 0 || ecx == 0) {
+        return 0;
+    }
+
+    return (static_cast<uint64_t>(ecx) * ebx) / eax;
+}
+
+// CPUID.16H:EAX[15:0] reports the processor base frequency in MHz which,
+// on processors with an invariant TSC, matches the TSC frequency.
+//
+static uint64_t
+cpuid_16h_freq_hz()
+{
+    if (cpuid_max_leaf() < 0x16) {
+        return 0;
+    }
+
+    auto eax = std::get<0>(::x64::cpuid::get(0x16, 0, 0, 0));
+    return static_cast<uint64_t>(eax & 0xFFFFU) * MHz;
+}
+
+// The ACPI PM timer runs at 3.579545 MHz and is at least 24 bits wide, so
+// all of the math below is done modulo 2^24 to handle a wrap.
+//
+static uint64_t
+pm_timer_freq_hz_of_tsc(uint16_t port)
+{
+    if (port == 0) {
+        return 0;
+    }
+
+    auto pm_start = ::x64::portio::ind(port) & pm_timer_mask;
+    auto tsc_start = ::x64::read_tsc::get();
+
+    auto pm_delta = 0ULL;
+    for (auto loops = 0ULL; pm_delta < pm_timer_ticks; loops++) {
+        if (loops > max_spin_loops) {
+            return 0;
+        }
+
+        pm_delta = ((::x64::portio::ind(port) & pm_timer_mask) - pm_start) & pm_timer_mask;
+    }
+
+    auto tsc_delta = ::x64::read_tsc::get() - tsc_start;
+    return (tsc_delta * pm_timer_freq_hz) / pm_delta;
+}
+
+// PIT channel 2 is programmed in mode 0 (interrupt on terminal count) with
+// the speaker disabled. Once the count expires, the channel 2 output is
+// reflected in bit 5 of port 0x61.
+//
+static uint64_t
+pit_freq_hz_of_tsc()
+{
+    using namespace ::x64::portio;
+
+    auto gate = inb(pit_port_gate);
+    outb(pit_port_gate, gsl::narrow_cast<uint8_t>((gate & ~0x02U) | 0x01U));
+
+    outb(pit_port_cmd, 0xB0U);
+    outb(pit_port_ch2, gsl::narrow_cast<uint8_t>(pit_latch & 0xFFU));
+    outb(pit_port_ch2, gsl::narrow_cast<uint8_t>(pit_latch >> 8U));
+
+    auto tsc_start = ::x64::read_tsc::get();
+
+    for (auto loops = 0ULL; (inb(pit_port_gate) & 0x20U) == 0; loops++) {
+        if (loops > max_spin_loops) {
+            outb(pit_port_gate, gate);
+            return 0;
+        }
+    }
+
+    auto tsc_delta = ::x64::read_tsc::get() - tsc_start;
+    outb(pit_port_gate, gate);
+
+    return (tsc_delta * pit_freq_hz) / pit_latch;
+}
+
+static uint64_t
+platform_info_freq_hz()
+{ return time::tsc_freq_MHz(time::bus_freq_MHz()) * MHz; }
+
+// -----------------------------------------------------------------------------
+// Cache
+// -----------------------------------------------------------------------------
+
+static std::mutex g_mutex;
+static uint64_t g_freq_hz{0};
+static tsc::source_t g_source{tsc::source_t::none};
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+tsc::conversion_t
+tsc::make_conversion(uint64_t from_hz, uint64_t to_hz)
+{
+    expects(from_hz != 0);
+    expects(from_hz >> 63U == 0);
+
+    // Long division of (to_hz << shift) / from_hz, one bit at a time, until
+    // the next bit would overflow the multiplier. This only uses 64bit
+    // arithmetic and is only ever executed during calibration.
+    //
+
+    uint64_t mult = to_hz / from_hz;
+    uint64_t rem = to_hz % from_hz;
+    uint64_t shift = 0;
+
+    while (shift < 63 && (mult >> 63U) == 0) {
+        mult <<= 1U;
+        rem <<= 1U;
+
+        if (rem >= from_hz) {
+            rem -= from_hz;
+            mult |= 1U;
+        }
+
+        shift++;
+    }
+
+    // Round to nearest so that exact ratios (e.g. 3GHz -> 1GHz) convert
+    // without losing a tick to truncation.
+    //
+
+    if (rem >= from_hz - rem && mult != ~0ULL) {
+        mult++;
+    }
+
+    return {mult, shift};
+}
+
+void
+tsc::calibrate(uint16_t pm_timer_port)
+{
+    auto pet_shift =
+        ::intel_x64::msrs::ia32_vmx_misc::preemption_timer_decrement::get();
+
+    std::lock_guard<std::mutex> lock(g_mutex);
+
+    if (g_freq_hz != 0 && time::invariant_tsc_supported()) {
+        this->set_freq_hz(g_freq_hz, pet_shift, g_source);
+        return;
+    }
+
+    auto source = source_t::cpuid_15h;
+    auto freq_hz = cpuid_15h_freq_hz();
+
+    if (freq_hz == 0) {
+        source = source_t::cpuid_16h;
+        freq_hz = cpuid_16h_freq_hz();
+    }
+
+    if (freq_hz == 0) {
+        source = source_t::acpi_pm_timer;
+        freq_hz = pm_timer_freq_hz_of_tsc(pm_timer_port);
+    }
+
+    if (freq_hz == 0) {
+        source = source_t::pit;
+        freq_hz = pit_freq_hz_of_tsc();
+    }
+
+    if (freq_hz == 0) {
+        source = source_t::platform_info;
+        freq_hz = platform_info_freq_hz();
+    }
+
+    if (freq_hz == 0) {
+        bfalert_info(0, "tsc::calibrate: unable to determine TSC frequency");
+        return;
+    }
+
+    g_freq_hz = freq_hz;
+    g_source = source;
+
+    this->set_freq_hz(freq_hz, pet_shift, source);
+}
+
+void
+tsc::set_freq_hz(uint64_t freq_hz, uint64_t pet_shift, source_t source)
+{
+    expects(freq_hz != 0);
+    expects(pet_shift < 64);
+
+    auto pet_freq_hz = freq_hz >> pet_shift;
+    expects(pet_freq_hz != 0);
+
+    m_source = source;
+    m_freq_hz = freq_hz;
+    m_pet_shift = pet_shift;
+
+    m_to_MHz = make_conversion(MHz, 1);
+    m_tsc_to_ns = make_conversion(freq_hz, ns_per_s);
+    m_ns_to_tsc = make_conversion(ns_per_s, freq_hz);
+    m_pet_to_ns = make_conversion(pet_freq_hz, ns_per_s);
+    m_ns_to_pet = make_conversion(ns_per_s, pet_freq_hz);
+}
+
+void
+tsc::dump(int level) const
+{
+    bfdebug_transaction(level, [&](std::string * msg) {
+        bfdebug_lnbr(level, msg);
+        bfdebug_info(level, "tsc", msg);
+        bfdebug_brk2(level, msg);
+
+        switch (m_source) {
+            case source_t::cpuid_15h:
+                bfdebug_subtext(level, "source", "cpuid.15H", msg);
+                break;
+
+            case source_t::cpuid_16h:
+                bfdebug_subtext(level, "source", "cpuid.16H", msg);
+                break;
+
+            case source_t::acpi_pm_timer:
+                bfdebug_subtext(level, "source", "acpi pm timer", msg);
+                break;
+
+            case source_t::pit:
+                bfdebug_subtext(level, "source", "pit", msg);
+                break;
+
+            case source_t::platform_info:
+                bfdebug_subtext(level, "source", "platform info", msg);
+                break;
+
+            case source_t::manual:
+                bfdebug_subtext(level, "source", "manual", msg);
+                break;
+
+            default:
+                bfdebug_subtext(level, "source", "none", msg);
+                break;
+        };
+
+        bfdebug_subndec(level, "freq (Hz)", m_freq_hz, msg);
+        bfdebug_subndec(level, "pet shift", m_pet_shift, msg);
+        bfdebug_subnhex(level, "tsc->ns mult", m_tsc_to_ns.mult, msg);
+        bfdebug_subndec(level, "tsc->ns shift", m_tsc_to_ns.shift, msg);
+        bfdebug_subnhex(level, "ns->tsc mult", m_ns_to_tsc.mult, msg);
+        bfdebug_subndec(level, "ns->tsc shift", m_ns_to_tsc.shift, msg);
+    });
+}
+
+}
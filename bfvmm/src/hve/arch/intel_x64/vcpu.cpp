@@ -19,6 +19,8 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <cstring>
+
 #include <hve/arch/intel_x64/vcpu.h>
 
 namespace eapis::intel_x64
@@ -49,12 +51,17 @@ vcpu::vcpu(
     m_external_interrupt_handler{this},
     m_init_signal_handler{this},
     m_interrupt_window_handler{this},
+    m_page_modification_log_handler{this},
     m_sipi_signal_handler{this},
 
     m_ept_handler{this},
     m_microcode_handler{this},
+    m_mmio_handler{this},
     m_vpid_handler{this},
-    m_preemption_timer_handler{this}
+    m_virtualization_exception_handler{this},
+    m_preemption_timer_handler{this},
+
+    m_profiler{this}
 {
     using namespace vmcs_n;
 
@@ -65,6 +72,7 @@ vcpu::vcpu(
     primary_processor_based_vm_execution_controls::use_msr_bitmap::enable();
     primary_processor_based_vm_execution_controls::use_io_bitmaps::enable();
 
+    m_tsc.calibrate();
     this->enable_vpid();
 }
 
@@ -78,18 +86,292 @@ vcpu::vcpu(
 
 void
 vcpu::set_eptp(ept::mmap &map)
+{ m_ept_handler.set_eptp(&map); }
+
+void
+vcpu::disable_ept()
+{ m_ept_handler.set_eptp(nullptr); }
+
+void
+vcpu::invept()
+{ m_ept_handler.invept(); }
+
+std::size_t
+vcpu::harvest_dirty(
+    uintptr_t gpa, std::size_t size, gsl::span<uint64_t> bitmap)
+{
+    auto mmap = m_ept_handler.map();
+
+    if (mmap == nullptr) {
+        throw std::runtime_error("vcpu::harvest_dirty: EPT is not enabled");
+    }
+
+    if (mmap->attached() > 1) {
+        throw std::runtime_error("vcpu::harvest_dirty: map is used by more than one vcpu");
+    }
+
+    auto num = mmap->harvest_dirty(gpa, size, bitmap);
+
+    if (num != 0) {
+        m_ept_handler.invept();
+    }
+
+    return num;
+}
+
+std::size_t
+vcpu::harvest_accessed(
+    uintptr_t gpa, std::size_t size, gsl::span<uint64_t> bitmap)
 {
-    m_ept_handler.set_eptp(&map);
-    m_mmap = &map;
+    auto mmap = m_ept_handler.map();
+
+    if (mmap == nullptr) {
+        throw std::runtime_error("vcpu::harvest_accessed: EPT is not enabled");
+    }
+
+    if (mmap->attached() > 1) {
+        throw std::runtime_error("vcpu::harvest_accessed: map is used by more than one vcpu");
+    }
+
+    auto num = mmap->harvest_accessed(gpa, size, bitmap);
+
+    if (num != 0) {
+        m_ept_handler.invept();
+    }
+
+    return num;
 }
 
 void
-vcpu::disable_ept()
+vcpu::add_ept_view(std::size_t index, ept::mmap &map)
+{ m_ept_handler.set_eptp_list_entry(index, &map); }
+
+void
+vcpu::remove_ept_view(std::size_t index)
+{ m_ept_handler.set_eptp_list_entry(index, nullptr); }
+
+void
+vcpu::switch_ept_view(std::size_t index)
+{ m_ept_handler.set_eptp_index(index); }
+
+std::size_t
+vcpu::ept_view() const
+{ return m_ept_handler.eptp_index(); }
+
+void
+vcpu::enable_eptp_switching()
+{ m_ept_handler.enable_eptp_switching(); }
+
+void
+vcpu::disable_eptp_switching()
+{ m_ept_handler.disable_eptp_switching(); }
+
+//--------------------------------------------------------------------------
+// Sub-Page Write Permissions
+//--------------------------------------------------------------------------
+
+void
+vcpu::set_sppt(ept::sppt &sppt)
+{ m_ept_handler.set_sppt(&sppt); }
+
+void
+vcpu::disable_sppt()
+{ m_ept_handler.set_sppt(nullptr); }
+
+void
+vcpu::write_protect_sub_pages(uintptr_t gpa, std::size_t size)
+{
+    auto mmap = m_ept_handler.map();
+    auto sppt = m_ept_handler.sppt();
+
+    if (sppt == nullptr || mmap == nullptr) {
+        throw std::runtime_error("vcpu::write_protect_sub_pages: SPP is not enabled");
+    }
+
+    sppt->write_protect(*mmap, gpa, size);
+    m_ept_handler.invept();
+}
+
+void
+vcpu::write_unprotect_sub_pages(uintptr_t gpa, std::size_t size)
+{
+    auto mmap = m_ept_handler.map();
+    auto sppt = m_ept_handler.sppt();
+
+    if (sppt == nullptr || mmap == nullptr) {
+        throw std::runtime_error("vcpu::write_unprotect_sub_pages: SPP is not enabled");
+    }
+
+    sppt->write_unprotect(*mmap, gpa, size);
+    m_ept_handler.invept();
+}
+
+//--------------------------------------------------------------------------
+// Snapshots
+//--------------------------------------------------------------------------
+
+std::size_t
+vcpu::snapshot()
+{
+    auto mmap = m_ept_handler.map();
+
+    if (mmap == nullptr) {
+        throw std::runtime_error("vcpu::snapshot: EPT is not enabled");
+    }
+
+    if (mmap->attached() > 1) {
+        throw std::runtime_error("vcpu::snapshot: map is used by more than one vcpu");
+    }
+
+    if (!m_snapshot_handler) {
+        m_ept_violation_handler.add_write_handler(
+            ept_violation_handler::handler_delegate_t::create<vcpu, &vcpu::handle_snapshot_write>(this)
+        );
+
+        m_snapshot_handler = true;
+    }
+
+    auto num = mmap->snapshot();
+    m_ept_handler.invept();
+
+    return num;
+}
+
+std::size_t
+vcpu::revert_snapshot()
+{
+    auto mmap = m_ept_handler.map();
+
+    if (mmap == nullptr) {
+        throw std::runtime_error("vcpu::revert_snapshot: EPT is not enabled");
+    }
+
+    if (mmap->attached() > 1) {
+        throw std::runtime_error("vcpu::revert_snapshot: map is used by more than one vcpu");
+    }
+
+    auto num = mmap->revert();
+
+    if (num != 0) {
+        m_ept_handler.invept();
+    }
+
+    return num;
+}
+
+void
+vcpu::release_snapshot()
+{
+    auto mmap = m_ept_handler.map();
+
+    if (mmap == nullptr) {
+        throw std::runtime_error("vcpu::release_snapshot: EPT is not enabled");
+    }
+
+    if (mmap->attached() > 1) {
+        throw std::runtime_error("vcpu::release_snapshot: map is used by more than one vcpu");
+    }
+
+    mmap->release_snapshot();
+    m_ept_handler.invept();
+}
+
+//--------------------------------------------------------------------------
+// Page Deduplication
+//--------------------------------------------------------------------------
+
+void
+vcpu::enable_dedup(page_dedup &dedup)
+{
+    if (m_ept_handler.map() == nullptr) {
+        throw std::runtime_error("vcpu::enable_dedup: EPT is not enabled");
+    }
+
+    if (m_ept_handler.map()->attached() > 1) {
+        throw std::runtime_error("vcpu::enable_dedup: map is used by more than one vcpu");
+    }
+
+    if (m_dedup == nullptr) {
+        m_ept_violation_handler.add_write_handler(
+            ept_violation_handler::handler_delegate_t::create<vcpu, &vcpu::handle_dedup_write>(this)
+        );
+    }
+
+    m_dedup = &dedup;
+}
+
+//--------------------------------------------------------------------------
+// Demand Paging
+//--------------------------------------------------------------------------
+
+void
+vcpu::enable_demand_paging(demand_pager &pager)
 {
-    m_ept_handler.set_eptp(nullptr);
-    m_mmap = nullptr;
+    if (m_ept_handler.map() == nullptr) {
+        throw std::runtime_error("vcpu::enable_demand_paging: EPT is not enabled");
+    }
+
+    if (m_demand_pager == nullptr) {
+        auto d = ept_violation_handler::handler_delegate_t::create<vcpu, &vcpu::handle_demand_fault>(this);
+
+        m_ept_violation_handler.add_read_handler(d);
+        m_ept_violation_handler.add_write_handler(d);
+        m_ept_violation_handler.add_execute_handler(d);
+    }
+
+    m_demand_pager = &pager;
+}
+
+//--------------------------------------------------------------------------
+// Virtualization Exceptions
+//--------------------------------------------------------------------------
+
+void
+vcpu::enable_ve()
+{ m_virtualization_exception_handler.enable(); }
+
+void
+vcpu::disable_ve()
+{ m_virtualization_exception_handler.disable(); }
+
+void
+vcpu::rearm_ve()
+{ m_virtualization_exception_handler.rearm(); }
+
+const virtualization_exception_handler::info_t *
+vcpu::ve_info() const
+{ return m_virtualization_exception_handler.info(); }
+
+void
+vcpu::set_suppress_ve(uintptr_t gpa, std::size_t size, bool suppress)
+{
+    auto mmap = m_ept_handler.map();
+
+    if (mmap == nullptr) {
+        throw std::runtime_error("vcpu::set_suppress_ve: EPT is not enabled");
+    }
+
+    if (mmap->set_suppress_ve(gpa, size, suppress) != 0) {
+        m_ept_handler.invept();
+    }
 }
 
+//--------------------------------------------------------------------------
+// Page-Modification Logging
+//--------------------------------------------------------------------------
+
+void
+vcpu::enable_pml(dirty_bitmap &bitmap)
+{ m_page_modification_log_handler.enable(bitmap); }
+
+void
+vcpu::disable_pml()
+{ m_page_modification_log_handler.disable(); }
+
+uint64_t
+vcpu::flush_pml()
+{ return m_page_modification_log_handler.flush(); }
+
 //--------------------------------------------------------------------------
 // VPID
 //--------------------------------------------------------------------------
@@ -102,6 +384,30 @@ void
 vcpu::disable_vpid()
 { m_vpid_handler.disable(); }
 
+void
+vcpu::invvpid_single_address(uint64_t gva)
+{ m_vpid_handler.invalidate_address(gva); }
+
+void
+vcpu::invvpid_single_context(bool retain_globals)
+{ m_vpid_handler.invalidate_context(retain_globals); }
+
+//--------------------------------------------------------------------------
+// Profiler
+//--------------------------------------------------------------------------
+
+void
+vcpu::enable_profiler(uint64_t freq_hz)
+{ m_profiler.enable(freq_hz); }
+
+void
+vcpu::disable_profiler()
+{ m_profiler.disable(); }
+
+void
+vcpu::allow_profiler_user_access(bool allow)
+{ m_profiler.allow_user_access(allow); }
+
 //--------------------------------------------------------------------------
 // VMX preemption timer
 //--------------------------------------------------------------------------
@@ -224,6 +530,36 @@ vcpu::add_ept_execute_violation_handler(
     const ept_violation_handler::handler_delegate_t &d)
 { m_ept_violation_handler.add_execute_handler(d); }
 
+void
+vcpu::add_ept_read_violation_handler(
+    uint64_t gpa, uint64_t size,
+    const ept_violation_handler::handler_delegate_t &d)
+{ m_ept_violation_handler.add_read_handler(gpa, size, d); }
+
+void
+vcpu::add_ept_write_violation_handler(
+    uint64_t gpa, uint64_t size,
+    const ept_violation_handler::handler_delegate_t &d)
+{ m_ept_violation_handler.add_write_handler(gpa, size, d); }
+
+void
+vcpu::add_ept_execute_violation_handler(
+    uint64_t gpa, uint64_t size,
+    const ept_violation_handler::handler_delegate_t &d)
+{ m_ept_violation_handler.add_execute_handler(gpa, size, d); }
+
+bool
+vcpu::remove_ept_read_violation_handler(uint64_t gpa)
+{ return m_ept_violation_handler.remove_read_handler(gpa); }
+
+bool
+vcpu::remove_ept_write_violation_handler(uint64_t gpa)
+{ return m_ept_violation_handler.remove_write_handler(gpa); }
+
+bool
+vcpu::remove_ept_execute_violation_handler(uint64_t gpa)
+{ return m_ept_violation_handler.remove_execute_handler(gpa); }
+
 void
 vcpu::add_default_ept_read_violation_handler(
     const ::handler_delegate_t &d)
@@ -239,6 +575,24 @@ vcpu::add_default_ept_execute_violation_handler(
     const ::handler_delegate_t &d)
 { m_ept_violation_handler.set_default_execute_handler(d); }
 
+//--------------------------------------------------------------------------
+// MMIO
+//--------------------------------------------------------------------------
+
+void
+vcpu::add_mmio_handler(
+    uint64_t gpa, uint64_t size,
+    const mmio_handler::handler_delegate_t &d)
+{ m_mmio_handler.add_handler(gpa, size, d); }
+
+bool
+vcpu::remove_mmio_handler(uint64_t gpa)
+{ return m_mmio_handler.remove_handler(gpa); }
+
+void
+vcpu::flush_mmio_decode_cache()
+{ m_mmio_handler.flush_decode_cache(); }
+
 //--------------------------------------------------------------------------
 // External Interrupt
 //--------------------------------------------------------------------------
@@ -437,6 +791,20 @@ preemption_timer_handler::value_t
 vcpu::get_preemption_timer()
 { return m_preemption_timer_handler.get_timer(); }
 
+timer_wheel::id_t
+vcpu::add_timer(
+    uint64_t ns, const timer_wheel::handler_delegate_t &d)
+{ return m_preemption_timer_handler.add_timer(ns, d); }
+
+timer_wheel::id_t
+vcpu::add_periodic_timer(
+    uint64_t period_ns, const timer_wheel::handler_delegate_t &d)
+{ return m_preemption_timer_handler.add_periodic_timer(period_ns, d); }
+
+bool
+vcpu::cancel_timer(timer_wheel::id_t id)
+{ return m_preemption_timer_handler.cancel_timer(id); }
+
 //==============================================================================
 // Memory Mapping
 //==============================================================================
@@ -454,11 +822,13 @@ vcpu::get_preemption_timer()
 std::pair<uintptr_t, uintptr_t>
 vcpu::gpa_to_hpa(uintptr_t gpa)
 {
-    if (m_mmap == nullptr) {
+    auto mmap = m_ept_handler.map();
+
+    if (mmap == nullptr) {
         return {gpa, 0};
     }
 
-    return m_mmap->virt_to_phys(gpa);
+    return mmap->virt_to_phys(gpa);
 }
 
 std::pair<uintptr_t, uintptr_t>
@@ -536,7 +906,7 @@ vcpu::gva_to_hpa(uint64_t gva)
 {
     auto ret = this->gva_to_gpa(gva);
 
-    if (m_mmap == nullptr) {
+    if (m_ept_handler.map() == nullptr) {
         return ret;
     }
 
@@ -546,91 +916,109 @@ vcpu::gva_to_hpa(uint64_t gva)
 void
 vcpu::map_1g_ro(uintptr_t gpa, uintptr_t hpa)
 {
-    if (m_mmap == nullptr) {
+    auto mmap = m_ept_handler.map();
+
+    if (mmap == nullptr) {
         throw std::runtime_error("attempted map with EPT not set");
     }
 
-    m_mmap->map_1g(gpa, hpa, ept::mmap::attr_type::read_only);
+    mmap->map_1g(gpa, hpa, ept::mmap::attr_type::read_only);
 }
 
 void
 vcpu::map_2m_ro(uintptr_t gpa, uintptr_t hpa)
 {
-    if (m_mmap == nullptr) {
+    auto mmap = m_ept_handler.map();
+
+    if (mmap == nullptr) {
         throw std::runtime_error("attempted map with EPT not set");
     }
 
-    m_mmap->map_2m(gpa, hpa, ept::mmap::attr_type::read_only);
+    mmap->map_2m(gpa, hpa, ept::mmap::attr_type::read_only);
 }
 
 void
 vcpu::map_4k_ro(uintptr_t gpa, uintptr_t hpa)
 {
-    if (m_mmap == nullptr) {
+    auto mmap = m_ept_handler.map();
+
+    if (mmap == nullptr) {
         throw std::runtime_error("attempted map with EPT not set");
     }
 
-    m_mmap->map_4k(gpa, hpa, ept::mmap::attr_type::read_only);
+    mmap->map_4k(gpa, hpa, ept::mmap::attr_type::read_only);
 }
 
 void
 vcpu::map_1g_rw(uintptr_t gpa, uintptr_t hpa)
 {
-    if (m_mmap == nullptr) {
+    auto mmap = m_ept_handler.map();
+
+    if (mmap == nullptr) {
         throw std::runtime_error("attempted map with EPT not set");
     }
 
-    m_mmap->map_1g(gpa, hpa, ept::mmap::attr_type::read_write);
+    mmap->map_1g(gpa, hpa, ept::mmap::attr_type::read_write);
 }
 
 void
 vcpu::map_2m_rw(uintptr_t gpa, uintptr_t hpa)
 {
-    if (m_mmap == nullptr) {
+    auto mmap = m_ept_handler.map();
+
+    if (mmap == nullptr) {
         throw std::runtime_error("attempted map with EPT not set");
     }
 
-    m_mmap->map_2m(gpa, hpa, ept::mmap::attr_type::read_write);
+    mmap->map_2m(gpa, hpa, ept::mmap::attr_type::read_write);
 }
 
 void
 vcpu::map_4k_rw(uintptr_t gpa, uintptr_t hpa)
 {
-    if (m_mmap == nullptr) {
+    auto mmap = m_ept_handler.map();
+
+    if (mmap == nullptr) {
         throw std::runtime_error("attempted map with EPT not set");
     }
 
-    m_mmap->map_4k(gpa, hpa, ept::mmap::attr_type::read_write);
+    mmap->map_4k(gpa, hpa, ept::mmap::attr_type::read_write);
 }
 
 void
 vcpu::map_1g_rwe(uintptr_t gpa, uintptr_t hpa)
 {
-    if (m_mmap == nullptr) {
+    auto mmap = m_ept_handler.map();
+
+    if (mmap == nullptr) {
         throw std::runtime_error("attempted map with EPT not set");
     }
 
-    m_mmap->map_1g(gpa, hpa, ept::mmap::attr_type::read_write_execute);
+    mmap->map_1g(gpa, hpa, ept::mmap::attr_type::read_write_execute);
 }
 
 void
 vcpu::map_2m_rwe(uintptr_t gpa, uintptr_t hpa)
 {
-    if (m_mmap == nullptr) {
+    auto mmap = m_ept_handler.map();
+
+    if (mmap == nullptr) {
         throw std::runtime_error("attempted map with EPT not set");
     }
 
-    m_mmap->map_2m(gpa, hpa, ept::mmap::attr_type::read_write_execute);
+    mmap->map_2m(gpa, hpa, ept::mmap::attr_type::read_write_execute);
 }
 
 void
 vcpu::map_4k_rwe(uintptr_t gpa, uintptr_t hpa)
 {
-    if (m_mmap == nullptr) {
+    auto mmap = m_ept_handler.map();
+
+    if (mmap == nullptr) {
         throw std::runtime_error("attempted map with EPT not set");
     }
 
-    m_mmap->map_4k(gpa, hpa, ept::mmap::attr_type::read_write_execute);
+    mmap->map_4k(gpa, hpa, ept::mmap::attr_type::read_write_execute);
 }
 
 uintptr_t
@@ -642,4 +1030,73 @@ vcpu::get_entry(uintptr_t tble_gpa, std::ptrdiff_t index)
     return span[index];
 }
 
+bool
+vcpu::handle_snapshot_write(
+    gsl::not_null<vcpu_t *> vcpu, ept_violation_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    auto mmap = m_ept_handler.map();
+
+    if (mmap == nullptr) {
+        return false;
+    }
+
+    auto copy = [&](void *dst, ept::mmap::phys_addr_t src) {
+        auto map = this->map_hpa_4k<uint8_t>(src);
+        std::memcpy(dst, map.get(), ::x64::pt::page_size);
+    };
+
+    if (!mmap->copy_on_write(info.gpa, copy)) {
+        return false;
+    }
+
+    info.ignore_advance = true;
+    return true;
+}
+
+bool
+vcpu::handle_dedup_write(
+    gsl::not_null<vcpu_t *> vcpu, ept_violation_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    auto mmap = m_ept_handler.map();
+
+    if (mmap == nullptr || m_dedup == nullptr) {
+        return false;
+    }
+
+    if (!m_dedup->handle_write(*mmap, info.gpa)) {
+        return false;
+    }
+
+    info.ignore_advance = true;
+    return true;
+}
+
+bool
+vcpu::handle_demand_fault(
+    gsl::not_null<vcpu_t *> vcpu, ept_violation_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    auto mmap = m_ept_handler.map();
+
+    if (mmap == nullptr || m_demand_pager == nullptr) {
+        return false;
+    }
+
+    if ((info.exit_qualification & ept_violation_handler::entry_present_mask) != 0) {
+        return false;
+    }
+
+    if (!m_demand_pager->handle_fault(*mmap, info.gpa)) {
+        return false;
+    }
+
+    info.ignore_advance = true;
+    return true;
+}
+
 }
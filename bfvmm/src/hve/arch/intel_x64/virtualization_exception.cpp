@@ -0,0 +1,127 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <cstddef>
+#include <cstring>
+
+#include <hve/arch/intel_x64/vcpu.h>
+
+namespace eapis::intel_x64
+{
+
+static_assert(offsetof(virtualization_exception_handler::info_t, busy) == 4);
+static_assert(offsetof(virtualization_exception_handler::info_t, gpa) == 24);
+static_assert(offsetof(virtualization_exception_handler::info_t, eptp_index) == 32);
+
+virtualization_exception_handler::virtualization_exception_handler(
+    gsl::not_null<vcpu *> vcpu
+) :
+    m_vcpu{vcpu},
+    m_info{nullptr, free_page}
+{ }
+
+// -----------------------------------------------------------------------------
+// Enablers
+// -----------------------------------------------------------------------------
+
+void
+virtualization_exception_handler::enable()
+{
+    using namespace vmcs_n;
+    using namespace vmcs_n::secondary_processor_based_vm_execution_controls;
+
+    if (ept_pointer::phys_addr::get() == 0) {
+        throw std::runtime_error(
+            "virtualization_exception_handler::enable: EPT is not enabled"
+        );
+    }
+
+    if (!m_info) {
+        m_info.reset(static_cast<info_t *>(alloc_page()));
+        std::memset(m_info.get(), 0, sizeof(info_t));
+
+        virtualization_exception_information_address::set(
+            g_mm->virtptr_to_physint(m_info.get())
+        );
+    }
+
+    // The EPTP index is only updated by VMFUNC while #VE is enabled, so it
+    // has to start out matching the active view.
+    //
+
+    auto index = m_vcpu->ept_view();
+    eptp_index::set(index < ept_handler::eptp_list_size ? index : 0);
+
+    this->rearm();
+
+    ept_violation_ve::enable();
+    m_enabled = true;
+}
+
+void
+virtualization_exception_handler::disable()
+{
+    using namespace vmcs_n::secondary_processor_based_vm_execution_controls;
+
+    if (!m_enabled) {
+        return;
+    }
+
+    ept_violation_ve::disable();
+    m_enabled = false;
+}
+
+void
+virtualization_exception_handler::rearm()
+{
+    if (!m_info) {
+        throw std::runtime_error(
+            "virtualization_exception_handler::rearm: #VE has not been enabled"
+        );
+    }
+
+    __atomic_store_n(&m_info->busy, 0, __ATOMIC_SEQ_CST);
+}
+
+bool
+virtualization_exception_handler::armed() const noexcept
+{
+    if (!m_info) {
+        return false;
+    }
+
+    return __atomic_load_n(&m_info->busy, __ATOMIC_SEQ_CST) == 0;
+}
+
+uintptr_t
+virtualization_exception_handler::info_phys() const
+{
+    if (!m_info) {
+        throw std::runtime_error(
+            "virtualization_exception_handler::info_phys: #VE has not been enabled"
+        );
+    }
+
+    return g_mm->virtptr_to_physint(m_info.get());
+}
+
+}
@@ -26,7 +26,7 @@ namespace eapis::intel_x64
 
 static bool
 emulate_ia_32e_mode_switch(
-    control_register_handler::info_t &info)
+    gsl::not_null<vcpu_t *> vcpu, control_register_handler::info_t &info)
 {
     using namespace vmcs_n::guest_cr0;
     using namespace vmcs_n::guest_ia32_efer;
@@ -40,12 +40,12 @@ emulate_ia_32e_mode_switch(
     if (paging::is_enabled(info.val)) {
         lma::enable();
         ia_32e_mode_guest::enable();
-        ::intel_x64::vmx::invept_global();
+        vcpu_cast(vcpu)->invvpid_single_context();
     }
     else {
         lma::disable();
         ia_32e_mode_guest::disable();
-        ::intel_x64::vmx::invept_global();
+        vcpu_cast(vcpu)->invvpid_single_context();
     }
 
     return true;
@@ -56,10 +56,9 @@ default_wrcr0_handler(
     gsl::not_null<vcpu_t *> vcpu, control_register_handler::info_t &info)
 {
     using namespace vmcs_n::guest_cr0;
-    bfignored(vcpu);
 
     if (paging::is_enabled() != paging::is_enabled(info.val)) {
-        return emulate_ia_32e_mode_switch(info);
+        return emulate_ia_32e_mode_switch(vcpu, info);
     }
 
     return true;
@@ -79,10 +78,13 @@ static bool
 default_wrcr3_handler(
     gsl::not_null<vcpu_t *> vcpu, control_register_handler::info_t &info)
 {
-    bfignored(vcpu);
     bfignored(info);
 
-    ::intel_x64::vmx::invept_global();
+    // A guest write to CR3 flushes every non-global translation, which,
+    // with VPID enabled, has to be done for the guest on its behalf.
+    //
+
+    vcpu_cast(vcpu)->invvpid_single_context(true);
     return true;
 }
 
@@ -56,6 +56,33 @@ ept_violation_handler::add_execute_handler(
     const handler_delegate_t &d)
 { m_execute_handlers.push_front(d); }
 
+void
+ept_violation_handler::add_read_handler(
+    uint64_t gpa, uint64_t size, const handler_delegate_t &d)
+{ add_range(m_read_ranges, gpa, size, d); }
+
+void
+ept_violation_handler::add_write_handler(
+    uint64_t gpa, uint64_t size, const handler_delegate_t &d)
+{ add_range(m_write_ranges, gpa, size, d); }
+
+void
+ept_violation_handler::add_execute_handler(
+    uint64_t gpa, uint64_t size, const handler_delegate_t &d)
+{ add_range(m_execute_ranges, gpa, size, d); }
+
+bool
+ept_violation_handler::remove_read_handler(uint64_t gpa)
+{ return m_read_ranges.erase(gpa) != 0; }
+
+bool
+ept_violation_handler::remove_write_handler(uint64_t gpa)
+{ return m_write_ranges.erase(gpa) != 0; }
+
+bool
+ept_violation_handler::remove_execute_handler(uint64_t gpa)
+{ return m_execute_ranges.erase(gpa) != 0; }
+
 void
 ept_violation_handler::set_default_read_handler(
     const ::handler_delegate_t &d)
@@ -88,14 +115,21 @@ ept_violation_handler::handle(gsl::not_null<vcpu_t *> vcpu)
         true
     };
 
-    if (exit_qualification::ept_violation::data_read::is_enabled(qual)) {
-        return handle_read(vcpu, info);
+    if ((qual & spp_violation_mask) != 0) {
+        return handle_write(vcpu, info);
     }
 
+    // A read-modify-write access reports both the read and the write bit.
+    // The write is what needs permission, so it is checked first.
+    //
     if (exit_qualification::ept_violation::data_write::is_enabled(qual)) {
         return handle_write(vcpu, info);
     }
 
+    if (exit_qualification::ept_violation::data_read::is_enabled(qual)) {
+        return handle_read(vcpu, info);
+    }
+
     if (exit_qualification::ept_violation::instruction_fetch::is_enabled(qual)) {
         return handle_execute(vcpu, info);
     }
@@ -108,70 +142,110 @@ ept_violation_handler::handle(gsl::not_null<vcpu_t *> vcpu)
 bool
 ept_violation_handler::handle_read(gsl::not_null<vcpu_t *> vcpu, info_t &info)
 {
-    for (const auto &d : m_read_handlers) {
-        if (d(vcpu, info)) {
+    return dispatch(
+               vcpu, info, m_read_ranges, m_read_handlers, m_default_read_handler,
+               "ept_violation_handler: unhandled ept read violation"
+           );
+}
 
-            if (!info.ignore_advance) {
-                return vcpu->advance();
-            }
+bool
+ept_violation_handler::handle_write(gsl::not_null<vcpu_t *> vcpu, info_t &info)
+{
+    return dispatch(
+               vcpu, info, m_write_ranges, m_write_handlers, m_default_write_handler,
+               "ept_violation_handler: unhandled ept write violation"
+           );
+}
 
-            return true;
-        }
+bool
+ept_violation_handler::handle_execute(gsl::not_null<vcpu_t *> vcpu, info_t &info)
+{
+    return dispatch(
+               vcpu, info, m_execute_ranges, m_execute_handlers, m_default_execute_handler,
+               "ept_violation_handler: unhandled ept execute violation"
+           );
+}
+
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
+
+void
+ept_violation_handler::add_range(
+    range_map_t &ranges, uint64_t gpa, uint64_t size, const handler_delegate_t &d)
+{
+    expects(size != 0);
+    expects(gpa + size > gpa);
+
+    auto end = gpa + size;
+    auto next = ranges.lower_bound(gpa);
+
+    if (next != ranges.end() && next->first < end) {
+        throw std::runtime_error(
+            "ept_violation_handler::add_range: range overlaps a registered range"
+        );
     }
 
-    if (m_default_read_handler.is_valid()) {
-        return m_default_read_handler(vcpu);
+    if (next != ranges.begin() && std::prev(next)->second.end > gpa) {
+        throw std::runtime_error(
+            "ept_violation_handler::add_range: range overlaps a registered range"
+        );
     }
 
-    throw std::runtime_error(
-        "ept_violation_handler: unhandled ept read violation"
-    );
+    ranges.emplace_hint(next, gpa, range_t{end, d});
 }
 
-bool
-ept_violation_handler::handle_write(gsl::not_null<vcpu_t *> vcpu, info_t &info)
+const ept_violation_handler::range_t *
+ept_violation_handler::find_range(
+    const range_map_t &ranges, uint64_t gpa) noexcept
 {
-    for (const auto &d : m_write_handlers) {
-        if (d(vcpu, info)) {
+    auto iter = ranges.upper_bound(gpa);
 
-            if (!info.ignore_advance) {
-                return vcpu->advance();
-            }
-
-            return true;
-        }
+    if (iter == ranges.begin()) {
+        return nullptr;
     }
 
-    if (m_default_write_handler.is_valid()) {
-        return m_default_write_handler(vcpu);
-    }
-
-    throw std::runtime_error(
-        "ept_violation_handler: unhandled ept write violation"
-    );
+    --iter;
+    return gpa < iter->second.end ? &iter->second : nullptr;
 }
 
+// A range handler gets the first chance to handle a violation. If it
+// returns false (or there is no range for the GPA), the list of handlers and
+// then the default handler are tried, as if the range did not exist.
+//
 bool
-ept_violation_handler::handle_execute(gsl::not_null<vcpu_t *> vcpu, info_t &info)
+ept_violation_handler::dispatch(
+    gsl::not_null<vcpu_t *> vcpu, info_t &info,
+    const range_map_t &ranges,
+    const std::list<handler_delegate_t> &handlers,
+    const ::handler_delegate_t &default_handler,
+    const char *unhandled)
 {
-    for (const auto &d : m_execute_handlers) {
-        if (d(vcpu, info)) {
+    auto advance = [&]() {
+        if (!info.ignore_advance) {
+            return vcpu->advance();
+        }
 
-            if (!info.ignore_advance) {
-                return vcpu->advance();
-            }
+        return true;
+    };
 
-            return true;
+    if (auto range = find_range(ranges, info.gpa); range != nullptr) {
+        if (range->d(vcpu, info)) {
+            return advance();
         }
     }
 
-    if (m_default_execute_handler.is_valid()) {
-        return m_default_execute_handler(vcpu);
+    for (const auto &d : handlers) {
+        if (d(vcpu, info)) {
+            return advance();
+        }
     }
 
-    throw std::runtime_error(
-        "ept_violation_handler: unhandled ept execute violation"
-    );
+    if (default_handler.is_valid()) {
+        return default_handler(vcpu);
+    }
+
+    throw std::runtime_error(unhandled);
 }
 
 }
@@ -0,0 +1,144 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <hve/arch/intel_x64/vcpu.h>
+
+namespace eapis::intel_x64
+{
+
+page_modification_log_handler::page_modification_log_handler(
+    gsl::not_null<vcpu *> vcpu
+) :
+    m_vcpu{vcpu},
+    m_log{nullptr, free_page}
+{
+    using namespace vmcs_n;
+
+    vcpu->add_handler(
+        exit_reason::basic_exit_reason::page_modification_log_full,
+        ::handler_delegate_t::create <
+        page_modification_log_handler, &page_modification_log_handler::handle > (this)
+    );
+}
+
+// -----------------------------------------------------------------------------
+// Enablers
+// -----------------------------------------------------------------------------
+
+void
+page_modification_log_handler::enable(dirty_bitmap &bitmap)
+{
+    using namespace vmcs_n;
+    using namespace vmcs_n::secondary_processor_based_vm_execution_controls;
+
+    if (ept_pointer::accessed_and_dirty_flags::is_disabled()) {
+        throw std::runtime_error(
+            "page_modification_log_handler::enable: EPT accessed and dirty flags are disabled"
+        );
+    }
+
+    if (m_bitmap != nullptr) {
+        this->flush();
+    }
+
+    if (!m_log) {
+        m_log.reset(static_cast<uint64_t *>(alloc_page()));
+        pml_address::set(g_mm->virtptr_to_physint(m_log.get()));
+    }
+
+    m_bitmap = &bitmap;
+
+    guest_pml_index::set(num_entries - 1U);
+    enable_pml::enable();
+}
+
+void
+page_modification_log_handler::disable()
+{
+    using namespace vmcs_n::secondary_processor_based_vm_execution_controls;
+
+    if (m_bitmap == nullptr) {
+        return;
+    }
+
+    this->flush();
+    enable_pml::disable();
+
+    m_bitmap = nullptr;
+}
+
+uint64_t
+page_modification_log_handler::flush()
+{
+    using namespace vmcs_n;
+
+    if (m_bitmap == nullptr) {
+        return 0;
+    }
+
+    // The hardware writes the log from the last entry to the first, and
+    // the index always points to the next entry it will write. Once the
+    // last entry has been written, the index wraps to 0xFFFF (the log is
+    // full), so everything after the index is a valid GPA.
+    //
+
+    auto index = guest_pml_index::get();
+    auto first = index < num_entries ? index + 1U : 0U;
+
+    auto entries = this->log();
+
+    for (auto i = first; i < num_entries; i++) {
+        m_bitmap->set(entries[static_cast<std::ptrdiff_t>(i)]);
+    }
+
+    guest_pml_index::set(num_entries - 1U);
+    return num_entries - first;
+}
+
+gsl::span<uint64_t>
+page_modification_log_handler::log() const noexcept
+{
+    if (!m_log) {
+        return {};
+    }
+
+    return gsl::make_span(m_log.get(), num_entries);
+}
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+// A PML full exit happens before the write that could not be logged, so
+// the guest simply retries the write once the log has been drained (i.e.
+// there is no instruction to advance).
+//
+bool
+page_modification_log_handler::handle(gsl::not_null<vcpu_t *> vcpu)
+{
+    bfignored(vcpu);
+
+    this->flush();
+    return true;
+}
+
+}
@@ -78,6 +78,85 @@ preemption_timer_handler::get_timer() const
     return preemption_timer_value::get();
 }
 
+// -----------------------------------------------------------------------------
+// Timer Wheel
+// -----------------------------------------------------------------------------
+
+timer_wheel::id_t
+preemption_timer_handler::add_timer(
+    uint64_t ns, const timer_wheel::handler_delegate_t &d)
+{
+    auto now = this->now();
+    auto id = m_timer_wheel.add(now, now + ns, 0, d);
+
+    this->program_timer();
+    return id;
+}
+
+timer_wheel::id_t
+preemption_timer_handler::add_periodic_timer(
+    uint64_t period_ns, const timer_wheel::handler_delegate_t &d)
+{
+    expects(period_ns != 0);
+
+    auto now = this->now();
+    auto id = m_timer_wheel.add(now, now + period_ns, period_ns, d);
+
+    this->program_timer();
+    return id;
+}
+
+bool
+preemption_timer_handler::cancel_timer(timer_wheel::id_t id)
+{
+    auto ret = m_timer_wheel.cancel(id);
+
+    this->program_timer();
+    return ret;
+}
+
+void
+preemption_timer_handler::program_timer()
+{
+    if (m_timer_wheel.empty()) {
+        if (m_timer_wheel_armed) {
+            this->disable_exiting();
+            m_timer_wheel_armed = false;
+        }
+
+        return;
+    }
+
+    const auto &clock = m_vcpu->clock();
+
+    auto deadline = m_timer_wheel.next_deadline();
+    auto now = this->now();
+
+    // The VMX-preemption timer field is only 32bits wide, so deadlines that
+    // are further out are reached in several steps. The wheel simply finds
+    // nothing to expire on the intermediate exits and reprograms the timer.
+    //
+
+    value_t ticks = 0;
+    if (deadline > now) {
+        ticks = std::min<value_t>(clock.ns_to_pet(deadline - now), 0xFFFFFFFFULL);
+    }
+
+    this->enable_exiting();
+    this->set_timer(ticks);
+
+    m_timer_wheel_armed = true;
+}
+
+uint64_t
+preemption_timer_handler::now() const
+{
+    const auto &clock = m_vcpu->clock();
+    expects(clock.calibrated());
+
+    return clock.tsc_to_ns(::x64::read_tsc::get());
+}
+
 // -----------------------------------------------------------------------------
 // Handlers
 // -----------------------------------------------------------------------------
@@ -85,6 +164,13 @@ preemption_timer_handler::get_timer() const
 bool
 preemption_timer_handler::handle(gsl::not_null<vcpu_t *> vcpu)
 {
+    if (m_timer_wheel_armed) {
+        m_timer_wheel.expire(vcpu, this->now());
+        this->program_timer();
+
+        return true;
+    }
+
     for (const auto &d : m_handlers) {
         if (d(vcpu)) {
             return true;
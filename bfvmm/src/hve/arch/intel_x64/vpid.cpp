@@ -24,15 +24,93 @@
 namespace eapis::intel_x64
 {
 
+// -----------------------------------------------------------------------------
+// Allocator
+// -----------------------------------------------------------------------------
+
+vpid_allocator::id_t
+vpid_allocator::allocate(bool &recycled)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (!m_free.empty()) {
+        auto id = m_free.back();
+        m_free.pop_back();
+        m_released.reset(id);
+
+        recycled = true;
+        return id;
+    }
+
+    if (m_next > max_id) {
+        throw std::runtime_error("vpid_allocator::allocate: out of VPIDs");
+    }
+
+    recycled = false;
+    return gsl::narrow_cast<id_t>(m_next++);
+}
+
+void
+vpid_allocator::release(id_t id)
+{
+    expects(id != invalid_id);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    expects(id < m_next);
+    expects(!m_released.test(id));
+
+    m_released.set(id);
+    m_free.push_back(id);
+}
+
+std::size_t
+vpid_allocator::in_use() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return (m_next - 1U) - m_free.size();
+}
+
+vpid_allocator &
+g_vpid_allocator() noexcept
+{
+    static vpid_allocator s_vpid_allocator;
+    return s_vpid_allocator;
+}
+
+// -----------------------------------------------------------------------------
+// Handler
+// -----------------------------------------------------------------------------
+
 vpid_handler::vpid_handler(
     gsl::not_null<vcpu *> vcpu
 ) :
     m_vcpu{vcpu}
 {
-    static uint16_t s_id = 1;
-    m_id = s_id++;
+    bool recycled = false;
+    m_id = g_vpid_allocator().allocate(recycled);
 
     vmcs_n::virtual_processor_identifier::set(m_id);
+
+    // A recycled VPID might still tag translations that belong to a vCPU
+    // that used it before, which must not leak into this vCPU. INVVPID only
+    // affects the CPU that executes it, so the VPID is flushed on the CPU
+    // its last owner ran on when it is released (see below), and every
+    // VPID is flushed on the CPU that receives it, which covers any older
+    // owner that ran on this CPU.
+    //
+
+    if (recycled) {
+        ::intel_x64::vmx::invvpid_all_contexts();
+    }
+}
+
+vpid_handler::~vpid_handler()
+{
+    if (m_id != vpid_allocator::invalid_id) {
+        ::intel_x64::vmx::invvpid_single_context(m_id);
+        g_vpid_allocator().release(gsl::narrow_cast<vpid_allocator::id_t>(m_id));
+    }
 }
 
 vmcs_n::value_type vpid_handler::id() const noexcept
@@ -44,4 +122,29 @@ void vpid_handler::enable()
 void vpid_handler::disable()
 { vmcs_n::secondary_processor_based_vm_execution_controls::enable_vpid::disable(); }
 
+void
+vpid_handler::invalidate_address(uint64_t gva)
+{
+    if (vmcs_n::secondary_processor_based_vm_execution_controls::enable_vpid::is_disabled()) {
+        return;
+    }
+
+    ::intel_x64::vmx::invvpid_individual_address(m_id, gva);
+}
+
+void
+vpid_handler::invalidate_context(bool retain_globals)
+{
+    if (vmcs_n::secondary_processor_based_vm_execution_controls::enable_vpid::is_disabled()) {
+        return;
+    }
+
+    if (retain_globals) {
+        ::intel_x64::vmx::invvpid_single_context_global(m_id);
+    }
+    else {
+        ::intel_x64::vmx::invvpid_single_context(m_id);
+    }
+}
+
 }
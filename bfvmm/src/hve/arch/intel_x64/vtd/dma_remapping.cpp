@@ -0,0 +1,425 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <cstring>
+
+#include <intrinsics.h>
+#include <hve/arch/intel_x64/vtd/dma_remapping.h>
+
+namespace eapis::intel_x64::vtd
+{
+
+using namespace ::intel_x64::vtd;
+
+// -----------------------------------------------------------------------------
+// Constants
+// -----------------------------------------------------------------------------
+
+constexpr const uint64_t num_root_entries = 256;
+constexpr const uint64_t num_context_entries = 256;
+
+constexpr const uint64_t sagaw_48bit = 0x4;
+constexpr const uint64_t aw_48bit = 2;
+
+constexpr const uint64_t sllps_2m = 0x1;
+constexpr const uint64_t sllps_1g = 0x2;
+
+constexpr const uint64_t t_untranslated = 0;
+constexpr const uint64_t t_passthrough = 2;
+
+constexpr const uint64_t cirg_global = 1;
+constexpr const uint64_t cirg_device = 3;
+
+// The IOTLB registers are not at a fixed offset (ECAP.IRO), so they are not
+// part of iommu.h. The IOTLB invalidate register is the second of the two.
+//
+constexpr const uint64_t iotlb_reg_ivt = 1ULL << 63U;
+constexpr const uint64_t iotlb_reg_iirg_from = 60;
+constexpr const uint64_t iotlb_reg_did_from = 32;
+constexpr const uint64_t iotlb_reg_dr = 1ULL << 49U;
+constexpr const uint64_t iotlb_reg_dw = 1ULL << 48U;
+
+constexpr const uint64_t iirg_global = 1;
+constexpr const uint64_t iirg_domain = 2;
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+dma_remapping::dma_remapping(iommu_unit &unit) :
+    m_unit{unit},
+    m_root{alloc_page(), free_page}
+{
+    std::memset(m_root.get(), 0, num_root_entries * sizeof(rte::value_type));
+    m_root_phys = g_mm->virtptr_to_physint(m_root.get());
+}
+
+bool
+dma_remapping::ept_compatible() const
+{
+    return
+        (iommu::cap_reg::sagaw::get(m_unit.cap()) & sagaw_48bit) != 0 &&
+        (iommu::cap_reg::sllps::get(m_unit.cap()) & (sllps_2m | sllps_1g)) == (sllps_2m | sllps_1g) &&
+        iommu::ecap_reg::c::is_enabled(m_unit.ecap());
+}
+
+void
+dma_remapping::assign_device(
+    bus_type bus, devfn_type devfn, did_type did, ept::mmap &map)
+{
+    if (!this->ept_compatible()) {
+        throw std::runtime_error(
+            "dma_remapping::assign_device: remapping hardware cannot share EPT");
+    }
+
+    context_entry::value_type entry{};
+
+    context_entry::p::enable(entry);
+    context_entry::t::set(entry, t_untranslated);
+    context_entry::slptptr::set(entry, map.eptp() >> 12U);
+    context_entry::aw::set(entry, aw_48bit);
+    context_entry::did::set(entry, did);
+
+    this->set_context_entry(bus, devfn, entry);
+}
+
+void
+dma_remapping::assign_device(
+    bus_type bus, devfn_type devfn, did_type did, second_level_table &table)
+{
+    context_entry::value_type entry{};
+
+    context_entry::p::enable(entry);
+    context_entry::t::set(entry, t_untranslated);
+    context_entry::slptptr::set(entry, table.root_phys() >> 12U);
+    context_entry::aw::set(entry, table.aw());
+    context_entry::did::set(entry, did);
+
+    this->set_context_entry(bus, devfn, entry);
+}
+
+void
+dma_remapping::assign_device_passthrough(
+    bus_type bus, devfn_type devfn, did_type did)
+{
+    if (iommu::ecap_reg::pt::is_disabled(m_unit.ecap())) {
+        throw std::runtime_error(
+            "dma_remapping::assign_device_passthrough: pass through not supported");
+    }
+
+    context_entry::value_type entry{};
+
+    context_entry::p::enable(entry);
+    context_entry::t::set(entry, t_passthrough);
+    context_entry::aw::set(entry, aw_48bit);
+    context_entry::did::set(entry, did);
+
+    this->set_context_entry(bus, devfn, entry);
+}
+
+void
+dma_remapping::remove_device(bus_type bus, devfn_type devfn)
+{
+    expects(bus < num_root_entries);
+    expects(devfn < num_context_entries);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (m_context_tables.count(bus) == 0) {
+        return;
+    }
+
+    auto &entry = this->context_entry_ref(bus, devfn);
+    if (context_entry::p::is_disabled(entry)) {
+        return;
+    }
+
+    auto did = context_entry::did::get(entry);
+
+    __atomic_store_n(&entry.data[0], 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&entry.data[1], 0, __ATOMIC_SEQ_CST);
+
+    this->flush_tables();
+
+    if (iommu::gsts_reg::tes::is_enabled(m_unit.gsts())) {
+        this->invalidate_device(did, (bus << 8U) | devfn);
+    }
+}
+
+void
+dma_remapping::enable()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    this->flush_tables();
+
+    iommu::rtaddr_reg::value_type rtaddr = 0;
+    iommu::rtaddr_reg::rta::set(rtaddr, m_root_phys >> 12U);
+    m_unit.write_64(iommu::rtaddr_reg::offset, rtaddr);
+
+    m_unit.gcmd_set(1U << iommu::gcmd_reg::srtp::from);
+    iommu_unit::wait_for(
+        [&] { return iommu::gsts_reg::rtps::is_enabled(m_unit.gsts()); },
+        "dma_remapping::enable: root table pointer not set"
+    );
+
+    this->invalidate_all();
+
+    m_unit.gcmd_set(1U << iommu::gcmd_reg::te::from);
+    iommu_unit::wait_for(
+        [&] { return iommu::gsts_reg::tes::is_enabled(m_unit.gsts()); },
+        "dma_remapping::enable: translation not enabled"
+    );
+}
+
+void
+dma_remapping::disable()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_unit.gcmd_clear(1U << iommu::gcmd_reg::te::from);
+    iommu_unit::wait_for(
+        [&] { return iommu::gsts_reg::tes::is_disabled(m_unit.gsts()); },
+        "dma_remapping::disable: translation not disabled"
+    );
+}
+
+context_entry::value_type
+dma_remapping::get_context_entry(bus_type bus, devfn_type devfn) const
+{
+    expects(bus < num_root_entries);
+    expects(devfn < num_context_entries);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    const auto &table = m_context_tables.find(bus);
+    if (table == m_context_tables.end()) {
+        return {};
+    }
+
+    return static_cast<context_entry::value_type *>(table->second.get())[devfn];
+}
+
+void
+dma_remapping::flush_context_cache()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (this->use_qi()) {
+        queued_invalidation::batch b{*m_qi};
+        b.context_global();
+
+        return m_qi->submit(b);
+    }
+
+    this->flush_context_cache(cirg_global, 0, 0);
+}
+
+void
+dma_remapping::flush_iotlb()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (this->use_qi()) {
+        queued_invalidation::batch b{*m_qi};
+        b.iotlb_global();
+
+        return m_qi->submit(b);
+    }
+
+    this->flush_iotlb(iirg_global, 0);
+}
+
+void
+dma_remapping::invalidate_domain(did_type did)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (this->use_qi()) {
+        queued_invalidation::batch b{*m_qi};
+        b.iotlb_domain(did);
+
+        return m_qi->submit(b);
+    }
+
+    this->flush_iotlb(iirg_domain, did);
+}
+
+void
+dma_remapping::set_invalidation_queue(queued_invalidation *qi)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_qi = qi;
+}
+
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
+
+context_entry::value_type &
+dma_remapping::context_entry_ref(bus_type bus, devfn_type devfn)
+{
+    auto table = m_context_tables.find(bus);
+
+    if (table == m_context_tables.end()) {
+        page_ptr page{alloc_page(), free_page};
+        std::memset(page.get(), 0, num_context_entries * sizeof(context_entry::value_type));
+
+        auto &root_entry = static_cast<rte::value_type *>(m_root.get())[bus];
+        rte::context_table_pointer::set(root_entry, g_mm->virtptr_to_physint(page.get()) >> 12U);
+        rte::present::enable(root_entry);
+
+        table = m_context_tables.emplace(bus, std::move(page)).first;
+    }
+
+    return static_cast<context_entry::value_type *>(table->second.get())[devfn];
+}
+
+void
+dma_remapping::set_context_entry(
+    bus_type bus, devfn_type devfn, const context_entry::value_type &entry)
+{
+    expects(bus < num_root_entries);
+    expects(devfn < num_context_entries);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto &ce = this->context_entry_ref(bus, devfn);
+    auto sid = (bus << 8U) | devfn;
+    auto translating = iommu::gsts_reg::tes::is_enabled(m_unit.gsts());
+
+    // A present entry is never modified in place, as the hardware could
+    // see (and cache) a mix of the old and new entry. Instead, it is made
+    // not present, and any cached copy of it is invalidated, before the
+    // new entry is written.
+    //
+
+    if (context_entry::p::is_enabled(ce)) {
+        auto old_did = context_entry::did::get(ce);
+
+        __atomic_store_n(&ce.data[0], 0, __ATOMIC_SEQ_CST);
+        this->flush_tables();
+
+        if (translating) {
+            this->invalidate_device(old_did, sid);
+        }
+    }
+
+    // The lower half holds the present bit, so it is written last
+    //
+
+    __atomic_store_n(&ce.data[1], entry.data[1], __ATOMIC_SEQ_CST);
+    __atomic_store_n(&ce.data[0], entry.data[0], __ATOMIC_SEQ_CST);
+
+    this->flush_tables();
+
+    // Per the spec, caching mode hardware (i.e. a virtual IOMMU) may cache
+    // non-present entries (tagged with domain id 0), otherwise only a
+    // present entry can be cached.
+    //
+
+    if (translating && iommu::cap_reg::cm::is_enabled(m_unit.cap())) {
+        this->invalidate_device(0, sid);
+    }
+}
+
+void
+dma_remapping::flush_tables()
+{
+    if (iommu::ecap_reg::c::is_disabled(m_unit.ecap())) {
+        ::x64::cache::wbinvd();
+    }
+
+    if (iommu::cap_reg::rwbf::is_enabled(m_unit.cap())) {
+        m_unit.gcmd_set(1U << iommu::gcmd_reg::wbf::from);
+        iommu_unit::wait_for(
+            [&] { return iommu::gsts_reg::wbfs::is_disabled(m_unit.gsts()); },
+            "dma_remapping::flush_tables: write buffer flush timed out"
+        );
+    }
+}
+
+void
+dma_remapping::invalidate_all()
+{
+    if (this->use_qi()) {
+        queued_invalidation::batch b{*m_qi};
+        b.context_global();
+        b.iotlb_global();
+
+        return m_qi->submit(b);
+    }
+
+    this->flush_context_cache(cirg_global, 0, 0);
+    this->flush_iotlb(iirg_global, 0);
+}
+
+void
+dma_remapping::invalidate_device(did_type did, uint64_t sid)
+{
+    if (this->use_qi()) {
+        queued_invalidation::batch b{*m_qi};
+        b.context_device(did, sid);
+        b.iotlb_domain(did);
+
+        return m_qi->submit(b);
+    }
+
+    this->flush_context_cache(cirg_device, did, sid);
+    this->flush_iotlb(iirg_domain, did);
+}
+
+void
+dma_remapping::flush_context_cache(uint64_t cirg, did_type did, uint64_t sid)
+{
+    iommu::ccmd_reg::value_type ccmd = 0;
+
+    iommu::ccmd_reg::icc::enable(ccmd);
+    iommu::ccmd_reg::cirg::set(ccmd, cirg);
+    iommu::ccmd_reg::did::set(ccmd, did);
+    iommu::ccmd_reg::sid::set(ccmd, sid);
+
+    m_unit.write_64(iommu::ccmd_reg::offset, ccmd);
+    iommu_unit::wait_for(
+        [&] { return iommu::ccmd_reg::icc::is_disabled(m_unit.read_64(iommu::ccmd_reg::offset)); },
+        "dma_remapping::flush_context_cache: invalidation timed out"
+    );
+}
+
+void
+dma_remapping::flush_iotlb(uint64_t iirg, did_type did)
+{
+    auto offset = gsl::narrow_cast<iommu_unit::offset_type>(
+                      (iommu::ecap_reg::iro::get(m_unit.ecap()) * 16U) + 8U);
+
+    auto val =
+        iotlb_reg_ivt | iotlb_reg_dr | iotlb_reg_dw |
+        (iirg << iotlb_reg_iirg_from) | (did << iotlb_reg_did_from);
+
+    m_unit.write_64(offset, val);
+    iommu_unit::wait_for(
+        [&] { return (m_unit.read_64(offset) & iotlb_reg_ivt) == 0; },
+        "dma_remapping::flush_iotlb: invalidation timed out"
+    );
+}
+
+}
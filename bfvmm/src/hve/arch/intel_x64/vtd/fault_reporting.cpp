@@ -0,0 +1,250 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <bfdebug.h>
+
+#include <hve/arch/intel_x64/vtd/fault_reporting.h>
+
+namespace eapis::intel_x64::vtd
+{
+
+using namespace ::intel_x64::vtd;
+
+// -----------------------------------------------------------------------------
+// Constants
+// -----------------------------------------------------------------------------
+
+constexpr const uint32_t frr_size = 16;
+constexpr const uint32_t frr_f_offset = 12;
+constexpr const uint32_t frr_f_bit = 0x80000000U;
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+fault_reporting::fault_reporting(
+    iommu_unit &unit, uint64_t burst, uint64_t interval_ns
+) :
+    m_unit{unit},
+    m_fro{iommu::cap_reg::fro::get(unit.cap()) * frr_size},
+    m_nfr{iommu::cap_reg::nfr::get(unit.cap()) + 1},
+    m_burst{burst},
+    m_interval_ns{interval_ns},
+    m_tokens{burst}
+{ }
+
+std::size_t
+fault_reporting::drain(uint64_t now_ns)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    std::size_t drained = 0;
+    auto fsts = m_unit.read_32(iommu::fsts_reg::offset);
+
+    // Per the spec, software should start at FSTS.FRI and keep going until
+    // it finds a record with F clear. Each record is released back to the
+    // hardware (by writing 1 to F) as soon as it has been read, so new
+    // faults can be recorded while the rest are being processed.
+    //
+
+    if (iommu::fsts_reg::ppf::is_enabled(fsts)) {
+        auto index = iommu::fsts_reg::fri::get(fsts) % m_nfr;
+
+        for (uint64_t i = 0; i < m_nfr; i++) {
+            auto offset = gsl::narrow_cast<iommu_unit::offset_type>(m_fro + (index * frr_size));
+
+            iommu::frr::value_type frr{};
+            frr.data[1] = m_unit.read_64(offset + 8U);
+
+            if (iommu::frr::f::is_disabled(frr)) {
+                break;
+            }
+
+            frr.data[0] = m_unit.read_64(offset);
+            m_unit.write_32(offset + frr_f_offset, frr_f_bit);
+
+            this->record(frr, now_ns);
+            drained++;
+
+            index = (index + 1) % m_nfr;
+        }
+    }
+
+    if (iommu::fsts_reg::pfo::is_enabled(fsts)) {
+        m_overflows++;
+        m_unit.write_32(iommu::fsts_reg::offset, 1U << iommu::fsts_reg::pfo::from);
+    }
+
+    return drained;
+}
+
+uint64_t
+fault_reporting::count(sid_type sid, reason_type reason) const
+{ return this->stats(sid, reason).count; }
+
+fault_reporting::stats_t
+fault_reporting::stats(sid_type sid, reason_type reason) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    const auto &iter = m_stats.find(key(sid, reason));
+    if (iter == m_stats.end()) {
+        return {};
+    }
+
+    return iter->second;
+}
+
+void
+fault_reporting::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    m_stats.clear();
+
+    m_total = 0;
+    m_overflows = 0;
+    m_logged = 0;
+    m_suppressed = 0;
+    m_suppressed_total = 0;
+}
+
+void
+fault_reporting::dump(int level) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    bfdebug_transaction(level, [&](std::string * msg) {
+        bfdebug_lnbr(level, msg);
+        bfdebug_info(level, "vt-d faults", msg);
+        bfdebug_brk2(level, msg);
+
+        bfdebug_subndec(level, "total", m_total, msg);
+        bfdebug_subndec(level, "overflows", m_overflows, msg);
+        bfdebug_subndec(level, "suppressed", m_suppressed_total, msg);
+
+        for (const auto &[k, stats] : m_stats) {
+            bfdebug_brk3(level, msg);
+            bfdebug_subnhex(level, "sid", k >> 8U, msg);
+            bfdebug_subtext(level, "reason", reason_to_str(k & 0xFFU), msg);
+            bfdebug_subndec(level, "count", stats.count, msg);
+            bfdebug_subnhex(level, "last fault info", stats.last_fi, msg);
+        }
+    });
+}
+
+const char *
+fault_reporting::reason_to_str(reason_type reason) noexcept
+{
+    switch (reason) {
+        case 0x01: return "root entry not present";
+        case 0x02: return "context entry not present";
+        case 0x03: return "invalid context entry";
+        case 0x04: return "address beyond agaw";
+        case 0x05: return "write to read-only page";
+        case 0x06: return "read from non-readable page";
+        case 0x07: return "error accessing paging entry";
+        case 0x08: return "error accessing root entry";
+        case 0x09: return "error accessing context entry";
+        case 0x0A: return "reserved bit set in root entry";
+        case 0x0B: return "reserved bit set in context entry";
+        case 0x0C: return "reserved bit set in paging entry";
+        case 0x0D: return "translation type blocked";
+        case 0x20: return "reserved bit set in interrupt request";
+        case 0x21: return "interrupt index beyond irt";
+        case 0x22: return "irte not present";
+        case 0x23: return "error accessing irte";
+        case 0x24: return "reserved bit set in irte";
+        case 0x25: return "compatibility format interrupt blocked";
+        case 0x26: return "source id verification failed";
+        case 0x27: return "error accessing posted descriptor";
+        case 0x28: return "reserved bit set in posted descriptor";
+        default: return "unknown";
+    };
+}
+
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
+
+bool
+fault_reporting::take_token(uint64_t now_ns) noexcept
+{
+    if (now_ns - m_interval_start >= m_interval_ns) {
+        m_tokens = m_burst;
+        m_interval_start = now_ns;
+    }
+
+    if (m_tokens == 0) {
+        return false;
+    }
+
+    m_tokens--;
+    return true;
+}
+
+void
+fault_reporting::record(const iommu::frr::value_type &frr, uint64_t now_ns)
+{
+    auto sid = iommu::frr::sid::get(frr);
+    auto reason = iommu::frr::fr::get(frr);
+    auto fi = iommu::frr::fi::get(frr);
+    auto write = iommu::frr::t::is_disabled(frr);
+
+    auto iter = m_stats.find(key(sid, reason));
+    if (iter == m_stats.end()) {
+        iter = m_stats.emplace(key(sid, reason), stats_t{0, 0, false, now_ns, 0}).first;
+    }
+
+    auto &stats = iter->second;
+
+    stats.count++;
+    stats.last_fi = fi;
+    stats.last_write = write;
+    stats.last_ns = now_ns;
+
+    m_total++;
+
+    if (!this->take_token(now_ns)) {
+        m_suppressed++;
+        m_suppressed_total++;
+        return;
+    }
+
+    bfalert_transaction(0, [&](std::string * msg) {
+        bfalert_info(0, "vt-d fault", msg);
+        bfalert_subnhex(0, "sid", sid, msg);
+        bfalert_subtext(0, "reason", reason_to_str(reason), msg);
+        bfalert_subtext(0, "type", write ? "write" : "read", msg);
+        bfalert_subnhex(0, "fault info", fi, msg);
+        bfalert_subndec(0, "count", stats.count, msg);
+
+        if (m_suppressed != 0) {
+            bfalert_subndec(0, "suppressed", m_suppressed, msg);
+        }
+    });
+
+    m_logged++;
+    m_suppressed = 0;
+}
+
+}
@@ -0,0 +1,328 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <cstring>
+
+#include <bfgsl.h>
+
+#include <bfvmm/memory_manager/memory_manager.h>
+#include <hve/arch/intel_x64/vtd/interrupt_remapping.h>
+
+namespace eapis::intel_x64::vtd
+{
+
+using namespace ::intel_x64::vtd;
+
+// -----------------------------------------------------------------------------
+// Constants
+// -----------------------------------------------------------------------------
+
+constexpr const uint64_t irta_s_256 = 7;
+
+constexpr const uint64_t svt_verify_sid = 1;
+constexpr const uint64_t sq_all_bits = 0;
+
+constexpr const uint64_t max_block_size = 32;
+
+// Compares the 128bit entry at dst with expected and, if they match,
+// replaces it with desired. Otherwise, expected is updated with the
+// current contents of dst. The entry must be 16 byte aligned.
+//
+static bool
+cmpxchg16b(
+    volatile irte::value_type *dst, irte::value_type &expected,
+    const irte::value_type &desired) noexcept
+{
+    bool success;
+
+    asm volatile(
+        "lock cmpxchg16b %1"
+        : "=@ccz"(success),
+          "+m"(*reinterpret_cast<volatile unsigned __int128 *>(dst)),
+          "+a"(expected.data[0]),
+          "+d"(expected.data[1])
+        : "b"(desired.data[0]),
+          "c"(desired.data[1])
+        : "memory"
+    );
+
+    return success;
+}
+
+static uint64_t
+block_mask(uint64_t index, uint64_t count) noexcept
+{ return (count == 64 ? ~0ULL : ((1ULL << count) - 1)) << (index & 63U); }
+
+static uint64_t
+pid_phys(const pid::value_type &pid)
+{
+    auto phys = g_mm->virtptr_to_physint(const_cast<pid::value_type *>(&pid));
+    expects((phys & 0x3FU) == 0);
+
+    return phys;
+}
+
+static void
+set_pda(irte::value_type &entry, uint64_t phys) noexcept
+{
+    irte::pdal::set(entry, (phys & 0xFFFFFFFFU) >> 6U);
+    irte::pdah::set(entry, phys >> 32U);
+}
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+interrupt_remapping::interrupt_remapping(iommu_unit &unit, queued_invalidation &qi) :
+    m_unit{unit},
+    m_qi{qi},
+    m_table{alloc_page(), free_page}
+{
+    expects(iommu::ecap_reg::ir::is_enabled(unit.ecap()));
+
+    std::memset(m_table.get(), 0, num_entries * sizeof(irte::value_type));
+    m_table_phys = g_mm->virtptr_to_physint(m_table.get());
+}
+
+void
+interrupt_remapping::enable(bool x2apic)
+{
+    expects(m_qi.enabled());
+
+    if (x2apic && iommu::ecap_reg::eim::is_disabled(m_unit.ecap())) {
+        throw std::runtime_error(
+            "interrupt_remapping::enable: x2apic mode not supported");
+    }
+
+    iommu::irta_reg::value_type irta = 0;
+    iommu::irta_reg::irta::set(irta, m_table_phys >> 12U);
+    iommu::irta_reg::s::set(irta, irta_s_256);
+
+    if (x2apic) {
+        iommu::irta_reg::eime::enable(irta);
+    }
+
+    m_unit.write_64(iommu::irta_reg::offset, irta);
+
+    m_unit.gcmd_set(1U << iommu::gcmd_reg::sirtp::from);
+    iommu_unit::wait_for(
+        [&] { return iommu::gsts_reg::irtps::is_enabled(m_unit.gsts()); },
+        "interrupt_remapping::enable: table pointer not set"
+    );
+
+    queued_invalidation::batch b{m_qi};
+    b.iec_global();
+    m_qi.submit(b);
+
+    m_unit.gcmd_set(1U << iommu::gcmd_reg::ire::from);
+    iommu_unit::wait_for(
+        [&] { return iommu::gsts_reg::ires::is_enabled(m_unit.gsts()); },
+        "interrupt_remapping::enable: interrupt remapping not enabled"
+    );
+
+    m_x2apic = x2apic;
+}
+
+void
+interrupt_remapping::disable()
+{
+    m_unit.gcmd_clear(1U << iommu::gcmd_reg::ire::from);
+    iommu_unit::wait_for(
+        [&] { return iommu::gsts_reg::ires::is_disabled(m_unit.gsts()); },
+        "interrupt_remapping::disable: interrupt remapping not disabled"
+    );
+}
+
+interrupt_remapping::index_type
+interrupt_remapping::allocate(index_type count)
+{
+    expects(count != 0 && count <= max_block_size);
+    expects((count & (count - 1)) == 0);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    for (index_type index = 0; index < num_entries; index += count) {
+        auto &word = m_bitmap.at(index / 64);
+        auto mask = block_mask(index, count);
+
+        if ((word & mask) == 0) {
+            word |= mask;
+            return index;
+        }
+    }
+
+    throw std::runtime_error("interrupt_remapping::allocate: out of entries");
+}
+
+void
+interrupt_remapping::free(index_type index, index_type count)
+{
+    expects(count != 0 && count <= max_block_size);
+    expects((count & (count - 1)) == 0);
+    expects((index & (count - 1)) == 0);
+    expects(index < num_entries);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto &word = m_bitmap.at(index / 64);
+    auto mask = block_mask(index, count);
+
+    expects((word & mask) == mask);
+
+    for (index_type i = index; i < index + count; i++) {
+        auto expected = *const_cast<irte::value_type *>(this->entry(i));
+        while (!cmpxchg16b(this->entry(i), expected, {})) { }
+    }
+
+    this->invalidate(index, static_cast<uint64_t>(__builtin_ctzll(count)));
+    word &= ~mask;
+}
+
+void
+interrupt_remapping::map_remapped(
+    index_type index, sid_type sid, uint64_t vector, uint64_t dst)
+{
+    expects(this->allocated(index));
+
+    irte::value_type entry{};
+
+    irte::p::enable(entry);
+    irte::v::set(entry, vector & 0xFFU);
+    irte::dst::set(entry, m_x2apic ? dst : (dst & 0xFFU) << 8U);
+    irte::sid::set(entry, sid & 0xFFFFU);
+    irte::sq::set(entry, sq_all_bits);
+    irte::svt::set(entry, svt_verify_sid);
+
+    this->set_entry(index, entry);
+}
+
+void
+interrupt_remapping::map_posted(
+    index_type index, sid_type sid, uint64_t vector,
+    const pid::value_type &pid, bool urgent)
+{
+    expects(this->allocated(index));
+
+    if (iommu::cap_reg::pi::is_disabled(m_unit.cap())) {
+        throw std::runtime_error(
+            "interrupt_remapping::map_posted: posted interrupts not supported");
+    }
+
+    irte::value_type entry{};
+
+    irte::p::enable(entry);
+    irte::im::enable(entry);
+    irte::vv::set(entry, vector & 0xFFU);
+    irte::sid::set(entry, sid & 0xFFFFU);
+    irte::sq::set(entry, sq_all_bits);
+    irte::svt::set(entry, svt_verify_sid);
+
+    if (urgent) {
+        irte::urg::enable(entry);
+    }
+
+    set_pda(entry, pid_phys(pid));
+    this->set_entry(index, entry);
+}
+
+void
+interrupt_remapping::retarget(index_type index, const pid::value_type &pid)
+{
+    expects(this->allocated(index));
+
+    auto phys = pid_phys(pid);
+    auto expected = *const_cast<irte::value_type *>(this->entry(index));
+
+    // If the hardware (or another CPU) changes the entry between the read
+    // and the exchange, the exchange fails and reloads the entry, so the
+    // new entry is always built from what was actually replaced.
+    //
+
+    while (true) {
+        if (irte::p::is_disabled(expected) || irte::im::is_disabled(expected)) {
+            throw std::runtime_error("interrupt_remapping::retarget: entry not posted");
+        }
+
+        auto desired = expected;
+        set_pda(desired, phys);
+
+        if (cmpxchg16b(this->entry(index), expected, desired)) {
+            break;
+        }
+    }
+
+    this->invalidate(index, 0);
+}
+
+irte::value_type
+interrupt_remapping::get_entry(index_type index) const
+{
+    expects(index < num_entries);
+
+    irte::value_type expected{};
+    cmpxchg16b(this->entry(index), expected, expected);
+
+    return expected;
+}
+
+bool
+interrupt_remapping::allocated(index_type index) const
+{
+    if (index >= num_entries) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return (m_bitmap.at(index / 64) & (1ULL << (index & 63U))) != 0;
+}
+
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
+
+volatile irte::value_type *
+interrupt_remapping::entry(index_type index) const
+{ return &static_cast<volatile irte::value_type *>(m_table.get())[index]; }
+
+void
+interrupt_remapping::set_entry(index_type index, const irte::value_type &irte)
+{
+    auto expected = *const_cast<irte::value_type *>(this->entry(index));
+    while (!cmpxchg16b(this->entry(index), expected, irte)) { }
+
+    this->invalidate(index, 0);
+}
+
+void
+interrupt_remapping::invalidate(index_type index, uint64_t im)
+{
+    if (!m_qi.enabled()) {
+        return;
+    }
+
+    queued_invalidation::batch b{m_qi};
+    b.iec_index(index, im);
+
+    m_qi.submit(b);
+}
+
+}
@@ -0,0 +1,209 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <algorithm>
+
+#include <bfdebug.h>
+
+#include <bfvmm/memory_manager/memory_manager.h>
+#include <bfvmm/memory_manager/arch/x64/cr3.h>
+
+#include <hve/arch/intel_x64/vtd/iommu_unit.h>
+
+namespace eapis::intel_x64::vtd
+{
+
+using namespace ::intel_x64::vtd;
+
+// -----------------------------------------------------------------------------
+// Constants
+// -----------------------------------------------------------------------------
+
+constexpr const std::size_t min_register_set_size = 0x1000;
+constexpr const std::size_t register_size = 16;
+
+// The registers of a remapping unit must be mapped uncached (the unit may
+// be mapped write-back by the host's default page tables), and each page
+// is mapped individually as the register set is not guaranteed to be
+// 2m aligned.
+//
+static x64::unique_map<uint8_t>
+map_uncached(uintptr_t hpa, std::size_t size)
+{
+    using namespace ::x64::pt;
+    using mmap = bfvmm::x64::cr3::mmap;
+
+    auto hva = static_cast<uint8_t *>(g_mm->alloc_map(size));
+
+    for (std::size_t i = 0; i < size; i += page_size) {
+        g_cr3->map_4k(
+            hva + i, hpa + i, mmap::attr_type::read_write, mmap::memory_type::uncacheable);
+    }
+
+    return x64::unique_map<uint8_t>(hva, x64::unmapper(hva, size));
+}
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+iommu_unit::iommu_unit(uintptr_t hpa) :
+    m_hpa{hpa}
+{
+    expects(hpa != 0);
+    expects((hpa & (min_register_set_size - 1)) == 0);
+
+    // The location of the IOTLB and fault recording registers is only
+    // known once the capability registers have been read, so the first
+    // page is mapped on its own, and the mapping is then replaced if the
+    // register set turns out to be larger than that.
+    //
+
+    m_map = map_uncached(hpa, min_register_set_size);
+    m_regs = m_map.get();
+    m_size = min_register_set_size;
+
+    m_cap = this->read_64(iommu::cap_reg::offset);
+    m_ecap = this->read_64(iommu::ecap_reg::offset);
+
+    if (auto size = this->register_set_size(); size > m_size) {
+        m_map = map_uncached(hpa, size);
+        m_regs = m_map.get();
+        m_size = size;
+    }
+}
+
+iommu_unit::iommu_unit(void *regs, std::size_t size) :
+    m_regs{static_cast<uint8_t *>(regs)},
+    m_size{size}
+{
+    expects(regs != nullptr);
+    expects(size >= min_register_set_size);
+
+    m_cap = this->read_64(iommu::cap_reg::offset);
+    m_ecap = this->read_64(iommu::ecap_reg::offset);
+}
+
+uint32_t
+iommu_unit::read_32(offset_type offset) const
+{
+    expects(offset + sizeof(uint32_t) <= m_size);
+    return *reinterpret_cast<volatile uint32_t *>(m_regs + offset);
+}
+
+uint64_t
+iommu_unit::read_64(offset_type offset) const
+{
+    expects(offset + sizeof(uint64_t) <= m_size);
+    return *reinterpret_cast<volatile uint64_t *>(m_regs + offset);
+}
+
+void
+iommu_unit::write_32(offset_type offset, uint32_t val)
+{
+    expects(offset + sizeof(uint32_t) <= m_size);
+    *reinterpret_cast<volatile uint32_t *>(m_regs + offset) = val;
+}
+
+void
+iommu_unit::write_64(offset_type offset, uint64_t val)
+{
+    expects(offset + sizeof(uint64_t) <= m_size);
+    *reinterpret_cast<volatile uint64_t *>(m_regs + offset) = val;
+}
+
+void
+iommu_unit::gcmd_set(uint32_t bit)
+{
+    auto val = this->gsts() & gsl::narrow_cast<uint32_t>(iommu::gcmd_reg::wo_bits);
+    this->write_32(iommu::gcmd_reg::offset, val | bit);
+}
+
+void
+iommu_unit::gcmd_clear(uint32_t bit)
+{
+    auto val = this->gsts() & gsl::narrow_cast<uint32_t>(iommu::gcmd_reg::wo_bits);
+    this->write_32(iommu::gcmd_reg::offset, val & ~bit);
+}
+
+iommu_unit::snapshot_t
+iommu_unit::snapshot() const
+{
+    return {
+        this->read_32(iommu::ver_reg::offset),
+        m_cap,
+        m_ecap,
+        this->read_32(iommu::gsts_reg::offset),
+        this->read_64(iommu::rtaddr_reg::offset),
+        this->read_32(iommu::fsts_reg::offset),
+        this->read_32(iommu::fectl_reg::offset),
+        this->read_64(iommu::iqh_reg::offset),
+        this->read_64(iommu::iqt_reg::offset),
+        this->read_64(iommu::iqa_reg::offset),
+        this->read_32(iommu::ics_reg::offset),
+        this->read_64(iommu::irta_reg::offset)
+    };
+}
+
+void
+iommu_unit::dump(int level) const
+{
+    auto regs = this->snapshot();
+
+    bfdebug_transaction(level, [&](std::string * msg) {
+        bfdebug_lnbr(level, msg);
+        bfdebug_info(level, "iommu unit", msg);
+        bfdebug_brk2(level, msg);
+
+        bfdebug_subnhex(level, "hpa", m_hpa, msg);
+        bfdebug_subnhex(level, "size", m_size, msg);
+        bfdebug_subnhex(level, "ver", regs.ver, msg);
+        bfdebug_subnhex(level, "cap", regs.cap, msg);
+        bfdebug_subnhex(level, "ecap", regs.ecap, msg);
+        bfdebug_subnhex(level, "gsts", regs.gsts, msg);
+        bfdebug_subnhex(level, "rtaddr", regs.rtaddr, msg);
+        bfdebug_subnhex(level, "fsts", regs.fsts, msg);
+        bfdebug_subnhex(level, "fectl", regs.fectl, msg);
+        bfdebug_subnhex(level, "iqh", regs.iqh, msg);
+        bfdebug_subnhex(level, "iqt", regs.iqt, msg);
+        bfdebug_subnhex(level, "iqa", regs.iqa, msg);
+        bfdebug_subnhex(level, "ics", regs.ics, msg);
+        bfdebug_subnhex(level, "irta", regs.irta, msg);
+    });
+}
+
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
+
+std::size_t
+iommu_unit::register_set_size() const noexcept
+{
+    auto iotlb_end = (iommu::ecap_reg::iro::get(m_ecap) + 1) * register_size;
+    auto frr_end =
+        (iommu::cap_reg::fro::get(m_cap) + iommu::cap_reg::nfr::get(m_cap) + 1) * register_size;
+
+    auto size = std::max<std::size_t>({min_register_set_size, iotlb_end, frr_end});
+    return (size + min_register_set_size - 1) & ~(min_register_set_size - 1);
+}
+
+}
@@ -0,0 +1,259 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+#include <cstring>
+
+#include <bfgsl.h>
+
+#include <intrinsics.h>
+#include <bfvmm/memory_manager/memory_manager.h>
+#include <hve/arch/intel_x64/vtd/pasid_table.h>
+
+namespace eapis::intel_x64::vtd
+{
+
+using namespace ::intel_x64::vtd;
+
+// -----------------------------------------------------------------------------
+// Constants
+// -----------------------------------------------------------------------------
+
+// The PASID table holds 2^(PTS + 5) entries, so a single page of 512
+// entries is a PTS of 4.
+//
+constexpr const uint64_t pts_one_page = 4;
+
+constexpr const uint64_t flpm_4_level = 0;
+constexpr const uint64_t aw_48bit = 2;
+
+constexpr const uint64_t cr3_pwt = 1ULL << 3U;
+constexpr const uint64_t cr3_pcd = 1ULL << 4U;
+
+constexpr const uintptr_t cache_line_size = 64;
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+pasid_table::pasid_table(iommu_unit &unit, queued_invalidation &qi, did_type did) :
+    m_unit{unit},
+    m_qi{qi},
+    m_did{did},
+    m_table{alloc_page(), free_page},
+    m_state{alloc_page(), free_page}
+{
+    expects(iommu::ecap_reg::ecs::is_enabled(unit.ecap()));
+    expects(iommu::ecap_reg::pasid::is_enabled(unit.ecap()));
+
+    auto bits = iommu::ecap_reg::pss::get(unit.ecap()) + 1;
+    m_size = bits < 9 ? (1ULL << bits) : num_entries;
+    m_dis = iommu::ecap_reg::dis::is_enabled(unit.ecap());
+
+    std::memset(m_table.get(), 0, num_entries * sizeof(pasid_entry::value_type));
+    std::memset(m_state.get(), 0, num_entries * sizeof(pasid_state_entry::value_type));
+
+    this->flush_cache(m_table.get(), num_entries * sizeof(pasid_entry::value_type));
+    this->flush_cache(m_state.get(), num_entries * sizeof(pasid_state_entry::value_type));
+
+    m_table_phys = g_mm->virtptr_to_physint(m_table.get());
+    m_state_phys = g_mm->virtptr_to_physint(m_state.get());
+}
+
+void
+pasid_table::bind(pasid_type pasid, uint64_t cr3, bool supervisor)
+{
+    expects(pasid < m_size);
+
+    if (supervisor) {
+        expects(iommu::ecap_reg::srs::is_enabled(m_unit.ecap()));
+    }
+
+    pasid_entry::value_type entry = 0;
+
+    pasid_entry::p::enable(entry);
+    pasid_entry::flpm::set(entry, flpm_4_level);
+    pasid_entry::flptptr::set(entry, cr3 >> 12U);
+
+    if ((cr3 & cr3_pwt) != 0) {
+        pasid_entry::pwt::enable(entry);
+    }
+
+    if ((cr3 & cr3_pcd) != 0) {
+        pasid_entry::pcd::enable(entry);
+    }
+
+    if (supervisor) {
+        pasid_entry::sre::enable(entry);
+    }
+
+    this->write(pasid, entry);
+}
+
+void
+pasid_table::unbind(pasid_type pasid)
+{
+    expects(pasid < m_size);
+    this->write(pasid, 0);
+}
+
+bool
+pasid_table::bound(pasid_type pasid) const
+{ return pasid_entry::p::is_enabled(this->entry(pasid)); }
+
+bool
+pasid_table::invalidate(pasid_type pasid)
+{
+    expects(pasid < m_size);
+
+    // The hardware increments the active reference count before it uses
+    // a PASID, and if DINV is set at that point, it invalidates the PASID
+    // and clears DINV. If a device starts using the PASID while we are
+    // trying to set DINV, the compare exchange fails, and the count is no
+    // longer 0, so we fall back to a real invalidation. A device-TLB can
+    // be used without the hardware ever seeing the PASID again, so ATS
+    // devices always get a real invalidation.
+    //
+
+    std::lock_guard<std::mutex> lock(m_ats_mutex);
+
+    if (m_dis && m_ats_devices.empty()) {
+        auto &state = this->state_table()[pasid];
+        auto expected = __atomic_load_n(&state, __ATOMIC_SEQ_CST);
+
+        while (pasid_state_entry::arefcnt::get(expected) == 0) {
+            auto desired = expected;
+            pasid_state_entry::dinv::enable(desired);
+
+            if (__atomic_compare_exchange_n(
+                    &state, &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                this->flush_cache(&state, sizeof(state));
+                m_deferred++;
+                return true;
+            }
+        }
+    }
+
+    queued_invalidation::batch b{m_qi};
+    b.pasid_cache_pasid(m_did, pasid);
+    b.ext_iotlb_pasid(m_did, pasid);
+
+    for (const auto &dev : m_ats_devices) {
+        b.ext_dev_tlb_pasid(dev.sid, pasid, dev.qdep);
+    }
+
+    m_qi.submit(b);
+    return false;
+}
+
+void
+pasid_table::enable_ats(sid_type sid, uint64_t qdep)
+{
+    expects(iommu::ecap_reg::dt::is_enabled(m_unit.ecap()));
+
+    std::lock_guard<std::mutex> lock(m_ats_mutex);
+    expects(m_ats_devices.size() < max_ats_devices);
+
+    m_ats_devices.push_back({sid, qdep});
+}
+
+void
+pasid_table::setup_context_entry(extended_context_entry::value_type &ece) const
+{
+    extended_context_entry::paside::enable(ece);
+    extended_context_entry::pts::set(ece, pts_one_page);
+    extended_context_entry::pasidptr::set(ece, m_table_phys >> 12U);
+    extended_context_entry::pasidstptr::set(ece, m_state_phys >> 12U);
+
+    if (m_dis) {
+        extended_context_entry::dinve::enable(ece);
+    }
+    else {
+        extended_context_entry::dinve::disable(ece);
+    }
+}
+
+void
+pasid_table::setup_nested_context_entry(
+    extended_context_entry::value_type &ece, ept::mmap &guest) const
+{
+    expects(iommu::ecap_reg::nest::is_enabled(m_unit.ecap()));
+
+    this->setup_context_entry(ece);
+
+    extended_context_entry::neste::enable(ece);
+    extended_context_entry::slptptr::set(ece, guest.eptp() >> 12U);
+    extended_context_entry::aw::set(ece, aw_48bit);
+}
+
+pasid_entry::value_type
+pasid_table::entry(pasid_type pasid) const
+{
+    expects(pasid < m_size);
+    return __atomic_load_n(&this->table()[pasid], __ATOMIC_ACQUIRE);
+}
+
+pasid_state_entry::value_type
+pasid_table::state_entry(pasid_type pasid) const
+{
+    expects(pasid < m_size);
+    return __atomic_load_n(&this->state_table()[pasid], __ATOMIC_ACQUIRE);
+}
+
+void
+pasid_table::write(pasid_type pasid, pasid_entry::value_type val)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto &entry = this->table()[pasid];
+    auto old = __atomic_exchange_n(&entry, val, __ATOMIC_SEQ_CST);
+
+    this->flush_cache(&entry, sizeof(entry));
+
+    // A not present entry is only cached by the hardware when caching
+    // mode is reported (i.e. when running on an emulated IOMMU)
+    //
+
+    if (pasid_entry::p::is_disabled(old) &&
+        iommu::cap_reg::cm::is_disabled(m_unit.cap())) {
+        return;
+    }
+
+    this->invalidate(pasid);
+}
+
+void
+pasid_table::flush_cache(const void *ptr, std::size_t size) const
+{
+    if (iommu::ecap_reg::c::is_enabled(m_unit.ecap())) {
+        return;
+    }
+
+    auto addr = reinterpret_cast<uintptr_t>(ptr);
+    auto end = addr + size;
+
+    for (addr &= ~(cache_line_size - 1U); addr < end; addr += cache_line_size) {
+        ::x64::cache::clflush(reinterpret_cast<void *>(addr));
+    }
+}
+
+}
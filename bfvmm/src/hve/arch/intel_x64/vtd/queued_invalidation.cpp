@@ -0,0 +1,448 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <cstring>
+
+#include <bfgsl.h>
+
+#include <bfvmm/memory_manager/memory_manager.h>
+#include <hve/arch/intel_x64/vtd/queued_invalidation.h>
+
+namespace eapis::intel_x64::vtd
+{
+
+using namespace ::intel_x64::vtd;
+
+// -----------------------------------------------------------------------------
+// Constants
+// -----------------------------------------------------------------------------
+
+constexpr const uint64_t num_descriptors = 0x1000 / sizeof(queued_invalidation::descriptor_t);
+constexpr const uint64_t qs_one_page = 0;
+
+constexpr const uint64_t desc_type_context = 0x1;
+constexpr const uint64_t desc_type_iotlb = 0x2;
+constexpr const uint64_t desc_type_iec = 0x4;
+constexpr const uint64_t desc_type_wait = 0x5;
+constexpr const uint64_t desc_type_ext_iotlb = 0x6;
+constexpr const uint64_t desc_type_pasid_cache = 0x7;
+constexpr const uint64_t desc_type_ext_dev_tlb = 0x8;
+
+constexpr const uint64_t desc_g_from = 4;
+
+constexpr const uint64_t context_g_global = 1;
+constexpr const uint64_t context_g_domain = 2;
+constexpr const uint64_t context_g_device = 3;
+constexpr const uint64_t context_did_from = 16;
+constexpr const uint64_t context_sid_from = 32;
+constexpr const uint64_t context_fm_from = 48;
+
+constexpr const uint64_t iotlb_g_global = 1;
+constexpr const uint64_t iotlb_g_domain = 2;
+constexpr const uint64_t iotlb_g_page = 3;
+constexpr const uint64_t iotlb_dw = 1ULL << 6U;
+constexpr const uint64_t iotlb_dr = 1ULL << 7U;
+constexpr const uint64_t iotlb_did_from = 16;
+constexpr const uint64_t iotlb_ih = 1ULL << 6U;
+
+constexpr const uint64_t iec_g_index = 1;
+constexpr const uint64_t iec_im_from = 27;
+constexpr const uint64_t iec_iidx_from = 32;
+
+constexpr const uint64_t pasid_g_domain = 0;
+constexpr const uint64_t pasid_g_pasid = 1;
+constexpr const uint64_t pasid_did_from = 16;
+constexpr const uint64_t pasid_pasid_from = 32;
+constexpr const uint64_t pasid_pasid_mask = 0xFFFFFU;
+
+// An extended device-TLB invalidation with S set and every address bit
+// below bit 63 set invalidates the entire address space of the PASID
+//
+constexpr const uint64_t dev_tlb_qdep_from = 4;
+constexpr const uint64_t dev_tlb_qdep_mask = 0x1FU;
+constexpr const uint64_t dev_tlb_sid_from = 16;
+constexpr const uint64_t dev_tlb_s = 1ULL << 11U;
+constexpr const uint64_t dev_tlb_addr_all = 0x7FFFFFFFFFFFF000ULL;
+
+constexpr const uint64_t ext_iotlb_g_pasid = 2;
+
+constexpr const uint64_t wait_sw = 1ULL << 5U;
+constexpr const uint64_t wait_fn = 1ULL << 6U;
+constexpr const uint64_t wait_data_from = 32;
+
+// The status word of a wait descriptor is written to the slot of the
+// status page that matches the wait descriptor's slot in the queue. The
+// top bit is always set so that a status word that has never been written
+// can not be mistaken for a completed ticket.
+//
+constexpr const uint32_t status_valid = 0x80000000U;
+
+static uint32_t
+status_data(queued_invalidation::ticket_type ticket) noexcept
+{ return gsl::narrow_cast<uint32_t>(ticket) | status_valid; }
+
+// -----------------------------------------------------------------------------
+// Batch
+// -----------------------------------------------------------------------------
+
+queued_invalidation::batch::batch(const queued_invalidation &qi) noexcept :
+    m_psi{iommu::cap_reg::psi::is_enabled(qi.m_unit.cap())},
+    m_mamv{iommu::cap_reg::mamv::get(qi.m_unit.cap())}
+{ }
+
+void
+queued_invalidation::batch::context_global()
+{
+    this->push(desc_type_context | (context_g_global << desc_g_from), 0);
+}
+
+void
+queued_invalidation::batch::context_domain(did_type did)
+{
+    this->push(
+        desc_type_context | (context_g_domain << desc_g_from) |
+        ((did & 0xFFFFU) << context_did_from), 0
+    );
+}
+
+void
+queued_invalidation::batch::context_device(did_type did, sid_type sid, uint64_t fm)
+{
+    this->push(
+        desc_type_context | (context_g_device << desc_g_from) |
+        ((did & 0xFFFFU) << context_did_from) |
+        ((sid & 0xFFFFU) << context_sid_from) |
+        ((fm & 0x3U) << context_fm_from), 0
+    );
+}
+
+void
+queued_invalidation::batch::iotlb_global()
+{
+    this->push(
+        desc_type_iotlb | (iotlb_g_global << desc_g_from) | iotlb_dr | iotlb_dw, 0
+    );
+}
+
+void
+queued_invalidation::batch::iotlb_domain(did_type did)
+{
+    this->push(
+        desc_type_iotlb | (iotlb_g_domain << desc_g_from) | iotlb_dr | iotlb_dw |
+        ((did & 0xFFFFU) << iotlb_did_from), 0
+    );
+}
+
+void
+queued_invalidation::batch::iotlb_pages(
+    did_type did, uintptr_t addr, uint64_t size, bool ih)
+{
+    expects(size != 0);
+
+    // The address mask (AM) selects a naturally aligned block of 2^AM
+    // pages, so find the smallest block that holds both the first and the
+    // last page of the range.
+    //
+
+    auto first = addr >> 12U;
+    auto last = (addr + size - 1) >> 12U;
+
+    uint64_t am = 0;
+    while ((first >> am) != (last >> am)) {
+        am++;
+    }
+
+    if (!m_psi || am > m_mamv) {
+        return this->iotlb_domain(did);
+    }
+
+    this->push(
+        desc_type_iotlb | (iotlb_g_page << desc_g_from) | iotlb_dr | iotlb_dw |
+        ((did & 0xFFFFU) << iotlb_did_from),
+        ((first >> am) << (am + 12U)) | (ih ? iotlb_ih : 0) | am
+    );
+}
+
+void
+queued_invalidation::batch::iec_global()
+{
+    this->push(desc_type_iec, 0);
+}
+
+void
+queued_invalidation::batch::iec_index(uint64_t index, uint64_t im)
+{
+    expects(im < 32);
+    expects((index & ((1ULL << im) - 1)) == 0);
+
+    this->push(
+        desc_type_iec | (iec_g_index << desc_g_from) |
+        (im << iec_im_from) | ((index & 0xFFFFU) << iec_iidx_from), 0
+    );
+}
+
+void
+queued_invalidation::batch::pasid_cache_domain(did_type did)
+{
+    this->push(
+        desc_type_pasid_cache | (pasid_g_domain << desc_g_from) |
+        ((did & 0xFFFFU) << pasid_did_from), 0
+    );
+}
+
+void
+queued_invalidation::batch::pasid_cache_pasid(did_type did, pasid_type pasid)
+{
+    this->push(
+        desc_type_pasid_cache | (pasid_g_pasid << desc_g_from) |
+        ((did & 0xFFFFU) << pasid_did_from) |
+        ((pasid & pasid_pasid_mask) << pasid_pasid_from), 0
+    );
+}
+
+void
+queued_invalidation::batch::ext_iotlb_pasid(did_type did, pasid_type pasid)
+{
+    this->push(
+        desc_type_ext_iotlb | (ext_iotlb_g_pasid << desc_g_from) |
+        ((did & 0xFFFFU) << pasid_did_from) |
+        ((pasid & pasid_pasid_mask) << pasid_pasid_from), 0
+    );
+}
+
+void
+queued_invalidation::batch::ext_dev_tlb_pasid(sid_type sid, pasid_type pasid, uint64_t qdep)
+{
+    this->push(
+        desc_type_ext_dev_tlb | ((qdep & dev_tlb_qdep_mask) << dev_tlb_qdep_from) |
+        ((sid & 0xFFFFU) << dev_tlb_sid_from) |
+        ((pasid & pasid_pasid_mask) << pasid_pasid_from),
+        dev_tlb_addr_all | dev_tlb_s
+    );
+}
+
+void
+queued_invalidation::batch::push(uint64_t lo, uint64_t hi)
+{
+    expects(m_size < max_batch_size);
+    m_descs.at(m_size++) = {lo, hi};
+}
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+queued_invalidation::queued_invalidation(iommu_unit &unit) :
+    m_unit{unit},
+    m_queue{alloc_page(), free_page},
+    m_status{alloc_page(), free_page}
+{
+    expects(iommu::ecap_reg::qi::is_enabled(unit.ecap()));
+
+    std::memset(m_queue.get(), 0, 0x1000);
+    std::memset(m_status.get(), 0, 0x1000);
+
+    m_queue_phys = g_mm->virtptr_to_physint(m_queue.get());
+    m_status_phys = g_mm->virtptr_to_physint(m_status.get());
+}
+
+void
+queued_invalidation::enable()
+{
+    if (m_enabled) {
+        return;
+    }
+
+    m_reserved = 0;
+    m_published = 0;
+    m_completed = 0;
+
+    m_unit.write_64(iommu::iqt_reg::offset, 0);
+
+    iommu::iqa_reg::value_type iqa = 0;
+    iommu::iqa_reg::iqa::set(iqa, m_queue_phys >> 12U);
+    iommu::iqa_reg::qs::set(iqa, qs_one_page);
+    m_unit.write_64(iommu::iqa_reg::offset, iqa);
+
+    m_unit.gcmd_set(1U << iommu::gcmd_reg::qie::from);
+    iommu_unit::wait_for(
+        [&] { return iommu::gsts_reg::qies::is_enabled(m_unit.gsts()); },
+        "queued_invalidation::enable: queued invalidation not enabled"
+    );
+
+    m_enabled = true;
+}
+
+void
+queued_invalidation::disable()
+{
+    if (!m_enabled) {
+        return;
+    }
+
+    // Per the spec, the queue must be empty (head == tail) before queued
+    // invalidation can be disabled.
+    //
+
+    iommu_unit::wait_for(
+        [&] { return this->head() == m_published.load(); },
+        "queued_invalidation::disable: queue not drained"
+    );
+
+    m_unit.gcmd_clear(1U << iommu::gcmd_reg::qie::from);
+    iommu_unit::wait_for(
+        [&] { return iommu::gsts_reg::qies::is_disabled(m_unit.gsts()); },
+        "queued_invalidation::disable: queued invalidation not disabled"
+    );
+
+    m_enabled = false;
+}
+
+queued_invalidation::ticket_type
+queued_invalidation::post(const batch &b)
+{
+    expects(m_enabled);
+
+    auto num = b.size() + 1;
+    expects(num < num_descriptors);
+
+    // Slots are only reserved once the ring has room for them, so that a
+    // timeout can never leave a reservation behind that is not published
+    // (which would stall every later post()). The ring always keeps one
+    // slot free, as head == tail means that the queue is empty.
+    //
+
+    auto start = m_reserved.load();
+
+    iommu_unit::wait_for(
+        [&] {
+            if (start + num - this->head() >= num_descriptors) {
+                start = m_reserved.load();
+                return false;
+            }
+
+            return m_reserved.compare_exchange_weak(start, start + num);
+        },
+        "queued_invalidation::post: queue full"
+    );
+
+    auto ticket = start + num;
+
+    auto queue = static_cast<descriptor_t *>(m_queue.get());
+
+    for (std::size_t i = 0; i < b.size(); i++) {
+        queue[(start + i) & (num_descriptors - 1)] = b.data()[i];
+    }
+
+    queue[(ticket - 1) & (num_descriptors - 1)] = {
+        desc_type_wait | wait_sw | wait_fn |
+        (static_cast<uint64_t>(status_data(ticket)) << wait_data_from),
+        m_status_phys + (((ticket - 1) & (num_descriptors - 1)) * sizeof(uint32_t))
+    };
+
+    // Batches that were reserved before this one must be handed to the
+    // hardware first, as moving the tail past them would expose slots that
+    // are still being written. Each CPU only waits for the CPUs ahead of
+    // it to finish copying their descriptors.
+    //
+
+    iommu_unit::wait_for(
+        [&] { return m_published.load(std::memory_order_acquire) == start; },
+        "queued_invalidation::post: publish timed out"
+    );
+
+    std::atomic_thread_fence(std::memory_order_release);
+
+    iommu::iqt_reg::value_type iqt = 0;
+    iommu::iqt_reg::qt::set(iqt, ticket & (num_descriptors - 1));
+    m_unit.write_64(iommu::iqt_reg::offset, iqt);
+
+    m_published.store(ticket, std::memory_order_release);
+    return ticket;
+}
+
+void
+queued_invalidation::wait(ticket_type ticket)
+{
+    iommu_unit::wait_for(
+        [&] {
+            if (iommu::fsts_reg::iqe::is_enabled(m_unit.read_32(iommu::fsts_reg::offset))) {
+                throw std::runtime_error("queued_invalidation::wait: invalidation queue error");
+            }
+
+            return this->complete(ticket);
+        },
+        "queued_invalidation::wait: invalidation timed out"
+    );
+}
+
+bool
+queued_invalidation::complete(ticket_type ticket) const
+{
+    auto completed = m_completed.load();
+    if (ticket <= completed) {
+        return true;
+    }
+
+    if (this->status(ticket) != status_data(ticket)) {
+        return false;
+    }
+
+    // Wait descriptors are posted with the fence flag set, so once a
+    // ticket completes, every ticket before it has completed as well.
+    //
+
+    while (completed < ticket && !m_completed.compare_exchange_weak(completed, ticket))
+    { }
+
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Private
+// -----------------------------------------------------------------------------
+
+uint64_t
+queued_invalidation::head() const
+{
+    // IQH only holds the index of the next descriptor in the ring, so the
+    // number of descriptors still pending is used to convert it into the
+    // same monotonic count as the tail. If more descriptors have been
+    // published since m_published was read, the result is smaller than
+    // the real head, which only makes callers wait a little longer.
+    //
+
+    auto published = m_published.load(std::memory_order_acquire);
+    auto iqh = m_unit.read_64(iommu::iqh_reg::offset);
+    auto pending = (published - iommu::iqh_reg::qh::get(iqh)) & (num_descriptors - 1);
+
+    return published - pending;
+}
+
+volatile uint32_t &
+queued_invalidation::status(ticket_type ticket) const
+{
+    auto words = static_cast<volatile uint32_t *>(m_status.get());
+    return words[(ticket - 1) & (num_descriptors - 1)];
+}
+
+}
@@ -0,0 +1,129 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <hve/arch/intel_x64/vtd/second_level_table.h>
+
+namespace eapis::intel_x64::vtd
+{
+
+using namespace ::intel_x64::vtd;
+
+// -----------------------------------------------------------------------------
+// Constants
+// -----------------------------------------------------------------------------
+
+// CAP.SAGAW bit n is set if a walk of n + 2 levels (30 + 9 * (n + 1)
+// address bits) is supported. CAP.SLLPS bit 0 is 2m, and bit 1 is 1g.
+//
+constexpr const uint64_t min_levels = 3;
+constexpr const uint64_t max_levels = 5;
+
+constexpr const uint64_t sllps_2m = 0x1;
+constexpr const uint64_t sllps_1g = 0x2;
+
+static uint64_t
+select_levels(uint64_t cap, uint64_t addr_width)
+{
+    auto levels = second_level_table::levels_from_cap(cap, addr_width);
+
+    if (levels == 0) {
+        throw std::runtime_error(
+            "second_level_table: unsupported address width: " +
+            std::to_string(addr_width)
+        );
+    }
+
+    return levels;
+}
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+second_level_table::second_level_table(const iommu_unit &unit, uint64_t addr_width) :
+    page_table{select_levels(unit.cap(), addr_width), iommu::ecap_reg::c::is_enabled(unit.ecap())},
+    m_max_level{max_level_from_cap(unit.cap())},
+    m_snoop_control{iommu::ecap_reg::sc::is_enabled(unit.ecap())}
+{ }
+
+second_level_table::second_level_table(
+    uint64_t levels, uint64_t max_level, bool snoop_control, bool coherent
+) :
+    page_table{levels, coherent},
+    m_max_level{max_level},
+    m_snoop_control{snoop_control}
+{
+    expects(max_level <= paging::level_1g);
+}
+
+second_level_table::entry_type &
+second_level_table::map(uintptr_t gpa, uintptr_t hpa, uint64_t level, attr_type attr)
+{
+    expects(level <= m_max_level);
+
+    attr.snoop = attr.snoop && m_snoop_control;
+    return page_table::map(gpa, hpa, level, attr);
+}
+
+second_level_table::size_type
+second_level_table::map_range(
+    uintptr_t gpa, uintptr_t hpa, size_type size, attr_type attr)
+{
+    attr.snoop = attr.snoop && m_snoop_control;
+    return page_table::map_range(gpa, hpa, size, attr, m_max_level);
+}
+
+uint64_t
+second_level_table::levels_from_cap(uint64_t cap, uint64_t addr_width) noexcept
+{
+    auto sagaw = iommu::cap_reg::sagaw::get(cap);
+
+    for (auto levels = min_levels; levels <= max_levels; levels++) {
+        if ((sagaw & (1ULL << (levels - 2U))) == 0) {
+            continue;
+        }
+
+        if (paging::from(levels) >= addr_width) {
+            return levels;
+        }
+    }
+
+    return 0;
+}
+
+uint64_t
+second_level_table::max_level_from_cap(uint64_t cap) noexcept
+{
+    auto sllps = iommu::cap_reg::sllps::get(cap);
+
+    if ((sllps & sllps_1g) != 0 && (sllps & sllps_2m) != 0) {
+        return paging::level_1g;
+    }
+
+    if ((sllps & sllps_2m) != 0) {
+        return paging::level_2m;
+    }
+
+    return paging::level_4k;
+}
+
+}
@@ -0,0 +1,110 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+// TIDY_EXCLUSION=-cppcoreguidelines-pro-type-reinterpret-cast
+//
+// Reason:
+//     Although in general this is a good rule, for hypervisor level code that
+//     interfaces with the kernel, and raw hardware, this rule is
+//     impractical.
+//
+
+#include <bfgsl.h>
+#include <bfupperlower.h>
+
+#include <hve/arch/x64/map_window.h>
+#include <bfvmm/memory_manager/arch/x64/cr3.h>
+
+namespace eapis::x64
+{
+
+map_window::map_window(std::size_t num_pages) :
+    m_hpas(num_pages, 0)
+{ expects(num_pages != 0); }
+
+map_window::~map_window()
+{
+    if (m_hva == 0) {
+        return;
+    }
+
+    for (std::size_t slot = 0; slot < m_hpas.size(); slot++) {
+        this->unmap(slot);
+    }
+
+    g_mm->free_map(reinterpret_cast<void *>(m_hva));
+}
+
+void *
+map_window::map(std::size_t slot, uintptr_t hpa)
+{
+    using namespace ::x64::pt;
+
+    expects(bfn::lower(hpa, from) == 0);
+    expects(hpa != 0);
+
+    auto &current = m_hpas.at(slot);
+
+    if (m_hva == 0) {
+        m_hva = reinterpret_cast<uintptr_t>(g_mm->alloc_map(m_hpas.size() * page_size));
+    }
+
+    auto hva = m_hva + (slot * page_size);
+    auto ptr = reinterpret_cast<void *>(hva);
+
+    if (current != hpa) {
+        this->unmap(slot);
+
+        g_cr3->map_4k(ptr, hpa);
+        current = hpa;
+    }
+
+    // The window's page tables are shared by every CPU, but invlpg only
+    // flushes the TLB of this one. Another CPU may have remapped the slot
+    // (even back to hpa) since this CPU last touched it, so this CPU's TLB
+    // could still hold any of the slot's previous pages.
+    //
+
+    ::x64::tlb::invlpg(hva);
+    return ptr;
+}
+
+void
+map_window::unmap(std::size_t slot)
+{
+    using namespace ::x64::pt;
+
+    auto &current = m_hpas.at(slot);
+
+    if (current == 0) {
+        return;
+    }
+
+    auto hva = m_hva + (slot * page_size);
+
+    g_cr3->unmap(hva);
+    ::x64::tlb::invlpg(hva);
+
+    current = 0;
+}
+
+}
@@ -0,0 +1,370 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef BENCH_EAPIS_TEST_H
+#define BENCH_EAPIS_TEST_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <x86intrin.h>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace bench
+{
+
+/// Config
+///
+/// Benchmarks are configured from the environment so that they can be run
+/// through the same test binaries (and ctest) as the unit tests:
+///
+/// - EAPIS_BENCH_ITERATIONS: calls per round (default: 10000)
+/// - EAPIS_BENCH_ROUNDS: rounds per benchmark, the median is kept
+///   (default: 9)
+/// - EAPIS_BENCH_BASELINE: a results file to compare against
+/// - EAPIS_BENCH_SAVE: where to write the results file
+/// - EAPIS_BENCH_THRESHOLD: the slowdown (in percent) over the baseline
+///   that is reported as a regression (default: 10)
+/// - EAPIS_BENCH_JSON: where to write the results as JSON
+///
+struct config_t {
+    uint64_t iterations{10000};
+    uint64_t rounds{9};
+    uint64_t threshold{10};
+    std::string baseline{};
+    std::string save{};
+    std::string json{};
+};
+
+inline uint64_t
+env_or(const char *name, uint64_t def)
+{
+    const char *val = std::getenv(name);
+    return val != nullptr ? std::strtoull(val, nullptr, 0) : def;
+}
+
+inline config_t
+config_from_env()
+{
+    config_t cfg;
+
+    cfg.iterations = std::max<uint64_t>(1, env_or("EAPIS_BENCH_ITERATIONS", cfg.iterations));
+    cfg.rounds = std::max<uint64_t>(1, env_or("EAPIS_BENCH_ROUNDS", cfg.rounds));
+    cfg.threshold = env_or("EAPIS_BENCH_THRESHOLD", cfg.threshold);
+
+    if (const char *val = std::getenv("EAPIS_BENCH_BASELINE")) {
+        cfg.baseline = val;
+    }
+
+    if (const char *val = std::getenv("EAPIS_BENCH_SAVE")) {
+        cfg.save = val;
+    }
+
+    if (const char *val = std::getenv("EAPIS_BENCH_JSON")) {
+        cfg.json = val;
+    }
+
+    return cfg;
+}
+
+/// Cycles
+///
+/// Reads the TSC. The fences keep the measured code from being reordered
+/// around the read.
+///
+inline uint64_t
+cycles() noexcept
+{
+    _mm_lfence();
+    auto tsc = __rdtsc();
+    _mm_lfence();
+
+    return tsc;
+}
+
+/// Suite
+///
+/// Runs benchmarks and collects the median number of cycles per call of
+/// each one, along with any other recorded measurements. Every result is
+/// lower-is-better. Results are stored as one "<name> <value>" pair per
+/// line, which is also the format of the baseline, and can also be written
+/// as JSON for trend tracking.
+///
+class suite
+{
+public:
+
+    explicit suite(std::string name, config_t cfg = config_from_env()) :
+        m_name{std::move(name)},
+        m_cfg{std::move(cfg)}
+    {
+        if (!m_cfg.baseline.empty()) {
+            m_baseline = load(m_cfg.baseline);
+        }
+    }
+
+    /// Run
+    ///
+    /// Calls f(i) for i in [0, iterations) once to warm up, and then
+    /// once per round
+    ///
+    /// @param name the name of the benchmark
+    /// @param f the code to measure
+    /// @return the median number of cycles per call
+    ///
+    template<typename F>
+    uint64_t run(const std::string &name, F &&f)
+    {
+        std::vector<uint64_t> samples(m_cfg.rounds);
+
+        for (uint64_t i = 0; i < m_cfg.iterations; i++) {
+            f(i);
+        }
+
+        for (auto &sample : samples) {
+            auto start = cycles();
+
+            for (uint64_t i = 0; i < m_cfg.iterations; i++) {
+                f(i);
+            }
+
+            sample = (cycles() - start) / m_cfg.iterations;
+        }
+
+        std::nth_element(samples.begin(), samples.begin() + samples.size() / 2, samples.end());
+        return this->record(name, samples.at(samples.size() / 2));
+    }
+
+    /// Run Rounds
+    ///
+    /// For operations that change state (and therefore can not simply be
+    /// repeated), calls setup() before each round without measuring it,
+    /// and then measures f(ctx), where ctx is what setup() returned
+    ///
+    /// @param name the name of the benchmark
+    /// @param ops the number of operations performed by each call to f
+    /// @param setup creates the state used by a round
+    /// @param f the code to measure
+    /// @return the median number of cycles per operation
+    ///
+    template<typename S, typename F>
+    uint64_t run_rounds(const std::string &name, uint64_t ops, S &&setup, F &&f)
+    {
+        std::vector<uint64_t> samples(m_cfg.rounds);
+
+        for (auto &sample : samples) {
+            auto ctx = setup();
+            auto start = cycles();
+
+            f(ctx);
+
+            sample = (cycles() - start) / std::max<uint64_t>(1, ops);
+        }
+
+        std::nth_element(samples.begin(), samples.begin() + samples.size() / 2, samples.end());
+        return this->record(name, samples.at(samples.size() / 2));
+    }
+
+    /// Record
+    ///
+    /// Records a measurement that was not taken with run()
+    ///
+    /// @param name the name of the benchmark
+    /// @param value the measurement
+    /// @param unit the unit of the measurement
+    /// @return value
+    ///
+    uint64_t record(const std::string &name, uint64_t value, const char *unit = "cycles")
+    {
+        m_results[name] = value;
+        m_units[name] = unit;
+
+        return value;
+    }
+
+    /// Iterations
+    ///
+    /// @return the number of calls per round
+    ///
+    uint64_t iterations() const noexcept
+    { return m_cfg.iterations; }
+
+    /// Rounds
+    ///
+    /// @return the number of rounds per benchmark
+    ///
+    uint64_t rounds() const noexcept
+    { return m_cfg.rounds; }
+
+    /// Regressions
+    ///
+    /// @return the names of the benchmarks that are slower than the
+    ///     baseline by more than the threshold
+    ///
+    std::vector<std::string> regressions() const
+    {
+        std::vector<std::string> names;
+
+        for (const auto &[name, value] : m_results) {
+            const auto &base = m_baseline.find(name);
+            if (base == m_baseline.end() || base->second == 0) {
+                continue;
+            }
+
+            if (value * 100 > base->second * (100 + m_cfg.threshold)) {
+                names.push_back(name);
+            }
+        }
+
+        return names;
+    }
+
+    /// Report
+    ///
+    /// Prints every result, along with the baseline and the change
+    /// relative to it when a baseline was provided
+    ///
+    void report(std::ostream &os = std::cout) const
+    {
+        for (const auto &[name, value] : m_results) {
+            os << std::left << std::setw(56) << name << std::right << std::setw(12) << value;
+
+            const auto &base = m_baseline.find(name);
+            if (base != m_baseline.end() && base->second != 0) {
+                auto delta =
+                    (static_cast<double>(value) - static_cast<double>(base->second)) * 100.0 /
+                    static_cast<double>(base->second);
+
+                os << std::setw(12) << base->second << std::setw(9) << std::fixed
+                   << std::setprecision(1) << std::showpos << delta << '%' << std::noshowpos;
+            }
+
+            os << '\n';
+        }
+    }
+
+    /// Save
+    ///
+    /// Writes the results to the files named by EAPIS_BENCH_SAVE and
+    /// EAPIS_BENCH_JSON (if any)
+    ///
+    void save() const
+    {
+        if (!m_cfg.save.empty()) {
+            std::ofstream file{m_cfg.save};
+            for (const auto &[name, value] : m_results) {
+                file << name << ' ' << value << '\n';
+            }
+        }
+
+        if (!m_cfg.json.empty()) {
+            std::ofstream file{m_cfg.json};
+            this->json(file);
+        }
+    }
+
+    /// JSON
+    ///
+    /// Writes the results as a JSON object of the form:
+    ///
+    ///     {
+    ///         "suite": "<name>",
+    ///         "iterations": <n>,
+    ///         "rounds": <n>,
+    ///         "results": [
+    ///             {"name": "<name>", "value": <n>, "unit": "<unit>"},
+    ///             ...
+    ///         ]
+    ///     }
+    ///
+    /// Benchmark names never contain characters that need escaping.
+    ///
+    /// @param os the stream to write to
+    ///
+    void json(std::ostream &os) const
+    {
+        os << "{\n";
+        os << "    \"suite\": \"" << m_name << "\",\n";
+        os << "    \"iterations\": " << m_cfg.iterations << ",\n";
+        os << "    \"rounds\": " << m_cfg.rounds << ",\n";
+        os << "    \"results\": [";
+
+        auto first = true;
+        for (const auto &[name, value] : m_results) {
+            os << (first ? "\n" : ",\n");
+            os << "        {\"name\": \"" << name << "\", \"value\": " << value
+               << ", \"unit\": \"" << m_units.at(name) << "\"}";
+
+            first = false;
+        }
+
+        os << "\n    ]\n}\n";
+    }
+
+    /// Results
+    ///
+    /// @return the median number of cycles per call of each benchmark
+    ///
+    const std::map<std::string, uint64_t> &results() const noexcept
+    { return m_results; }
+
+private:
+
+    static std::map<std::string, uint64_t> load(const std::string &path)
+    {
+        std::map<std::string, uint64_t> results;
+
+        std::ifstream file{path};
+        std::string name;
+        uint64_t value;
+
+        while (file >> name >> value) {
+            results[name] = value;
+        }
+
+        return results;
+    }
+
+private:
+
+    std::string m_name;
+    config_t m_cfg;
+
+    std::map<std::string, uint64_t> m_results;
+    std::map<std::string, std::string> m_units;
+    std::map<std::string, uint64_t> m_baseline;
+};
+
+}
+
+#endif
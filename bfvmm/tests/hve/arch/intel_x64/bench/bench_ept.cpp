@@ -0,0 +1,399 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <bfvmm/test/support.h>
+#include <hve/arch/intel_x64/ept/helpers.h>
+
+#include "bench.h"
+
+using namespace eapis::intel_x64;
+
+using mmap_ptr = std::unique_ptr<ept::mmap>;
+
+constexpr uint64_t GB = 0x40000000ULL;
+constexpr uint64_t phys_addr_bits = 48;
+
+constexpr uint64_t page_size_4k = ::intel_x64::ept::pt::page_size;
+constexpr uint64_t page_size_2m = ::intel_x64::ept::pd::page_size;
+
+static volatile uintptr_t g_sink = 0;
+
+// -----------------------------------------------------------------------------
+// Parameters
+// -----------------------------------------------------------------------------
+
+struct params_t {
+
+    /// The sizes of the identity maps to build
+    ///
+    std::vector<uint64_t> sizes;
+
+    /// The size of the maps used to measure lookups, splits and releases
+    ///
+    uint64_t span;
+
+    /// The thread counts used to measure concurrent lookups
+    ///
+    std::vector<uint64_t> threads;
+};
+
+static const params_t full_params = {
+    {64 * GB, 1024 * GB}, 1 * GB, {2, 4, 8}
+};
+
+static const params_t smoke_params = {
+    {1 * GB}, 32 * page_size_2m, {2}
+};
+
+// -----------------------------------------------------------------------------
+// MTRR Layouts
+// -----------------------------------------------------------------------------
+
+// - disabled: MTRRs are disabled, so all of memory is a single span
+// - typical: write-back, with a 2GB uncacheable MMIO hole below 4GB and a
+//   write-combining framebuffer inside of it
+// - fragmented: write-back, with eight 64KB uncacheable ranges that are not
+//   2m aligned, each of which forces a 2m region to be mapped with 4k pages
+//
+enum class layout_t { disabled, typical, fragmented };
+
+constexpr std::array<std::pair<const char *, layout_t>, 3> layouts = {{
+    {"disabled", layout_t::disabled},
+    {"typical", layout_t::typical},
+    {"fragmented", layout_t::fragmented}
+}};
+
+static void
+set_variable_range(uint64_t i, uint64_t base, uint64_t size, uint64_t type)
+{
+    using namespace ::intel_x64::msrs;
+
+    uint64_t physbase = 0;
+    uint64_t physmask = 0;
+
+    ia32_mtrr_physbase::type::set(physbase, type);
+    ia32_mtrr_physbase::physbase::set(physbase, base >> 12U);
+
+    ia32_mtrr_physmask::valid::enable(physmask);
+    ia32_mtrr_physmask::physmask::set(
+        physmask, (((1ULL << phys_addr_bits) - 1U) & ~(size - 1U)) >> 12U
+    );
+
+    ::intel_x64::msrs::set(ia32_mtrr_physbase::addr + (i * 2), physbase);
+    ::intel_x64::msrs::set(ia32_mtrr_physmask::addr + (i * 2), physmask);
+}
+
+static std::unique_ptr<mtrrs>
+make_mtrrs(layout_t layout)
+{
+    using namespace ::intel_x64::msrs;
+
+    g_eax_cpuid[::x64::cpuid::addr_size::addr] = phys_addr_bits;
+
+    ::x64::msrs::ia32_mtrrcap::vcnt::set(0);
+    ia32_mtrr_def_type::type::set(ia32_mtrr_def_type::type::write_back);
+    ia32_mtrr_def_type::mtrr_enable::enable();
+
+    switch (layout) {
+        case layout_t::disabled:
+            ia32_mtrr_def_type::mtrr_enable::disable();
+            break;
+
+        case layout_t::typical:
+            ::x64::msrs::ia32_mtrrcap::vcnt::set(2);
+            set_variable_range(0, 2 * GB, 2 * GB, ia32_mtrr_physbase::type::uncacheable);
+            set_variable_range(1, 3 * GB, 256 * 0x100000, ia32_mtrr_physbase::type::write_combining);
+            break;
+
+        case layout_t::fragmented:
+            ::x64::msrs::ia32_mtrrcap::vcnt::set(8);
+            for (uint64_t i = 0; i < 8; i++) {
+                set_variable_range(
+                    i, ((i + 1) * GB) + 0x10000, 0x10000, ia32_mtrr_physbase::type::uncacheable
+                );
+            }
+            break;
+    };
+
+    return std::make_unique<mtrrs>();
+}
+
+static std::string
+size_name(uint64_t size)
+{
+    std::ostringstream name;
+
+    if (size >= GB) {
+        name << (size / GB) << 'g';
+    }
+    else {
+        name << (size / 0x100000) << 'm';
+    }
+
+    return name.str();
+}
+
+static std::vector<uintptr_t>
+random_addrs(uint64_t span)
+{
+    std::vector<uintptr_t> addrs(4096);
+    std::mt19937_64 rng{42};
+
+    for (auto &addr : addrs) {
+        addr = rng() % span;
+    }
+
+    return addrs;
+}
+
+// -----------------------------------------------------------------------------
+// Benchmarks
+// -----------------------------------------------------------------------------
+
+static void
+bench_identity_map(bench::suite &s, const params_t &p)
+{
+    for (const auto &[lname, layout] : layouts) {
+        auto ranges = make_mtrrs(layout);
+        REQUIRE(ranges->size() != 0);
+
+        for (auto size : p.sizes) {
+            auto name = std::string(lname) + "/" + size_name(size);
+            uint64_t pages = 0;
+
+            s.run_rounds("identity_map/" + name, 1, [] {
+                return std::make_unique<ept::mmap>();
+            },
+            [&](mmap_ptr & map) {
+                ept::identity_map(*map, *ranges, 0, size);
+            });
+
+            s.run_rounds("teardown/" + name, 1, [&] {
+                auto map = std::make_unique<ept::mmap>();
+                auto before = g_allocated_pages.size();
+
+                ept::identity_map(*map, *ranges, 0, size);
+                pages = g_allocated_pages.size() - before;
+
+                return map;
+            },
+            [](mmap_ptr & map) {
+                map.reset();
+            });
+
+            s.record("tables/" + name, pages, "pages");
+        }
+    }
+
+    // For comparison, the same sizes mapped with the largest pages
+    // possible, ignoring the MTRRs
+    //
+
+    for (auto size : p.sizes) {
+        s.run_rounds("map_range/" + size_name(size), 1, [] {
+            return std::make_unique<ept::mmap>();
+        },
+        [&](mmap_ptr & map) {
+            map->map_range(0, 0, size);
+        });
+    }
+}
+
+static void
+bench_virt_to_phys(bench::suite &s, const params_t &p, const char *granularity, ept::mmap &map)
+{
+    auto addrs = random_addrs(p.span);
+    auto mask = addrs.size() - 1;
+
+    s.run(std::string("virt_to_phys/") + granularity + "/threads=1", [&](uint64_t i) {
+        g_sink = map.virt_to_phys(addrs[i & mask]).first;
+    });
+
+    // Each thread performs the same number of lookups. The result is the
+    // wall clock cycles per lookup across all threads, so perfect scaling
+    // divides the single threaded result by the thread count.
+    //
+
+    for (auto threads : p.threads) {
+        std::ostringstream name;
+        name << "virt_to_phys/" << granularity << "/threads=" << threads;
+
+        std::vector<uint64_t> samples(s.rounds());
+
+        for (auto &sample : samples) {
+            std::atomic<uint64_t> ready{0};
+            std::atomic<bool> go{false};
+            std::vector<std::thread> workers;
+
+            for (uint64_t t = 0; t < threads; t++) {
+                workers.emplace_back([&, t] {
+                    ready++;
+                    while (!go) { }
+
+                    for (uint64_t i = 0; i < s.iterations(); i++) {
+                        g_sink = map.virt_to_phys(addrs[(i + (t * 512)) & mask]).first;
+                    }
+                });
+            }
+
+            while (ready != threads) { }
+
+            auto start = bench::cycles();
+            go = true;
+
+            for (auto &worker : workers) {
+                worker.join();
+            }
+
+            sample = (bench::cycles() - start) / (threads * s.iterations());
+        }
+
+        std::nth_element(samples.begin(), samples.begin() + samples.size() / 2, samples.end());
+        s.record(name.str(), samples.at(samples.size() / 2));
+    }
+}
+
+static void
+bench_virt_to_phys(bench::suite &s, const params_t &p)
+{
+    auto ranges = make_mtrrs(layout_t::disabled);
+
+    ept::mmap map_2m;
+    ept::identity_map(map_2m, *ranges, 0, p.span);
+    bench_virt_to_phys(s, p, "2m", map_2m);
+
+    ept::mmap map_4k;
+    ept::identity_map_4k(map_4k, 0, p.span);
+    bench_virt_to_phys(s, p, "4k", map_4k);
+}
+
+static void
+bench_split(bench::suite &s, const params_t &p)
+{
+    s.run_rounds("split/2m_to_4k", p.span / page_size_2m, [&] {
+        auto map = std::make_unique<ept::mmap>();
+        ept::identity_map_2m(*map, 0, p.span);
+
+        return map;
+    },
+    [&](mmap_ptr & map) {
+        for (uint64_t gpa = 0; gpa < p.span; gpa += page_size_2m) {
+            ept::identity_map_convert_2m_to_4k(*map, gpa);
+        }
+    });
+
+    s.run_rounds("merge/4k_to_2m", p.span / page_size_2m, [&] {
+        auto map = std::make_unique<ept::mmap>();
+        ept::identity_map_4k(*map, 0, p.span);
+
+        return map;
+    },
+    [&](mmap_ptr & map) {
+        for (uint64_t gpa = 0; gpa < p.span; gpa += page_size_2m) {
+            ept::identity_map_convert_4k_to_2m(*map, gpa);
+        }
+    });
+}
+
+static void
+bench_release(bench::suite &s, const params_t &p)
+{
+    s.run_rounds("release/2m", p.span / page_size_2m, [&] {
+        auto map = std::make_unique<ept::mmap>();
+        ept::identity_map_2m(*map, 0, p.span);
+
+        return map;
+    },
+    [&](mmap_ptr & map) {
+        ept::identity_release_2m(*map, 0, p.span);
+    });
+
+    s.run_rounds("release/4k", p.span / page_size_4k, [&] {
+        auto map = std::make_unique<ept::mmap>();
+        ept::identity_map_4k(*map, 0, p.span);
+
+        return map;
+    },
+    [&](mmap_ptr & map) {
+        ept::identity_release_4k(*map, 0, p.span);
+    });
+}
+
+static void
+bench_all(bench::suite &s, const params_t &p)
+{
+    bench_identity_map(s, p);
+    bench_virt_to_phys(s, p);
+    bench_split(s, p);
+    bench_release(s, p);
+}
+
+// -----------------------------------------------------------------------------
+// Tests
+// -----------------------------------------------------------------------------
+
+// Runs every benchmark on small maps so that the benchmarks are built and
+// exercised along with the unit tests
+//
+TEST_CASE("bench_ept: smoke")
+{
+    bench::config_t cfg;
+    cfg.iterations = 16;
+    cfg.rounds = 1;
+
+    bench::suite s{"ept", cfg};
+    bench_all(s, smoke_params);
+
+    CHECK(s.results().at("tables/disabled/1g") == 2);
+    CHECK(g_allocated_pages.empty());
+}
+
+// The benchmarks themselves are hidden, and are run with:
+//
+//     EAPIS_BENCH_JSON=<file> bench_ept [.bench]
+//
+// Identity mapping 1TB takes a few hundred MB of page tables per round.
+//
+TEST_CASE("bench_ept: run", "[.bench]")
+{
+    bench::suite s{"ept"};
+
+    bench_all(s, full_params);
+    s.report();
+    s.save();
+
+    for (const auto &name : s.regressions()) {
+        FAIL_CHECK("regression: " << name);
+    }
+}
@@ -0,0 +1,388 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <array>
+#include <memory>
+#include <random>
+#include <sstream>
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <bfvmm/test/support.h>
+#include <hve/arch/intel_x64/vcpu.h>
+
+#include "bench.h"
+
+using namespace eapis::intel_x64;
+using eapis_vcpu = eapis::intel_x64::vcpu;
+
+// -----------------------------------------------------------------------------
+// Parameters
+// -----------------------------------------------------------------------------
+
+// Each keyed handler (cpuid, rdmsr, wrmsr and io_instruction) is measured
+// for every combination of the following. The handler count is the length
+// of the delegate list of a key (every delegate but the last one returns
+// false), the key space is the number of keys with registered delegates,
+// and the hit ratio is the percentage of exits that land on a registered
+// key (the rest fall through to the default handler).
+//
+constexpr std::array<uint64_t, 3> handler_counts = {1, 4, 16};
+constexpr std::array<uint64_t, 3> key_space_sizes = {1, 64, 4096};
+constexpr std::array<uint64_t, 3> hit_percents = {100, 50, 0};
+
+constexpr std::array<uint64_t, 3> queue_depths = {1, 16, 64};
+
+// The keys used by each exit are precomputed so that the benchmark loop
+// only measures the handler
+//
+constexpr uint64_t num_keys = 1024;
+
+using keys_t = std::array<uint64_t, num_keys>;
+
+static keys_t
+make_keys(uint64_t base, uint64_t key_space, uint64_t hit_percent)
+{
+    keys_t keys{};
+    std::mt19937_64 rng{42};
+
+    for (auto &key : keys) {
+        if (rng() % 100 < hit_percent) {
+            key = base + (rng() % key_space);
+        }
+        else {
+            key = base + key_space + (rng() % key_space);
+        }
+    }
+
+    return keys;
+}
+
+static std::string
+make_name(const char *exit, uint64_t handlers, uint64_t keys, uint64_t hit)
+{
+    std::ostringstream name;
+    name << exit << "/handlers=" << handlers << "/keys=" << keys << "/hit=" << hit;
+
+    return name.str();
+}
+
+// -----------------------------------------------------------------------------
+// Delegates
+// -----------------------------------------------------------------------------
+
+template<typename T>
+bool
+pass(gsl::not_null<vcpu_t *> vcpu, T &info)
+{
+    bfignored(vcpu);
+    bfignored(info);
+
+    return false;
+}
+
+template<typename T>
+bool
+claim(gsl::not_null<vcpu_t *> vcpu, T &info)
+{
+    bfignored(vcpu);
+    bfignored(info);
+
+    return true;
+}
+
+bool
+default_handler(gsl::not_null<vcpu_t *> vcpu)
+{
+    bfignored(vcpu);
+    return true;
+}
+
+template<typename H>
+void
+add_delegates(H &handler, uint64_t key, uint64_t count)
+{
+    using info_t = typename H::info_t;
+    using delegate_t = typename H::handler_delegate_t;
+
+    // Delegates are pushed to the front of the list, so the one that
+    // claims the exit is added first and ends up last.
+    //
+
+    handler.add_handler(key, delegate_t::template create<claim<info_t>>());
+    for (uint64_t i = 1; i < count; i++) {
+        handler.add_handler(key, delegate_t::template create<pass<info_t>>());
+    }
+
+    handler.emulate(key);
+}
+
+// -----------------------------------------------------------------------------
+// Benchmarks
+// -----------------------------------------------------------------------------
+
+static void
+bench_cpuid(bench::suite &s, eapis_vcpu *vcpu)
+{
+    constexpr uint64_t base = 0x40000100;
+
+    for (auto handlers : handler_counts) {
+        for (auto key_space : key_space_sizes) {
+            for (auto hit : hit_percents) {
+                cpuid_handler handler{vcpu};
+                handler.set_default_handler(::handler_delegate_t::create<default_handler>());
+
+                for (uint64_t key = base; key < base + key_space; key++) {
+                    add_delegates(handler, key, handlers);
+                }
+
+                auto keys = make_keys(base, key_space, hit);
+                s.run(make_name("cpuid", handlers, key_space, hit), [&](uint64_t i) {
+                    vcpu->set_rax(keys[i % num_keys]);
+                    handler.handle(vcpu);
+                });
+            }
+        }
+    }
+}
+
+template<typename H>
+static void
+bench_msr(bench::suite &s, eapis_vcpu *vcpu, const char *exit_name)
+{
+    constexpr uint64_t base = 0xC0010000;
+
+    for (auto handlers : handler_counts) {
+        for (auto key_space : key_space_sizes) {
+            for (auto hit : hit_percents) {
+                H handler{vcpu};
+                handler.set_default_handler(::handler_delegate_t::create<default_handler>());
+
+                for (uint64_t key = base; key < base + key_space; key++) {
+                    add_delegates(handler, key, handlers);
+                }
+
+                auto keys = make_keys(base, key_space, hit);
+                s.run(make_name(exit_name, handlers, key_space, hit), [&](uint64_t i) {
+                    vcpu->set_rcx(keys[i % num_keys]);
+                    handler.handle(vcpu);
+                });
+            }
+        }
+    }
+}
+
+static void
+bench_io_instruction(bench::suite &s, eapis_vcpu *vcpu)
+{
+    using info_t = io_instruction_handler::info_t;
+    using delegate_t = io_instruction_handler::handler_delegate_t;
+
+    constexpr uint64_t base = 0x1000;
+
+    // A 1 byte OUT with the port in DX. Misses are not measured as the
+    // default path logs every port it sees.
+    //
+
+    ::intel_x64::vm::write(vmcs_n::exit_qualification::addr, 0);
+
+    for (auto handlers : handler_counts) {
+        for (auto key_space : key_space_sizes) {
+            io_instruction_handler handler{vcpu};
+
+            for (uint64_t key = base; key < base + key_space; key++) {
+                handler.add_handler(
+                    key,
+                    delegate_t::create<claim<info_t>>(),
+                    delegate_t::create<claim<info_t>>()
+                );
+
+                for (uint64_t i = 1; i < handlers; i++) {
+                    handler.add_handler(
+                        key,
+                        delegate_t::create<pass<info_t>>(),
+                        delegate_t::create<pass<info_t>>()
+                    );
+                }
+
+                handler.emulate(key);
+            }
+
+            auto keys = make_keys(base, key_space, 100);
+            s.run(make_name("io_instruction", handlers, key_space, 100), [&](uint64_t i) {
+                vcpu->set_rdx(keys[i % num_keys]);
+                handler.handle(vcpu);
+            });
+        }
+    }
+}
+
+static void
+bench_control_register(bench::suite &s, eapis_vcpu *vcpu)
+{
+    using info_t = control_register_handler::info_t;
+    using delegate_t = control_register_handler::handler_delegate_t;
+
+    // MOV to CR3 from RAX
+    //
+
+    ::intel_x64::vm::write(vmcs_n::exit_qualification::addr, 3);
+
+    for (auto handlers : handler_counts) {
+        control_register_handler handler{vcpu};
+
+        handler.add_wrcr3_handler(delegate_t::create<claim<info_t>>());
+        for (uint64_t i = 1; i < handlers; i++) {
+            handler.add_wrcr3_handler(delegate_t::create<pass<info_t>>());
+        }
+
+        std::ostringstream name;
+        name << "control_register/wrcr3/handlers=" << handlers;
+
+        s.run(name.str(), [&](uint64_t i) {
+            vcpu->set_rax(i << 12U);
+            handler.handle(vcpu);
+        });
+    }
+}
+
+static void
+bench_ept_violation(bench::suite &s, eapis_vcpu *vcpu)
+{
+    using info_t = ept_violation_handler::info_t;
+    using delegate_t = ept_violation_handler::handler_delegate_t;
+
+    constexpr std::array<std::pair<const char *, uint64_t>, 3> accesses = {{
+        {"read", 1}, {"write", 2}, {"execute", 4}
+    }};
+
+    for (auto handlers : handler_counts) {
+        ept_violation_handler handler{vcpu};
+
+        handler.add_read_handler(delegate_t::create<claim<info_t>>());
+        handler.add_write_handler(delegate_t::create<claim<info_t>>());
+        handler.add_execute_handler(delegate_t::create<claim<info_t>>());
+
+        for (uint64_t i = 1; i < handlers; i++) {
+            handler.add_read_handler(delegate_t::create<pass<info_t>>());
+            handler.add_write_handler(delegate_t::create<pass<info_t>>());
+            handler.add_execute_handler(delegate_t::create<pass<info_t>>());
+        }
+
+        for (const auto &[access, qual] : accesses) {
+            ::intel_x64::vm::write(vmcs_n::exit_qualification::addr, qual);
+
+            std::ostringstream name;
+            name << "ept_violation/" << access << "/handlers=" << handlers;
+
+            s.run(name.str(), [&](uint64_t i) {
+                bfignored(i);
+                handler.handle(vcpu);
+            });
+        }
+    }
+}
+
+static void
+bench_interrupt_window(bench::suite &s, eapis_vcpu *vcpu)
+{
+    // Each iteration queues one interrupt and injects one, so the queue
+    // stays at the given depth
+    //
+
+    for (auto depth : queue_depths) {
+        interrupt_window_handler handler{vcpu};
+
+        for (uint64_t i = 1; i < depth; i++) {
+            handler.queue_external_interrupt(0x20 + (i % 0xD0));
+        }
+
+        std::ostringstream name;
+        name << "interrupt_window/depth=" << depth;
+
+        s.run(name.str(), [&](uint64_t i) {
+            handler.queue_external_interrupt(0x20 + (i % 0xD0));
+            handler.handle(vcpu);
+        });
+    }
+}
+
+static void
+bench_all(bench::suite &s)
+{
+    setup_test_support();
+
+    // Allow every VM execution control so that the vCPU can enable the
+    // controls it needs (e.g. VPID)
+    //
+    g_msrs[::intel_x64::msrs::ia32_vmx_true_pinbased_ctls::addr] = 0xFFFFFFFF00000000;
+    g_msrs[::intel_x64::msrs::ia32_vmx_true_procbased_ctls::addr] = 0xFFFFFFFF00000000;
+    g_msrs[::intel_x64::msrs::ia32_vmx_true_entry_ctls::addr] = 0xFFFFFFFF00000000;
+    g_msrs[::intel_x64::msrs::ia32_vmx_true_exit_ctls::addr] = 0xFFFFFFFF00000000;
+    g_msrs[::intel_x64::msrs::ia32_vmx_procbased_ctls2::addr] = 0xFFFFFFFF00000000;
+
+    auto vcpu = std::make_unique<eapis_vcpu>(0);
+
+    bench_cpuid(s, vcpu.get());
+    bench_msr<rdmsr_handler>(s, vcpu.get(), "rdmsr");
+    bench_msr<wrmsr_handler>(s, vcpu.get(), "wrmsr");
+    bench_io_instruction(s, vcpu.get());
+    bench_control_register(s, vcpu.get());
+    bench_ept_violation(s, vcpu.get());
+    bench_interrupt_window(s, vcpu.get());
+}
+
+// -----------------------------------------------------------------------------
+// Tests
+// -----------------------------------------------------------------------------
+
+// Runs every benchmark a few times so that the benchmarks are built and
+// exercised along with the unit tests
+//
+TEST_CASE("bench_vmexit: smoke")
+{
+    bench::config_t cfg;
+    cfg.iterations = 16;
+    cfg.rounds = 1;
+
+    bench::suite s{"vmexit", cfg};
+    CHECK_NOTHROW(bench_all(s));
+    CHECK_FALSE(s.results().empty());
+}
+
+// The benchmarks themselves are hidden, and are run with:
+//
+//     EAPIS_BENCH_BASELINE=<file> EAPIS_BENCH_SAVE=<file> bench_vmexit [.bench]
+//
+TEST_CASE("bench_vmexit: run", "[.bench]")
+{
+    bench::suite s{"vmexit"};
+
+    bench_all(s);
+    s.report();
+    s.save();
+
+    for (const auto &name : s.regressions()) {
+        FAIL_CHECK("regression: " << name);
+    }
+}
@@ -204,3 +204,25 @@ TEST_CASE("identity_map")
     CHECK(mmap.is_4k(0x7FF000));
     CHECK(mmap.is_2m(0x800000));
 }
+
+TEST_CASE("map_mmio")
+{
+    using namespace ::intel_x64::ept;
+
+    ept::mmap mmap{};
+    map_mmio(mmap, 0x10000, pt::page_size * 2);
+
+    auto entry = mmap.entry(0x10000).first.get();
+    CHECK(mmap.is_4k(0x11000));
+    CHECK(pt::entry::read_access::is_disabled(entry));
+    CHECK(pt::entry::write_access::is_enabled(entry));
+    CHECK(pt::entry::execute_access::is_disabled(entry));
+    CHECK_THROWS(mmap.is_4k(0x12000));
+
+    CHECK_THROWS(map_mmio(mmap, 0x10000, pt::page_size));
+    CHECK_THROWS(map_mmio(mmap, 0x20001, pt::page_size));
+
+    unmap_mmio(mmap, 0x10000, pt::page_size * 2);
+    CHECK_THROWS(mmap.is_4k(0x10000));
+    CHECK_THROWS(mmap.is_4k(0x11000));
+}
@@ -19,6 +19,9 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <array>
+#include <vector>
+
 #include <catch/catch.hpp>
 #include <hippomocks.h>
 
@@ -905,3 +908,520 @@ TEST_CASE("mmap: 4k release range")
     mmap.release(0x3000);
     CHECK(g_allocated_pages.size() == 1);
 }
+
+TEST_CASE("mmap: map range")
+{
+    {
+        ept::mmap mmap{};
+
+        CHECK(mmap.map_range(0x3FE00000, 0x3FE00000, 0x40201000) == 3);
+        CHECK(mmap.is_2m(0x3FE00000));
+        CHECK(mmap.is_1g(0x40000000));
+        CHECK(mmap.is_4k(0x80000000));
+
+        CHECK(mmap.map_range(0x100000000, 0x100001000, 0x200000) == 0x200);
+        CHECK(mmap.is_4k(0x100000000));
+
+        CHECK(mmap.map_range(0x200000000, 0x200000000, 0x40000000, ept::mmap::attr_type::read_write,
+                             ept::mmap::memory_type::write_back, paging::level_2m) == 0x200);
+        CHECK(mmap.is_2m(0x200000000));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: accessed and dirty flags")
+{
+    ept::mmap mmap{};
+    std::array<uint64_t, 1> bitmap{};
+
+    CHECK_FALSE(mmap.accessed_and_dirty_flags());
+    CHECK_THROWS(mmap.harvest_dirty(0, 0x1000, bitmap));
+
+    mmap.enable_accessed_and_dirty_flags();
+    CHECK(mmap.accessed_and_dirty_flags());
+
+    mmap.disable_accessed_and_dirty_flags();
+    CHECK_FALSE(mmap.accessed_and_dirty_flags());
+}
+
+TEST_CASE("mmap: harvest dirty 4k")
+{
+    using namespace ::intel_x64::ept;
+
+    {
+        ept::mmap mmap{};
+        std::array<uint64_t, 2> bitmap{};
+
+        mmap.enable_accessed_and_dirty_flags();
+        mmap.map_range(0x0, 0x0, 0x80000, ept::mmap::attr_type::read_write,
+                       ept::mmap::memory_type::write_back, paging::level_4k);
+
+        pt::entry::dirty::enable(mmap.entry(0x1000).first.get());
+        pt::entry::dirty::enable(mmap.entry(0x41000).first.get());
+        pt::entry::accessed_flag::enable(mmap.entry(0x2000).first.get());
+
+        CHECK_THROWS(mmap.harvest_dirty(0x0, 0x80000, gsl::make_span(bitmap.data(), 1)));
+        CHECK_THROWS(mmap.harvest_dirty(0x1, 0x1000, bitmap));
+
+        CHECK(mmap.harvest_dirty(0x0, 0x80000, bitmap) == 2);
+        CHECK(bitmap.at(0) == 0x2);
+        CHECK(bitmap.at(1) == 0x2);
+
+        CHECK(pt::entry::dirty::is_disabled(mmap.entry(0x1000).first.get()));
+        CHECK(pt::entry::accessed_flag::is_enabled(mmap.entry(0x2000).first.get()));
+
+        CHECK(mmap.harvest_dirty(0x0, 0x80000, bitmap) == 0);
+        CHECK(bitmap.at(0) == 0);
+        CHECK(bitmap.at(1) == 0);
+
+        CHECK(mmap.harvest_accessed(0x1000, 0x2000, bitmap) == 1);
+        CHECK(bitmap.at(0) == 0x2);
+        CHECK(pt::entry::accessed_flag::is_disabled(mmap.entry(0x2000).first.get()));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: harvest dirty large pages")
+{
+    using namespace ::intel_x64::ept;
+
+    {
+        ept::mmap mmap{};
+        std::array<uint64_t, 8> bitmap{};
+
+        mmap.enable_accessed_and_dirty_flags();
+        mmap.map_2m(0x200000, 0x200000);
+        mmap.map_1g(0x40000000, 0x40000000);
+
+        pd::entry::dirty::enable(mmap.entry(0x200000).first.get());
+        pdpt::entry::dirty::enable(mmap.entry(0x40000000).first.get());
+
+        // A range that only covers part of a large page reports the part
+        // that it covers, but leaves the flag set
+        //
+
+        CHECK(mmap.harvest_dirty(0x3FF000, 0x2000, bitmap) == 1);
+        CHECK(bitmap.at(0) == 0x1);
+        CHECK(pd::entry::dirty::is_enabled(mmap.entry(0x200000).first.get()));
+
+        CHECK(mmap.harvest_dirty(0x40000000, 0x40000, bitmap) == 0x40);
+        CHECK(bitmap.at(0) == ~0ULL);
+        CHECK(bitmap.at(1) == 0);
+        CHECK(pdpt::entry::dirty::is_enabled(mmap.entry(0x40000000).first.get()));
+
+        std::vector<uint64_t> large(8);
+        CHECK(mmap.harvest_dirty(0x200000, 0x200000, large) == 0x200);
+        CHECK(large.at(7) == ~0ULL);
+        CHECK(pd::entry::dirty::is_disabled(mmap.entry(0x200000).first.get()));
+
+        // Unmapped ranges (including missing tables) are skipped without
+        // allocating anything
+        //
+
+        auto pages = g_allocated_pages.size();
+        CHECK(mmap.harvest_dirty(0x8000000000, 0x40000, bitmap) == 0);
+        CHECK(mmap.harvest_dirty(0x80000000, 0x40000, bitmap) == 0);
+        CHECK(g_allocated_pages.size() == pages);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: suppress ve")
+{
+    using namespace ::intel_x64::ept;
+
+    {
+        ept::mmap mmap{};
+
+        mmap.map_4k(0x1000, 0x1000);
+        CHECK_FALSE(mmap.suppress_ve_by_default());
+        CHECK_FALSE(mmap.suppress_ve(0x1000));
+
+        mmap.enable_suppress_ve_by_default();
+        CHECK(mmap.suppress_ve_by_default());
+
+        mmap.map_4k(0x2000, 0x2000);
+        mmap.map_2m(0x200000, 0x200000);
+        mmap.map_1g(0x40000000, 0x40000000);
+        CHECK(mmap.suppress_ve(0x2000));
+        CHECK(mmap.suppress_ve(0x200000));
+        CHECK(mmap.suppress_ve(0x40000000));
+        CHECK(pt::entry::phys_addr::get(mmap.entry(0x2000).first.get()) == 0x2000);
+
+        mmap.disable_suppress_ve_by_default();
+        CHECK_FALSE(mmap.suppress_ve_by_default());
+        CHECK_THROWS(mmap.suppress_ve(0x3000));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: set suppress ve")
+{
+    using namespace ::intel_x64::ept;
+
+    {
+        ept::mmap mmap{};
+
+        mmap.enable_suppress_ve_by_default();
+        mmap.map_range(0x0, 0x0, 0x10000, ept::mmap::attr_type::read_write,
+                       ept::mmap::memory_type::write_back, paging::level_4k);
+        mmap.map_2m(0x200000, 0x200000);
+
+        pt::entry::dirty::enable(mmap.entry(0x3000).first.get());
+
+        CHECK_THROWS(mmap.set_suppress_ve(0x1, 0x1000, false));
+
+        CHECK(mmap.set_suppress_ve(0x2000, 0x2000, false) == 2);
+        CHECK(mmap.suppress_ve(0x1000));
+        CHECK_FALSE(mmap.suppress_ve(0x2000));
+        CHECK_FALSE(mmap.suppress_ve(0x3000));
+        CHECK(mmap.suppress_ve(0x4000));
+        CHECK(pt::entry::dirty::is_enabled(mmap.entry(0x3000).first.get()));
+
+        // Large pages (and entries that are not present) are updated as a
+        // whole, and no tables are allocated
+        //
+
+        CHECK(mmap.set_suppress_ve(0x1FF000, 0x2000, false) == 2);
+        CHECK_FALSE(mmap.suppress_ve(0x3FF000));
+
+        auto pages = g_allocated_pages.size();
+        CHECK(mmap.set_suppress_ve(0x80000000, 0x40000, false) == 1);
+        CHECK(g_allocated_pages.size() == pages);
+
+        CHECK(mmap.set_suppress_ve(0x0, 0x400000, true) == 513);
+        CHECK(mmap.suppress_ve(0x2000));
+        CHECK(mmap.suppress_ve(0x200000));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: suppress ve not present")
+{
+    using namespace ::intel_x64::ept;
+
+    {
+        ept::mmap mmap{};
+        mmap.map_4k(0x1000, 0x1000);
+
+        auto pml4 =
+            static_cast<ept::mmap::entry_type *>(
+                g_mm->physint_to_virtptr(mmap.eptp())
+            );
+
+        CHECK(pml4[1] == 0);
+
+        mmap.enable_suppress_ve_by_default();
+        CHECK(pml4[1] == ept::mmap::suppress_ve_mask);
+        CHECK_FALSE(mmap.suppress_ve(0x1000));
+
+        // Entries that only have the suppress #VE bit set are not mapped
+        //
+
+        CHECK(mmap.is_mapped(0x0, 0x40000000));
+        CHECK_FALSE(mmap.is_mapped(0x2000, 0x1FE000));
+        CHECK_THROWS(mmap.entry(0x2000));
+
+        mmap.map_4k(0x40001000, 0x40001000);
+        CHECK_FALSE(mmap.is_mapped(0x40000000, 0x1000));
+        CHECK_FALSE(mmap.is_mapped(0x40200000, 0x40000000 - 0x200000));
+        CHECK(mmap.suppress_ve(0x40001000));
+
+        mmap.unmap(0x1000);
+        CHECK_FALSE(mmap.is_mapped(0x0, 0x40000000));
+        CHECK_THROWS(mmap.entry(0x1000));
+
+        // Not present entries are armed like any other entry, and a new
+        // leaf does not inherit the bit once the default is disabled
+        //
+
+        CHECK(mmap.set_suppress_ve(0x1000, 0x1000, false) == 1);
+        CHECK_FALSE(mmap.is_mapped(0x1000, 0x1000));
+
+        mmap.disable_suppress_ve_by_default();
+        CHECK(pml4[1] == 0);
+
+        mmap.set_suppress_ve(0x0, 0x40000000, true);
+        mmap.map_4k(0x1000, 0x1000);
+        CHECK_FALSE(mmap.suppress_ve(0x1000));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: snapshot")
+{
+    using namespace ::intel_x64::ept;
+    std::vector<std::pair<void *, ept::mmap::phys_addr_t>> copies;
+
+    auto copy = [&](void *dst, ept::mmap::phys_addr_t src) {
+        copies.emplace_back(dst, src);
+    };
+
+    auto writable = [](ept::mmap & mmap, ept::mmap::virt_addr_t virt_addr) {
+        return pt::entry::write_access::is_enabled(mmap.entry(virt_addr).first.get());
+    };
+
+    {
+        ept::mmap mmap{};
+
+        mmap.map_4k(0x1000, 0x11000);
+        mmap.map_4k(0x2000, 0x12000, ept::mmap::attr_type::read_only);
+        mmap.map_4k(0x3000, 0x13000, ept::mmap::attr_type::write_only);
+        mmap.map_4k(0x5000, 0x15000, ept::mmap::attr_type::read_write,
+                    ept::mmap::memory_type::uncacheable);
+
+        CHECK_FALSE(mmap.copy_on_write(0x1000, copy));
+
+        CHECK(mmap.snapshot() == 1);
+        CHECK(mmap.has_snapshot());
+        CHECK_THROWS(mmap.snapshot());
+
+        CHECK_FALSE(writable(mmap, 0x1000));
+        CHECK_FALSE(writable(mmap, 0x2000));
+        CHECK(writable(mmap, 0x3000));
+        CHECK(writable(mmap, 0x5000));
+
+        CHECK_FALSE(mmap.copy_on_write(0x2000, copy));
+        CHECK_FALSE(mmap.copy_on_write(0x3000, copy));
+        CHECK_FALSE(mmap.copy_on_write(0x4000, copy));
+        CHECK_FALSE(mmap.copy_on_write(0x5000, copy));
+        CHECK_FALSE(mmap.copy_on_write(0x80000000, copy));
+        CHECK(copies.empty());
+
+        CHECK(mmap.copy_on_write(0x1234, copy));
+        CHECK(copies.size() == 1);
+        CHECK(copies.at(0).second == 0x11000);
+        CHECK(mmap.virt_to_phys(0x1000).first == g_mm->virtptr_to_physint(copies.at(0).first));
+        CHECK(writable(mmap, 0x1000));
+        CHECK(mmap.cow_pages() == 1);
+
+        // A second violation on the same page (e.g. from another CPU) is
+        // already handled
+        //
+
+        CHECK(mmap.copy_on_write(0x1000, copy));
+        CHECK(copies.size() == 1);
+
+        auto pages = g_allocated_pages.size();
+
+        CHECK(mmap.revert() == 1);
+        CHECK(mmap.cow_pages() == 0);
+        CHECK(mmap.virt_to_phys(0x1000).first == 0x11000);
+        CHECK_FALSE(writable(mmap, 0x1000));
+
+        // Private copies are recycled
+        //
+
+        CHECK(mmap.copy_on_write(0x1000, copy));
+        CHECK(copies.size() == 2);
+        CHECK(copies.at(1).first == copies.at(0).first);
+        CHECK(g_allocated_pages.size() == pages);
+
+        mmap.release_snapshot();
+        CHECK_FALSE(mmap.has_snapshot());
+        CHECK(mmap.virt_to_phys(0x1000).first == 0x11000);
+        CHECK(writable(mmap, 0x1000));
+        CHECK_FALSE(writable(mmap, 0x2000));
+        CHECK(g_allocated_pages.size() == pages - 1);
+
+        CHECK_FALSE(mmap.copy_on_write(0x1000, copy));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: snapshot large pages")
+{
+    using namespace ::intel_x64::ept;
+    std::vector<std::pair<void *, ept::mmap::phys_addr_t>> copies;
+
+    auto copy = [&](void *dst, ept::mmap::phys_addr_t src) {
+        copies.emplace_back(dst, src);
+    };
+
+    auto writable = [](ept::mmap & mmap, ept::mmap::virt_addr_t virt_addr) {
+        return pt::entry::write_access::is_enabled(mmap.entry(virt_addr).first.get());
+    };
+
+    {
+        ept::mmap mmap{};
+
+        mmap.map_2m(0x200000, 0x400000);
+        mmap.map_1g(0x40000000, 0x80000000);
+
+        CHECK(mmap.snapshot() == 2);
+        CHECK(mmap.is_2m(0x200000));
+        CHECK(mmap.is_1g(0x40000000));
+
+        CHECK(mmap.copy_on_write(0x201010, copy));
+        CHECK(mmap.is_4k(0x200000));
+        CHECK(copies.at(0).second == 0x401000);
+        CHECK(writable(mmap, 0x201000));
+        CHECK_FALSE(writable(mmap, 0x200000));
+        CHECK_FALSE(writable(mmap, 0x3FF000));
+        CHECK(mmap.virt_to_phys(0x3FF123).first == 0x5FF123);
+
+        CHECK(mmap.copy_on_write(0x40201000, copy));
+        CHECK(mmap.is_4k(0x40200000));
+        CHECK(mmap.is_2m(0x40000000));
+        CHECK(mmap.is_2m(0x7FE00000));
+        CHECK(copies.at(1).second == 0x80201000);
+        CHECK(mmap.virt_to_phys(0x7FE00010).first == 0xBFE00010);
+        CHECK(mmap.virt_to_phys(0x40202000).first == 0x80202000);
+        CHECK_FALSE(writable(mmap, 0x7FE00000));
+
+        CHECK(mmap.revert() == 2);
+        CHECK(mmap.virt_to_phys(0x201000).first == 0x401000);
+        CHECK(mmap.virt_to_phys(0x40201000).first == 0x80201000);
+
+        mmap.release_snapshot();
+        CHECK(writable(mmap, 0x200000));
+        CHECK(writable(mmap, 0x201000));
+        CHECK(writable(mmap, 0x40000000));
+        CHECK(writable(mmap, 0x40201000));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: write protect shared")
+{
+    using namespace ::intel_x64::ept;
+    std::vector<std::pair<ept::mmap::virt_addr_t, ept::mmap::phys_addr_t>> pages;
+
+    auto track = [&](ept::mmap::virt_addr_t virt_addr, ept::mmap::phys_addr_t phys_addr) {
+        pages.emplace_back(virt_addr, phys_addr);
+    };
+
+    auto writable = [](ept::mmap & mmap, ept::mmap::virt_addr_t virt_addr) {
+        return pt::entry::write_access::is_enabled(mmap.entry(virt_addr).first.get());
+    };
+
+    {
+        ept::mmap mmap{};
+
+        mmap.map_4k(0x1000, 0x11000);
+        mmap.map_4k(0x2000, 0x12000, ept::mmap::attr_type::read_only);
+        mmap.map_4k(0x3000, 0x13000);
+        mmap.map_2m(0x200000, 0x400000);
+
+        CHECK_FALSE(mmap.remap_shared(0x1000, 0x11000, 0x21000));
+        CHECK_FALSE(mmap.unshare(0x1000, 0x11000));
+
+        CHECK(mmap.write_protect_shared(0x0, 0x400000, track) == 2);
+        CHECK(pages.size() == 2);
+        CHECK(pages.at(0).first == 0x1000);
+        CHECK(pages.at(0).second == 0x11000);
+        CHECK(pages.at(1).first == 0x3000);
+
+        CHECK_FALSE(writable(mmap, 0x1000));
+        CHECK_FALSE(writable(mmap, 0x3000));
+        CHECK(writable(mmap, 0x200000));
+
+        CHECK(mmap.write_protect_shared(0x0, 0x400000, track) == 0);
+
+        CHECK_FALSE(mmap.remap_shared(0x1000, 0x31000, 0x21000));
+        CHECK_FALSE(mmap.remap_shared(0x2000, 0x12000, 0x21000));
+        CHECK_FALSE(mmap.remap_shared(0x80000000, 0x11000, 0x21000));
+        CHECK(mmap.remap_shared(0x3000, 0x13000, 0x11000));
+        CHECK(mmap.virt_to_phys(0x3000).first == 0x11000);
+        CHECK_FALSE(writable(mmap, 0x3000));
+
+        CHECK(mmap.unshare(0x3000, 0x23000));
+        CHECK(mmap.virt_to_phys(0x3000).first == 0x23000);
+        CHECK(writable(mmap, 0x3000));
+        CHECK_FALSE(mmap.unshare(0x3000, 0x23000));
+        CHECK_FALSE(mmap.remap_shared(0x3000, 0x23000, 0x11000));
+
+        CHECK(mmap.unshare(0x1000, 0x11000));
+        CHECK(mmap.virt_to_phys(0x1000).first == 0x11000);
+        CHECK(writable(mmap, 0x1000));
+
+        // Snapshots and shared pages are tracked separately
+        //
+
+        CHECK(mmap.snapshot() == 3);
+        CHECK(mmap.write_protect_shared(0x0, 0x400000, track) == 0);
+        mmap.release_snapshot();
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: shared pages require a single vcpu")
+{
+    auto track = [](ept::mmap::virt_addr_t, ept::mmap::phys_addr_t) { };
+
+    {
+        ept::mmap mmap{};
+
+        mmap.map_4k(0x1000, 0x11000);
+        mmap.map_4k(0x2000, 0x12000);
+
+        mmap.attach();
+        mmap.attach();
+        CHECK(mmap.write_protect_shared(0x0, 0x3000, track) == 0);
+
+        mmap.detach();
+        CHECK(mmap.write_protect_shared(0x0, 0x2000, track) == 1);
+        CHECK_THROWS(mmap.attach());
+        CHECK(mmap.attached() == 1);
+
+        CHECK(mmap.unshare(0x1000, 0x11000));
+        CHECK_NOTHROW(mmap.attach());
+        CHECK(mmap.attached() == 2);
+
+        mmap.detach();
+        mmap.detach();
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: snapshots require a single vcpu")
+{
+    {
+        ept::mmap mmap{};
+
+        mmap.map_4k(0x1000, 0x11000);
+
+        mmap.attach();
+        mmap.attach();
+        CHECK_THROWS(mmap.snapshot());
+        CHECK_FALSE(mmap.has_snapshot());
+
+        mmap.detach();
+        CHECK(mmap.snapshot() == 1);
+        CHECK_THROWS(mmap.attach());
+        CHECK(mmap.attached() == 1);
+
+        mmap.release_snapshot();
+        CHECK_NOTHROW(mmap.attach());
+        CHECK(mmap.attached() == 2);
+
+        mmap.detach();
+        mmap.detach();
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: is mapped")
+{
+    {
+        ept::mmap mmap{};
+
+        CHECK_FALSE(mmap.is_mapped(0x0, 0x40000000));
+        CHECK(g_allocated_pages.size() == 1);
+
+        mmap.map_4k(0x1000, 0x11000);
+        mmap.map_2m(0x400000, 0x400000);
+
+        CHECK(mmap.is_mapped(0x1000, 0x1000));
+        CHECK(mmap.is_mapped(0x0, 0x2000));
+        CHECK_FALSE(mmap.is_mapped(0x0, 0x1000));
+        CHECK_FALSE(mmap.is_mapped(0x2000, 0x1FE000));
+        CHECK_FALSE(mmap.is_mapped(0x200000, 0x200000));
+        CHECK(mmap.is_mapped(0x5FF000, 0x1000));
+        CHECK_FALSE(mmap.is_mapped(0x600000, 0x1000));
+
+        mmap.unmap(0x1000);
+        CHECK_FALSE(mmap.is_mapped(0x0, 0x200000));
+    }
+    CHECK(g_allocated_pages.empty());
+}
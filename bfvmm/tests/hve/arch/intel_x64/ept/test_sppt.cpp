@@ -0,0 +1,106 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <bfvmm/test/support.h>
+#include <hve/arch/intel_x64/ept/sppt.h>
+
+using namespace eapis::intel_x64;
+
+TEST_CASE("sppt: set write permissions")
+{
+    {
+        ept::mmap mmap{};
+        ept::sppt sppt{};
+
+        mmap.map_4k(0x1000, 0x1000);
+        mmap.map_4k(0x2000, 0x2000, ept::mmap::attr_type::read_only);
+        mmap.map_2m(0x200000, 0x200000);
+
+        CHECK(sppt.spptp() != 0);
+        CHECK(sppt.write_permissions(0x1000) == ept::sppt::all_writable);
+
+        sppt.set_write_permissions(mmap, 0x1080, 0xFFFFFFFE);
+        CHECK(sppt.write_permissions(0x1000) == 0xFFFFFFFE);
+        CHECK(sppt.size() == 1);
+
+        auto entry = mmap.entry(0x1000).first.get();
+        CHECK(mmap.spp(0x1000));
+        CHECK(::intel_x64::ept::pt::entry::write_access::is_disabled(entry));
+        CHECK(::intel_x64::ept::pt::entry::read_access::is_enabled(entry));
+
+        CHECK_THROWS(sppt.set_write_permissions(mmap, 0x2000, 0));
+        CHECK_THROWS(sppt.set_write_permissions(mmap, 0x200000, 0));
+        CHECK_THROWS(sppt.set_write_permissions(mmap, 0x400000, 0));
+        CHECK(sppt.size() == 1);
+
+        sppt.set_write_permissions(mmap, 0x1000, ept::sppt::all_writable);
+        CHECK(sppt.write_permissions(0x1000) == ept::sppt::all_writable);
+        CHECK(sppt.size() == 0);
+
+        entry = mmap.entry(0x1000).first.get();
+        CHECK_FALSE(mmap.spp(0x1000));
+        CHECK(::intel_x64::ept::pt::entry::write_access::is_enabled(entry));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("sppt: write protect")
+{
+    {
+        ept::mmap mmap{};
+        ept::sppt sppt{};
+
+        mmap.map_4k(0x1000, 0x1000);
+        mmap.map_4k(0x2000, 0x2000);
+
+        CHECK_THROWS(sppt.write_protect(mmap, 0x1000, 0));
+
+        sppt.write_protect(mmap, 0x1010, 8);
+        CHECK(sppt.write_permissions(0x1000) == 0xFFFFFFFE);
+
+        sppt.write_protect(mmap, 0x10F0, 0x20);
+        CHECK(sppt.write_permissions(0x1000) == 0xFFFFFFF8);
+
+        sppt.write_protect(mmap, 0x1F80, 0x100);
+        CHECK(sppt.write_permissions(0x1000) == 0x7FFFFFF8);
+        CHECK(sppt.write_permissions(0x2000) == 0xFFFFFFFE);
+        CHECK(sppt.size() == 2);
+
+        sppt.write_unprotect(mmap, 0x1000, 0x1000);
+        CHECK(sppt.write_permissions(0x1000) == ept::sppt::all_writable);
+        CHECK_FALSE(mmap.spp(0x1000));
+        CHECK(mmap.spp(0x2000));
+
+        sppt.write_unprotect(mmap, 0x3000, 0x1000);
+        CHECK(sppt.size() == 1);
+
+        sppt.write_protect(mmap, 0x2000, 0x1000);
+        CHECK(sppt.write_permissions(0x2000) == 0);
+
+        sppt.write_unprotect(mmap, 0x2000, 0x80);
+        CHECK(sppt.write_permissions(0x2000) == 0x1);
+    }
+    CHECK(g_allocated_pages.empty());
+}
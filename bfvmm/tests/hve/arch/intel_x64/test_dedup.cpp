@@ -0,0 +1,109 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <vector>
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <bfvmm/test/support.h>
+#include <hve/arch/intel_x64/dedup.h>
+
+using namespace eapis::intel_x64;
+
+static uintptr_t
+test_alloc()
+{ return 0; }
+
+static void
+test_free(uintptr_t hpa)
+{ bfignored(hpa); }
+
+TEST_CASE("dedup: hash")
+{
+    std::vector<uint8_t> page1(::x64::pt::page_size, 0);
+    std::vector<uint8_t> page2(::x64::pt::page_size, 0);
+
+    CHECK(page_dedup::hash(page1.data()) == page_dedup::hash(page2.data()));
+
+    page2.back() = 1;
+    CHECK(page_dedup::hash(page1.data()) != page_dedup::hash(page2.data()));
+
+    // Each lane is mixed into the result, so the same change in
+    // different lanes must produce a different hash
+    //
+
+    page2.back() = 0;
+    page2.at(8) = 1;
+    auto hash = page_dedup::hash(page2.data());
+
+    page2.at(8) = 0;
+    page2.at(16) = 1;
+    CHECK(hash != page_dedup::hash(page2.data()));
+}
+
+TEST_CASE("dedup: protect")
+{
+    using namespace ::intel_x64::ept;
+
+    auto writable = [](ept::mmap & mmap, ept::mmap::virt_addr_t virt_addr) {
+        return pt::entry::write_access::is_enabled(mmap.entry(virt_addr).first.get());
+    };
+
+    {
+        ept::mmap mmap{};
+
+        mmap.map_4k(0x1000, 0x11000);
+        mmap.map_4k(0x2000, 0x12000);
+        mmap.map_4k(0x3000, 0x13000);
+
+        page_dedup dedup{
+            page_dedup::alloc_delegate_t::create<test_alloc>(),
+            page_dedup::free_delegate_t::create<test_free>()
+        };
+
+        CHECK(dedup.scan() == 0);
+        CHECK_THROWS(dedup.add_range(mmap, 0x1001, 0x1000));
+
+        dedup.add_range(mmap, 0x1000, 0x3000);
+        CHECK(dedup.scan(2) == 0);
+
+        CHECK_FALSE(writable(mmap, 0x1000));
+        CHECK_FALSE(writable(mmap, 0x2000));
+        CHECK(writable(mmap, 0x3000));
+
+        CHECK_FALSE(dedup.handle_write(mmap, 0x3000));
+        CHECK(dedup.handle_write(mmap, 0x2010));
+        CHECK(writable(mmap, 0x2000));
+        CHECK(mmap.virt_to_phys(0x2000).first == 0x12000);
+        CHECK_FALSE(dedup.handle_write(mmap, 0x2010));
+
+        dedup.remove_map(mmap);
+        CHECK(writable(mmap, 0x1000));
+        CHECK_FALSE(dedup.handle_write(mmap, 0x1000));
+
+        CHECK(dedup.shared_frames() == 0);
+        CHECK(dedup.freed_frames() == 0);
+        CHECK(dedup.copied_frames() == 0);
+    }
+    CHECK(g_allocated_pages.empty());
+}
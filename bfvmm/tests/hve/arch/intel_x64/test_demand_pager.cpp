@@ -0,0 +1,236 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <vector>
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <bfvmm/test/support.h>
+#include <hve/arch/intel_x64/demand_pager.h>
+
+using namespace eapis::intel_x64;
+
+constexpr static uintptr_t test_hpa = 0x10000000;
+
+static bool g_alloc_2m = true;
+static bool g_alloc_4k = true;
+static std::vector<std::pair<uintptr_t, std::size_t>> g_freed;
+static std::vector<std::pair<uintptr_t, std::size_t>> g_zeroed;
+
+static ept::mmap *g_zero_mmap = nullptr;
+static bool g_zeroed_mapped = false;
+
+static uintptr_t
+test_alloc(uintptr_t gpa, std::size_t size)
+{
+    if (size == ::intel_x64::ept::pd::page_size) {
+        return g_alloc_2m ? gpa + test_hpa : 0;
+    }
+
+    return g_alloc_4k ? gpa + test_hpa : 0;
+}
+
+static void
+test_free(uintptr_t hpa, std::size_t size)
+{ g_freed.emplace_back(hpa, size); }
+
+static void
+test_zero(uintptr_t hpa, std::size_t size)
+{
+    if (g_zero_mmap != nullptr && g_zero_mmap->is_mapped(hpa - test_hpa, size)) {
+        g_zeroed_mapped = true;
+    }
+
+    g_zeroed.emplace_back(hpa, size);
+}
+
+static demand_pager
+*make_pager()
+{
+    g_alloc_2m = true;
+    g_alloc_4k = true;
+    g_freed.clear();
+    g_zeroed.clear();
+
+    g_zero_mmap = nullptr;
+    g_zeroed_mapped = false;
+
+    return new demand_pager(
+        demand_pager::alloc_delegate_t::create<test_alloc>(),
+        demand_pager::free_delegate_t::create<test_free>(),
+        demand_pager::zero_delegate_t::create<test_zero>()
+    );
+}
+
+TEST_CASE("demand_pager: add region")
+{
+    std::unique_ptr<demand_pager> pager{make_pager()};
+
+    {
+        ept::mmap mmap1{};
+        ept::mmap mmap2{};
+
+        CHECK_THROWS(pager->add_region(mmap1, 0x1000, 0));
+        CHECK_THROWS(pager->add_region(mmap1, 0x1001, 0x1000));
+        CHECK_THROWS(pager->add_region(mmap1, 0x1000, 0x1001));
+
+        pager->add_region(mmap1, 0x1000, 0x3000);
+        CHECK_THROWS(pager->add_region(mmap1, 0x3000, 0x1000));
+        CHECK_THROWS(pager->add_region(mmap1, 0x0, 0x2000));
+        CHECK_NOTHROW(pager->add_region(mmap1, 0x4000, 0x1000));
+        CHECK_NOTHROW(pager->add_region(mmap2, 0x1000, 0x3000));
+
+        CHECK_FALSE(pager->handle_fault(mmap1, 0x0));
+        CHECK_FALSE(pager->handle_fault(mmap1, 0x5000));
+        CHECK(mmap1.is_mapped(0x0, 0x10000) == false);
+
+        pager->remove_map(mmap1);
+        pager->remove_map(mmap2);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("demand_pager: populate 2m")
+{
+    std::unique_ptr<demand_pager> pager{make_pager()};
+
+    {
+        ept::mmap mmap1{};
+        ept::mmap mmap2{};
+
+        pager->add_region(mmap1, 0x0, 0x800000);
+        g_zero_mmap = &mmap1;
+
+        // A fault at the start of the region is treated as sequential, so
+        // the next 2m page is prefetched as well. Every frame is zeroed
+        // before it is mapped.
+        //
+
+        CHECK(pager->handle_fault(mmap1, 0x1234));
+        CHECK(g_zeroed.size() == 2);
+        CHECK(g_zeroed.at(0).first == test_hpa);
+        CHECK(g_zeroed.at(0).second == 0x200000);
+        CHECK(g_zeroed.at(1).first == test_hpa + 0x200000);
+        CHECK_FALSE(g_zeroed_mapped);
+        CHECK(mmap1.is_2m(0x1000));
+        CHECK(mmap1.is_2m(0x200000));
+        CHECK(mmap1.virt_to_phys(0x200000).first == test_hpa + 0x200000);
+        CHECK_FALSE(mmap1.is_mapped(0x400000, 0x400000));
+
+        CHECK(pager->faults() == 1);
+        CHECK(pager->populated() == 0x400000);
+        CHECK(pager->prefetched() == 0x200000);
+
+        CHECK(pager->handle_fault(mmap1, 0x5000));
+        CHECK(pager->faults() == 1);
+
+        CHECK(pager->handle_fault(mmap1, 0x400010));
+        CHECK(mmap1.is_2m(0x400000));
+        CHECK(mmap1.is_2m(0x600000));
+        CHECK(pager->faults() == 2);
+        CHECK(pager->populated() == 0x800000);
+        CHECK(pager->prefetched() == 0x400000);
+
+        CHECK_FALSE(pager->handle_fault(mmap1, 0x800000));
+        CHECK_FALSE(pager->handle_fault(mmap2, 0x0));
+
+        pager->remove_map(mmap1);
+        CHECK(g_freed.size() == 4);
+        CHECK(g_freed.at(0).first == test_hpa);
+        CHECK(g_freed.at(0).second == 0x200000);
+        CHECK(pager->populated() == 0);
+        CHECK_FALSE(mmap1.is_mapped(0x0, 0x800000));
+        CHECK_FALSE(pager->handle_fault(mmap1, 0x0));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("demand_pager: populate 4k")
+{
+    std::unique_ptr<demand_pager> pager{make_pager()};
+
+    {
+        ept::mmap mmap{};
+        pager->add_region(mmap, 0x1000, 0xF000);
+
+        CHECK(pager->handle_fault(mmap, 0x3000));
+        CHECK(mmap.is_4k(0x3000));
+        CHECK(mmap.virt_to_phys(0x3000).first == test_hpa + 0x3000);
+        CHECK(pager->prefetched() == 0);
+
+        // Sequential faults double the number of pages that are prefetched
+        //
+
+        CHECK(pager->handle_fault(mmap, 0x4000));
+        CHECK(pager->prefetched() == 0x1000);
+        CHECK(pager->handle_fault(mmap, 0x6FFF));
+        CHECK(pager->prefetched() == 0x3000);
+        CHECK(mmap.is_mapped(0x3000, 0x1000));
+        CHECK(mmap.is_4k(0x8000));
+        CHECK_FALSE(mmap.is_mapped(0x9000, 0x7000));
+
+        // Any other fault resets prefetching
+        //
+
+        CHECK(pager->handle_fault(mmap, 0x1000));
+        CHECK_FALSE(mmap.is_mapped(0x2000, 0x1000));
+        CHECK(pager->handle_fault(mmap, 0xF000));
+        CHECK(pager->prefetched() == 0x3000);
+        CHECK(pager->populated() == 0x8000);
+        CHECK(g_zeroed.size() == 8);
+
+        g_alloc_4k = false;
+        CHECK_THROWS(pager->handle_fault(mmap, 0xA000));
+
+        pager->remove_map(mmap);
+        CHECK(g_freed.size() == 8);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("demand_pager: 4k fallback")
+{
+    std::unique_ptr<demand_pager> pager{make_pager()};
+
+    {
+        ept::mmap mmap{};
+        pager->add_region(mmap, 0x200000, 0x400000);
+
+        g_alloc_2m = false;
+        CHECK(pager->handle_fault(mmap, 0x300000));
+        CHECK(mmap.is_4k(0x300000));
+
+        // Once part of a 2m block is populated with 4k pages, the rest of
+        // the block is populated with 4k pages as well
+        //
+
+        g_alloc_2m = true;
+        CHECK(pager->handle_fault(mmap, 0x200000));
+        CHECK(mmap.is_4k(0x200000));
+        CHECK(pager->handle_fault(mmap, 0x400000));
+        CHECK(mmap.is_2m(0x400000));
+
+        pager->remove_map(mmap);
+    }
+    CHECK(g_allocated_pages.empty());
+}
@@ -0,0 +1,115 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <array>
+#include <thread>
+#include <vector>
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <bfvmm/test/support.h>
+#include <hve/arch/intel_x64/dirty_bitmap.h>
+
+using namespace eapis::intel_x64;
+
+TEST_CASE("dirty_bitmap: size")
+{
+    CHECK_THROWS(dirty_bitmap(0));
+
+    CHECK(dirty_bitmap(0x1000).words() == 1);
+    CHECK(dirty_bitmap(0x40000).words() == 1);
+    CHECK(dirty_bitmap(0x40001).words() == 2);
+    CHECK(dirty_bitmap(0x40001).size() == 0x40001);
+}
+
+TEST_CASE("dirty_bitmap: set")
+{
+    dirty_bitmap bitmap{0x100000};
+
+    CHECK_FALSE(bitmap.is_dirty(0x1000));
+    CHECK(bitmap.set(0x1234));
+    CHECK_FALSE(bitmap.set(0x1000));
+    CHECK(bitmap.is_dirty(0x1FFF));
+    CHECK_FALSE(bitmap.is_dirty(0x2000));
+
+    CHECK_FALSE(bitmap.set(0x100000));
+    CHECK_FALSE(bitmap.is_dirty(0x100000));
+
+    bitmap.clear();
+    CHECK_FALSE(bitmap.is_dirty(0x1000));
+}
+
+TEST_CASE("dirty_bitmap: harvest")
+{
+    dirty_bitmap bitmap{0x80000};
+    std::array<uint64_t, 2> bits{};
+
+    CHECK_THROWS(bitmap.harvest(gsl::make_span(bits.data(), 1)));
+
+    bitmap.set(0x0);
+    bitmap.set(0x41000);
+    bitmap.set(0x7F000);
+
+    CHECK(bitmap.harvest(bits) == 3);
+    CHECK(bits.at(0) == 0x1);
+    CHECK(bits.at(1) == 0x8000000000000002);
+    CHECK_FALSE(bitmap.is_dirty(0x0));
+
+    CHECK(bitmap.harvest(bits) == 0);
+    CHECK(bits.at(0) == 0);
+    CHECK(bits.at(1) == 0);
+}
+
+TEST_CASE("dirty_bitmap: concurrent set and harvest")
+{
+    constexpr uint64_t pages = 0x1000;
+
+    dirty_bitmap bitmap{pages << 12U};
+    std::vector<uint64_t> bits(bitmap.words());
+    std::vector<uint64_t> seen(bitmap.words());
+
+    std::vector<std::thread> threads;
+    for (uint64_t t = 0; t < 4; t++) {
+        threads.emplace_back([&, t] {
+            for (uint64_t page = t; page < pages; page += 4) {
+                bitmap.set(page << 12U);
+            }
+        });
+    }
+
+    uint64_t total = 0;
+    for (auto i = 0; i < 16; i++) {
+        total += bitmap.harvest(bits);
+        for (std::size_t w = 0; w < bits.size(); w++) {
+            CHECK((seen.at(w) & bits.at(w)) == 0);
+            seen.at(w) |= bits.at(w);
+        }
+    }
+
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    total += bitmap.harvest(bits);
+    CHECK(total == pages);
+}
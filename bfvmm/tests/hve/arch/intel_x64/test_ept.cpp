@@ -61,3 +61,250 @@ TEST_CASE("set_eptp")
     handler.set_eptp(nullptr);
     CHECK(vmcs_n::secondary_processor_based_vm_execution_controls::enable_ept::is_disabled());
 }
+
+TEST_CASE("set_eptp accessed and dirty flags")
+{
+    using namespace ::intel_x64::msrs;
+
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto handler = ept_handler(eapis, &g_eapis_vcpu_global_state);
+
+    auto mm = ept::mmap{};
+    mm.enable_accessed_and_dirty_flags();
+
+    g_msrs[ia32_vmx_ept_vpid_cap::addr] = 0;
+    CHECK_THROWS(handler.set_eptp(&mm));
+    CHECK(vmcs_n::secondary_processor_based_vm_execution_controls::enable_ept::is_disabled());
+    CHECK(vmcs_n::ept_pointer::get() == 0);
+    CHECK(mm.attached() == 0);
+
+    g_msrs[ia32_vmx_ept_vpid_cap::addr] = ia32_vmx_ept_vpid_cap::accessed_dirty_support::mask;
+    handler.set_eptp(&mm);
+    CHECK(vmcs_n::ept_pointer::accessed_and_dirty_flags::is_enabled());
+
+    mm.disable_accessed_and_dirty_flags();
+    handler.set_eptp(&mm);
+    CHECK(vmcs_n::ept_pointer::accessed_and_dirty_flags::is_disabled());
+
+    handler.set_eptp(nullptr);
+    CHECK(vmcs_n::ept_pointer::accessed_and_dirty_flags::is_disabled());
+}
+
+TEST_CASE("eptp list")
+{
+    using namespace ::intel_x64::msrs;
+
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto handler = ept_handler(eapis, &g_eapis_vcpu_global_state);
+
+    auto mm1 = ept::mmap{};
+    auto mm2 = ept::mmap{};
+    mm2.enable_accessed_and_dirty_flags();
+
+    CHECK(handler.eptp_index() == ept_handler::eptp_list_size);
+    CHECK(handler.eptp_list_entry(1) == nullptr);
+    CHECK_THROWS(handler.eptp_list_entry(ept_handler::eptp_list_size));
+    CHECK_THROWS(handler.set_eptp_list_entry(ept_handler::eptp_list_size, &mm1));
+
+    g_msrs[ia32_vmx_ept_vpid_cap::addr] = 0;
+    CHECK_THROWS(handler.set_eptp_list_entry(2, &mm2));
+
+    g_msrs[ia32_vmx_ept_vpid_cap::addr] = ia32_vmx_ept_vpid_cap::accessed_dirty_support::mask;
+    handler.set_eptp_list_entry(1, &mm1);
+    handler.set_eptp_list_entry(2, &mm2);
+    CHECK(handler.eptp_list_entry(1) == &mm1);
+    CHECK(handler.eptp_list_entry(2) == &mm2);
+
+    handler.set_eptp(&mm1);
+    CHECK(handler.eptp_index() == 1);
+
+    CHECK(handler.set_eptp_index(2) == &mm2);
+    CHECK(handler.eptp_index() == 2);
+    CHECK(vmcs_n::ept_pointer::phys_addr::get() == mm2.eptp());
+    CHECK(vmcs_n::ept_pointer::accessed_and_dirty_flags::is_enabled());
+
+    CHECK_THROWS(handler.set_eptp_index(3));
+    CHECK_THROWS(handler.set_eptp_list_entry(2, nullptr));
+
+    handler.set_eptp_index(1);
+    handler.set_eptp_list_entry(2, nullptr);
+    CHECK(handler.eptp_list_entry(2) == nullptr);
+    CHECK_THROWS(handler.set_eptp_index(2));
+
+    handler.set_eptp(nullptr);
+}
+
+TEST_CASE("active map")
+{
+    using namespace ::intel_x64::msrs;
+
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto handler = ept_handler(eapis, &g_eapis_vcpu_global_state);
+
+    auto mm1 = ept::mmap{};
+    auto mm2 = ept::mmap{};
+    auto mm3 = ept::mmap{};
+
+    CHECK(handler.map() == nullptr);
+
+    handler.set_eptp(&mm3);
+    CHECK(handler.map() == &mm3);
+
+    handler.set_eptp_list_entry(1, &mm1);
+    handler.set_eptp_list_entry(2, &mm2);
+    CHECK(handler.map() == &mm3);
+
+    handler.set_eptp_index(2);
+    auto eptp2 = vmcs_n::ept_pointer::get();
+    CHECK(handler.map() == &mm2);
+
+    handler.set_eptp_index(1);
+    auto eptp1 = vmcs_n::ept_pointer::get();
+    CHECK(handler.map() == &mm1);
+
+    // Emulate the guest switching views with VMFUNC, which the cached
+    // index must not hide
+    //
+    vmcs_n::ept_pointer::set(eptp2);
+    CHECK(handler.map() == &mm2);
+    CHECK(handler.eptp_index() == 2);
+
+    vmcs_n::ept_pointer::set(eptp1);
+    CHECK(handler.eptp_index() == 1);
+    CHECK(handler.map() == &mm1);
+
+    handler.set_eptp(nullptr);
+    CHECK(handler.map() == nullptr);
+}
+
+TEST_CASE("vmfunc exit")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto handler = ept_handler(eapis, &g_eapis_vcpu_global_state);
+
+    mocks.ExpectCall(eapis, eapis::intel_x64::vcpu::inject_exception).With(6U, 0U);
+    CHECK(handler.handle_vmfunc(eapis));
+}
+
+TEST_CASE("attached")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+
+    auto mm1 = ept::mmap{};
+    auto mm2 = ept::mmap{};
+
+    {
+        auto handler1 = ept_handler(eapis, &g_eapis_vcpu_global_state);
+        auto handler2 = ept_handler(eapis, &g_eapis_vcpu_global_state);
+
+        handler1.set_eptp(&mm1);
+        handler1.set_eptp_list_entry(0, &mm1);
+        handler1.set_eptp_list_entry(1, &mm2);
+        CHECK(mm1.attached() == 1);
+        CHECK(mm2.attached() == 1);
+
+        handler2.set_eptp(&mm1);
+        CHECK(mm1.attached() == 2);
+
+        handler2.set_eptp(&mm2);
+        CHECK(mm1.attached() == 1);
+        CHECK(mm2.attached() == 2);
+
+        handler1.set_eptp_list_entry(1, nullptr);
+        CHECK(mm2.attached() == 1);
+
+        handler1.set_eptp_list_entry(0, nullptr);
+        CHECK(mm1.attached() == 1);
+    }
+
+    CHECK(mm1.attached() == 0);
+    CHECK(mm2.attached() == 0);
+}
+
+TEST_CASE("eptp switching")
+{
+    using namespace ::intel_x64::msrs;
+    using namespace vmcs_n::secondary_processor_based_vm_execution_controls;
+
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto handler = ept_handler(eapis, &g_eapis_vcpu_global_state);
+
+    auto mm = ept::mmap{};
+
+    g_msrs[ia32_vmx_vmfunc::addr] = ia32_vmx_vmfunc::eptp_switching::mask;
+    CHECK_THROWS(handler.enable_eptp_switching());
+
+    handler.set_eptp(&mm);
+    handler.set_eptp_list_entry(0, &mm);
+
+    g_msrs[ia32_vmx_vmfunc::addr] = 0;
+    CHECK_THROWS(handler.enable_eptp_switching());
+
+    g_msrs[ia32_vmx_vmfunc::addr] = ia32_vmx_vmfunc::eptp_switching::mask;
+    handler.enable_eptp_switching();
+    CHECK(enable_vm_functions::is_enabled());
+    CHECK(vmcs_n::vm_function_controls::eptp_switching::is_enabled());
+    CHECK(vmcs_n::eptp_list_address::get() != 0);
+
+    handler.disable_eptp_switching();
+    CHECK(enable_vm_functions::is_disabled());
+
+    handler.enable_eptp_switching();
+    handler.set_eptp(nullptr);
+    CHECK(enable_vm_functions::is_disabled());
+    CHECK(vmcs_n::vm_function_controls::eptp_switching::is_disabled());
+}
+
+TEST_CASE("set_sppt")
+{
+    using namespace ::intel_x64::msrs;
+    using namespace vmcs_n::secondary_processor_based_vm_execution_controls;
+
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto eapis = setup_eapis(mocks);
+    auto handler = ept_handler(eapis, &g_eapis_vcpu_global_state);
+
+    auto mm = ept::mmap{};
+    auto sppt = ept::sppt{};
+
+    CHECK_THROWS(handler.set_sppt(&sppt));
+    handler.set_eptp(&mm);
+
+    g_msrs[ia32_vmx_procbased_ctls2::addr] = 0;
+    CHECK_THROWS(handler.set_sppt(&sppt));
+    CHECK(sub_page_write_permissions::is_disabled());
+    CHECK(vmcs_n::sub_page_permission_table_pointer::get() == 0);
+    CHECK(handler.sppt() == nullptr);
+
+    g_msrs[ia32_vmx_procbased_ctls2::addr] = sub_page_write_permissions::mask << 32U;
+    handler.set_sppt(&sppt);
+    CHECK(sub_page_write_permissions::is_enabled());
+    CHECK(vmcs_n::sub_page_permission_table_pointer::get() == sppt.spptp());
+    CHECK(handler.sppt() == &sppt);
+
+    handler.set_sppt(nullptr);
+    CHECK(sub_page_write_permissions::is_disabled());
+    CHECK(handler.sppt() == nullptr);
+
+    handler.set_eptp(nullptr);
+}
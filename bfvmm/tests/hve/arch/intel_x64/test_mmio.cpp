@@ -0,0 +1,251 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <memory>
+#include <vector>
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <bfvmm/test/support.h>
+#include <hve/arch/intel_x64/vcpu.h>
+
+using namespace eapis::intel_x64;
+using eapis_vcpu = eapis::intel_x64::vcpu;
+
+using op_t = mmio_decoder::op_t;
+using status_t = mmio_decoder::status_t;
+
+static std::unique_ptr<eapis_vcpu>
+setup_vcpu()
+{
+    setup_test_support();
+
+    g_msrs[::intel_x64::msrs::ia32_vmx_true_pinbased_ctls::addr] = 0xFFFFFFFF00000000;
+    g_msrs[::intel_x64::msrs::ia32_vmx_true_procbased_ctls::addr] = 0xFFFFFFFF00000000;
+    g_msrs[::intel_x64::msrs::ia32_vmx_true_entry_ctls::addr] = 0xFFFFFFFF00000000;
+    g_msrs[::intel_x64::msrs::ia32_vmx_true_exit_ctls::addr] = 0xFFFFFFFF00000000;
+    g_msrs[::intel_x64::msrs::ia32_vmx_procbased_ctls2::addr] = 0xFFFFFFFF00000000;
+
+    return std::make_unique<eapis_vcpu>(0);
+}
+
+static status_t
+decode(const std::vector<uint8_t> &bytes, mmio_decoder::insn_t &insn, bool long_mode = true)
+{
+    return mmio_decoder::decode(
+               {bytes.data(), static_cast<std::ptrdiff_t>(bytes.size())}, long_mode, insn
+           );
+}
+
+static bool
+test_handler(gsl::not_null<vcpu_t *> vcpu, mmio_handler::info_t &info)
+{
+    bfignored(vcpu);
+    bfignored(info);
+
+    return true;
+}
+
+TEST_CASE("mmio_decoder: mov")
+{
+    mmio_decoder::insn_t insn{};
+
+    // mov eax, [rdi]
+    CHECK(decode({0x8B, 0x07}, insn) == status_t::ok);
+    CHECK(insn.op == op_t::load);
+    CHECK(insn.len == 2);
+    CHECK(insn.size == 4);
+    CHECK(insn.reg == 0);
+
+    // mov [rax + 0x10], r9
+    CHECK(decode({0x4C, 0x89, 0x48, 0x10}, insn) == status_t::ok);
+    CHECK(insn.op == op_t::store);
+    CHECK(insn.len == 4);
+    CHECK(insn.size == 8);
+    CHECK(insn.reg == 9);
+
+    // mov [rip + 0x1234], ax
+    CHECK(decode({0x66, 0x89, 0x05, 0x34, 0x12, 0x00, 0x00}, insn) == status_t::ok);
+    CHECK(insn.len == 7);
+    CHECK(insn.size == 2);
+
+    // mov [rsp + 8], ah
+    CHECK(decode({0x88, 0x64, 0x24, 0x08}, insn) == status_t::ok);
+    CHECK(insn.len == 4);
+    CHECK(insn.high_byte);
+    CHECK(insn.reg == 0);
+
+    // mov [rsp + 8], spl
+    CHECK(decode({0x40, 0x88, 0x64, 0x24, 0x08}, insn) == status_t::ok);
+    CHECK_FALSE(insn.high_byte);
+    CHECK(insn.reg == 4);
+
+    // mov eax, [disp32]
+    CHECK(decode({0x8B, 0x04, 0x25, 0x00, 0x00, 0x00, 0x00}, insn) == status_t::ok);
+    CHECK(insn.len == 7);
+}
+
+TEST_CASE("mmio_decoder: mov imm")
+{
+    mmio_decoder::insn_t insn{};
+
+    // mov dword [rbx], 0x80000000
+    CHECK(decode({0xC7, 0x03, 0x00, 0x00, 0x00, 0x80}, insn) == status_t::ok);
+    CHECK(insn.op == op_t::store);
+    CHECK(insn.has_imm);
+    CHECK(insn.len == 6);
+    CHECK(insn.size == 4);
+    CHECK((insn.imm & 0xFFFFFFFF) == 0x80000000);
+
+    // mov qword [rbx], -1
+    CHECK(decode({0x48, 0xC7, 0x03, 0xFF, 0xFF, 0xFF, 0xFF}, insn) == status_t::ok);
+    CHECK(insn.size == 8);
+    CHECK(insn.imm == 0xFFFFFFFFFFFFFFFF);
+
+    // mov word [rbx], 0x1234
+    CHECK(decode({0x66, 0xC7, 0x03, 0x34, 0x12}, insn) == status_t::ok);
+    CHECK(insn.len == 5);
+    CHECK((insn.imm & 0xFFFF) == 0x1234);
+
+    // mov byte [rbx], 0x42
+    CHECK(decode({0xC6, 0x03, 0x42}, insn) == status_t::ok);
+    CHECK(insn.size == 1);
+    CHECK_FALSE(insn.high_byte);
+
+    CHECK(decode({0xC6, 0x0B, 0x42}, insn) == status_t::unsupported);
+}
+
+TEST_CASE("mmio_decoder: movzx / movsx")
+{
+    mmio_decoder::insn_t insn{};
+
+    // movzx eax, byte [rdi]
+    CHECK(decode({0x0F, 0xB6, 0x07}, insn) == status_t::ok);
+    CHECK(insn.op == op_t::load);
+    CHECK(insn.size == 1);
+    CHECK(insn.reg_size == 4);
+    CHECK_FALSE(insn.sign_extend);
+
+    // movsx rax, word [rdi + disp32]
+    CHECK(decode({0x48, 0x0F, 0xBF, 0x87, 0x00, 0x10, 0x00, 0x00}, insn) == status_t::ok);
+    CHECK(insn.len == 8);
+    CHECK(insn.size == 2);
+    CHECK(insn.reg_size == 8);
+    CHECK(insn.sign_extend);
+
+    // movsxd rcx, [rdx]
+    CHECK(decode({0x48, 0x63, 0x0A}, insn) == status_t::ok);
+    CHECK(insn.size == 4);
+    CHECK(insn.reg == 1);
+    CHECK(insn.reg_size == 8);
+    CHECK(insn.sign_extend);
+
+    CHECK(decode({0x63, 0x0A}, insn) == status_t::unsupported);
+    CHECK(decode({0x0F, 0xB8, 0x07}, insn) == status_t::unsupported);
+}
+
+TEST_CASE("mmio_decoder: stos")
+{
+    mmio_decoder::insn_t insn{};
+
+    // rep stosq
+    CHECK(decode({0xF3, 0x48, 0xAB}, insn) == status_t::ok);
+    CHECK(insn.op == op_t::stos);
+    CHECK(insn.len == 3);
+    CHECK(insn.rep);
+    CHECK(insn.size == 8);
+    CHECK(insn.addr_size == 8);
+
+    // stosb (32bit addressing)
+    CHECK(decode({0x67, 0xAA}, insn) == status_t::ok);
+    CHECK(insn.size == 1);
+    CHECK(insn.addr_size == 4);
+    CHECK_FALSE(insn.rep);
+}
+
+TEST_CASE("mmio_decoder: invalid")
+{
+    mmio_decoder::insn_t insn{};
+
+    CHECK(decode({0x89, 0xC0}, insn) == status_t::unsupported);
+    CHECK(decode({0xF3, 0x89, 0x07}, insn) == status_t::unsupported);
+    CHECK(decode({0x8B, 0x87, 0x00}, insn) == status_t::truncated);
+    CHECK(decode({0x66}, insn) == status_t::truncated);
+    CHECK(decode({}, insn) == status_t::truncated);
+    CHECK(decode(std::vector<uint8_t>(15, 0x66), insn) == status_t::unsupported);
+}
+
+TEST_CASE("mmio_decoder: 32bit")
+{
+    mmio_decoder::insn_t insn{};
+
+    CHECK(decode({0x89, 0x07}, insn, false) == status_t::ok);
+    CHECK(insn.size == 4);
+    CHECK(insn.addr_size == 4);
+
+    CHECK(decode({0x48, 0x89, 0x07}, insn, false) == status_t::unsupported);
+    CHECK(decode({0x67, 0x89, 0x07}, insn, false) == status_t::unsupported);
+}
+
+TEST_CASE("mmio_handler: add / remove")
+{
+    auto vcpu = setup_vcpu();
+    auto handler = mmio_handler(vcpu.get());
+    auto d = mmio_handler::handler_delegate_t::create<test_handler>();
+
+    CHECK_THROWS(handler.add_handler(0x1000, 0, d));
+    CHECK_NOTHROW(handler.add_handler(0x1000, 0x1000, d));
+    CHECK_NOTHROW(handler.add_handler(0x3000, 0x1000, d));
+    CHECK_THROWS(handler.add_handler(0x1800, 0x1000, d));
+    CHECK_THROWS(handler.add_handler(0x0000, 0x1001, d));
+    CHECK_NOTHROW(handler.add_handler(0x2000, 0x1000, d));
+
+    CHECK(handler.remove_handler(0x2000));
+    CHECK_FALSE(handler.remove_handler(0x2000));
+    CHECK_NOTHROW(handler.flush_decode_cache());
+
+    CHECK_NOTHROW(vcpu->add_mmio_handler(0x1000, 0x1000, d));
+    CHECK(vcpu->remove_mmio_handler(0x1000));
+    CHECK_NOTHROW(vcpu->flush_mmio_decode_cache());
+}
+
+TEST_CASE("mmio_handler: unhandled")
+{
+    auto vcpu = setup_vcpu();
+    auto handler = mmio_handler(vcpu.get());
+
+    handler.add_handler(
+        0x1000, 0x1000, mmio_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    ept_misconfiguration_handler::info_t info = {0, 0x2000, false};
+    CHECK_FALSE(handler.handle(vcpu.get(), info));
+
+    // 16bit code is not supported
+    //
+
+    g_vmcs_fields[vmcs_n::guest_cs_access_rights::addr] = 0x9B;
+
+    info.gpa = 0x1000;
+    CHECK_FALSE(handler.handle(vcpu.get(), info));
+}
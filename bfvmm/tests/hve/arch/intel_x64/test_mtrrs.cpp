@@ -161,14 +161,70 @@ TEST_CASE("overlapping ranges version #4")
     CHECK(m.ranges().at(3) == range_t{wb, 0x300000, 0x200000});
 }
 
-TEST_CASE("invalid overlapping ranges version")
+TEST_CASE("intersecting ranges")
 {
     enable_mtrrs(5);
     add_variable_range(0, range_t{wb, 0x100000, 0x200000});
     add_variable_range(1, range_t{wb, 0x200000, 0x200000});
 
     mtrrs m{};
-    CHECK(m.size() == 0);
+
+    CHECK(m.ranges().at(0) == range_t{uc, 0, 0x100000});
+    CHECK(m.ranges().at(1) == range_t{wb, 0x100000, 0x100000});
+    CHECK(m.ranges().at(2) == range_t{wb, 0x200000, 0x100000});
+    CHECK(m.ranges().at(3) == range_t{wb, 0x300000, 0x100000});
+    CHECK(m.ranges().at(4) == range_t{wb, 0x400000, 0xFFFFFFFFFFFFFFFF - 0x400000});
+}
+
+TEST_CASE("intersecting ranges, uncacheable wins")
+{
+    enable_mtrrs(2);
+    add_variable_range(0, range_t{wb, 0x100000, 0x200000});
+    add_variable_range(1, range_t{uc, 0x200000, 0x200000});
+
+    mtrrs m{};
+
+    CHECK(m.ranges().at(1) == range_t{wb, 0x100000, 0x100000});
+    CHECK(m.ranges().at(2) == range_t{uc, 0x200000, 0x100000});
+    CHECK(m.ranges().at(3) == range_t{uc, 0x300000, 0x100000});
+}
+
+TEST_CASE("intersecting ranges, write_through wins over write_back")
+{
+    enable_mtrrs(2);
+    add_variable_range(0, range_t{wb, 0x100000, 0x200000});
+    add_variable_range(1, range_t{ept::mmap::memory_type::write_through, 0x200000, 0x200000});
+
+    mtrrs m{};
+
+    CHECK(m.ranges().at(2) == range_t{ept::mmap::memory_type::write_through, 0x200000, 0x100000});
+}
+
+TEST_CASE("intersecting ranges, undefined combination is uncacheable")
+{
+    enable_mtrrs(2);
+    add_variable_range(0, range_t{wb, 0x100000, 0x200000});
+    add_variable_range(1, range_t{ept::mmap::memory_type::write_combining, 0x200000, 0x200000});
+
+    mtrrs m{};
+
+    CHECK(m.ranges().at(2) == range_t{uc, 0x200000, 0x100000});
+}
+
+TEST_CASE("lookup")
+{
+    enable_mtrrs(2);
+    add_variable_range(0, range_t{wb, 0x100000, 0x200000});
+    add_variable_range(1, range_t{uc, 0x400000, 0x100000});
+
+    mtrrs m{};
+
+    CHECK(m.lookup(0) == range_t{uc, 0, 0x100000});
+    CHECK(m.lookup(0xFFFFF) == range_t{uc, 0, 0x100000});
+    CHECK(m.lookup(0x100000) == range_t{wb, 0x100000, 0x300000});
+    CHECK(m.lookup(0x3FFFFF) == range_t{wb, 0x100000, 0x300000});
+    CHECK(m.lookup(0x400000) == range_t{uc, 0x400000, 0x100000});
+    CHECK(m.lookup(0x500000) == range_t{wb, 0x500000, 0xFFFFFFFFFFFFFFFF - 0x500000});
 }
 
 TEST_CASE("default type: write_back")
@@ -0,0 +1,229 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <memory>
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <bfvmm/test/support.h>
+#include <hve/arch/intel_x64/vcpu.h>
+
+using namespace eapis::intel_x64;
+using eapis_vcpu = eapis::intel_x64::vcpu;
+
+constexpr const uint64_t cpl0_ss = 0x93;
+constexpr const uint64_t cpl3_ss = 0xF3;
+
+static std::unique_ptr<eapis_vcpu>
+setup_vcpu()
+{
+    setup_test_support();
+
+    g_msrs[::intel_x64::msrs::ia32_vmx_true_pinbased_ctls::addr] = 0xFFFFFFFF00000000;
+    g_msrs[::intel_x64::msrs::ia32_vmx_true_procbased_ctls::addr] = 0xFFFFFFFF00000000;
+    g_msrs[::intel_x64::msrs::ia32_vmx_true_entry_ctls::addr] = 0xFFFFFFFF00000000;
+    g_msrs[::intel_x64::msrs::ia32_vmx_true_exit_ctls::addr] = 0xFFFFFFFF00000000;
+    g_msrs[::intel_x64::msrs::ia32_vmx_procbased_ctls2::addr] = 0xFFFFFFFF00000000;
+
+    g_vmcs_fields[vmcs_n::guest_ss_access_rights::addr] = cpl0_ss;
+    g_vmcs_fields[vmcs_n::vm_entry_controls::addr] = 0;
+
+    return std::make_unique<eapis_vcpu>(0);
+}
+
+static void
+setup_timers(MockRepository &mocks, eapis_vcpu *vcpu, uint64_t &period_ns)
+{
+    mocks.OnCall(vcpu, eapis_vcpu::add_periodic_timer).Do(
+    [&](uint64_t period, const timer_wheel::handler_delegate_t & d) {
+        bfignored(d);
+
+        period_ns = period;
+        return 1;
+    });
+
+    mocks.OnCall(vcpu, eapis_vcpu::cancel_timer).Return(true);
+}
+
+static uint64_t
+call(eapis_vcpu *vcpu, profiler &p, uint64_t cmd, uint64_t arg = 0)
+{
+    cpuid_handler::info_t info{};
+
+    vcpu->set_rbx(cmd);
+    vcpu->set_rcx(arg);
+
+    CHECK(p.handle_cpuid(vcpu, info));
+    CHECK(info.ignore_write);
+
+    return vcpu->rax();
+}
+
+TEST_CASE("profiler: enable / disable")
+{
+    MockRepository mocks;
+    uint64_t period_ns = 0;
+
+    auto vcpu = setup_vcpu();
+    setup_timers(mocks, vcpu.get(), period_ns);
+
+    auto p = profiler(vcpu.get());
+    CHECK_FALSE(p.enabled());
+
+    CHECK_THROWS(p.enable(0));
+    CHECK_THROWS(p.enable(profiler::max_freq_hz + 1));
+    CHECK_THROWS(p.enable(1000, 0));
+    CHECK_THROWS(p.enable(1000, 3));
+    CHECK_FALSE(p.enabled());
+
+    p.enable(1000);
+    CHECK(p.enabled());
+    CHECK(period_ns == 1000000);
+
+    p.enable(profiler::max_freq_hz);
+    CHECK(period_ns == 10000);
+
+    p.disable();
+    CHECK_FALSE(p.enabled());
+    CHECK_NOTHROW(p.disable());
+}
+
+TEST_CASE("profiler: samples")
+{
+    MockRepository mocks;
+    uint64_t period_ns = 0;
+
+    auto vcpu = setup_vcpu();
+    setup_timers(mocks, vcpu.get(), period_ns);
+
+    auto p = profiler(vcpu.get());
+    timer_wheel::info_t info{};
+    profiler::sample_t sample{};
+
+    // Without a ring, every sample is dropped
+    //
+
+    p.handle_sample(vcpu.get(), info);
+    CHECK(p.size() == 0);
+    CHECK(p.dropped() == 1);
+
+    p.enable(1000, 2);
+
+    vcpu->set_rip(0x1234);
+    g_vmcs_fields[vmcs_n::guest_cr3::addr] = 0x5000;
+
+    p.handle_sample(vcpu.get(), info);
+    p.handle_sample(vcpu.get(), info);
+    p.handle_sample(vcpu.get(), info);
+
+    CHECK(p.size() == 2);
+    CHECK(p.dropped() == 2);
+
+    CHECK(p.pop(sample));
+    CHECK(sample.rip == 0x1234);
+    CHECK(sample.cr3 == 0x5000);
+    CHECK(sample.depth == 0);
+
+    CHECK(p.pop(sample));
+    CHECK_FALSE(p.pop(sample));
+}
+
+TEST_CASE("profiler: cpuid")
+{
+    MockRepository mocks;
+    uint64_t period_ns = 0;
+
+    auto vcpu = setup_vcpu();
+    setup_timers(mocks, vcpu.get(), period_ns);
+
+    auto p = profiler(vcpu.get());
+
+    CHECK(call(vcpu.get(), p, profiler_abi::cmd_start, 0) == profiler_abi::status_failure);
+    CHECK_FALSE(p.enabled());
+
+    // The frequency is clamped instead of flooding the vCPU with exits
+    //
+
+    CHECK(call(vcpu.get(), p, profiler_abi::cmd_start, 1000000000) == profiler_abi::status_success);
+    CHECK(p.enabled());
+    CHECK(period_ns == 1000000000 / profiler::max_freq_hz);
+
+    CHECK(call(vcpu.get(), p, profiler_abi::cmd_pop) == profiler_abi::status_empty);
+
+    timer_wheel::info_t info{};
+    vcpu->set_rip(0x1234);
+    p.handle_sample(vcpu.get(), info);
+
+    CHECK(call(vcpu.get(), p, profiler_abi::cmd_frames, 0) == profiler_abi::status_failure);
+    CHECK(call(vcpu.get(), p, 42) == profiler_abi::status_failure);
+
+    CHECK(call(vcpu.get(), p, profiler_abi::cmd_pop) == 0);
+    CHECK(vcpu->rbx() == 0x1234);
+
+    CHECK(call(vcpu.get(), p, profiler_abi::cmd_stop) == profiler_abi::status_success);
+    CHECK_FALSE(p.enabled());
+}
+
+TEST_CASE("profiler: cpuid requires cpl 0")
+{
+    MockRepository mocks;
+    uint64_t period_ns = 0;
+
+    auto vcpu = setup_vcpu();
+    setup_timers(mocks, vcpu.get(), period_ns);
+
+    auto p = profiler(vcpu.get());
+    p.enable(1000);
+
+    timer_wheel::info_t info{};
+    vcpu->set_rip(0x1234);
+    p.handle_sample(vcpu.get(), info);
+
+    g_vmcs_fields[vmcs_n::guest_ss_access_rights::addr] = cpl3_ss;
+
+    CHECK(call(vcpu.get(), p, profiler_abi::cmd_pop) == profiler_abi::status_failure);
+    CHECK(vcpu->rbx() == 0);
+    CHECK(p.size() == 1);
+
+    CHECK(call(vcpu.get(), p, profiler_abi::cmd_stop) == profiler_abi::status_failure);
+    CHECK(p.enabled());
+
+    // Once the VMM allows it, ring 3 (e.g. ack_profile) can use it too
+    //
+
+    CHECK_FALSE(p.user_access());
+    p.allow_user_access(true);
+    CHECK(p.user_access());
+
+    CHECK(call(vcpu.get(), p, profiler_abi::cmd_pop) == 0);
+    CHECK(vcpu->rbx() == 0x1234);
+
+    p.handle_sample(vcpu.get(), info);
+    p.allow_user_access(false);
+    CHECK(call(vcpu.get(), p, profiler_abi::cmd_pop) == profiler_abi::status_failure);
+
+    g_vmcs_fields[vmcs_n::guest_ss_access_rights::addr] = cpl0_ss;
+
+    CHECK(call(vcpu.get(), p, profiler_abi::cmd_pop) == 0);
+    CHECK(vcpu->rbx() == 0x1234);
+}
@@ -0,0 +1,157 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/timer_wheel.h>
+
+using namespace eapis::intel_x64;
+
+static uint64_t g_fired = 0;
+static uint64_t g_last_deadline = 0;
+
+void
+test_handler(gsl::not_null<vcpu_t *> vcpu, timer_wheel::info_t &info)
+{
+    bfignored(vcpu);
+
+    g_fired++;
+    g_last_deadline = info.deadline;
+}
+
+void
+test_handler_cancel(gsl::not_null<vcpu_t *> vcpu, timer_wheel::info_t &info)
+{
+    bfignored(vcpu);
+
+    g_fired++;
+    info.cancel = true;
+}
+
+auto d = timer_wheel::handler_delegate_t::create<test_handler>();
+auto d_cancel = timer_wheel::handler_delegate_t::create<test_handler_cancel>();
+
+TEST_CASE("empty")
+{
+    timer_wheel wheel{};
+
+    CHECK(wheel.empty());
+    CHECK(wheel.next_deadline() == timer_wheel::never);
+}
+
+TEST_CASE("one-shot")
+{
+    MockRepository mocks;
+    auto vcpu = mocks.Mock<vcpu_t>();
+
+    g_fired = 0;
+    timer_wheel wheel{};
+
+    auto id = wheel.add(1000, 5000, 0, d);
+    CHECK(id != timer_wheel::invalid_id);
+    CHECK(wheel.size() == 1);
+    CHECK(wheel.next_deadline() == 5000);
+
+    CHECK(wheel.expire(vcpu, 4999) == 0);
+    CHECK(wheel.expire(vcpu, 5000) == 1);
+    CHECK(g_fired == 1);
+    CHECK(g_last_deadline == 5000);
+    CHECK(wheel.empty());
+}
+
+TEST_CASE("ordering across levels")
+{
+    MockRepository mocks;
+    auto vcpu = mocks.Mock<vcpu_t>();
+
+    timer_wheel wheel{};
+
+    wheel.add(0, 100000000, 0, d);
+    CHECK(wheel.next_deadline() == 100000000);
+
+    wheel.expire(vcpu, 90000000);
+    wheel.add(90000000, 95000000, 0, d);
+    CHECK(wheel.next_deadline() == 95000000);
+
+    wheel.add(90000000, 90002000, 0, d);
+    CHECK(wheel.next_deadline() == 90002000);
+
+    wheel.add(90000000, 90000000 + 60000000000ULL, 0, d);
+    CHECK(wheel.next_deadline() == 90002000);
+    CHECK(wheel.size() == 4);
+}
+
+TEST_CASE("cancel")
+{
+    MockRepository mocks;
+    auto vcpu = mocks.Mock<vcpu_t>();
+
+    g_fired = 0;
+    timer_wheel wheel{};
+
+    auto id1 = wheel.add(0, 1000, 0, d);
+    auto id2 = wheel.add(0, 2000, 0, d);
+
+    CHECK(wheel.cancel(id1));
+    CHECK(!wheel.cancel(id1));
+    CHECK(wheel.next_deadline() == 2000);
+
+    CHECK(wheel.expire(vcpu, 3000) == 1);
+    CHECK(!wheel.cancel(id2));
+    CHECK(g_fired == 1);
+}
+
+TEST_CASE("periodic")
+{
+    MockRepository mocks;
+    auto vcpu = mocks.Mock<vcpu_t>();
+
+    g_fired = 0;
+    timer_wheel wheel{};
+
+    wheel.add(0, 1000, 1000, d);
+
+    CHECK(wheel.expire(vcpu, 1000) == 1);
+    CHECK(wheel.next_deadline() == 2000);
+
+    CHECK(wheel.expire(vcpu, 2500) == 1);
+    CHECK(wheel.next_deadline() == 3000);
+
+    CHECK(wheel.expire(vcpu, 10500) == 1);
+    CHECK(wheel.next_deadline() == 11500);
+    CHECK(g_fired == 3);
+}
+
+TEST_CASE("periodic cancel")
+{
+    MockRepository mocks;
+    auto vcpu = mocks.Mock<vcpu_t>();
+
+    g_fired = 0;
+    timer_wheel wheel{};
+
+    wheel.add(0, 1000, 1000, d_cancel);
+
+    CHECK(wheel.expire(vcpu, 1000) == 1);
+    CHECK(wheel.empty());
+}
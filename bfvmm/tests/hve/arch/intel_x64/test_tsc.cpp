@@ -0,0 +1,84 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/tsc.h>
+
+using namespace eapis::intel_x64;
+
+TEST_CASE("make conversion")
+{
+    auto tsc_to_ns = tsc::make_conversion(3000000000ULL, 1000000000ULL);
+    auto ns_to_tsc = tsc::make_conversion(1000000000ULL, 3000000000ULL);
+
+    CHECK(tsc_to_ns(3000000000ULL) == 1000000000ULL);
+    CHECK(tsc_to_ns(3) == 1);
+    CHECK(ns_to_tsc(1000) == 3000);
+    CHECK(ns_to_tsc(1000000000ULL * 3600) == 3000000000ULL * 3600);
+}
+
+TEST_CASE("make conversion invalid")
+{
+    CHECK_THROWS(tsc::make_conversion(0, 1000000000ULL));
+}
+
+TEST_CASE("not calibrated")
+{
+    tsc clock{};
+
+    CHECK(!clock.calibrated());
+    CHECK(clock.freq_hz() == 0);
+    CHECK(clock.source() == tsc::source_t::none);
+}
+
+TEST_CASE("set frequency")
+{
+    tsc clock{};
+    clock.set_freq_hz(2400000000ULL, 5);
+
+    CHECK(clock.calibrated());
+    CHECK(clock.source() == tsc::source_t::manual);
+    CHECK(clock.freq_MHz() == 2400);
+    CHECK(clock.pet_shift() == 5);
+
+    // Conversions truncate, so inexact ratios may be off by a single tick
+    //
+
+    CHECK(clock.tsc_to_ns(2400) >= 999);
+    CHECK(clock.tsc_to_ns(2400) <= 1000);
+    CHECK(clock.ns_to_tsc(1000) == 2400);
+    CHECK(clock.ns_to_pet(1000000) == 75000);
+    CHECK(clock.pet_to_ns(75000) >= 999999);
+    CHECK(clock.pet_to_ns(75000) <= 1000000);
+    CHECK(clock.tsc_to_pet(2400000) == 75000);
+    CHECK(clock.pet_to_tsc(75000) == 2400000);
+}
+
+TEST_CASE("set frequency invalid")
+{
+    tsc clock{};
+
+    CHECK_THROWS(clock.set_freq_hz(0, 5));
+    CHECK_THROWS(clock.set_freq_hz(1, 5));
+}
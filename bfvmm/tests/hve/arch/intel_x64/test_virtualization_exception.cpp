@@ -0,0 +1,105 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <memory>
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <bfvmm/test/support.h>
+#include <hve/arch/intel_x64/vcpu.h>
+
+using namespace eapis::intel_x64;
+using eapis_vcpu = eapis::intel_x64::vcpu;
+
+static std::unique_ptr<eapis_vcpu>
+setup_vcpu()
+{
+    setup_test_support();
+
+    g_msrs[::intel_x64::msrs::ia32_vmx_true_pinbased_ctls::addr] = 0xFFFFFFFF00000000;
+    g_msrs[::intel_x64::msrs::ia32_vmx_true_procbased_ctls::addr] = 0xFFFFFFFF00000000;
+    g_msrs[::intel_x64::msrs::ia32_vmx_true_entry_ctls::addr] = 0xFFFFFFFF00000000;
+    g_msrs[::intel_x64::msrs::ia32_vmx_true_exit_ctls::addr] = 0xFFFFFFFF00000000;
+    g_msrs[::intel_x64::msrs::ia32_vmx_procbased_ctls2::addr] = 0xFFFFFFFF00000000;
+
+    return std::make_unique<eapis_vcpu>(0);
+}
+
+TEST_CASE("virtualization exception: requires ept")
+{
+    auto vcpu = setup_vcpu();
+    auto handler = virtualization_exception_handler(vcpu.get());
+
+    g_vmcs_fields[vmcs_n::ept_pointer::addr] = 0;
+
+    CHECK_THROWS(handler.enable());
+    CHECK_THROWS(handler.rearm());
+    CHECK_THROWS(handler.info_phys());
+
+    CHECK_FALSE(handler.enabled());
+    CHECK_FALSE(handler.armed());
+    CHECK(handler.info() == nullptr);
+}
+
+TEST_CASE("virtualization exception: enable / disable")
+{
+    using namespace vmcs_n::secondary_processor_based_vm_execution_controls;
+
+    auto vcpu = setup_vcpu();
+    auto handler = virtualization_exception_handler(vcpu.get());
+
+    g_vmcs_fields[vmcs_n::ept_pointer::addr] = 0x1000;
+
+    CHECK_NOTHROW(handler.enable());
+    CHECK(handler.enabled());
+    CHECK(handler.armed());
+    CHECK(ept_violation_ve::is_enabled());
+
+    CHECK(handler.info() != nullptr);
+    CHECK_NOTHROW(handler.info_phys());
+    CHECK(vmcs_n::eptp_index::get() == 0);
+
+    handler.disable();
+    CHECK_FALSE(handler.enabled());
+    CHECK(ept_violation_ve::is_disabled());
+
+    CHECK_NOTHROW(handler.disable());
+}
+
+TEST_CASE("virtualization exception: rearm")
+{
+    auto vcpu = setup_vcpu();
+    auto handler = virtualization_exception_handler(vcpu.get());
+
+    g_vmcs_fields[vmcs_n::ept_pointer::addr] = 0x1000;
+    handler.enable();
+
+    auto info = const_cast<virtualization_exception_handler::info_t *>(handler.info());
+
+    info->busy = virtualization_exception_handler::busy;
+    CHECK_FALSE(handler.armed());
+
+    handler.rearm();
+    CHECK(handler.armed());
+    CHECK(info->busy == 0);
+}
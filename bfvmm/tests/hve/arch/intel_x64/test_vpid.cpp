@@ -54,3 +54,73 @@ TEST_CASE("enable / disable")
     handler.disable();
     CHECK(vmcs_n::secondary_processor_based_vm_execution_controls::enable_vpid::is_disabled());
 }
+
+TEST_CASE("vpid_allocator: never returns 0")
+{
+    vpid_allocator allocator;
+    bool recycled = true;
+
+    CHECK(allocator.allocate(recycled) == 1);
+    CHECK_FALSE(recycled);
+    CHECK(allocator.in_use() == 1);
+}
+
+TEST_CASE("vpid_allocator: recycles released ids")
+{
+    vpid_allocator allocator;
+    bool recycled = false;
+
+    auto id1 = allocator.allocate(recycled);
+    auto id2 = allocator.allocate(recycled);
+    CHECK(id1 != id2);
+
+    allocator.release(id1);
+    CHECK(allocator.in_use() == 1);
+
+    CHECK(allocator.allocate(recycled) == id1);
+    CHECK(recycled);
+    CHECK(allocator.in_use() == 2);
+}
+
+TEST_CASE("vpid_allocator: release 0")
+{
+    vpid_allocator allocator;
+    CHECK_THROWS(allocator.release(vpid_allocator::invalid_id));
+}
+
+TEST_CASE("vpid_allocator: double release")
+{
+    vpid_allocator allocator;
+    bool recycled = false;
+
+    auto id1 = allocator.allocate(recycled);
+    auto id2 = allocator.allocate(recycled);
+
+    allocator.release(id1);
+    CHECK_THROWS(allocator.release(id1));
+    CHECK_THROWS(allocator.release(id2 + 1));
+    CHECK(allocator.in_use() == 1);
+
+    CHECK(allocator.allocate(recycled) == id1);
+    CHECK(allocator.allocate(recycled) != id1);
+
+    allocator.release(id1);
+    allocator.release(id2);
+    CHECK(allocator.in_use() == 1);
+}
+
+TEST_CASE("vpid_allocator: exhausted")
+{
+    vpid_allocator allocator;
+    bool recycled = false;
+
+    for (auto i = 1U; i <= vpid_allocator::max_id; i++) {
+        CHECK(allocator.allocate(recycled) != vpid_allocator::invalid_id);
+    }
+
+    CHECK_THROWS(allocator.allocate(recycled));
+
+    allocator.release(42);
+    CHECK(allocator.allocate(recycled) == 42);
+    CHECK(recycled);
+}
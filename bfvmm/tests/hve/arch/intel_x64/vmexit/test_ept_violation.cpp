@@ -283,6 +283,46 @@ TEST_CASE("ept write violation exit, returns false")
     CHECK_THROWS(handler.handle(vmcs));
 }
 
+TEST_CASE("ept read-modify-write violation exit")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = ept_violation_handler(eapis, &g_eapis_vcpu_global_state);
+
+    ::intel_x64::vm::write(
+        vmcs_n::exit_qualification::addr, 3
+    );
+
+    handler.add_write_handler(
+        ept_violation_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    CHECK(handler.handle(vmcs) == true);
+}
+
+TEST_CASE("ept read-modify-write violation exit, read handler only")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto vmcs = setup_vmcs(mocks);
+    auto eapis = setup_eapis(mocks);
+    auto handler = ept_violation_handler(eapis, &g_eapis_vcpu_global_state);
+
+    ::intel_x64::vm::write(
+        vmcs_n::exit_qualification::addr, 3
+    );
+
+    handler.add_read_handler(
+        ept_violation_handler::handler_delegate_t::create<test_handler>()
+    );
+
+    CHECK_THROWS(handler.handle(vmcs));
+}
+
 TEST_CASE("ept execute violation exit")
 {
     setup_eapis_test_support();
@@ -0,0 +1,209 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <memory>
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <bfvmm/test/support.h>
+#include <hve/arch/intel_x64/vcpu.h>
+
+using namespace eapis::intel_x64;
+using eapis_vcpu = eapis::intel_x64::vcpu;
+
+static uint64_t g_called{0};
+
+static std::unique_ptr<eapis_vcpu>
+setup_vcpu()
+{
+    setup_test_support();
+
+    g_msrs[::intel_x64::msrs::ia32_vmx_true_pinbased_ctls::addr] = 0xFFFFFFFF00000000;
+    g_msrs[::intel_x64::msrs::ia32_vmx_true_procbased_ctls::addr] = 0xFFFFFFFF00000000;
+    g_msrs[::intel_x64::msrs::ia32_vmx_true_entry_ctls::addr] = 0xFFFFFFFF00000000;
+    g_msrs[::intel_x64::msrs::ia32_vmx_true_exit_ctls::addr] = 0xFFFFFFFF00000000;
+    g_msrs[::intel_x64::msrs::ia32_vmx_procbased_ctls2::addr] = 0xFFFFFFFF00000000;
+
+    g_called = 0;
+    return std::make_unique<eapis_vcpu>(0);
+}
+
+static void
+setup_exit(uint64_t gpa, uint64_t qual)
+{
+    g_vmcs_fields[vmcs_n::guest_physical_address::addr] = gpa;
+    g_vmcs_fields[vmcs_n::exit_qualification::addr] = qual;
+}
+
+template<uint64_t id, bool ret>
+static bool
+test_handler(gsl::not_null<vcpu_t *> vcpu, ept_violation_handler::info_t &info)
+{
+    bfignored(vcpu);
+    bfignored(info);
+
+    g_called = id;
+    return ret;
+}
+
+template<uint64_t id, bool ret = true>
+static ept_violation_handler::handler_delegate_t
+make_handler()
+{ return ept_violation_handler::handler_delegate_t::create<test_handler<id, ret>>(); }
+
+TEST_CASE("ept_violation ranges: add / remove")
+{
+    auto vcpu = setup_vcpu();
+    auto handler = ept_violation_handler(vcpu.get());
+
+    CHECK_THROWS(handler.add_read_handler(0x1000, 0, make_handler<1>()));
+    CHECK_THROWS(handler.add_read_handler(~0xFFFULL, 0x2000, make_handler<1>()));
+
+    CHECK_NOTHROW(handler.add_read_handler(0x2000, 0x2000, make_handler<1>()));
+    CHECK_NOTHROW(handler.add_read_handler(0x1000, 0x1000, make_handler<2>()));
+    CHECK_NOTHROW(handler.add_read_handler(0x4000, 0x1000, make_handler<3>()));
+
+    CHECK_THROWS(handler.add_read_handler(0x3000, 0x1000, make_handler<4>()));
+    CHECK_THROWS(handler.add_read_handler(0x0000, 0x1001, make_handler<4>()));
+    CHECK_THROWS(handler.add_read_handler(0x3FFF, 0x0002, make_handler<4>()));
+    CHECK_THROWS(handler.add_read_handler(0x0000, 0x8000, make_handler<4>()));
+
+    CHECK_NOTHROW(handler.add_write_handler(0x3000, 0x1000, make_handler<4>()));
+    CHECK_NOTHROW(handler.add_execute_handler(0x3000, 0x1000, make_handler<4>()));
+
+    CHECK(handler.remove_read_handler(0x2000));
+    CHECK_FALSE(handler.remove_read_handler(0x2000));
+    CHECK_FALSE(handler.remove_read_handler(0x1001));
+    CHECK_NOTHROW(handler.add_read_handler(0x3000, 0x1000, make_handler<4>()));
+
+    CHECK(handler.remove_write_handler(0x3000));
+    CHECK(handler.remove_execute_handler(0x3000));
+}
+
+TEST_CASE("ept_violation ranges: dispatch")
+{
+    auto vcpu = setup_vcpu();
+    auto handler = ept_violation_handler(vcpu.get());
+
+    handler.add_read_handler(0x1000, 0x1000, make_handler<1>());
+    handler.add_read_handler(0x3000, 0x1000, make_handler<2>());
+    handler.add_write_handler(0x1000, 0x1000, make_handler<3>());
+    handler.add_execute_handler(0x1000, 0x1000, make_handler<4>());
+    handler.add_read_handler(make_handler<5>());
+
+    setup_exit(0x1000, 1);
+    CHECK(handler.handle(vcpu.get()));
+    CHECK(g_called == 1);
+
+    setup_exit(0x1FFF, 1);
+    CHECK(handler.handle(vcpu.get()));
+    CHECK(g_called == 1);
+
+    setup_exit(0x3ABC, 1);
+    CHECK(handler.handle(vcpu.get()));
+    CHECK(g_called == 2);
+
+    setup_exit(0x2000, 1);
+    CHECK(handler.handle(vcpu.get()));
+    CHECK(g_called == 5);
+
+    setup_exit(0x0FFF, 1);
+    CHECK(handler.handle(vcpu.get()));
+    CHECK(g_called == 5);
+
+    setup_exit(0x1000, 2);
+    CHECK(handler.handle(vcpu.get()));
+    CHECK(g_called == 3);
+
+    setup_exit(0x1000, 4);
+    CHECK(handler.handle(vcpu.get()));
+    CHECK(g_called == 4);
+}
+
+TEST_CASE("ept_violation ranges: fall back")
+{
+    auto vcpu = setup_vcpu();
+    auto handler = ept_violation_handler(vcpu.get());
+
+    handler.add_write_handler(0x1000, 0x1000, make_handler<1, false>());
+
+    setup_exit(0x1000, 2);
+    CHECK_THROWS(handler.handle(vcpu.get()));
+    CHECK(g_called == 1);
+
+    handler.add_write_handler(make_handler<2>());
+
+    CHECK(handler.handle(vcpu.get()));
+    CHECK(g_called == 2);
+
+    CHECK(handler.remove_write_handler(0x1000));
+    g_called = 0;
+
+    CHECK(handler.handle(vcpu.get()));
+    CHECK(g_called == 2);
+}
+
+TEST_CASE("ept_violation ranges: spp violation")
+{
+    auto vcpu = setup_vcpu();
+    auto handler = ept_violation_handler(vcpu.get());
+
+    handler.add_read_handler(0x1000, 0x1000, make_handler<1>());
+    handler.add_write_handler(0x1000, 0x1000, make_handler<2>());
+
+    setup_exit(0x1080, 1);
+    CHECK(handler.handle(vcpu.get()));
+    CHECK(g_called == 1);
+
+    setup_exit(0x1080, ept_violation_handler::spp_violation_mask | 1);
+    CHECK(handler.handle(vcpu.get()));
+    CHECK(g_called == 2);
+}
+
+TEST_CASE("ept_violation ranges: read-modify-write")
+{
+    auto vcpu = setup_vcpu();
+    auto handler = ept_violation_handler(vcpu.get());
+
+    handler.add_read_handler(0x1000, 0x1000, make_handler<1>());
+    handler.add_write_handler(0x1000, 0x1000, make_handler<2>());
+
+    setup_exit(0x1000, 3);
+    CHECK(handler.handle(vcpu.get()));
+    CHECK(g_called == 2);
+}
+
+TEST_CASE("ept_violation ranges: vcpu")
+{
+    auto vcpu = setup_vcpu();
+
+    CHECK_NOTHROW(vcpu->add_ept_read_violation_handler(0x1000, 0x1000, make_handler<1>()));
+    CHECK_NOTHROW(vcpu->add_ept_write_violation_handler(0x1000, 0x1000, make_handler<2>()));
+    CHECK_NOTHROW(vcpu->add_ept_execute_violation_handler(0x1000, 0x1000, make_handler<3>()));
+    CHECK_THROWS(vcpu->add_ept_read_violation_handler(0x1800, 0x1000, make_handler<1>()));
+
+    CHECK(vcpu->remove_ept_read_violation_handler(0x1000));
+    CHECK(vcpu->remove_ept_write_violation_handler(0x1000));
+    CHECK(vcpu->remove_ept_execute_violation_handler(0x1000));
+    CHECK_FALSE(vcpu->remove_ept_execute_violation_handler(0x1000));
+}
@@ -0,0 +1,126 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <memory>
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <bfvmm/test/support.h>
+#include <hve/arch/intel_x64/vcpu.h>
+
+using namespace eapis::intel_x64;
+using eapis_vcpu = eapis::intel_x64::vcpu;
+
+static std::unique_ptr<eapis_vcpu>
+setup_vcpu()
+{
+    setup_test_support();
+
+    g_msrs[::intel_x64::msrs::ia32_vmx_true_pinbased_ctls::addr] = 0xFFFFFFFF00000000;
+    g_msrs[::intel_x64::msrs::ia32_vmx_true_procbased_ctls::addr] = 0xFFFFFFFF00000000;
+    g_msrs[::intel_x64::msrs::ia32_vmx_true_entry_ctls::addr] = 0xFFFFFFFF00000000;
+    g_msrs[::intel_x64::msrs::ia32_vmx_true_exit_ctls::addr] = 0xFFFFFFFF00000000;
+    g_msrs[::intel_x64::msrs::ia32_vmx_procbased_ctls2::addr] = 0xFFFFFFFF00000000;
+
+    return std::make_unique<eapis_vcpu>(0);
+}
+
+TEST_CASE("page_modification_log: requires accessed and dirty flags")
+{
+    auto vcpu = setup_vcpu();
+    auto handler = page_modification_log_handler(vcpu.get());
+    dirty_bitmap bitmap{0x100000};
+
+    vmcs_n::ept_pointer::accessed_and_dirty_flags::disable();
+    CHECK_THROWS(handler.enable(bitmap));
+    CHECK_FALSE(handler.enabled());
+    CHECK(handler.log().empty());
+}
+
+TEST_CASE("page_modification_log: enable / disable")
+{
+    using namespace vmcs_n::secondary_processor_based_vm_execution_controls;
+
+    auto vcpu = setup_vcpu();
+    auto handler = page_modification_log_handler(vcpu.get());
+    dirty_bitmap bitmap{0x100000};
+
+    vmcs_n::ept_pointer::accessed_and_dirty_flags::enable();
+
+    handler.enable(bitmap);
+    CHECK(handler.enabled());
+    CHECK(enable_pml::is_enabled());
+    CHECK(vmcs_n::pml_address::get() != 0);
+    CHECK(vmcs_n::guest_pml_index::get() == 511);
+    CHECK(handler.log().size() == 512);
+
+    handler.disable();
+    CHECK_FALSE(handler.enabled());
+    CHECK(enable_pml::is_disabled());
+    CHECK(handler.flush() == 0);
+}
+
+TEST_CASE("page_modification_log: flush")
+{
+    auto vcpu = setup_vcpu();
+    auto handler = page_modification_log_handler(vcpu.get());
+    dirty_bitmap bitmap{0x100000};
+
+    vmcs_n::ept_pointer::accessed_and_dirty_flags::enable();
+    handler.enable(bitmap);
+
+    auto log = handler.log();
+    log[511] = 0x1000;
+    log[510] = 0x5000;
+    vmcs_n::guest_pml_index::set(509);
+
+    CHECK(handler.flush() == 2);
+    CHECK(bitmap.is_dirty(0x1000));
+    CHECK(bitmap.is_dirty(0x5000));
+    CHECK_FALSE(bitmap.is_dirty(0x2000));
+    CHECK(vmcs_n::guest_pml_index::get() == 511);
+
+    CHECK(handler.flush() == 0);
+}
+
+TEST_CASE("page_modification_log: log full exit")
+{
+    auto vcpu = setup_vcpu();
+    auto handler = page_modification_log_handler(vcpu.get());
+    dirty_bitmap bitmap{0x1000000};
+
+    vmcs_n::ept_pointer::accessed_and_dirty_flags::enable();
+    handler.enable(bitmap);
+
+    auto log = handler.log();
+    for (std::ptrdiff_t i = 0; i < log.size(); i++) {
+        log[i] = static_cast<uint64_t>(i) << 12U;
+    }
+
+    vmcs_n::guest_pml_index::set(0xFFFF);
+
+    CHECK(handler.handle(vcpu.get()));
+    CHECK(bitmap.is_dirty(0x0));
+    CHECK(bitmap.is_dirty(0x1FF000));
+    CHECK(vmcs_n::guest_pml_index::get() == 511);
+}
@@ -0,0 +1,185 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <array>
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <bfvmm/test/support.h>
+#include <hve/arch/intel_x64/vtd/dma_remapping.h>
+
+#include "vtd_test_support.h"
+
+using namespace eapis::intel_x64;
+namespace iommu = ::intel_x64::vtd::iommu;
+namespace context_entry = ::intel_x64::vtd::context_entry;
+
+// A fake register file. The capability register reports a 4-level AGAW
+// and 2m / 1g pages, and the extended capability register reports coherency
+// and pass through.
+//
+using vtd_test::g_regs;
+
+static void
+setup_regs(bool ept_compatible = true)
+{
+    if (ept_compatible) {
+        vtd_test::setup_regs((0x4ULL << 8U) | (0x3ULL << 34U), 0x1ULL | 0x40ULL | (0x10ULL << 8U));
+    }
+    else {
+        vtd_test::setup_regs(0, 0);
+    }
+}
+
+TEST_CASE("dma_remapping: constructor / destructor")
+{
+    setup_regs();
+
+    {
+        vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+        vtd::dma_remapping dmar{unit};
+        CHECK(dmar.root_table_phys() != 0);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("dma_remapping: ept compatible")
+{
+    setup_regs(true);
+    {
+        vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+        CHECK(vtd::dma_remapping{unit}.ept_compatible());
+    }
+
+    setup_regs(false);
+    {
+        vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+        CHECK_FALSE(vtd::dma_remapping{unit}.ept_compatible());
+    }
+
+    // An ept::mmap can contain 1g pages, so 2m pages alone are not enough
+    //
+
+    vtd_test::setup_regs((0x4ULL << 8U) | (0x1ULL << 34U), 0x1ULL);
+    {
+        vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+        CHECK_FALSE(vtd::dma_remapping{unit}.ept_compatible());
+    }
+}
+
+TEST_CASE("dma_remapping: assign device")
+{
+    setup_regs();
+
+    {
+        ept::mmap mmap{};
+        vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+        vtd::dma_remapping dmar{unit};
+
+        dmar.assign_device(3, 0x10, 7, mmap);
+
+        auto entry = dmar.get_context_entry(3, 0x10);
+        CHECK(context_entry::p::is_enabled(entry));
+        CHECK(context_entry::t::get(entry) == 0);
+        CHECK(context_entry::slptptr::get(entry) == mmap.eptp() >> 12U);
+        CHECK(context_entry::aw::get(entry) == 2);
+        CHECK(context_entry::did::get(entry) == 7);
+
+        CHECK(context_entry::p::is_disabled(dmar.get_context_entry(3, 0x11)));
+        CHECK(context_entry::p::is_disabled(dmar.get_context_entry(4, 0x10)));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("dma_remapping: assign device, incompatible")
+{
+    setup_regs(false);
+
+    ept::mmap mmap{};
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    vtd::dma_remapping dmar{unit};
+
+    CHECK_THROWS(dmar.assign_device(3, 0x10, 7, mmap));
+    CHECK_THROWS(dmar.assign_device_passthrough(3, 0x10, 7));
+}
+
+TEST_CASE("dma_remapping: assign device passthrough")
+{
+    setup_regs();
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    vtd::dma_remapping dmar{unit};
+
+    dmar.assign_device_passthrough(0, 0xF8, 1);
+
+    auto entry = dmar.get_context_entry(0, 0xF8);
+    CHECK(context_entry::p::is_enabled(entry));
+    CHECK(context_entry::t::get(entry) == 2);
+}
+
+TEST_CASE("dma_remapping: reassign device")
+{
+    setup_regs();
+
+    {
+        vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+        vtd::dma_remapping dmar{unit};
+        vtd::second_level_table table{unit};
+
+        dmar.assign_device_passthrough(3, 0x10, 7);
+        dmar.assign_device(3, 0x10, 9, table);
+
+        auto entry = dmar.get_context_entry(3, 0x10);
+        CHECK(context_entry::p::is_enabled(entry));
+        CHECK(context_entry::t::get(entry) == 0);
+        CHECK(context_entry::slptptr::get(entry) == table.root_phys() >> 12U);
+        CHECK(context_entry::did::get(entry) == 9);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("dma_remapping: remove device")
+{
+    setup_regs();
+
+    ept::mmap mmap{};
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    vtd::dma_remapping dmar{unit};
+
+    dmar.assign_device(3, 0x10, 7, mmap);
+    dmar.remove_device(3, 0x10);
+    dmar.remove_device(5, 0x10);
+
+    CHECK(context_entry::p::is_disabled(dmar.get_context_entry(3, 0x10)));
+}
+
+TEST_CASE("dma_remapping: invalid bus / devfn")
+{
+    setup_regs();
+
+    ept::mmap mmap{};
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    vtd::dma_remapping dmar{unit};
+
+    CHECK_THROWS(dmar.assign_device(256, 0, 7, mmap));
+    CHECK_THROWS(dmar.assign_device(0, 256, 7, mmap));
+    CHECK_THROWS(dmar.get_context_entry(256, 0));
+}
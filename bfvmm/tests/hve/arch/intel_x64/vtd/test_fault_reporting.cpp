@@ -0,0 +1,204 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <array>
+#include <cstring>
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <bfvmm/test/support.h>
+#include <hve/arch/intel_x64/vtd/fault_reporting.h>
+
+#include "vtd_test_support.h"
+
+using namespace eapis::intel_x64;
+namespace iommu = ::intel_x64::vtd::iommu;
+
+// A fake register file. The capability register reports 4 fault
+// recording registers at offset 0x200.
+//
+using vtd_test::g_regs;
+
+constexpr const uint64_t frr_base = 0x200;
+
+static void
+setup_regs()
+{ vtd_test::setup_regs(((frr_base / 16) << 24U) | (3ULL << 40U), 0); }
+
+static void
+set_fsts(bool ppf, uint32_t fri, bool pfo = false)
+{
+    iommu::write_32(
+        iommu::fsts_reg::offset, (ppf ? 0x2U : 0U) | (pfo ? 0x1U : 0U) | (fri << 8U));
+}
+
+static void
+set_record(uint64_t index, uint64_t sid, uint64_t reason, uint64_t fi, bool write)
+{
+    g_regs.at((frr_base / 8) + (index * 2)) = fi << 12U;
+    g_regs.at((frr_base / 8) + (index * 2) + 1) =
+        (1ULL << 63U) | (write ? 0 : (1ULL << 62U)) | (reason << 32U) | sid;
+}
+
+static void
+clear_records()
+{
+    for (uint64_t i = 0; i < 8; i++) {
+        g_regs.at((frr_base / 8) + i) = 0;
+    }
+}
+
+static bool
+record_released(uint64_t index)
+{
+    // The fake register file does not implement RW1C, so a released
+    // record is one whose upper 32bits only hold the F bit.
+    //
+    return (g_regs.at((frr_base / 8) + (index * 2) + 1) >> 32U) == 0x80000000U;
+}
+
+TEST_CASE("fault_reporting: frr fields")
+{
+    iommu::frr::value_type frr{};
+    frr.data[1] = 0x80000005A5A51234ULL;
+
+    CHECK(iommu::frr::sid::get(frr) == 0x1234);
+    CHECK(iommu::frr::fr::get(frr) == 0x05);
+    CHECK(iommu::frr::f::is_enabled(frr));
+}
+
+TEST_CASE("fault_reporting: nothing pending")
+{
+    setup_regs();
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    vtd::fault_reporting faults{unit};
+
+    set_record(0, 0x10, 0x5, 0x1234, true);
+    set_fsts(false, 0);
+
+    CHECK(faults.drain(0) == 0);
+    CHECK(faults.total() == 0);
+}
+
+TEST_CASE("fault_reporting: drain")
+{
+    setup_regs();
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    vtd::fault_reporting faults{unit};
+
+    set_record(2, 0x10, 0x5, 0x1234, true);
+    set_record(3, 0x10, 0x5, 0x1235, true);
+    set_record(0, 0x18, 0x6, 0x5678, false);
+    set_fsts(true, 2);
+
+    CHECK(faults.drain(100) == 3);
+    CHECK(faults.total() == 3);
+    CHECK(faults.count(0x10, 0x5) == 2);
+    CHECK(faults.count(0x18, 0x6) == 1);
+    CHECK(faults.count(0x18, 0x5) == 0);
+
+    CHECK(record_released(2));
+    CHECK(record_released(3));
+    CHECK(record_released(0));
+    CHECK_FALSE(record_released(1));
+
+    auto stats = faults.stats(0x10, 0x5);
+    CHECK(stats.last_fi == 0x1235);
+    CHECK(stats.last_write);
+    CHECK(stats.first_ns == 100);
+    CHECK(stats.last_ns == 100);
+    CHECK_FALSE(faults.stats(0x18, 0x6).last_write);
+
+    CHECK_NOTHROW(faults.dump());
+
+    faults.clear();
+    CHECK(faults.total() == 0);
+    CHECK(faults.count(0x10, 0x5) == 0);
+}
+
+TEST_CASE("fault_reporting: drain stops at every record")
+{
+    setup_regs();
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    vtd::fault_reporting faults{unit};
+
+    for (uint64_t i = 0; i < 4; i++) {
+        set_record(i, 0x10, 0x5, i, true);
+    }
+    set_fsts(true, 1);
+
+    CHECK(faults.drain(0) == 4);
+}
+
+TEST_CASE("fault_reporting: overflow")
+{
+    setup_regs();
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    vtd::fault_reporting faults{unit};
+
+    set_fsts(false, 0, true);
+
+    CHECK(faults.drain(0) == 0);
+    CHECK(faults.overflows() == 1);
+    CHECK(iommu::fsts_reg::get() == 0x1);
+}
+
+TEST_CASE("fault_reporting: rate limit")
+{
+    setup_regs();
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    vtd::fault_reporting faults{unit, 2, 1000};
+
+    for (uint64_t i = 0; i < 4; i++) {
+        set_record(i, 0x10, 0x5, i, true);
+    }
+    set_fsts(true, 0);
+
+    faults.drain(5000);
+    CHECK(faults.logged() == 2);
+    CHECK(faults.suppressed() == 2);
+
+    clear_records();
+    set_record(0, 0x10, 0x5, 0, true);
+    set_fsts(true, 0);
+
+    faults.drain(5500);
+    CHECK(faults.logged() == 2);
+    CHECK(faults.suppressed() == 3);
+
+    clear_records();
+    set_record(0, 0x10, 0x5, 0, true);
+    set_fsts(true, 0);
+
+    faults.drain(6000);
+    CHECK(faults.logged() == 3);
+    CHECK(faults.suppressed() == 3);
+    CHECK(faults.count(0x10, 0x5) == 6);
+}
+
+TEST_CASE("fault_reporting: reason to string")
+{
+    CHECK(std::strcmp(vtd::fault_reporting::reason_to_str(0x2), "context entry not present") == 0);
+    CHECK(std::strcmp(vtd::fault_reporting::reason_to_str(0x26), "source id verification failed") == 0);
+    CHECK(std::strcmp(vtd::fault_reporting::reason_to_str(0xFF), "unknown") == 0);
+}
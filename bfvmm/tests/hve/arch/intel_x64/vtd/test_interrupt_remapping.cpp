@@ -0,0 +1,323 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <array>
+#include <atomic>
+#include <thread>
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <bfvmm/test/support.h>
+#include <hve/arch/intel_x64/vtd/interrupt_remapping.h>
+
+#include "vtd_test_support.h"
+
+using namespace eapis::intel_x64;
+namespace iommu = ::intel_x64::vtd::iommu;
+namespace irte = ::intel_x64::vtd::irte;
+namespace pid = ::intel_x64::vtd::pid;
+
+using ir_t = vtd::interrupt_remapping;
+using qi_t = vtd::queued_invalidation;
+
+// A fake register file. The capability register reports posted
+// interrupts, and the extended capability register reports queued
+// invalidation, interrupt remapping and extended interrupt mode. GSTS
+// reports everything as enabled, so enable() does not time out.
+//
+using vtd_test::g_regs;
+
+static void
+setup_regs(bool pi = true)
+{ vtd_test::setup_regs(pi ? (1ULL << 59U) : 0, 0x2ULL | 0x8ULL | 0x10ULL, 0x7U << 24U); }
+
+// Emulates the hardware by processing the invalidation queue in the
+// background, writing the status word of each wait descriptor
+//
+class fake_hardware
+{
+public:
+
+    explicit fake_hardware(const qi_t &qi) :
+        m_thread{[this, &qi] { this->run(qi); }}
+    { }
+
+    ~fake_hardware()
+    {
+        m_stop = true;
+        m_thread.join();
+    }
+
+private:
+
+    void run(const qi_t &qi)
+    {
+        while (!m_stop) {
+            auto head = iommu::iqh_reg::qh::get();
+            auto tail = iommu::iqt_reg::qt::get();
+
+            for (; head != tail; head = (head + 1) & 0xFFU) {
+                const auto &desc = qi.queue()[head];
+
+                if ((desc.lo & 0xFU) == 0x4U) {
+                    m_iec++;
+                }
+
+                if ((desc.lo & 0xFU) == 0x5U) {
+                    *reinterpret_cast<volatile uint32_t *>(desc.hi) =
+                        static_cast<uint32_t>(desc.lo >> 32U);
+                }
+            }
+
+            g_regs.at(iommu::iqh_reg::offset / 8) = head << 4U;
+        }
+    }
+
+public:
+
+    std::atomic<bool> m_stop{false};
+    std::atomic<uint64_t> m_iec{0};
+
+private:
+
+    std::thread m_thread;
+};
+
+alignas(64) static pid::value_type g_pid1;
+alignas(64) static pid::value_type g_pid2;
+
+TEST_CASE("interrupt_remapping: constructor / destructor")
+{
+    setup_regs();
+
+    {
+        vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+        qi_t qi{unit};
+        ir_t ir{unit, qi};
+
+        CHECK(ir.table_phys() != 0);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("interrupt_remapping: not supported")
+{
+    setup_regs();
+    g_regs.at(iommu::ecap_reg::offset / 8) = 0x2ULL;
+
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    qi_t qi{unit};
+    CHECK_THROWS(ir_t{unit, qi});
+}
+
+TEST_CASE("interrupt_remapping: enable")
+{
+    setup_regs();
+
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    qi_t qi{unit};
+    ir_t ir{unit, qi};
+
+    CHECK_THROWS(ir.enable());
+
+    qi.enable();
+
+    {
+        fake_hardware hw{qi};
+        ir.enable();
+
+        CHECK(hw.m_iec == 1);
+    }
+
+    CHECK(iommu::irta_reg::irta::get() == ir.table_phys() >> 12U);
+    CHECK(iommu::irta_reg::s::get() == 7);
+    CHECK(iommu::irta_reg::eime::is_enabled());
+
+    iommu::write_32(iommu::gsts_reg::offset, 0x5U << 24U);
+    ir.disable();
+}
+
+TEST_CASE("interrupt_remapping: enable x2apic not supported")
+{
+    setup_regs();
+    g_regs.at(iommu::ecap_reg::offset / 8) = 0x2ULL | 0x8ULL;
+
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    qi_t qi{unit};
+    ir_t ir{unit, qi};
+
+    qi.enable();
+    CHECK_THROWS(ir.enable(true));
+}
+
+TEST_CASE("interrupt_remapping: allocate / free")
+{
+    setup_regs();
+
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    qi_t qi{unit};
+    ir_t ir{unit, qi};
+
+    CHECK(ir.allocate() == 0);
+    CHECK(ir.allocate() == 1);
+    CHECK(ir.allocate(4) == 4);
+    CHECK(ir.allocate(32) == 32);
+    CHECK(ir.allocate(2) == 2);
+    CHECK(ir.allocated(5));
+    CHECK_FALSE(ir.allocated(8));
+    CHECK_FALSE(ir.allocated(256));
+
+    ir.free(4, 4);
+    CHECK_FALSE(ir.allocated(5));
+    CHECK(ir.allocate(4) == 4);
+
+    CHECK_THROWS(ir.allocate(3));
+    CHECK_THROWS(ir.allocate(64));
+    CHECK_THROWS(ir.free(8));
+    CHECK_THROWS(ir.free(2, 4));
+}
+
+TEST_CASE("interrupt_remapping: allocate all")
+{
+    setup_regs();
+
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    qi_t qi{unit};
+    ir_t ir{unit, qi};
+
+    for (ir_t::index_type i = 0; i < ir_t::num_entries; i++) {
+        CHECK(ir.allocate() == i);
+    }
+
+    CHECK_THROWS(ir.allocate());
+
+    ir.free(100);
+    CHECK(ir.allocate() == 100);
+}
+
+TEST_CASE("interrupt_remapping: map remapped")
+{
+    setup_regs();
+
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    qi_t qi{unit};
+    ir_t ir{unit, qi};
+
+    auto index = ir.allocate();
+    ir.map_remapped(index, 0x0310, 0x42, 0x12345);
+
+    auto entry = ir.get_entry(index);
+    CHECK(irte::p::is_enabled(entry));
+    CHECK(irte::im::is_disabled(entry));
+    CHECK(irte::v::get(entry) == 0x42);
+    CHECK(irte::dst::get(entry) == 0x12345);
+    CHECK(irte::sid::get(entry) == 0x0310);
+    CHECK(irte::svt::get(entry) == 1);
+
+    CHECK_THROWS(ir.map_remapped(index + 1, 0x0310, 0x42, 1));
+}
+
+TEST_CASE("interrupt_remapping: map posted")
+{
+    setup_regs();
+
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    qi_t qi{unit};
+    ir_t ir{unit, qi};
+
+    auto index = ir.allocate();
+    ir.map_posted(index, 0x0310, 0x42, g_pid1, true);
+
+    auto entry = ir.get_entry(index);
+    auto phys = reinterpret_cast<uintptr_t>(&g_pid1);
+
+    CHECK(irte::p::is_enabled(entry));
+    CHECK(irte::im::is_enabled(entry));
+    CHECK(irte::urg::is_enabled(entry));
+    CHECK(irte::vv::get(entry) == 0x42);
+    CHECK(irte::pdal::get(entry) == (phys & 0xFFFFFFFFU) >> 6U);
+    CHECK(irte::pdah::get(entry) == phys >> 32U);
+    CHECK(irte::sid::get(entry) == 0x0310);
+
+    ir.free(index);
+    CHECK(irte::p::is_disabled(ir.get_entry(index)));
+}
+
+TEST_CASE("interrupt_remapping: map posted not supported")
+{
+    setup_regs(false);
+
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    qi_t qi{unit};
+    ir_t ir{unit, qi};
+
+    CHECK_THROWS(ir.map_posted(ir.allocate(), 0x0310, 0x42, g_pid1));
+}
+
+TEST_CASE("interrupt_remapping: retarget")
+{
+    setup_regs();
+
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    qi_t qi{unit};
+    ir_t ir{unit, qi};
+
+    auto index = ir.allocate();
+    ir.map_posted(index, 0x0310, 0x42, g_pid1);
+    ir.retarget(index, g_pid2);
+
+    auto entry = ir.get_entry(index);
+    auto phys = reinterpret_cast<uintptr_t>(&g_pid2);
+
+    CHECK(irte::vv::get(entry) == 0x42);
+    CHECK(irte::sid::get(entry) == 0x0310);
+    CHECK(irte::pdal::get(entry) == (phys & 0xFFFFFFFFU) >> 6U);
+    CHECK(irte::pdah::get(entry) == phys >> 32U);
+
+    auto remapped = ir.allocate();
+    ir.map_remapped(remapped, 0x0310, 0x42, 1);
+    CHECK_THROWS(ir.retarget(remapped, g_pid2));
+
+    auto unaligned = reinterpret_cast<const pid::value_type *>(
+        reinterpret_cast<uintptr_t>(&g_pid2) + 8);
+    CHECK_THROWS(ir.retarget(index, *unaligned));
+}
+
+TEST_CASE("interrupt_remapping: retarget invalidates")
+{
+    setup_regs();
+
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    qi_t qi{unit};
+    ir_t ir{unit, qi};
+
+    auto index = ir.allocate();
+    ir.map_posted(index, 0x0310, 0x42, g_pid1);
+
+    qi.enable();
+
+    fake_hardware hw{qi};
+    ir.retarget(index, g_pid2);
+
+    CHECK(hw.m_iec == 1);
+}
@@ -0,0 +1,171 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <array>
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <bfvmm/test/support.h>
+#include <hve/arch/intel_x64/vtd/iommu_unit.h>
+
+#include "vtd_test_support.h"
+
+using namespace eapis::intel_x64;
+namespace iommu = ::intel_x64::vtd::iommu;
+
+// Two fake register files, so that more than one unit can be tested at
+// the same time
+//
+alignas(0x1000) static vtd_test::regs_t g_regs1;
+alignas(0x1000) static vtd_test::regs_t g_regs2;
+
+using vtd_test::setup_regs;
+
+TEST_CASE("iommu_unit: constructor")
+{
+    setup_regs(g_regs1, 0x1234, 0x5678);
+
+    CHECK_THROWS(vtd::iommu_unit{nullptr, sizeof(g_regs1)});
+    CHECK_THROWS(vtd::iommu_unit{g_regs1.data(), 0x800});
+
+    vtd::iommu_unit unit{g_regs1.data(), sizeof(g_regs1)};
+    CHECK(unit.hpa() == 0);
+    CHECK(unit.hva() == reinterpret_cast<uintptr_t>(g_regs1.data()));
+    CHECK(unit.size() == sizeof(g_regs1));
+}
+
+TEST_CASE("iommu_unit: capabilities are cached")
+{
+    setup_regs(g_regs1, 0x1234, 0x5678);
+    vtd::iommu_unit unit{g_regs1.data(), sizeof(g_regs1)};
+
+    g_regs1.at(iommu::cap_reg::offset / 8) = 0;
+    g_regs1.at(iommu::ecap_reg::offset / 8) = 0;
+
+    CHECK(unit.cap() == 0x1234);
+    CHECK(unit.ecap() == 0x5678);
+    CHECK(unit.read_64(iommu::cap_reg::offset) == 0);
+}
+
+TEST_CASE("iommu_unit: read / write")
+{
+    setup_regs(g_regs1, 0, 0);
+    vtd::iommu_unit unit{g_regs1.data(), sizeof(g_regs1)};
+
+    unit.write_64(0x100, 0x1122334455667788ULL);
+    CHECK(g_regs1.at(0x100 / 8) == 0x1122334455667788ULL);
+    CHECK(unit.read_64(0x100) == 0x1122334455667788ULL);
+    CHECK(unit.read_32(0x100) == 0x55667788U);
+    CHECK(unit.read_32(0x104) == 0x11223344U);
+
+    unit.write_32(0x104, 0xAABBCCDDU);
+    CHECK(unit.read_64(0x100) == 0xAABBCCDD55667788ULL);
+
+    CHECK_NOTHROW(unit.read_64(0xFF8));
+    CHECK_NOTHROW(unit.read_32(0xFFC));
+    CHECK_THROWS(unit.read_64(0xFFC));
+    CHECK_THROWS(unit.read_32(0x1000));
+    CHECK_THROWS(unit.write_64(0xFFC, 0));
+    CHECK_THROWS(unit.write_32(0x1000, 0));
+}
+
+TEST_CASE("iommu_unit: global command")
+{
+    setup_regs(g_regs1, 0, 0);
+    vtd::iommu_unit unit{g_regs1.data(), sizeof(g_regs1)};
+
+    // TES and QIES are persistent, and RTPS is a one-shot status bit that
+    // must not be written back to the global command register.
+    //
+    unit.write_32(iommu::gsts_reg::offset, (1U << 31U) | (1U << 30U) | (1U << 26U));
+    CHECK(unit.gsts() == ((1U << 31U) | (1U << 30U) | (1U << 26U)));
+
+    unit.gcmd_set(1U << 25U);
+    CHECK(unit.read_32(iommu::gcmd_reg::offset) == ((1U << 31U) | (1U << 26U) | (1U << 25U)));
+
+    unit.gcmd_clear(1U << 26U);
+    CHECK(unit.read_32(iommu::gcmd_reg::offset) == (1U << 31U));
+}
+
+TEST_CASE("iommu_unit: wait for")
+{
+    auto count = 0;
+
+    CHECK_NOTHROW(vtd::iommu_unit::wait_for([&] { return ++count == 10; }, "timeout"));
+    CHECK(count == 10);
+}
+
+TEST_CASE("iommu_unit: snapshot")
+{
+    setup_regs(g_regs1, 0x1234, 0x5678);
+    vtd::iommu_unit unit{g_regs1.data(), sizeof(g_regs1)};
+
+    unit.write_32(iommu::ver_reg::offset, 0x10);
+    unit.write_32(iommu::gsts_reg::offset, 0x80000000U);
+    unit.write_64(iommu::rtaddr_reg::offset, 0x1000);
+    unit.write_32(iommu::fsts_reg::offset, 0x2);
+    unit.write_32(iommu::fectl_reg::offset, 0x80000000U);
+    unit.write_64(iommu::iqh_reg::offset, 0x20);
+    unit.write_64(iommu::iqt_reg::offset, 0x30);
+    unit.write_64(iommu::iqa_reg::offset, 0x2000);
+    unit.write_32(iommu::ics_reg::offset, 0x1);
+    unit.write_64(iommu::irta_reg::offset, 0x3007);
+
+    auto regs = unit.snapshot();
+    CHECK(regs.ver == 0x10);
+    CHECK(regs.cap == 0x1234);
+    CHECK(regs.ecap == 0x5678);
+    CHECK(regs.gsts == 0x80000000U);
+    CHECK(regs.rtaddr == 0x1000);
+    CHECK(regs.fsts == 0x2);
+    CHECK(regs.fectl == 0x80000000U);
+    CHECK(regs.iqh == 0x20);
+    CHECK(regs.iqt == 0x30);
+    CHECK(regs.iqa == 0x2000);
+    CHECK(regs.ics == 0x1);
+    CHECK(regs.irta == 0x3007);
+
+    CHECK_NOTHROW(unit.dump());
+}
+
+TEST_CASE("iommu_unit: multiple units")
+{
+    setup_regs(g_regs1, 0x1111, 0x2222);
+    setup_regs(g_regs2, 0x3333, 0x4444);
+
+    vtd::iommu_unit unit1{g_regs1.data(), sizeof(g_regs1)};
+    vtd::iommu_unit unit2{g_regs2.data(), sizeof(g_regs2)};
+
+    CHECK(unit1.cap() == 0x1111);
+    CHECK(unit2.cap() == 0x3333);
+
+    unit1.write_64(iommu::rtaddr_reg::offset, 0x1000);
+    unit2.write_64(iommu::rtaddr_reg::offset, 0x2000);
+
+    CHECK(unit1.read_64(iommu::rtaddr_reg::offset) == 0x1000);
+    CHECK(unit2.read_64(iommu::rtaddr_reg::offset) == 0x2000);
+
+    unit2.gcmd_set(1U << 31U);
+    CHECK(unit1.read_32(iommu::gcmd_reg::offset) == 0);
+    CHECK(unit2.read_32(iommu::gcmd_reg::offset) == (1U << 31U));
+}
@@ -0,0 +1,369 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+#include <array>
+#include <atomic>
+#include <thread>
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <bfvmm/test/support.h>
+#include <hve/arch/intel_x64/vtd/pasid_table.h>
+
+#include "vtd_test_support.h"
+
+using namespace eapis::intel_x64;
+namespace iommu = ::intel_x64::vtd::iommu;
+namespace ece = ::intel_x64::vtd::extended_context_entry;
+namespace pe = ::intel_x64::vtd::pasid_entry;
+namespace pse = ::intel_x64::vtd::pasid_state_entry;
+
+using qi_t = vtd::queued_invalidation;
+
+// A fake register file. The extended capability register reports queued
+// invalidation, extended context support, PASID support with 20 bit
+// PASIDs, and (optionally) deferred invalidation and supervisor requests.
+//
+using vtd_test::g_regs;
+
+constexpr const uint64_t ecap_qi = 1ULL << 1U;
+constexpr const uint64_t ecap_dt = 1ULL << 2U;
+constexpr const uint64_t ecap_ecs = 1ULL << 24U;
+constexpr const uint64_t ecap_nest = 1ULL << 26U;
+constexpr const uint64_t ecap_dis = 1ULL << 27U;
+constexpr const uint64_t ecap_srs = 1ULL << 31U;
+constexpr const uint64_t ecap_pss_20 = 19ULL << 35U;
+constexpr const uint64_t ecap_pasid = 1ULL << 40U;
+
+static void
+setup_regs(uint64_t ecap = ecap_qi | ecap_ecs | ecap_pss_20 | ecap_pasid)
+{ vtd_test::setup_regs(0, ecap, 1U << 26U); }
+
+// Emulates the hardware by processing the invalidation queue in the
+// background, writing the status word of each wait descriptor
+//
+class fake_hardware
+{
+public:
+
+    explicit fake_hardware(const qi_t &qi) :
+        m_thread{[this, &qi] { this->run(qi); }}
+    { }
+
+    ~fake_hardware()
+    {
+        m_stop = true;
+        m_thread.join();
+    }
+
+private:
+
+    void run(const qi_t &qi)
+    {
+        while (!m_stop) {
+            auto head = iommu::iqh_reg::qh::get();
+            auto tail = iommu::iqt_reg::qt::get();
+
+            for (; head != tail; head = (head + 1) & 0xFFU) {
+                const auto &desc = qi.queue()[head];
+
+                if ((desc.lo & 0xFU) == 0x5U) {
+                    *reinterpret_cast<volatile uint32_t *>(desc.hi) =
+                        static_cast<uint32_t>(desc.lo >> 32U);
+                    continue;
+                }
+
+                m_descs++;
+            }
+
+            g_regs.at(iommu::iqh_reg::offset / 8) = head << 4U;
+        }
+    }
+
+public:
+
+    std::atomic<bool> m_stop{false};
+    std::atomic<uint64_t> m_descs{0};
+
+private:
+
+    std::thread m_thread;
+};
+
+TEST_CASE("pasid_table: constructor / destructor")
+{
+    setup_regs();
+
+    {
+        vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+        qi_t qi{unit};
+        vtd::pasid_table pt{unit, qi, 5};
+
+        CHECK(pt.size() == vtd::pasid_table::num_entries);
+        CHECK(pt.did() == 5);
+        CHECK(pt.deferred() == 0);
+        CHECK(pt.table_phys() != 0);
+        CHECK(pt.state_table_phys() != 0);
+        CHECK_FALSE(pt.bound(0));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("pasid_table: not supported")
+{
+    setup_regs(ecap_qi | ecap_ecs);
+
+    {
+        vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+        qi_t qi{unit};
+        CHECK_THROWS(vtd::pasid_table{unit, qi, 5});
+    }
+
+    setup_regs(ecap_qi | ecap_pasid);
+
+    {
+        vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+        qi_t qi{unit};
+        CHECK_THROWS(vtd::pasid_table{unit, qi, 5});
+    }
+}
+
+TEST_CASE("pasid_table: size follows pss")
+{
+    setup_regs(ecap_qi | ecap_ecs | ecap_pasid | (4ULL << 35U));
+
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    qi_t qi{unit};
+    vtd::pasid_table pt{unit, qi, 5};
+
+    CHECK(pt.size() == 32);
+    CHECK_NOTHROW(pt.bound(31));
+    CHECK_THROWS(pt.bound(32));
+}
+
+TEST_CASE("pasid_table: bind")
+{
+    setup_regs();
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    qi_t qi{unit};
+    vtd::pasid_table pt{unit, qi, 5};
+
+    pt.bind(7, 0x12345018);
+
+    auto entry = pt.entry(7);
+    CHECK(pt.bound(7));
+    CHECK(pe::p::is_enabled(entry));
+    CHECK(pe::pwt::is_enabled(entry));
+    CHECK(pe::pcd::is_enabled(entry));
+    CHECK(pe::sre::is_disabled(entry));
+    CHECK(pe::flpm::get(entry) == 0);
+    CHECK(pe::flptptr::get(entry) == 0x12345);
+
+    CHECK_THROWS(pt.bind(vtd::pasid_table::num_entries, 0x1000));
+    CHECK_THROWS(pt.bind(8, 0x1000, true));
+}
+
+TEST_CASE("pasid_table: bind supervisor")
+{
+    setup_regs(ecap_qi | ecap_ecs | ecap_pss_20 | ecap_pasid | ecap_srs);
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    qi_t qi{unit};
+    vtd::pasid_table pt{unit, qi, 5};
+
+    pt.bind(8, 0x1000, true);
+    CHECK(pe::sre::is_enabled(pt.entry(8)));
+    CHECK(pe::pwt::is_disabled(pt.entry(8)));
+    CHECK(pe::pcd::is_disabled(pt.entry(8)));
+}
+
+TEST_CASE("pasid_table: invalidate")
+{
+    setup_regs();
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    qi_t qi{unit};
+    vtd::pasid_table pt{unit, qi, 5};
+
+    qi.enable();
+
+    {
+        fake_hardware hw{qi};
+        CHECK_FALSE(pt.invalidate(7));
+        CHECK(pt.deferred() == 0);
+        CHECK(hw.m_descs == 2);
+    }
+
+    CHECK(iommu::iqt_reg::qt::get() == 3);
+    CHECK(qi.queue()[0].lo == 0x700050017);
+    CHECK(qi.queue()[1].lo == 0x700050026);
+}
+
+TEST_CASE("pasid_table: invalidate deferred")
+{
+    setup_regs(ecap_qi | ecap_ecs | ecap_pss_20 | ecap_pasid | ecap_dis);
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    qi_t qi{unit};
+    vtd::pasid_table pt{unit, qi, 5};
+
+    qi.enable();
+
+    CHECK(pt.invalidate(7));
+    CHECK(iommu::iqt_reg::qt::get() == 0);
+    CHECK(pt.deferred() == 1);
+    CHECK(pse::dinv::is_enabled(pt.state_entry(7)));
+    CHECK(pse::arefcnt::get(pt.state_entry(7)) == 0);
+}
+
+TEST_CASE("pasid_table: invalidate in use")
+{
+    setup_regs(ecap_qi | ecap_ecs | ecap_pss_20 | ecap_pasid | ecap_dis);
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    qi_t qi{unit};
+    vtd::pasid_table pt{unit, qi, 5};
+
+    qi.enable();
+
+    // Emulate a device using the PASID
+    //
+    auto state = reinterpret_cast<uint64_t *>(pt.state_table_phys());
+    pse::arefcnt::set(state[7], 1);
+
+    {
+        fake_hardware hw{qi};
+        CHECK_FALSE(pt.invalidate(7));
+        CHECK(pt.deferred() == 0);
+        CHECK(hw.m_descs == 2);
+    }
+
+    CHECK(iommu::iqt_reg::qt::get() == 3);
+    CHECK(pse::dinv::is_disabled(pt.state_entry(7)));
+}
+
+TEST_CASE("pasid_table: invalidate ats")
+{
+    setup_regs(ecap_qi | ecap_dt | ecap_ecs | ecap_pss_20 | ecap_pasid | ecap_dis);
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    qi_t qi{unit};
+    vtd::pasid_table pt{unit, qi, 5};
+
+    qi.enable();
+
+    pt.enable_ats(0x300);
+    pt.enable_ats(0x301, 4);
+
+    {
+        fake_hardware hw{qi};
+        CHECK_FALSE(pt.invalidate(7));
+        CHECK(pt.deferred() == 0);
+        CHECK(hw.m_descs == 4);
+    }
+
+    CHECK(iommu::iqt_reg::qt::get() == 5);
+    CHECK(qi.queue()[2].lo == 0x703000008);
+    CHECK(qi.queue()[2].hi == 0x7FFFFFFFFFFFF800);
+    CHECK(qi.queue()[3].lo == 0x703010048);
+    CHECK(pse::dinv::is_disabled(pt.state_entry(7)));
+}
+
+TEST_CASE("pasid_table: ats not supported")
+{
+    setup_regs();
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    qi_t qi{unit};
+    vtd::pasid_table pt{unit, qi, 5};
+
+    CHECK_THROWS(pt.enable_ats(0x300));
+}
+
+TEST_CASE("pasid_table: rebind and unbind")
+{
+    setup_regs(ecap_qi | ecap_ecs | ecap_pss_20 | ecap_pasid | ecap_dis);
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    qi_t qi{unit};
+    vtd::pasid_table pt{unit, qi, 5};
+
+    pt.bind(3, 0x1000);
+    CHECK(pt.deferred() == 0);
+
+    pt.bind(3, 0x2000);
+    CHECK(pt.deferred() == 1);
+    CHECK(pe::flptptr::get(pt.entry(3)) == 0x2);
+
+    pt.unbind(3);
+    CHECK(pt.deferred() == 2);
+    CHECK_FALSE(pt.bound(3));
+
+    pt.unbind(3);
+    CHECK(pt.deferred() == 2);
+}
+
+TEST_CASE("pasid_table: setup context entry")
+{
+    setup_regs(ecap_qi | ecap_ecs | ecap_pss_20 | ecap_pasid | ecap_dis);
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    qi_t qi{unit};
+    vtd::pasid_table pt{unit, qi, 5};
+
+    ece::value_type entry;
+    pt.setup_context_entry(entry);
+
+    CHECK(ece::paside::is_enabled(entry));
+    CHECK(ece::dinve::is_enabled(entry));
+    CHECK(ece::pts::get(entry) == 4);
+    CHECK(ece::pasidptr::get(entry) == pt.table_phys() >> 12U);
+    CHECK(ece::pasidstptr::get(entry) == pt.state_table_phys() >> 12U);
+}
+
+TEST_CASE("pasid_table: setup nested context entry")
+{
+    setup_regs();
+
+    {
+        vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+        qi_t qi{unit};
+        vtd::pasid_table pt{unit, qi, 5};
+        ept::mmap guest{};
+
+        ece::value_type entry{};
+        CHECK_THROWS(pt.setup_nested_context_entry(entry, guest));
+    }
+
+    setup_regs(ecap_qi | ecap_ecs | ecap_nest | ecap_pss_20 | ecap_pasid);
+
+    {
+        vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+        qi_t qi{unit};
+        vtd::pasid_table pt{unit, qi, 5};
+        ept::mmap guest{};
+
+        ece::value_type entry{};
+        pt.setup_nested_context_entry(entry, guest);
+
+        CHECK(ece::paside::is_enabled(entry));
+        CHECK(ece::neste::is_enabled(entry));
+        CHECK(ece::slptptr::get(entry) == guest.eptp() >> 12U);
+        CHECK(ece::aw::get(entry) == 2);
+        CHECK(ece::pasidptr::get(entry) == pt.table_phys() >> 12U);
+    }
+    CHECK(g_allocated_pages.empty());
+}
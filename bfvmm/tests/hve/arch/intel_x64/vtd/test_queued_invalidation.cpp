@@ -0,0 +1,358 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <array>
+#include <thread>
+#include <vector>
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <bfvmm/test/support.h>
+#include <hve/arch/intel_x64/vtd/queued_invalidation.h>
+
+#include "vtd_test_support.h"
+
+using namespace eapis::intel_x64;
+namespace iommu = ::intel_x64::vtd::iommu;
+
+using qi_t = vtd::queued_invalidation;
+
+// A fake register file. The capability register reports page selective
+// invalidations with a maximum address mask of 9, and the extended
+// capability register reports queued invalidation. GSTS reports queued
+// invalidation as enabled, so enable() does not time out.
+//
+using vtd_test::g_regs;
+
+static void
+setup_regs(bool psi = true)
+{ vtd_test::setup_regs(psi ? ((1ULL << 39U) | (9ULL << 48U)) : 0, 0x2ULL, 1U << 26U); }
+
+// Emulates the hardware by processing every descriptor between the head
+// and the tail, writing the status word of each wait descriptor
+//
+static void
+process(const qi_t &qi)
+{
+    auto head = iommu::iqh_reg::qh::get();
+    auto tail = iommu::iqt_reg::qt::get();
+
+    for (; head != tail; head = (head + 1) & 0xFFU) {
+        const auto &desc = qi.queue()[head];
+
+        if ((desc.lo & 0xFU) == 0x5U && (desc.lo & 0x20U) != 0) {
+            *reinterpret_cast<volatile uint32_t *>(desc.hi) =
+                static_cast<uint32_t>(desc.lo >> 32U);
+        }
+    }
+
+    g_regs.at(iommu::iqh_reg::offset / 8) = head << 4U;
+}
+
+TEST_CASE("queued_invalidation: constructor / destructor")
+{
+    setup_regs();
+
+    {
+        vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+        qi_t qi{unit};
+        CHECK(qi.queue_phys() != 0);
+        CHECK(qi.status_phys() != 0);
+        CHECK_FALSE(qi.enabled());
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("queued_invalidation: not supported")
+{
+    setup_regs();
+    g_regs.at(iommu::ecap_reg::offset / 8) = 0;
+
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    CHECK_THROWS(qi_t{unit});
+}
+
+TEST_CASE("queued_invalidation: enable")
+{
+    setup_regs();
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    qi_t qi{unit};
+
+    qi.enable();
+    CHECK(qi.enabled());
+    CHECK(iommu::iqa_reg::iqa::get() == qi.queue_phys() >> 12U);
+    CHECK(iommu::iqa_reg::qs::get() == 0);
+    CHECK(iommu::iqt_reg::get() == 0);
+
+    iommu::write_32(iommu::gsts_reg::offset, 0);
+    qi.disable();
+    CHECK_FALSE(qi.enabled());
+}
+
+TEST_CASE("queued_invalidation: post before enable")
+{
+    setup_regs();
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    qi_t qi{unit};
+
+    CHECK_THROWS(qi.post(qi_t::batch{qi}));
+}
+
+TEST_CASE("queued_invalidation: context / iec descriptors")
+{
+    setup_regs();
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    qi_t qi{unit};
+    qi_t::batch b{qi};
+
+    b.context_global();
+    b.context_domain(0x12);
+    b.context_device(0x12, 0x0310, 1);
+    b.iec_global();
+    b.iec_index(0x40, 4);
+
+    REQUIRE(b.size() == 5);
+    CHECK(b.data()[0].lo == 0x11);
+    CHECK(b.data()[1].lo == 0x120021);
+    CHECK(b.data()[2].lo == 0x1031000120031);
+    CHECK(b.data()[3].lo == 0x4);
+    CHECK(b.data()[4].lo == 0x4020000014);
+
+    CHECK_THROWS(b.iec_index(0x41, 4));
+
+    b.clear();
+    CHECK(b.empty());
+}
+
+TEST_CASE("queued_invalidation: pasid descriptors")
+{
+    setup_regs();
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    qi_t qi{unit};
+    qi_t::batch b{qi};
+
+    b.pasid_cache_domain(0x12);
+    b.pasid_cache_pasid(0x12, 0x345);
+    b.ext_iotlb_pasid(0x12, 0x345);
+    b.ext_dev_tlb_pasid(0x300, 0x345, 4);
+
+    REQUIRE(b.size() == 4);
+    CHECK(b.data()[0].lo == 0x120007);
+    CHECK(b.data()[1].lo == 0x34500120017);
+    CHECK(b.data()[2].lo == 0x34500120026);
+    CHECK(b.data()[2].hi == 0);
+    CHECK(b.data()[3].lo == 0x34503000048);
+    CHECK(b.data()[3].hi == 0x7FFFFFFFFFFFF800);
+}
+
+TEST_CASE("queued_invalidation: iotlb descriptors")
+{
+    setup_regs();
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    qi_t qi{unit};
+    qi_t::batch b{qi};
+
+    b.iotlb_global();
+    b.iotlb_domain(3);
+    b.iotlb_pages(3, 0x5000, 0x1000);
+    b.iotlb_pages(3, 0x5000, 0x2000, true);
+    b.iotlb_pages(3, 0x200000, 0x200000);
+    b.iotlb_pages(3, 0x0, 0x10000000);
+
+    REQUIRE(b.size() == 6);
+    CHECK(b.data()[0].lo == 0xD2);
+    CHECK(b.data()[1].lo == 0x300E2);
+    CHECK(b.data()[2].lo == 0x300F2);
+    CHECK(b.data()[2].hi == 0x5000);
+    CHECK(b.data()[3].hi == (0x4000 | 0x40 | 2));
+    CHECK(b.data()[4].hi == (0x200000 | 9));
+    CHECK(b.data()[5].lo == 0x300E2);
+    CHECK(b.data()[5].hi == 0);
+
+    CHECK_THROWS(b.iotlb_pages(3, 0x5000, 0));
+}
+
+TEST_CASE("queued_invalidation: iotlb descriptors without psi")
+{
+    setup_regs(false);
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    qi_t qi{unit};
+    qi_t::batch b{qi};
+
+    b.iotlb_pages(3, 0x5000, 0x1000);
+    CHECK(b.data()[0].lo == 0x300E2);
+}
+
+TEST_CASE("queued_invalidation: batch full")
+{
+    setup_regs();
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    qi_t qi{unit};
+    qi_t::batch b{qi};
+
+    for (std::size_t i = 0; i < qi_t::max_batch_size; i++) {
+        b.context_global();
+    }
+
+    CHECK_THROWS(b.context_global());
+}
+
+TEST_CASE("queued_invalidation: submit")
+{
+    setup_regs();
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    qi_t qi{unit};
+    qi_t::batch b{qi};
+
+    qi.enable();
+
+    b.context_global();
+    b.iotlb_global();
+
+    auto ticket = qi.post(b);
+    CHECK(ticket == 3);
+    CHECK(iommu::iqt_reg::qt::get() == 3);
+    CHECK_FALSE(qi.complete(ticket));
+
+    auto wait = qi.queue()[2];
+    CHECK((wait.lo & 0xFFFFFFFFU) == 0x65);
+    CHECK(wait.hi == qi.status_phys() + 8);
+
+    process(qi);
+    CHECK(qi.complete(ticket));
+    CHECK_NOTHROW(qi.wait(ticket));
+}
+
+TEST_CASE("queued_invalidation: earlier tickets complete")
+{
+    setup_regs();
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    qi_t qi{unit};
+    qi_t::batch b{qi};
+
+    qi.enable();
+    b.context_global();
+
+    auto ticket1 = qi.post(b);
+    auto ticket2 = qi.post(b);
+    CHECK(ticket2 > ticket1);
+
+    process(qi);
+    qi.wait(ticket2);
+
+    CHECK(qi.complete(ticket1));
+}
+
+TEST_CASE("queued_invalidation: wrap")
+{
+    setup_regs();
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    qi_t qi{unit};
+    qi_t::batch b{qi};
+
+    qi.enable();
+
+    for (std::size_t i = 0; i < 7; i++) {
+        b.iotlb_global();
+    }
+
+    for (std::size_t i = 0; i < 100; i++) {
+        auto ticket = qi.post(b);
+        process(qi);
+        qi.wait(ticket);
+    }
+
+    CHECK(iommu::iqt_reg::qt::get() == (800U & 0xFFU));
+}
+
+TEST_CASE("queued_invalidation: queue full")
+{
+    setup_regs();
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    qi_t qi{unit};
+    qi_t::batch b{qi};
+
+    qi.enable();
+
+    for (std::size_t i = 0; i < 7; i++) {
+        b.iotlb_global();
+    }
+
+    for (std::size_t i = 0; i < 31; i++) {
+        qi.post(b);
+    }
+
+    // A post() that times out must not keep its slots reserved, otherwise
+    // every later post() would wait for it forever
+    //
+
+    CHECK_THROWS(qi.post(b));
+
+    process(qi);
+    CHECK(qi.post(b) == 256);
+}
+
+TEST_CASE("queued_invalidation: queue error")
+{
+    setup_regs();
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    qi_t qi{unit};
+
+    qi.enable();
+    auto ticket = qi.post(qi_t::batch{qi});
+
+    iommu::write_32(iommu::fsts_reg::offset, 0x10);
+    CHECK_THROWS(qi.wait(ticket));
+}
+
+TEST_CASE("queued_invalidation: post from multiple cpus")
+{
+    setup_regs();
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+    qi_t qi{unit};
+
+    qi.enable();
+
+    std::vector<std::thread> threads;
+    for (std::size_t t = 0; t < 4; t++) {
+        threads.emplace_back([&qi] {
+            qi_t::batch b{qi};
+            b.context_global();
+
+            for (std::size_t i = 0; i < 16; i++) {
+                qi.post(b);
+            }
+        });
+    }
+
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    CHECK(iommu::iqt_reg::qt::get() == 128);
+
+    process(qi);
+    for (std::size_t i = 0; i < 128; i += 2) {
+        CHECK(qi.complete(i + 2));
+    }
+}
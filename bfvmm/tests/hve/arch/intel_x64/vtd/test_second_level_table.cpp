@@ -0,0 +1,275 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <array>
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <bfvmm/test/support.h>
+#include <hve/arch/intel_x64/vtd/second_level_table.h>
+
+#include "vtd_test_support.h"
+
+using namespace eapis::intel_x64;
+namespace iommu = ::intel_x64::vtd::iommu;
+namespace sl = ::intel_x64::vtd::second_level_paging_entries;
+
+using vtd_test::g_regs;
+
+static void
+setup_regs(uint64_t sagaw, uint64_t sllps, bool sc)
+{ vtd_test::setup_regs((sagaw << 8U) | (sllps << 34U), sc ? 0x80ULL : 0); }
+
+TEST_CASE("second_level_table: constructor / destructor")
+{
+    {
+        vtd::second_level_table table{4, paging::level_1g, true};
+
+        CHECK(table.root_phys() != 0);
+        CHECK(table.levels() == 4);
+        CHECK(table.aw() == 2);
+        CHECK(table.num_tables() == 1);
+    }
+    CHECK(g_allocated_pages.empty());
+
+    CHECK_THROWS(vtd::second_level_table{2, paging::level_1g, true});
+    CHECK_THROWS(vtd::second_level_table{6, paging::level_1g, true});
+    CHECK_THROWS(vtd::second_level_table{4, 3, true});
+}
+
+TEST_CASE("second_level_table: levels from cap")
+{
+    setup_regs(0x2 | 0x4 | 0x8, 0, false);
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+
+    CHECK(vtd::second_level_table::levels_from_cap(unit.cap(), 39) == 3);
+    CHECK(vtd::second_level_table::levels_from_cap(unit.cap(), 46) == 4);
+    CHECK(vtd::second_level_table::levels_from_cap(unit.cap(), 52) == 5);
+    CHECK(vtd::second_level_table::levels_from_cap(unit.cap(), 58) == 0);
+
+    CHECK(vtd::second_level_table::levels_from_cap(0x4ULL << 8U, 39) == 4);
+    CHECK(vtd::second_level_table::levels_from_cap(0x4ULL << 8U, 52) == 0);
+    CHECK(vtd::second_level_table::levels_from_cap(0x8ULL << 8U, 39) == 5);
+
+    CHECK(vtd::second_level_table{unit}.levels() == 4);
+    CHECK(vtd::second_level_table{unit, 52}.levels() == 5);
+    CHECK(vtd::second_level_table{unit, 52}.aw() == 3);
+    CHECK_THROWS(vtd::second_level_table{unit, 58});
+}
+
+TEST_CASE("second_level_table: max level from cap")
+{
+    CHECK(vtd::second_level_table::max_level_from_cap(0) == paging::level_4k);
+    CHECK(vtd::second_level_table::max_level_from_cap(0x1ULL << 34U) == paging::level_2m);
+    CHECK(vtd::second_level_table::max_level_from_cap(0x3ULL << 34U) == paging::level_1g);
+}
+
+TEST_CASE("second_level_table: map")
+{
+    vtd::second_level_table table{4, paging::level_1g, true};
+
+    auto &pte = table.map(0x1000, 0x5000, paging::level_4k, {true, false, false});
+    CHECK(sl::pte::read_access::is_enabled(pte));
+    CHECK(sl::pte::write_access::is_disabled(pte));
+    CHECK(sl::pte::snoop::is_disabled(pte));
+    CHECK(sl::pte::phys_addr_bits::get(pte) == 0x5);
+    CHECK(table.num_tables() == 4);
+
+    auto &pde = table.map(0x200000, 0x400000, paging::level_2m, {});
+    CHECK(sl::pde::entry_type::is_enabled(pde));
+    CHECK(sl::pde::write_access::is_enabled(pde));
+
+    auto &pdpte = table.map(0x40000000, 0x80000000, paging::level_1g, {true, true, true});
+    CHECK(sl::pdpte::entry_type::is_enabled(pdpte));
+    CHECK(sl::pdpte::snoop::is_enabled(pdpte));
+
+    CHECK(table.virt_to_phys(0x1234).first == 0x5234);
+    CHECK(table.virt_to_phys(0x1234).second == paging::from(paging::level_4k));
+    CHECK(table.virt_to_phys(0x212345).first == 0x412345);
+    CHECK(table.virt_to_phys(0x212345).second == paging::from(paging::level_2m));
+    CHECK(table.virt_to_phys(0x41234567).first == 0x81234567);
+    CHECK(table.entry(0x41234567).second == paging::from(paging::level_1g));
+
+    CHECK_THROWS(table.virt_to_phys(0x2000));
+    CHECK_THROWS(table.entry(0x2000));
+    CHECK_FALSE(table.is_mapped(0x2000));
+
+    CHECK_THROWS(table.map(0x1000, 0x5000, paging::level_4k, {}));
+    CHECK_THROWS(table.map(0x201000, 0x5000, paging::level_4k, {}));
+    CHECK_THROWS(table.map(0x1000, 0x5000, paging::level_1g, {}));
+    CHECK_THROWS(table.map(0x1000000000000, 0, paging::level_4k, {}));
+}
+
+TEST_CASE("second_level_table: map 5 level")
+{
+    {
+        vtd::second_level_table table{5, paging::level_1g, false};
+
+        table.map(0x1000000000000, 0x1000, paging::level_4k, {});
+        CHECK(table.num_tables() == 5);
+        CHECK(table.virt_to_phys(0x1000000000000).first == 0x1000);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("second_level_table: map range")
+{
+    setup_regs(0x4, 0x3, true);
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+
+    {
+        vtd::second_level_table table{unit};
+
+        CHECK(table.map_range(0x3FE00000, 0x3FE00000, 0x40201000) == 3);
+        CHECK(table.entry(0x3FE00000).second == paging::from(paging::level_2m));
+        CHECK(table.entry(0x40000000).second == paging::from(paging::level_1g));
+        CHECK(table.entry(0x80000000).second == paging::from(paging::level_4k));
+
+        CHECK(table.map_range(0x100000000, 0x100001000, 0x200000) == 0x200);
+        CHECK(table.entry(0x100000000).second == paging::from(paging::level_4k));
+        CHECK(table.virt_to_phys(0x1001FF000).first == 0x100200000);
+
+        CHECK_THROWS(table.map_range(0x3FE01000, 0x3FE01000, 0x1000));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("second_level_table: map range without large pages")
+{
+    setup_regs(0x4, 0x1, false);
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+
+    vtd::second_level_table table{unit};
+    CHECK(table.max_level() == paging::level_2m);
+    CHECK_FALSE(table.snoop_control());
+
+    CHECK(table.map_range(0, 0, 0x40000000, {true, true, true}) == 512);
+    CHECK(table.entry(0).second == paging::from(paging::level_2m));
+    CHECK(sl::pde::snoop::is_disabled(table.entry(0).first));
+}
+
+TEST_CASE("second_level_table: map identity")
+{
+    setup_regs(0x4, 0x3, true);
+    vtd::iommu_unit unit{g_regs.data(), sizeof(g_regs)};
+
+    vtd::second_level_table table{unit};
+
+    // 4TB only needs 4096 1g entries, spread over 8 PDPTs
+    //
+    CHECK(table.map_identity(0x40000000000) == 4096);
+    CHECK(table.num_tables() == 9);
+    CHECK(table.virt_to_phys(0x3FFFFFFF123).first == 0x3FFFFFFF123);
+}
+
+TEST_CASE("second_level_table: unmap")
+{
+    {
+        vtd::second_level_table table{4, paging::level_1g, true};
+
+        table.map(0x1000, 0x1000, paging::level_4k, {});
+        table.map(0x2000, 0x2000, paging::level_4k, {});
+        table.map(0x40000000, 0x40000000, paging::level_1g, {});
+        CHECK(table.num_tables() == 4);
+
+        CHECK(table.unmap(0x1000) == 0x1000);
+        CHECK(table.unmap(0x1000) == 0);
+        CHECK(table.num_tables() == 4);
+
+        CHECK(table.unmap(0x2000) == 0x1000);
+        CHECK(table.num_tables() == 2);
+
+        CHECK(table.unmap(0x40001000) == 0x40000000);
+        CHECK(table.num_tables() == 1);
+        CHECK_FALSE(table.is_mapped(0x40000000));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+static std::size_t g_flushes;
+static std::size_t g_pages_at_flush;
+static uintptr_t g_flush_addr;
+static std::size_t g_flush_size;
+
+static void
+test_flush(uintptr_t virt_addr, std::size_t size)
+{
+    g_flushes++;
+    g_pages_at_flush = g_allocated_pages.size();
+    g_flush_addr = virt_addr;
+    g_flush_size = size;
+}
+
+TEST_CASE("second_level_table: flush before free")
+{
+    {
+        vtd::second_level_table table{4, paging::level_1g, true};
+        table.set_flush(vtd::second_level_table::flush_delegate_t::create<test_flush>());
+
+        g_flushes = 0;
+        table.map(0x1000, 0x1000, paging::level_4k, {});
+        auto pages = g_allocated_pages.size();
+
+        CHECK(table.unmap(0x1000) == 0x1000);
+        CHECK(g_flushes == 1);
+        CHECK(g_pages_at_flush == pages);
+        CHECK(g_flush_addr == 0x1000);
+        CHECK(g_flush_size == 0x1000);
+        CHECK(table.num_tables() == 1);
+
+        CHECK(table.unmap(0x1000) == 0);
+        CHECK(g_flushes == 1);
+
+        table.map_range(0x200000, 0x200000, 0x400000);
+        CHECK(table.unmap_range(0, 0x1000000) == 2);
+        CHECK(g_flushes == 2);
+        CHECK(g_flush_addr == 0x200000);
+        CHECK(g_flush_size == 0x400000);
+        CHECK(table.num_tables() == 1);
+
+        CHECK(table.unmap_range(0, 0x1000000) == 0);
+        CHECK(g_flushes == 2);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("second_level_table: map above max level")
+{
+    vtd::second_level_table table{4, paging::level_2m, false};
+
+    CHECK_THROWS(table.map(0x40000000, 0x40000000, paging::level_1g, {}));
+
+    auto &pde = table.map(0x200000, 0x200000, paging::level_2m, {true, true, true});
+    CHECK(sl::pde::snoop::is_disabled(pde));
+}
+
+TEST_CASE("second_level_table: unmap range")
+{
+    vtd::second_level_table table{4, paging::level_1g, true};
+
+    table.map_range(0x3FE00000, 0x3FE00000, 0x40201000, {});
+    table.map(0x8000000000, 0, paging::level_4k, {});
+
+    CHECK(table.unmap_range(0, 0x10000000000) == 4);
+    CHECK(table.num_tables() == 1);
+}
@@ -0,0 +1,89 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef VTD_TEST_SUPPORT_EAPIS_TEST_H
+#define VTD_TEST_SUPPORT_EAPIS_TEST_H
+
+#include <array>
+#include <cstdint>
+
+#include <hve/arch/intel_x64/vtd/iommu.h>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace vtd_test
+{
+
+/// Register File
+///
+/// A fake remapping unit register file. It is one page in size, like the
+/// real thing, so it can be handed to an iommu_unit directly.
+///
+using regs_t = std::array<uint64_t, 0x200>;
+
+/// Default Register File
+///
+/// Most tests only need one unit. Tests that need more than one declare
+/// their own regs_t.
+///
+alignas(0x1000) inline regs_t g_regs{};
+
+/// Setup Register File
+///
+/// Clears the register file, points iommu::base_addr at it (so that the
+/// register accessors in iommu.h read and write the fake), and loads
+/// the capability, extended capability and global status registers.
+///
+/// @param regs the register file to setup
+/// @param cap the value of the capability register
+/// @param ecap the value of the extended capability register
+/// @param gsts the value of the global status register. A unit that
+///     reports its features as enabled does not time out on enable()
+///
+inline void
+setup_regs(regs_t &regs, uint64_t cap, uint64_t ecap, uint32_t gsts = 0)
+{
+    namespace iommu = ::intel_x64::vtd::iommu;
+
+    regs.fill(0);
+    iommu::base_addr = reinterpret_cast<uintptr_t>(regs.data());
+
+    regs.at(iommu::cap_reg::offset / 8) = cap;
+    regs.at(iommu::ecap_reg::offset / 8) = ecap;
+    iommu::write_32(iommu::gsts_reg::offset, gsts);
+}
+
+/// Setup Default Register File
+///
+/// @param cap the value of the capability register
+/// @param ecap the value of the extended capability register
+/// @param gsts the value of the global status register
+///
+inline void
+setup_regs(uint64_t cap, uint64_t ecap, uint32_t gsts = 0)
+{ setup_regs(g_regs, cap, ecap, gsts); }
+
+}
+
+#endif